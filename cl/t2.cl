@@ -1,98 +1,155 @@
-
 #include <t2/extensions.cl>
 #include <t2/constants.cl>
 #include <t2/types.cl>
-#include <t2/scene.cl>
-#include <t2/pinhole_camera.cl>
-#include <t2/thinlens_camera.cl>
+#include <t2/camera.cl>
 #include <t2/config.cl>
+#include <t2/scene.cl>
+#include <t2/trace.cl>
+#include <t2/path.cl>
+#include <t2/photons.cl>
+#include <t2/wavefront.cl>
+#include <t2/adaptive.cl>
+#include <t2/sampling.cl>
 
 #include <t2/state.h>
 
-__kernel void raytracer(
-        __constant struct configuration *config,
+/* Take batchSize samples for one pixel and add them to its sums */
+static void tracepixel(__constant struct configuration *config,
         __constant struct state *state,
-        __read_only image2d_t input,
-        __write_only image2d_t output,
+        __global float4 *accum,
+        __global float *moments,
         __global float2 *squareSampleSets,
         __global float2 *diskSampleSets,
         int numSampleSets,
-        uint batchSize)
+        uint batchSize,
+        struct Scene *s,
+        __constant struct SceneHeader *sceneHeader,
+        uint pixel)
 {
-    __local struct Scene s;
-
-    local int sampleSetSize;
-
-    if ((get_local_id(0) == 0) & (get_local_id(1) == 0)) {
-        buildscene(&s);
-        sampleSetSize = config->sampleRoot * config->sampleRoot;
-    } else {
-        sampleSetSize = 0;
-    }
-
-    barrier(CLK_LOCAL_MEM_FENCE);
-
-    int2 pos = (int2)(get_global_id(0), get_global_id(1));
-    int sampleSetIndex = ((pos.x * config->height) + pos.y) % numSampleSets;
+    int2 pos = (int2)(pixel % config->width, pixel / config->width);
+    struct PixelSampler sampler = pixelsampler(config, squareSampleSets, diskSampleSets,
+            numSampleSets, pos);
 
     // newCVal is where we store the current color.
     float4 newCVal = (float4)(0.f);
 
-    float2 squareSample;
-    float2 diskSample;
-
-    // Compute the sample set offset in the sample set buffers based
-    // on the coordinates of the current pixel being traced.
-    int offset = sampleSetIndex * sampleSetSize;
-
-    // Get pointers to sample sets.
-    __global float2 *squareSamples = squareSampleSets + offset;
-    __global float2 *diskSamples = diskSampleSets + offset;
-
-    struct PinholeCamera pinhole;
-    struct ThinLensCamera thinLens;
-
-    // Configure camera
-    if (s.cameraType == CAMERA_THINLENS) {
-        thinLens = s.cameras.thinLens;
-        thinLens.eye = state->position;
-        thinLens.lookat = state->position + state->heading;
-        thinLens.lens_radius = state->lens_radius;
-        thinlens_camera_compute_uvw(&thinLens);
-    } else if (s.cameraType == CAMERA_PINHOLE) {
-        pinhole = s.cameras.pinhole;
-        pinhole.eye = state->position;
-        pinhole.lookat = state->position + state->heading;
-        pinhole_camera_compute_uvw(&pinhole);
-    }
+    // Sum of squared sample luminances, for the variance estimate
+    float newMoment = 0.f;
+
+    struct Camera camera;
+    camera_setup(&camera, sceneHeader, state);
 
     for (uint sampleNum = state->sampleNum;
             sampleNum < state->sampleNum + batchSize;
             sampleNum++) {
-        // Select samples from sets based on current sample index.
-        squareSample = squareSamples[sampleNum];
-        diskSample = diskSamples[sampleNum];
-
-        if (s.cameraType == CAMERA_THINLENS) {
-            newCVal += thinlens_camera_render(&thinLens, &s,
-                    config, pos, squareSample, diskSample);
-        } else if (s.cameraType == CAMERA_PINHOLE) {
-            newCVal += pinhole_camera_render(&pinhole, &s,
-                    config, pos, squareSample);
-        }
+        float2 squareSample = squaresample(&sampler, sampleNum);
+        float2 diskSample = disksample(&sampler, sampleNum);
+
+        struct Ray r = camera_ray(&camera, config, pos, squareSample, diskSample);
+        struct LightSampler ls = {
+            &sampler, sampleNum, hashuint(pixel ^ hashuint(sampleNum))
+        };
+        float4 c;
+        if (INTEGRATOR(config) == INTEGRATOR_PATH)
+            c = pathtrace(s, LIGHT_SAMPLES(config), &r, &ls);
+        else
+            c = recursivetrace(s, TRACE_DEPTH(config), LIGHT_SAMPLES(config), &r, &ls);
+        float l = luminance(c);
+
+        newCVal += c;
+        newMoment += l * l;
     }
 
-    // If this isn't the first sample for this frame, combine the new
-    // sample with the old ones.
+    // The w component counts the pixel's samples
+    newCVal.w = batchSize;
+
+    // Add this batch to the running sums for the pixel, starting them
+    // over on the first batch of a frame. resolve turns them into the
+    // displayed average.
     if (state->sampleNum > 0) {
-        // If this isn't the first sample for this frame, read the
-        // previous sample data from the input image. Otherwise we take
-        // the current sample as the first sample.
-        newCVal = (read_imagef(input, pos) * (float)state->sampleNum + newCVal) /
-            ((float)state->sampleNum + (float)batchSize);
-    } else if (batchSize > 1)
-        newCVal /= (float4)(batchSize);
-
-    // Write the final sample value to the output image.
-    write_imagef(output, pos, newCVal);
+        newCVal += accum[pixel];
+        newMoment += moments[pixel];
+    }
+    accum[pixel] = newCVal;
+    moments[pixel] = newMoment;
+}
+
+__kernel void raytracer(
+        __constant struct configuration *config,
+        __constant struct state *state,
+        __global float4 *accum,
+        __global float *moments,
+        __global uint *activePixels,
+        __global uint *activeCount,
+        __global uint *tileOrder,
+        uint first,
+        __global float2 *squareSampleSets,
+        __global float2 *diskSampleSets,
+        int numSampleSets,
+        uint batchSize,
+        __global uint *counters,
+        __global struct Photon *photons,
+        __global uint *photonCells,
+        uint numPhotonCells,
+        float photonRadius,
+        __global struct IrradianceCache *irradianceCache,
+        __global struct IrradianceRecord *irradianceRecords,
+        __global uint *irradianceCells,
+        __global uint *irradianceClaims,
+        __global uint *shadowCache,
+        uint shadowCacheLights,
+        SCENE_ARGS)
+{
+#ifdef T2_COUNTERS
+    __local uint groupCounts[NUM_COUNTERS];
+#else
+    __local uint *groupCounts = 0;
+#endif
+    struct Scene s;
+    SCENE_INIT(s);
+
+    // This pass's photon map (see t2/photons.h), if there is one
+    s.photons = photons;
+    s.photonCells = photonCells;
+    s.numPhotonCells = numPhotonCells;
+    s.photonRadius = photonRadius;
+
+    // The irradiance cache (see t2/irradiance.h), if there is one
+    s.irradianceCache = irradianceCache;
+    s.irradianceRecords = irradianceRecords;
+    s.irradianceCells = irradianceCells;
+    s.irradianceClaims = irradianceClaims;
+
+    // Work items map to pixels through the adaptive sampling list, if
+    // there is one, or else the tile order. Those without a pixel still
+    // have to reach the barriers in countersflush().
+    uint pixel;
+    if (activepixel(config, activePixels, activeCount, tileOrder, first, get_global_id(0),
+                &pixel)) {
+        // The pixel's occluders in the shadow cache, if there is one
+        s.shadowOccluders = shadowCache ? shadowCache + pixel * shadowCacheLights : 0;
+        s.shadowCacheLights = shadowCacheLights;
+        tracepixel(config, state, accum, moments, squareSampleSets, diskSampleSets,
+                numSampleSets, batchSize, &s, sceneHeader, pixel);
+    }
+
+    countersflush(&s, groupCounts, counters);
+}
+
+/* Average the running sums into the output image, adding in those
+from other devices if there are any */
+__kernel void resolve(
+        __constant struct configuration *config,
+        __global float4 *accum,
+        __write_only image2d_t output,
+        __global float4 *remoteAccum)
+{
+    int2 pos = (int2)(get_global_id(0), get_global_id(1));
+    uint pixel = pos.y * config->width + pos.x;
+    float4 sum = accum[pixel];
+
+    if (remoteAccum)
+        sum += remoteAccum[pixel];
+
+    write_imagef(output, pos, (float4)(sum.xyz / fmax(sum.w, 1.f), 1.f));
 }
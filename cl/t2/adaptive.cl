@@ -0,0 +1,93 @@
+#ifndef T2_ADAPTIVE_CL
+#define T2_ADAPTIVE_CL
+
+/*
+ * Adaptive sampling. Alongside the per-pixel sums (whose w component
+ * counts the pixel's samples) the raytracer kernel keeps the sum of
+ * each sample's squared luminance. From these compact estimates how far
+ * each pixel's mean is from converging and writes the pixels that
+ * still need work to a list, which later batches run over instead of
+ * the whole image.
+ */
+
+#include <t2/config.cl>
+
+static float luminance(float4 c)
+{
+    return dot(c.xyz, (float3)(0.2126f, 0.7152f, 0.0722f));
+}
+
+/* The pixel that work item i of a launch renders. Launches cover the
+pass's items starting at item first. With an active pixel list, item
+first + i is that entry of the list. Without one, items cover whole
+tiles in the order of tileOrder, each tile's pixels in scanline order.
+Without either, item first + i is that pixel. Returns 0 for items past
+the end of the list or the image. */
+static int activepixel(__constant struct configuration *config,
+        __global uint *activePixels, __global uint *activeCount,
+        __global uint *tileOrder, uint first, uint i, uint *pixel)
+{
+    i += first;
+
+    if (activePixels) {
+        if (i >= *activeCount)
+            return 0;
+        *pixel = activePixels[i];
+        return 1;
+    }
+
+    if (!tileOrder) {
+        if (i >= config->width * config->height)
+            return 0;
+        *pixel = i;
+        return 1;
+    }
+
+    uint size = config->tileSize;
+    uint tilesX = (config->width + size - 1) / size;
+    uint tile = tileOrder[i / (size * size)];
+    uint inTile = i % (size * size);
+
+    uint x = (tile % tilesX) * size + inTile % size;
+    uint y = (tile / tilesX) * size + inTile / size;
+    if (x >= config->width || y >= config->height)
+        return 0;
+
+    *pixel = y * config->width + x;
+    return 1;
+}
+
+__kernel void compact(
+        __constant struct configuration *config,
+        __global float4 *accum,
+        __global float *moments,
+        __global uint *activePixels,
+        __global uint *activeCount,
+        __global uint *tileOrder,
+        uint first,
+        __global uint *nextPixels,
+        __global uint *nextCount)
+{
+    uint pixel;
+    if (!activepixel(config, activePixels, activeCount, tileOrder, first, get_global_id(0),
+                &pixel))
+        return;
+
+    float4 sum = accum[pixel];
+    float n = sum.w;
+    float mean = luminance(sum) / n;
+
+    // Unbiased sample variance, then the standard error of the mean
+    float variance = fmax(moments[pixel] / n - mean * mean, 0.f) * n / fmax(n - 1.f, 1.f);
+    float error = sqrt(variance / n);
+
+    // Relative error, with a floor so that near-black pixels don't
+    // demand absurd precision
+    int converged = n >= config->adaptiveMinSamples &&
+        error <= config->adaptiveThreshold * fmax(mean, 0.01f);
+
+    if (!converged)
+        nextPixels[atomic_inc(nextCount)] = pixel;
+}
+
+#endif
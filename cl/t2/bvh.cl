@@ -0,0 +1,36 @@
+
+#ifndef T2_BVH_CL
+#define T2_BVH_CL
+
+#include <t2/types.cl>
+
+/* Should match BVH_MAX_DEPTH in t2/bvh.h */
+#define BVH_STACK_DEPTH 64
+
+/* Reciprocal of a ray direction for slab tests. Components too close
+to zero are nudged away from it since fast relaxed math doesn't promise
+sensible infinities. */
+static float3 bvhinversedir(float3 dir)
+{
+    float3 d = select(dir, copysign((float3)(1e-8f), dir), fabs(dir) < (float3)(1e-8f));
+    return (float3)(1.f) / d;
+}
+
+/* Slab test against a node's bounds, limited to [0, maxDist]. On a hit
+the entry distance is stored in *tEntry. */
+static int bvhnodeintersect(__global struct BVHNode *n, float3 origin, float3 invDir,
+        float maxDist, float *tEntry)
+{
+    float3 lo = ((float3)(n->min[0], n->min[1], n->min[2]) - origin) * invDir;
+    float3 hi = ((float3)(n->max[0], n->max[1], n->max[2]) - origin) * invDir;
+    float3 tmin3 = fmin(lo, hi);
+    float3 tmax3 = fmax(lo, hi);
+
+    float tmin = fmax(fmax(tmin3.x, tmin3.y), fmax(tmin3.z, 0.f));
+    float tmax = fmin(fmin(tmax3.x, tmax3.y), fmin(tmax3.z, maxDist));
+
+    *tEntry = tmin;
+    return tmin <= tmax;
+}
+
+#endif
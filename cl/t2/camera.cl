@@ -0,0 +1,58 @@
+#ifndef T2_CAMERA_CL
+#define T2_CAMERA_CL
+
+#include <t2/types.cl>
+#include <t2/config.cl>
+#include <t2/pinhole_camera.cl>
+#include <t2/thinlens_camera.cl>
+
+#include <t2/state.h>
+
+/* The scene's camera, placed where the viewer currently is */
+struct Camera
+{
+    enum CameraType type;
+    union {
+        struct PinholeCamera pinhole;
+        struct ThinLensCamera thinLens;
+    } cameras;
+};
+
+static void camera_setup(struct Camera *camera, __constant struct SceneHeader *sceneHeader,
+        __constant struct state *state)
+{
+#ifdef T2_CAMERA_TYPE
+    camera->type = T2_CAMERA_TYPE;
+#else
+    camera->type = sceneHeader->cameraType;
+#endif
+
+    if (camera->type == CAMERA_THINLENS) {
+        struct ThinLensCamera *thinLens = &camera->cameras.thinLens;
+        *thinLens = sceneHeader->cameras.thinLens;
+        thinLens->eye = state->position;
+        thinLens->lookat = state->position + state->heading;
+        thinLens->lens_radius = state->lens_radius;
+        thinlens_camera_compute_uvw(thinLens);
+    } else if (camera->type == CAMERA_PINHOLE) {
+        struct PinholeCamera *pinhole = &camera->cameras.pinhole;
+        *pinhole = sceneHeader->cameras.pinhole;
+        pinhole->eye = state->position;
+        pinhole->lookat = state->position + state->heading;
+        pinhole_camera_compute_uvw(pinhole);
+    }
+}
+
+/* Primary ray through pixel coord for one square (pixel) and disk
+(lens) sample */
+static struct Ray camera_ray(struct Camera *camera, __constant struct configuration *config,
+        int2 coord, float2 squareSample, float2 diskSample)
+{
+    if (camera->type == CAMERA_THINLENS)
+        return thinlens_camera_ray(&camera->cameras.thinLens, config, coord,
+                squareSample, diskSample);
+
+    return pinhole_camera_ray(&camera->cameras.pinhole, config, coord, squareSample);
+}
+
+#endif
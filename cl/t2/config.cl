@@ -2,7 +2,14 @@
 #ifndef T2_CONFIG_CL
 #define T2_CONFIG_CL
 
-/* This should match the struct in t2/config.h */
+/* These should match t2/config.h (up to its host-only settings) */
+
+#define SAMPLER_SETS  0
+#define SAMPLER_SOBOL 1
+
+#define INTEGRATOR_WHITTED 0
+#define INTEGRATOR_PATH    1
+
 struct configuration {
     uint traceDepth;
     int sampleRoot;
@@ -12,6 +19,40 @@ struct configuration {
     int _unused_batchSize;
     int _unused_paused;
     int _unused_fullScreen;
+    int _unused_headless;
+    float adaptiveThreshold;
+    int adaptiveMinSamples;
+    int tileSize;
+    int sampler;
+    int lightSamples;
+    int integrator;
 };
 
+/* Settings a specialised build of the program has baked in with -D
+options (see t2/variants.h), so that the compiler can unroll loops and
+drop branches over them. Without those they're read at run time. */
+#ifdef T2_TRACE_DEPTH
+#define TRACE_DEPTH(config) ((uint) T2_TRACE_DEPTH)
+#else
+#define TRACE_DEPTH(config) ((config)->traceDepth)
+#endif
+
+#ifdef T2_SAMPLER
+#define SAMPLER(config) T2_SAMPLER
+#else
+#define SAMPLER(config) ((config)->sampler)
+#endif
+
+#ifdef T2_LIGHT_SAMPLES
+#define LIGHT_SAMPLES(config) ((uint) T2_LIGHT_SAMPLES)
+#else
+#define LIGHT_SAMPLES(config) ((uint) (config)->lightSamples)
+#endif
+
+#ifdef T2_INTEGRATOR
+#define INTEGRATOR(config) T2_INTEGRATOR
+#else
+#define INTEGRATOR(config) ((config)->integrator)
+#endif
+
 #endif
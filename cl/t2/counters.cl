@@ -0,0 +1,51 @@
+
+#ifndef T2_COUNTERS_CL
+#define T2_COUNTERS_CL
+
+#include <t2/types.cl>
+
+/* Counting what the raytracer kernel does (see t2/counters.h). Builds
+with -DT2_COUNTERS count into the work item's struct Scene, and each
+work group adds its total to the global counts once at the end, so the
+global atomics are few. Without it none of this costs anything. */
+#ifdef T2_COUNTERS
+#define COUNT(s, counter) ((s)->counts[counter]++)
+#else
+#define COUNT(s, counter) do { } while (0)
+#endif
+
+/**
+ * Add every work item's counts to counters (NUM_COUNTERS pairs of low
+ * and high words), through groupCounts, NUM_COUNTERS uints of local
+ * memory. Every work item in the group must call this, as it has
+ * barriers.
+ */
+static void countersflush(struct Scene *s, __local uint *groupCounts,
+        __global uint *counters)
+{
+#ifdef T2_COUNTERS
+    uint lid = get_local_id(0);
+    uint size = get_local_size(0);
+
+    for (uint i = lid; i < NUM_COUNTERS; i += size)
+        groupCounts[i] = 0;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (uint i = 0; i < NUM_COUNTERS; i++) {
+        if (s->counts[i])
+            atomic_add(&groupCounts[i], s->counts[i]);
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // The low word wrapped around if it came out smaller than what was
+    // added to it
+    for (uint i = lid; i < NUM_COUNTERS && counters; i += size) {
+        uint n = groupCounts[i];
+
+        if (n && atomic_add(&counters[2 * i], n) + n < n)
+            atomic_inc(&counters[2 * i + 1]);
+    }
+#endif
+}
+
+#endif
@@ -0,0 +1,147 @@
+
+#ifndef T2_ENVMAP_CL
+#define T2_ENVMAP_CL
+
+/*
+ * Lighting from an environment map (see t2/envmap.h): rays that leave
+ * the scene see its texel in their direction, and every hit is lit by
+ * it like by an area light, with a sample picked from the map's
+ * distribution and a material sample weighted by multiple importance
+ * sampling. The map's light is integrated with the material's lobes
+ * scaled by 1 / pi, as in t2/path.cl, so a white map of radiance 1
+ * lights a diffuse surface to its own colour.
+ */
+
+#include <t2/types.cl>
+#include <t2/scene.cl>
+#include <t2/lights.cl>
+
+/* The lightsample() slot the environment map's samples come from */
+#define ENV_MAP_SLOT 0xfffeu
+
+/* The direction of the point uv on the map: u goes round the vertical
+axis starting from -z, v goes down from +y */
+static float3 envdirection(float2 uv)
+{
+    float theta = uv.y * M_PI_F;
+    float phi = (uv.x - 0.5f) * 2.f * M_PI_F;
+
+    return (float3)(sin(theta) * sin(phi), cos(theta), -sin(theta) * cos(phi));
+}
+
+static float2 envcoords(float3 dir)
+{
+    return (float2)(atan2(dir.x, -dir.z) / (2.f * M_PI_F) + 0.5f,
+            acos(clamp(dir.y, -1.f, 1.f)) / M_PI_F);
+}
+
+/* Light from the environment in direction dir; black without a map */
+static float4 envradiance(struct Scene *s, float3 dir)
+{
+    if (!SCENE_HAS_ENV_MAP || s->envWidth == 0)
+        return (float4)(0.f);
+
+    float2 uv = envcoords(dir);
+    uint x = min((uint) (uv.x * s->envWidth), s->envWidth - 1);
+    uint y = min((uint) (uv.y * s->envHeight), s->envHeight - 1);
+
+    return s->envTexels[y * s->envWidth + x];
+}
+
+/* The interval of cdf[0..n] that u falls in: the last i with
+cdf[i] <= u, which is never an empty interval */
+static uint searchcdf(__global float *cdf, uint n, float u)
+{
+    uint lo = 0, hi = n;
+
+    while (hi - lo > 1) {
+        uint mid = (lo + hi) / 2;
+        if (cdf[mid] <= u)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+/* The solid angle density in a texel the distribution picks with
+probability p, where the polar angle's sine is sinTheta */
+static float envtexelpdf(struct Scene *s, float p, float sinTheta)
+{
+    if (sinTheta <= 0.f)
+        return 0.f;
+
+    return p * s->envWidth * s->envHeight / (2.f * M_PI_F * M_PI_F * sinTheta);
+}
+
+/**
+ * Pick a direction *L from the map in proportion to its light, using
+ * the uniform sample u: a row from the marginal CDF, a texel from that
+ * row's CDF, and a point in the texel from what's left of u. Returns
+ * the direction's density per unit solid angle.
+ */
+static float sampleenvironment(struct Scene *s, float2 u, float3 *L)
+{
+    __global float *marginal = s->envDistribution;
+    uint y = searchcdf(marginal, s->envHeight, u.y);
+    __global float *row = marginal + (s->envHeight + 1) + y * (s->envWidth + 1);
+    uint x = searchcdf(row, s->envWidth, u.x);
+
+    float py = marginal[y + 1] - marginal[y];
+    float px = row[x + 1] - row[x];
+    if (px <= 0.f || py <= 0.f)
+        return 0.f;
+
+    float2 uv = (float2)((x + (u.x - row[x]) / px) / s->envWidth,
+            (y + (u.y - marginal[y]) / py) / s->envHeight);
+    *L = envdirection(uv);
+
+    return envtexelpdf(s, px * py, sin(uv.y * M_PI_F));
+}
+
+/* The density sampleenvironment() has of picking direction L */
+static float environmentpdf(struct Scene *s, float3 L)
+{
+    float2 uv = envcoords(L);
+    uint x = min((uint) (uv.x * s->envWidth), s->envWidth - 1);
+    uint y = min((uint) (uv.y * s->envHeight), s->envHeight - 1);
+
+    __global float *marginal = s->envDistribution;
+    __global float *row = marginal + (s->envHeight + 1) + y * (s->envWidth + 1);
+
+    return envtexelpdf(s, (marginal[y + 1] - marginal[y]) * (row[x + 1] - row[x]),
+            sqrt(fmax(0.f, 1.f - L.y * L.y)));
+}
+
+/**
+ * The directions *L to trace shadow rays in from P towards the
+ * environment, on a surface with normal N and mirror direction R, and
+ * the light each brings in if nothing blocks it: a map sample and a
+ * material sample, using the uniform samples u. Returns how many there
+ * are, at most 2.
+ */
+static int environmentsamples(struct Scene *s, __global struct Material *m, float3 N,
+        float3 R, float4 u, float3 *L, float4 *contribution)
+{
+    int n = 0;
+
+    float envPdf = sampleenvironment(s, u.xy, &L[n]);
+    if (envPdf > 0.f) {
+        contribution[n] = envradiance(s, L[n]) * materialvalue(m, N, R, L[n]) *
+            powerheuristic(envPdf, materialpdf(m, N, R, L[n])) / (M_PI_F * envPdf);
+        n++;
+    }
+
+    float materialPdf = samplematerial(m, N, R, u.zw, &L[n]);
+    if (materialPdf > 0.f) {
+        envPdf = environmentpdf(s, L[n]);
+        contribution[n] = envradiance(s, L[n]) * materialvalue(m, N, R, L[n]) *
+            powerheuristic(materialPdf, envPdf) / (M_PI_F * materialPdf);
+        n++;
+    }
+
+    return n;
+}
+
+#endif
@@ -0,0 +1,42 @@
+
+#ifndef T2_HASHGRID_CL
+#define T2_HASHGRID_CL
+
+/*
+ * Spatial hashing for the device-side caches (t2/photonmap.cl and
+ * t2/irradiance.cl). Space is cut into cubic cells and each cell is
+ * hashed into one of a power of two number of buckets. With cells
+ * twice as wide as the furthest anything reaches, everything that
+ * reaches a point is in the 2 x 2 x 2 cells around it.
+ */
+
+/* The grid cell P is in */
+static int3 gridcell(float3 P, float cellSize)
+{
+    return convert_int3(floor(P / cellSize));
+}
+
+/* The bucket a cell goes in (Teschner et al., "Optimized Spatial
+Hashing for Collision Detection of Deformable Objects", 2003) */
+static uint gridhash(int3 cell, uint numCells)
+{
+    return ((uint) cell.x * 73856093u ^ (uint) cell.y * 19349663u ^
+            (uint) cell.z * 83492791u) & (numCells - 1);
+}
+
+/* The i'th (of 8) bucket of the cells around a point reached from
+first, or numCells if an earlier one was the same bucket, which
+neighbouring cells can share */
+static uint gridneighbour(int3 first, uint numCells, int i, uint *searched)
+{
+    uint h = gridhash(first + (int3)(i & 1, (i >> 1) & 1, i >> 2), numCells);
+    int seen = 0;
+
+    for (int j = 0; j < i; j++)
+        seen |= searched[j] == h;
+    searched[i] = h;
+
+    return seen ? numCells : h;
+}
+
+#endif
@@ -0,0 +1,325 @@
+
+#ifndef T2_IRRADIANCE_CL
+#define T2_IRRADIANCE_CL
+
+/*
+ * The irradiance cache (see t2/irradiance.h). A diffuse hit at P with
+ * normal N takes its irradiance from the records within reach: record i
+ * reaches P if its error estimate
+ *
+ *   e_i = |P - P_i| / R_i + sqrt(1 - N . N_i)
+ *
+ * is below maxError, and contributes its irradiance extrapolated with
+ * its gradients, weighted by 1 / e_i. Where no record reaches, the hit
+ * samples the hemisphere itself, IRRADIANCE_THETA x IRRADIANCE_PHI
+ * stratified cosine-weighted rays lit by directlighting(), and stores
+ * what it found as a new record.
+ *
+ * Records are hashed into a grid (see t2/hashgrid.cl) of cells twice as
+ * wide as the furthest any record reaches. A launch only reads records
+ * linked into it by irradiance_link after earlier launches, so it never
+ * sees one half written. Neighbouring pixels would all store records
+ * for the same spot, so a record is only stored if it's the first in
+ * its launch to claim a cell about as wide as it reaches.
+ */
+
+#include <t2/types.cl>
+#include <t2/scene.cl>
+#include <t2/hashgrid.cl>
+
+#define IRRADIANCE_THETA 6
+#define IRRADIANCE_PHI 16
+
+/* An empty bucket, or the end of one */
+#define IRRADIANCE_NONE 0xffffffffu
+
+/* This should match struct IrradianceCache in t2/irradiance.h */
+struct IrradianceCache
+{
+    uint count;
+    uint linked;
+    uint capacity;
+    uint numCells;
+    float maxError;
+    float minSpacing;
+    float maxSpacing;
+};
+
+/* Irradiance at a point, and how it changes as the normal turns about
+and the point moves along each axis. This should match struct
+IrradianceRecord in t2/irradiance.h. */
+struct IrradianceRecord
+{
+    float3 position;
+    float3 normal;
+    float4 irradiance;
+    float4 rotation[3];
+    float4 translation[3];
+    float radius;
+    uint next;
+    uint claim;
+};
+
+/* How far from a record's position, relative to its radius, the records
+reach, and the width of the cells they're hashed into */
+static float irradiancereach(__global struct IrradianceCache *c)
+{
+    return c->maxError * c->maxSpacing;
+}
+
+/* The colour gradient g plus the vector v times colour x */
+static void addgradient(float4 g[3], float3 v, float4 x)
+{
+    g[0] += v.x * x;
+    g[1] += v.y * x;
+    g[2] += v.z * x;
+}
+
+/* g (a colour gradient) dotted with v */
+static float4 dotgradient(__global float4 *g, float3 v)
+{
+    return v.x * g[0] + v.y * g[1] + v.z * g[2];
+}
+
+/**
+ * Interpolate the irradiance at P, on a surface with normal N, from the
+ * records that reach it into *E. Returns 0 if none do.
+ */
+static int irradiancelookup(struct Scene *s, float3 P, float3 N, float4 *E)
+{
+    __global struct IrradianceCache *c = s->irradianceCache;
+    float reach = irradiancereach(c);
+    int3 first = gridcell(P - reach, 2.f * reach);
+    float4 sum = (float4)(0.f);
+    float weights = 0.f;
+    uint searched[8];
+
+    for (int i = 0; i < 8; i++) {
+        uint h = gridneighbour(first, c->numCells, i, searched);
+        if (h == c->numCells)
+            continue;
+
+        for (uint r = s->irradianceCells[h]; r != IRRADIANCE_NONE;
+                r = s->irradianceRecords[r].next) {
+            __global struct IrradianceRecord *rec = &s->irradianceRecords[r];
+            float3 d = P - rec->position;
+            float error = length(d) / rec->radius + sqrt(fmax(0.f, 1.f - dot(N, rec->normal)));
+
+            // Records in front of P see light that P might not
+            if (error >= c->maxError || dot(d, (N + rec->normal) * 0.5f) < -0.01f)
+                continue;
+
+            float w = 1.f / fmax(error, 1e-3f);
+            float4 e = rec->irradiance + dotgradient(rec->rotation, cross(rec->normal, N))
+                + dotgradient(rec->translation, d);
+
+            sum += w * fmax(e, (float4)(0.f));
+            weights += w;
+        }
+    }
+
+    if (weights <= 0.f)
+        return 0;
+
+    *E = sum / weights;
+    return 1;
+}
+
+/**
+ * Sample the light arriving at P, on a surface with normal N, from the
+ * surfaces around it into a new record. Each ray is lit the way
+ * raytrace() lights the surface it hits, less the mirror reflection:
+ * direct light and caustics. The environment map is direct light at P
+ * already, so rays that leave the scene bring nothing.
+ *
+ * The gradients are those of Ward and Heckbert, as given for cosine-
+ * weighted strata by Krivanek et al. ("Radiance Caching for Efficient
+ * Global Illumination Computation", 2005).
+ */
+static void irradiancesample(struct Scene *s, float3 P, float3 N, uint lightSamples,
+        uint *rng, struct IrradianceRecord *rec)
+{
+    __global struct IrradianceCache *c = s->irradianceCache;
+    struct LightSampler ls = { 0, 0, *rng };
+    float3 u, v;
+    float4 firstL[IRRADIANCE_THETA], prevL[IRRADIANCE_THETA], L[IRRADIANCE_THETA];
+    float firstDist[IRRADIANCE_THETA], prevDist[IRRADIANCE_THETA], dist[IRRADIANCE_THETA];
+    float4 sum = (float4)(0.f);
+    float invDistSum = 0.f;
+
+    // These rays' shadow rays would only push the pixel's own occluders
+    // out of its shadow cache
+    __global uint *shadowOccluders = s->shadowOccluders;
+    s->shadowOccluders = 0;
+
+    orthonormalbasis(N, &u, &v);
+
+    for (int a = 0; a < 3; a++) {
+        rec->rotation[a] = (float4)(0.f);
+        rec->translation[a] = (float4)(0.f);
+    }
+
+    for (int k = 0; k <= IRRADIANCE_PHI; k++) {
+        // The last pass round only compares the first column with the one
+        // before it
+        if (k < IRRADIANCE_PHI) {
+            float4 rotation = (float4)(0.f);
+
+            for (int j = 0; j < IRRADIANCE_THETA; j++) {
+                float sin2 = (j + randomfloat(&ls.rng)) / IRRADIANCE_THETA;
+                float phi = 2.f * M_PI_F * (k + randomfloat(&ls.rng)) / IRRADIANCE_PHI;
+                float sinTheta = sqrt(sin2);
+                float cosTheta = sqrt(1.f - sin2);
+
+                struct Ray ray;
+                ray.dir = sinTheta * cos(phi) * u + sinTheta * sin(phi) * v + cosTheta * N;
+                ray.origin = P + ray.dir * EPSILON;
+
+                struct IntersectionResult hit;
+                L[j] = (float4)(0.f);
+                dist[j] = MAXFLOAT;
+
+                COUNT(s, COUNTER_REFLECTION_RAYS);
+                if (findintersection(s, &ray, &hit)) {
+                    L[j] = directlighting(s, hit.material, hit.position, hit.normal, ray.dir,
+                            lightSamples, &ls, 0) +
+                        photonlight(s, hit.material, hit.position, hit.normal);
+                    dist[j] = hit.distance;
+                    invDistSum += 1.f / hit.distance;
+                }
+
+                sum += L[j];
+                rotation -= sinTheta / fmax(cosTheta, 1e-2f) * L[j];
+            }
+
+            float phiMid = 2.f * M_PI_F * (k + 0.5f) / IRRADIANCE_PHI;
+            addgradient(rec->rotation, -sin(phiMid) * u + cos(phiMid) * v, rotation);
+
+            // Across the theta strata
+            float4 theta = (float4)(0.f);
+            for (int j = 1; j < IRRADIANCE_THETA; j++) {
+                float sin2 = (float) j / IRRADIANCE_THETA;
+                theta += sqrt(sin2) * (1.f - sin2) / fmin(dist[j], dist[j - 1]) *
+                    (L[j] - L[j - 1]);
+            }
+            addgradient(rec->translation, cos(phiMid) * u + sin(phiMid) * v,
+                    2.f * M_PI_F / IRRADIANCE_PHI * theta);
+        } else {
+            for (int j = 0; j < IRRADIANCE_THETA; j++) {
+                L[j] = firstL[j];
+                dist[j] = firstDist[j];
+            }
+        }
+
+        // Across the phi strata, from the previous column
+        if (k > 0) {
+            float4 across = (float4)(0.f);
+            for (int j = 0; j < IRRADIANCE_THETA; j++) {
+                float sinBelow = sqrt((float) j / IRRADIANCE_THETA);
+                float sinAbove = sqrt((float) (j + 1) / IRRADIANCE_THETA);
+                across += (sinAbove - sinBelow) / fmin(dist[j], prevDist[j]) *
+                    (L[j] - prevL[j]);
+            }
+
+            float phiEdge = 2.f * M_PI_F * k / IRRADIANCE_PHI;
+            addgradient(rec->translation, -sin(phiEdge) * u + cos(phiEdge) * v, across);
+        }
+
+        for (int j = 0; j < IRRADIANCE_THETA; j++) {
+            if (k == 0) {
+                firstL[j] = L[j];
+                firstDist[j] = dist[j];
+            }
+            prevL[j] = L[j];
+            prevDist[j] = dist[j];
+        }
+    }
+
+    float scale = M_PI_F / (IRRADIANCE_THETA * IRRADIANCE_PHI);
+    for (int a = 0; a < 3; a++)
+        rec->rotation[a] *= scale;
+
+    // The harmonic mean distance to the surfaces around P
+    float radius = invDistSum > 0.f ?
+        IRRADIANCE_THETA * IRRADIANCE_PHI / invDistSum : c->maxSpacing;
+
+    rec->position = P;
+    rec->normal = N;
+    rec->irradiance = sum * scale;
+    rec->radius = clamp(radius, c->minSpacing, c->maxSpacing);
+    rec->next = IRRADIANCE_NONE;
+
+    s->shadowOccluders = shadowOccluders;
+    *rng = ls.rng;
+}
+
+/* Store rec if it's the first record of this launch to claim its spot,
+and there's room */
+static void irradiancestore(struct Scene *s, struct IrradianceRecord *rec)
+{
+    __global struct IrradianceCache *c = s->irradianceCache;
+
+    if (c->count >= c->capacity)
+        return;
+
+    // The claimed cells are a power of two wide, about as wide as the
+    // record reaches, at a level of their own in the hash
+    int level = (int) floor(log2(c->maxError * rec->radius));
+    uint h = gridhash(gridcell(rec->position, exp2((float) level)), c->numCells);
+    uint claim = (h ^ hashuint((uint) level)) & (c->numCells - 1);
+
+    if (atomic_cmpxchg(&s->irradianceClaims[claim], 0u, 1u) != 0u)
+        return;
+
+    uint i = atomic_inc(&c->count);
+    if (i >= c->capacity)
+        return;
+
+    rec->claim = claim;
+    s->irradianceRecords[i] = *rec;
+}
+
+/**
+ * Diffuse interreflection reaching the eye from P, on a surface with
+ * normal N: the irradiance there from the cache, through the material's
+ * diffuse lobe. Hits the cache has nothing for sample it, using the
+ * random state rng, and add to it.
+ */
+static float4 irradiancelight(struct Scene *s, __global struct Material *m, float3 P,
+        float3 N, uint lightSamples, uint *rng)
+{
+    if (!SCENE_HAS_IRRADIANCE_CACHE || !s->irradianceCache || m->diff <= 0.f)
+        return (float4)(0.f);
+
+    float4 E;
+    if (!irradiancelookup(s, P, N, &E)) {
+        struct IrradianceRecord rec;
+
+        irradiancesample(s, P, N, lightSamples, rng, &rec);
+        irradiancestore(s, &rec);
+        E = rec.irradiance;
+    }
+
+    return m->diff * m->amb * E / M_PI_F;
+}
+
+/* Link the records stored since the last time into the hash grid, and
+release their claims */
+__kernel void irradiance_link(
+        __global struct IrradianceCache *cache,
+        __global struct IrradianceRecord *records,
+        __global uint *cells,
+        __global uint *claims)
+{
+    uint i = cache->linked + get_global_id(0);
+    if (i >= min(cache->count, cache->capacity))
+        return;
+
+    float reach = irradiancereach(cache);
+    uint h = gridhash(gridcell(records[i].position, 2.f * reach), cache->numCells);
+
+    records[i].next = atomic_xchg(&cells[h], i);
+    claims[records[i].claim] = 0;
+}
+
+#endif
@@ -0,0 +1,333 @@
+
+#ifndef T2_LIGHTS_CL
+#define T2_LIGHTS_CL
+
+/*
+ * Picking lights by importance. Shading points in scenes with more
+ * lights than configuration.lightSamples shade that many lights, each
+ * picked by walking the light tree (see t2/lighttree.h) from the root:
+ * at every node one child is chosen with probability proportional to
+ * its importance from the shading point, its power over its squared
+ * distance. Dividing each light's contribution by the probability of
+ * picking it (and by the number of picks) keeps the estimate unbiased,
+ * and every light with any power can be picked.
+ *
+ * Area lights are shaded with two samples combined by multiple
+ * importance sampling (Veach 1997, power heuristic): a direction towards
+ * a point on the light, and a direction from the material's lobes that
+ * is kept if it happens to hit the light. The first does well for small
+ * lights and rough surfaces, the second for large lights and shiny
+ * ones, and the weights keep whichever is better for each direction.
+ */
+
+#include <t2/types.cl>
+#include <t2/sampling.cl>
+
+/* Where a pixel sample's light sampling decisions come from: stratified
+2D samples from the pixel's sampler, or with no sampler (the wavefront
+kernels) from rng, which also picks lights */
+struct LightSampler {
+    struct PixelSampler *pixel;
+    uint sampleNum;
+    uint rng;
+};
+
+/* A uniform float in [0, 1) from a per-sample random state */
+static float randomfloat(uint *state)
+{
+    *state = hashuint(*state + 0x9e3779b9u);
+    return (*state >> 8) * (1.f / 16777216.f);
+}
+
+/* Samples for the slot'th light shaded at the given depth: a position
+on the light in xy and a material direction in zw */
+static float4 lightsample(struct LightSampler *ls, uint depth, uint slot)
+{
+    if (!ls->pixel)
+        return (float4)(randomfloat(&ls->rng), randomfloat(&ls->rng),
+                randomfloat(&ls->rng), randomfloat(&ls->rng));
+
+    // Dimensions 0 and 1 are the pixel and lens samples
+    uint dimension = 2 + 2 * ((depth << 16) + slot);
+
+    return (float4)(extrasample(ls->pixel, ls->sampleNum, dimension),
+            extrasample(ls->pixel, ls->sampleNum, dimension + 1));
+}
+
+/* How much a node's lights might light P. The distance is taken to the
+middle of their bounds but kept at least half the bounds' diagonal, so
+points inside or near a cluster don't favour it without limit. */
+static float lightnodeimportance(__global struct LightNode *n, float3 P)
+{
+    float3 lo = (float3)(n->min[0], n->min[1], n->min[2]);
+    float3 hi = (float3)(n->max[0], n->max[1], n->max[2]);
+    float3 d = 0.5f * (lo + hi) - P;
+    float3 extent = hi - lo;
+
+    float dist2 = fmax(dot(d, d), 0.25f * dot(extent, extent));
+
+    return n->power / fmax(dist2, EPSILON);
+}
+
+/**
+ * Pick a light for P using the random number u, setting *pdf to the
+ * probability it had of being picked. *pdf is 0 if no light can light
+ * P, in which case the light returned is meaningless.
+ */
+static uint picklight(struct Scene *s, float3 P, float u, float *pdf)
+{
+    uint node = 0;
+
+    *pdf = 1.f;
+
+    while (s->lightNodes[node].count == 0) {
+        uint left = node + 1;
+        uint right = s->lightNodes[node].offset;
+        float wLeft = lightnodeimportance(&s->lightNodes[left], P);
+        float wRight = lightnodeimportance(&s->lightNodes[right], P);
+
+        if (wLeft + wRight <= 0.f) {
+            *pdf = 0.f;
+            return 0;
+        }
+
+        // Reuse u for the next level by rescaling the part of [0, 1)
+        // it fell in
+        float pLeft = wLeft / (wLeft + wRight);
+        if (u < pLeft) {
+            node = left;
+            *pdf *= pLeft;
+            u = u / pLeft;
+        } else {
+            node = right;
+            *pdf *= 1.f - pLeft;
+            u = fmin((u - pLeft) / (1.f - pLeft), 0x1.fffffep-1f);
+        }
+    }
+
+    return s->lightNodes[node].offset;
+}
+
+/* Two directions completing w to an orthonormal basis (Duff et al.,
+"Building an Orthonormal Basis, Revisited", 2017) */
+static void orthonormalbasis(float3 w, float3 *u, float3 *v)
+{
+    float sign = copysign(1.f, w.z);
+    float a = -1.f / (sign + w.z);
+    float b = w.x * w.y * a;
+
+    *u = (float3)(1.f + sign * w.x * w.x * a, sign * b, -sign * w.x);
+    *v = (float3)(b, sign + w.y * w.y * a, -w.y);
+}
+
+/* The direction at angle acos(cosTheta) from w, turned by phi about it */
+static float3 conedirection(float3 w, float cosTheta, float phi)
+{
+    float3 u, v;
+    float sinTheta = sqrt(fmax(0.f, 1.f - cosTheta * cosTheta));
+
+    orthonormalbasis(w, &u, &v);
+
+    return sinTheta * cos(phi) * u + sinTheta * sin(phi) * v + cosTheta * w;
+}
+
+/* 1 - cos of the half angle of the cone a sphere of the given radius
+covers from a point at squared distance dist2, accurate for distant
+spheres too, or 0 if the point is inside it */
+static float sphereconesize(float radius, float dist2)
+{
+    float sin2 = radius * radius / dist2;
+
+    if (sin2 >= 1.f)
+        return 0.f;
+
+    return sin2 / (1.f + sqrt(1.f - sin2));
+}
+
+/**
+ * Pick a direction *L from P towards the area light l using the
+ * uniform sample u: uniformly over the cone a sphere light covers, or
+ * towards a uniformly placed point on a rectangle light. Returns the
+ * direction's probability density per unit solid angle, 0 if there's
+ * no direction to pick.
+ *
+ * That density is also the light's weight in the direction (see struct
+ * Light in t2/scene.h), so shadelight() gives the sample's
+ * contribution as it is.
+ */
+static float samplelight(__global struct Light *l, float3 P, float2 u, float3 *L)
+{
+    float3 d = l->center - P;
+    float dist2 = dot(d, d);
+
+    if (l->type == LIGHT_SPHERE) {
+        float cone = sphereconesize(l->radius, dist2);
+        if (cone <= 0.f)
+            return 0.f;
+
+        *L = conedirection(d * rsqrt(dist2), 1.f - u.x * cone, 2.f * M_PI_F * u.y);
+        return 1.f / (2.f * M_PI_F * cone);
+    }
+
+    // The area times the cosine at the light is |dot(n, L)|
+    float3 n = cross(l->edgeU, l->edgeV);
+
+    d += (u.x - 0.5f) * l->edgeU + (u.y - 0.5f) * l->edgeV;
+    dist2 = dot(d, d);
+    *L = d * rsqrt(dist2);
+
+    float projectedArea = fabs(dot(n, *L));
+    if (projectedArea <= 0.f)
+        return 0.f;
+
+    return dist2 / projectedArea;
+}
+
+/* The density samplelight() has of picking direction L from P, 0 if L
+misses the light */
+static float lightpdf(__global struct Light *l, float3 P, float3 L)
+{
+    float3 d = l->center - P;
+    float dist2 = dot(d, d);
+
+    if (l->type == LIGHT_SPHERE) {
+        float cone = sphereconesize(l->radius, dist2);
+        if (cone <= 0.f || dot(d, L) <= 0.f)
+            return 0.f;
+
+        // Inside the cone if 1 - cos(angle to the centre) <= cone
+        float cosCentre = dot(d, L) * rsqrt(dist2);
+        if (1.f - cosCentre > cone)
+            return 0.f;
+
+        return 1.f / (2.f * M_PI_F * cone);
+    }
+
+    float3 n = cross(l->edgeU, l->edgeV);
+    float dn = dot(L, n);
+
+    if (dn == 0.f)
+        return 0.f;
+
+    float t = dot(d, n) / dn;
+    if (t <= 0.f)
+        return 0.f;
+
+    // Where L meets the light's plane, in units of its edges
+    float3 h = P + t * L - l->center;
+    float a = dot(h, l->edgeU) / dot(l->edgeU, l->edgeU);
+    float b = dot(h, l->edgeV) / dot(l->edgeV, l->edgeV);
+    if (fabs(a) > 0.5f || fabs(b) > 0.5f)
+        return 0.f;
+
+    return t * t / fabs(dn);
+}
+
+/* How much a material reflects in its diffuse lobe, on average over
+the colour channels */
+static float diffuselobe(__global struct Material *m)
+{
+    return m->diff * (m->amb.x + m->amb.y + m->amb.z) / 3.f;
+}
+
+/* The material's diffuse and specular lobes in direction L, for a
+surface with normal N and mirror direction R: what shadelight()
+multiplies a light's colour by */
+static float4 materialvalue(__global struct Material *m, float3 N, float3 R, float3 L)
+{
+    return fmax(0.f, dot(N, L)) * m->diff * m->amb
+        + native_powr(fmax(0.f, dot(R, L)), m->spec) * m->specAmount;
+}
+
+/* How likely samplematerial() is to sample the diffuse lobe rather
+than the specular one, or a negative number if it samples neither */
+static float diffuseweight(__global struct Material *m)
+{
+    float diffuse = diffuselobe(m);
+    float specular = m->specAmount;
+
+    if (diffuse + specular <= 0.f)
+        return -1.f;
+
+    return diffuse / (diffuse + specular);
+}
+
+/* The density samplematerial() has of picking direction L, for a
+surface with normal N and mirror direction R */
+static float materialpdf(__global struct Material *m, float3 N, float3 R, float3 L)
+{
+    float pDiffuse = diffuseweight(m);
+    if (pDiffuse < 0.f)
+        return 0.f;
+
+    float diffuse = fmax(0.f, dot(N, L)) / M_PI_F;
+    float specular = (m->spec + 1.f) / (2.f * M_PI_F) *
+        native_powr(fmax(0.f, dot(R, L)), m->spec);
+
+    return pDiffuse * diffuse + (1.f - pDiffuse) * specular;
+}
+
+/**
+ * Pick a direction *L in proportion to the material's lobes, using the
+ * uniform sample u: cosine weighted about the normal N for the diffuse
+ * lobe, or the Phong lobe about the mirror direction R for the specular
+ * one. Returns the density of the direction, 0 if there's none.
+ */
+static float samplematerial(__global struct Material *m, float3 N, float3 R, float2 u,
+        float3 *L)
+{
+    float pDiffuse = diffuseweight(m);
+    if (pDiffuse < 0.f)
+        return 0.f;
+
+    if (u.x < pDiffuse) {
+        u.x /= pDiffuse;
+        *L = conedirection(N, sqrt(1.f - u.x), 2.f * M_PI_F * u.y);
+    } else {
+        u.x = (u.x - pDiffuse) / (1.f - pDiffuse);
+        *L = conedirection(R, native_powr(u.x, 1.f / (m->spec + 1.f)), 2.f * M_PI_F * u.y);
+    }
+
+    return materialpdf(m, N, R, *L);
+}
+
+/* Veach's power heuristic weight for a sample with density pdf when
+the other strategy's density would have been other */
+static float powerheuristic(float pdf, float other)
+{
+    return pdf * pdf / (pdf * pdf + other * other);
+}
+
+/**
+ * The directions *L to trace shadow rays in from P towards an area
+ * light, on a surface with normal N and mirror direction R, and what
+ * shadelight() should be weighted by in each if the light turns out to
+ * be visible: a light sample and a material sample, using the uniform
+ * samples u (see lightsample()). Returns how many there are, at most 2.
+ */
+static int arealightsamples(__global struct Light *light, __global struct Material *m,
+        float3 P, float3 N, float3 R, float4 u, float3 *L, float *weight)
+{
+    int n = 0;
+
+    float lightPdf = samplelight(light, P, u.xy, &L[n]);
+    if (lightPdf > 0.f) {
+        weight[n] = powerheuristic(lightPdf, materialpdf(m, N, R, L[n]));
+        n++;
+    }
+
+    // Material samples that hit the light count its density over
+    // theirs (see samplelight())
+    float materialPdf = samplematerial(m, N, R, u.zw, &L[n]);
+    if (materialPdf > 0.f) {
+        lightPdf = lightpdf(light, P, L[n]);
+        if (lightPdf > 0.f) {
+            weight[n] = lightPdf / materialPdf * powerheuristic(materialPdf, lightPdf);
+            n++;
+        }
+    }
+
+    return n;
+}
+
+#endif
@@ -0,0 +1,113 @@
+
+#ifndef T2_PATH_CL
+#define T2_PATH_CL
+
+/*
+ * The path tracing integrator (INTEGRATOR_PATH). The Whitted integrator
+ * in t2/trace.cl only follows mirror reflections, and only down to
+ * traceDepth. Here a path bounces off every surface it hits, in a
+ * direction sampled from the surface's material: its mirror, diffuse
+ * or specular lobe, picked in proportion to how much each reflects.
+ *
+ * Every hit is lit by next-event estimation, that is directlighting()'s
+ * shadow rays to the lights and the environment map. Lights aren't
+ * objects paths can hit, so that is the only way their light gets in.
+ * Paths leaving the scene only pick up the environment map after the
+ * camera or a mirror, so nothing is counted twice. Caustics, light
+ * reaching a surface by way of mirrors, come from the photon map when
+ * there is one (see t2/photons.cl), for the same reason.
+ *
+ * Paths end by Russian roulette rather than at a fixed depth. After
+ * PATH_MIN_BOUNCES, a path carries on with probability equal to its
+ * throughput (at most 0.95), and is weighted up by one over that when
+ * it does. Paths that no longer add much end early, and the image
+ * stays unbiased.
+ */
+
+#include <t2/trace.cl>
+
+#define PATH_MIN_BOUNCES 2
+
+/* Paths that survive the roulette this long are cut off anyway */
+#define PATH_MAX_BOUNCES 64
+
+/* The lightsample() slot a path's bounce directions come from. Each
+depth's bounce is a pair of dimensions of its own, so with SAMPLER_SETS
+too it's stratified over the pixel's samples but unrelated to the camera
+sample and the other bounces (see extrasample()); were it not, every
+path would bounce the same way relative to the one before it, and the
+image would converge to the wrong thing. */
+#define PATH_BOUNCE_SLOT 0xffffu
+
+static float4 pathtrace(struct Scene *s, uint lightSamples, struct Ray *r,
+        struct LightSampler *ls)
+{
+    float4 color = (float4)(0.f);
+    float4 throughput = (float4)(1.f);
+    struct Ray ray = *r;
+
+    COUNT(s, COUNTER_PRIMARY_RAYS);
+
+    // Whether the ray came from the camera or a mirror. Those are the
+    // only rays that see the environment map when they leave the scene:
+    // direct lighting has already counted it for the others.
+    int specular = 1;
+
+    for (uint depth = 0; depth < PATH_MAX_BOUNCES; depth++) {
+        struct IntersectionResult hit;
+
+        if (!findintersection(s, &ray, &hit)) {
+            if (specular)
+                color += throughput * envradiance(s, ray.dir);
+            break;
+        }
+
+        __global struct Material *m = hit.material;
+        float3 P = hit.position;
+        float3 N = hit.normal;
+        float3 R = reflect(N, ray.dir);
+
+        color += throughput * (directlighting(s, m, P, N, ray.dir, lightSamples, ls, depth)
+                + photonlight(s, m, P, N));
+
+        // Pick a lobe with u.x and a direction in it with u.zw. The
+        // lobes are scaled by 1 / pi, like a Lambertian BRDF, so the
+        // diffuse lobe reflects diff * amb of the light reaching it.
+        float4 u = lightsample(ls, depth, PATH_BOUNCE_SLOT);
+        float mirror = m->refl > 0.f ? m->reflAmount : 0.f;
+        float lobes = diffuselobe(m) + m->specAmount;
+        float3 dir;
+
+        if (mirror + lobes <= 0.f)
+            break;
+
+        float pMirror = mirror / (mirror + lobes);
+        specular = u.x < pMirror;
+        if (specular) {
+            dir = R;
+            throughput *= mirror / pMirror;
+        } else {
+            float pdf = samplematerial(m, N, R, u.zw, &dir);
+            if (pdf <= 0.f || dot(N, dir) <= 0.f)
+                break;
+
+            throughput *= materialvalue(m, N, R, dir) / (M_PI_F * pdf * (1.f - pMirror));
+        }
+
+        if (depth + 1 >= PATH_MIN_BOUNCES) {
+            float survive = fmin(fmax(throughput.x, fmax(throughput.y, throughput.z)), 0.95f);
+            if (randomfloat(&ls->rng) >= survive)
+                break;
+
+            throughput /= survive;
+        }
+
+        ray.origin = P + dir * EPSILON;
+        ray.dir = dir;
+        COUNT(s, COUNTER_REFLECTION_RAYS);
+    }
+
+    return color;
+}
+
+#endif
@@ -0,0 +1,61 @@
+
+#ifndef T2_PHOTONMAP_CL
+#define T2_PHOTONMAP_CL
+
+/*
+ * Looking up the photon map (see t2/photons.cl). Photons are kept in a
+ * hash grid (see t2/hashgrid.cl) of cells twice the gather radius
+ * across, in numPhotonCells buckets; photonCells[h] is where bucket h's
+ * photons start in the sorted photon array and photonCells[h + 1] where
+ * they end.
+ */
+
+#include <t2/types.cl>
+#include <t2/scene.cl>
+#include <t2/hashgrid.cl>
+
+/* A photon where it landed: the direction it arrived in and the light
+it carries. This should match struct Photon in t2/photons.h. */
+struct Photon
+{
+    float3 position;
+    float3 direction;
+    float4 power;
+};
+
+/**
+ * Light the photon map brings to P, on a surface with normal N, seen
+ * through the material's diffuse lobe: the power of the photons within
+ * the radius that arrived from the front of the surface, over the area
+ * they were gathered from. Photons carry light in the units shadelight()
+ * multiplies by, so this adds to direct lighting as it is.
+ */
+static float4 photonlight(struct Scene *s, __global struct Material *m, float3 P,
+        float3 N)
+{
+    if (!SCENE_HAS_PHOTON_MAP || s->numPhotonCells == 0 || m->diff <= 0.f)
+        return (float4)(0.f);
+
+    float radius = s->photonRadius;
+    int3 first = gridcell(P - radius, 2.f * radius);
+    float4 power = (float4)(0.f);
+    uint searched[8];
+
+    for (int i = 0; i < 8; i++) {
+        uint h = gridneighbour(first, s->numPhotonCells, i, searched);
+        if (h == s->numPhotonCells)
+            continue;
+
+        for (uint p = s->photonCells[h]; p < s->photonCells[h + 1]; p++) {
+            __global struct Photon *photon = &s->photons[p];
+            float3 d = photon->position - P;
+
+            if (dot(d, d) <= radius * radius && dot(photon->direction, N) < 0.f)
+                power += photon->power;
+        }
+    }
+
+    return m->diff * m->amb * power / (M_PI_F * radius * radius);
+}
+
+#endif
@@ -0,0 +1,279 @@
+
+#ifndef T2_PHOTONS_CL
+#define T2_PHOTONS_CL
+
+/*
+ * Progressive photon mapping for caustics (see t2/photons.h). Each
+ * pass, photon_emit traces photons from the lights towards the mirror
+ * spheres and keeps those that land on a diffuse surface after at least
+ * one mirror: light that shadow rays can't find, since they stop at
+ * the mirror. The rest of the kernels sort what was kept into the hash
+ * grid of t2/photonmap.cl, for the raytracer kernel to gather from:
+ *
+ *   photon_hash:        each photon's bucket, and its rank among the
+ *                       photons in that bucket so far
+ *   photon_scan_blocks: bucket counts to starts (an exclusive prefix
+ *   photon_scan_sums:   sum), in blocks of PHOTON_SCAN_GROUP, then over
+ *   photon_add_sums:    the blocks' totals, then adding those back in
+ *   photon_sort:        each photon to its bucket's start plus its rank
+ *
+ * Photons are aimed at the mirrors rather than sent out evenly, since
+ * only those that hit one matter. Their power is divided by the
+ * density they were sent out with, as in any importance sampling, and
+ * multiplied by the squared distance to the first thing they hit. That
+ * undoes the falloff spreading out from the light would give them:
+ * lights here light a point by their strength however far away it is,
+ * and the photons hitting a surface straight from a light now bring it
+ * that much light too. Only spreading out after a mirror dims them.
+ */
+
+#include <t2/types.cl>
+#include <t2/scene.cl>
+#include <t2/trace.cl>
+#include <t2/photonmap.cl>
+
+/* Photons that keep hitting mirrors are dropped after this many hits */
+#define PHOTON_MAX_BOUNCES 8
+
+/* Work-group size of the prefix sum kernels; the host launches them
+with it */
+#define PHOTON_SCAN_GROUP 256
+
+/* A uniformly placed point on light l to send a photon from, using
+the uniform sample u */
+static float3 photonorigin(__global struct Light *l, float2 u)
+{
+    if (l->type == LIGHT_SPHERE)
+        return l->center + l->radius *
+            conedirection((float3)(0.f, 1.f, 0.f), 1.f - 2.f * u.x, 2.f * M_PI_F * u.y);
+    else if (l->type == LIGHT_RECT)
+        return l->center + (u.x - 0.5f) * l->edgeU + (u.y - 0.5f) * l->edgeV;
+
+    return l->center;
+}
+
+/* The density, per unit solid angle, with which photons from O go in
+direction L: towards one of the targets (mirror spheres) picked
+uniformly, uniformly over the cone it covers. Cones can overlap, so
+every target that L points at counts. */
+static float photondirectionpdf(struct Scene *s, __global uint *targets, uint numTargets,
+        float3 O, float3 L)
+{
+    float pdf = 0.f;
+
+    for (uint i = 0; i < numTargets; i++) {
+        __global struct Sphere *t = &s->objects[targets[i]].types.sphere;
+        float3 d = t->center - O;
+        float dist2 = dot(d, d);
+        float cone = sphereconesize(t->radius, dist2);
+
+        if (cone > 0.f && 1.f - dot(d, L) * rsqrt(dist2) <= cone)
+            pdf += 1.f / (2.f * M_PI_F * cone);
+    }
+
+    return pdf / numTargets;
+}
+
+/**
+ * Send one photon from a light picked uniformly, out of numEmitted,
+ * using the random state rng. Every time it lands on a diffuse surface
+ * after a mirror it's added to photons, unless count has reached
+ * capacity.
+ */
+static void tracephoton(struct Scene *s, __global uint *targets, uint numTargets,
+        uint numEmitted, uint *rng, __global struct Photon *photons,
+        __global uint *count, uint capacity)
+{
+    uint l = min((uint) (randomfloat(rng) * s->numLights), s->numLights - 1);
+    __global struct Light *light = &s->lights[l];
+    float2 u = (float2)(randomfloat(rng), randomfloat(rng));
+    float3 O = photonorigin(light, u);
+
+    uint t = min((uint) (randomfloat(rng) * numTargets), numTargets - 1);
+    __global struct Sphere *target = &s->objects[targets[t]].types.sphere;
+    float3 d = target->center - O;
+    float dist2 = dot(d, d);
+    float cone = sphereconesize(target->radius, dist2);
+    if (cone <= 0.f)
+        return;
+
+    struct Ray ray;
+    ray.origin = O;
+    ray.dir = conedirection(d * rsqrt(dist2), 1.f - randomfloat(rng) * cone,
+            2.f * M_PI_F * randomfloat(rng));
+
+    float pdf = photondirectionpdf(s, targets, numTargets, O, ray.dir);
+    if (pdf <= 0.f)
+        return;
+
+    float4 power = light->strength * light->color * (float) s->numLights /
+        (pdf * numEmitted);
+
+    for (uint depth = 0; depth < PHOTON_MAX_BOUNCES; depth++) {
+        struct IntersectionResult hit;
+
+        if (!findintersection(s, &ray, &hit))
+            return;
+
+        __global struct Material *m = hit.material;
+        float3 N = hit.normal;
+
+        if (depth == 0) {
+            power *= hit.distance * hit.distance;
+        } else if (diffuselobe(m) > 0.f) {
+            uint i = atomic_inc(count);
+            if (i < capacity) {
+                photons[i].position = hit.position;
+                photons[i].direction = ray.dir;
+                photons[i].power = power;
+            }
+        }
+
+        // Mirrors reflect reflAmount of the light, so that's how likely
+        // the photon is to carry on
+        float mirror = m->refl > 0.f ? m->reflAmount : 0.f;
+        float survive = fmin(mirror, 1.f);
+        if (randomfloat(rng) >= survive)
+            return;
+        power *= mirror / survive;
+
+        ray.dir = reflect(N, ray.dir);
+        ray.origin = hit.position + ray.dir * EPSILON;
+    }
+}
+
+__kernel void photon_emit(
+        uint seed,
+        uint numEmitted,
+        __global uint *targets,
+        uint numTargets,
+        __global struct Photon *photons,
+        __global uint *count,
+        uint capacity,
+        SCENE_ARGS)
+{
+    uint i = get_global_id(0);
+    if (i >= numEmitted)
+        return;
+
+    struct Scene s;
+    SCENE_INIT(s);
+
+    uint rng = hashuint(i ^ hashuint(seed));
+    tracephoton(&s, targets, numTargets, numEmitted, &rng, photons, count, capacity);
+}
+
+__kernel void photon_hash(
+        __global struct Photon *photons,
+        __global uint *count,
+        uint capacity,
+        float radius,
+        __global uint *cells,
+        uint numCells,
+        __global uint *hashes,
+        __global uint *ranks)
+{
+    uint i = get_global_id(0);
+    uint stored = *count;
+    if (i >= min(stored, capacity))
+        return;
+
+    // When the map filled up, the photons past capacity were dropped.
+    // They landed no differently from those kept, so the kept ones
+    // bring the dropped ones' light as well.
+    if (stored > capacity)
+        photons[i].power *= (float) stored / capacity;
+
+    uint h = gridhash(gridcell(photons[i].position, 2.f * radius), numCells);
+    hashes[i] = h;
+    ranks[i] = atomic_inc(&cells[h]);
+}
+
+/* Inclusive prefix sum of value over the work-group (Hillis and
+Steele), in temp, which holds PHOTON_SCAN_GROUP entries */
+static uint scangroup(__local uint *temp, uint value)
+{
+    uint l = get_local_id(0);
+
+    temp[l] = value;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (uint offset = 1; offset < PHOTON_SCAN_GROUP; offset <<= 1) {
+        uint add = l >= offset ? temp[l - offset] : 0;
+        barrier(CLK_LOCAL_MEM_FENCE);
+        temp[l] += add;
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    return temp[l];
+}
+
+/* Turn the first n of values into the exclusive prefix sum within
+each work-group's block of them, writing each block's total to sums */
+__kernel void photon_scan_blocks(
+        __global uint *values,
+        uint n,
+        __global uint *sums)
+{
+    __local uint temp[PHOTON_SCAN_GROUP];
+    uint i = get_global_id(0);
+    uint value = i < n ? values[i] : 0;
+    uint inclusive = scangroup(temp, value);
+
+    if (i < n)
+        values[i] = inclusive - value;
+    if (get_local_id(0) == PHOTON_SCAN_GROUP - 1)
+        sums[get_group_id(0)] = inclusive;
+}
+
+/* Exclusive prefix sum of the n block totals, in place, by a single
+work-group going through them a group's worth at a time */
+__kernel void photon_scan_sums(
+        __global uint *sums,
+        uint n)
+{
+    __local uint temp[PHOTON_SCAN_GROUP];
+    uint l = get_local_id(0);
+    uint carry = 0;
+
+    for (uint first = 0; first < n; first += PHOTON_SCAN_GROUP) {
+        uint value = first + l < n ? sums[first + l] : 0;
+        uint inclusive = scangroup(temp, value);
+
+        if (first + l < n)
+            sums[first + l] = carry + inclusive - value;
+        carry += temp[PHOTON_SCAN_GROUP - 1];
+
+        // Everyone has read the total before temp is reused
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+}
+
+__kernel void photon_add_sums(
+        __global uint *values,
+        uint n,
+        __global uint *sums)
+{
+    uint i = get_global_id(0);
+
+    if (i < n)
+        values[i] += sums[get_group_id(0)];
+}
+
+__kernel void photon_sort(
+        __global struct Photon *photons,
+        __global uint *count,
+        uint capacity,
+        __global uint *hashes,
+        __global uint *ranks,
+        __global uint *cells,
+        __global struct Photon *sorted)
+{
+    uint i = get_global_id(0);
+    if (i >= min(*count, capacity))
+        return;
+
+    sorted[cells[hashes[i]] + ranks[i]] = photons[i];
+}
+
+#endif
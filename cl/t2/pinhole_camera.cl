@@ -1,4 +1,7 @@
 
+#ifndef T2_PINHOLE_CAMERA_CL
+#define T2_PINHOLE_CAMERA_CL
+
 #include <t2/types.cl>
 #include <t2/config.cl>
 
@@ -16,8 +19,8 @@ static float3 pinhole_camera_ray_direction(struct PinholeCamera *camera, float2
                      (camera->vpdist * camera->w));
 }
 
-static float4 pinhole_camera_render(
-        struct PinholeCamera *camera, __local struct Scene *scene,
+static struct Ray pinhole_camera_ray(
+        struct PinholeCamera *camera,
         __constant struct configuration *config,
         int2 coord, float2 squareSample)
 {
@@ -28,5 +31,7 @@ static float4 pinhole_camera_render(
     r.origin = camera->eye;
     r.dir = pinhole_camera_ray_direction(camera, pp);
 
-    return recursivetrace(scene, config->traceDepth, &r);
+    return r;
 }
+
+#endif
@@ -0,0 +1,209 @@
+#ifndef T2_SAMPLING_CL
+#define T2_SAMPLING_CL
+
+/*
+ * Where each pixel's samples come from. With SAMPLER_SETS they are read
+ * from jittered sample sets generated on the host (see setup_samples()).
+ * With SAMPLER_SOBOL they are computed on the spot: the 2D Sobol
+ * sequence, Owen scrambled and shuffled with a different seed per pixel
+ * and per use (see "Practical Hash-based Owen Scrambling", Burley 2020),
+ * so any sampleRoot² prefix of a pixel's samples is well stratified and
+ * neighbouring pixels' patterns are unrelated.
+ */
+
+#include <t2/config.cl>
+
+struct PixelSampler {
+    // SAMPLER_SETS: this pixel's sets, of numSamples samples each
+    __global float2 *squareSamples;
+    __global float2 *diskSamples;
+    uint numSamples;
+
+    // SAMPLER_SOBOL: scrambling seeds
+    uint seed;
+    int sobol;
+};
+
+/* Finalizer from "lowbias32" (Chris Wellons) */
+static uint hashuint(uint x)
+{
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+}
+
+/* Element i of a random permutation of [0, n), picked by seed ("Correlated
+Multi-Jittered Sampling", Kensler 2013) */
+static uint permuteindex(uint i, uint n, uint seed)
+{
+    uint w = n - 1;
+    w |= w >> 1;
+    w |= w >> 2;
+    w |= w >> 4;
+    w |= w >> 8;
+    w |= w >> 16;
+
+    // Hash within the next power of two up, until the result is below n
+    do {
+        i ^= seed;
+        i *= 0xe170893du;
+        i ^= seed >> 16;
+        i ^= (i & w) >> 4;
+        i ^= seed >> 8;
+        i *= 0x0929eb3fu;
+        i ^= seed >> 23;
+        i ^= (i & w) >> 1;
+        i *= 1 | seed >> 27;
+        i *= 0x6935fa69u;
+        i ^= (i & w) >> 11;
+        i *= 0x74dcb303u;
+        i ^= (i & w) >> 2;
+        i *= 0x9e501cc3u;
+        i ^= (i & w) >> 2;
+        i *= 0xc860a3dfu;
+        i &= w;
+        i ^= i >> 5;
+    } while (i >= n);
+
+    return (i + seed) % n;
+}
+
+static uint reversebits(uint x)
+{
+    x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+    x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+    x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+    x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+    return (x >> 16) | (x << 16);
+}
+
+/* Owen scrambling of a bit-reversed value: each bit is flipped or not
+depending on the seed and the bits below it */
+static uint laineKarras(uint x, uint seed)
+{
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return x;
+}
+
+static uint owenscramble(uint x, uint seed)
+{
+    return reversebits(laineKarras(reversebits(x), seed));
+}
+
+/* The first two Sobol dimensions: van der Corput and its companion */
+static uint2 sobol2d(uint i)
+{
+    uint x = reversebits(i);
+    uint y = 0;
+
+    for (uint v = 1u << 31; i; i >>= 1, v ^= v >> 1) {
+        if (i & 1)
+            y ^= v;
+    }
+
+    return (uint2)(x, y);
+}
+
+static float2 sobolsample(uint i, uint seed)
+{
+    // Owen scrambling the index shuffles points within aligned blocks
+    // of any power-of-two size, so prefixes stay stratified
+    uint2 p = sobol2d(owenscramble(i, hashuint(seed)));
+    p.x = owenscramble(p.x, hashuint(seed + 1));
+    p.y = owenscramble(p.y, hashuint(seed + 2));
+
+    // Top 24 bits, so the result is exact and stays below 1
+    return convert_float2(p >> 8) * (1.f / 16777216.f);
+}
+
+/* Map a square sample to the unit disk (Shirley and Chiu's concentric
+mapping; the same as mapToUnitDisk() on the host) */
+static float2 concentricdisk(float2 s)
+{
+    float2 sp = 2.f * s - 1.f;
+    float r, phi;
+
+    if (sp.x == 0.f && sp.y == 0.f)
+        return (float2)(0.f);
+
+    if (fabs(sp.x) > fabs(sp.y)) {
+        r = sp.x;
+        phi = (M_PI_F / 4.f) * (sp.y / sp.x);
+    } else {
+        r = sp.y;
+        phi = (M_PI_F / 2.f) - (M_PI_F / 4.f) * (sp.x / sp.y);
+    }
+
+    return r * (float2)(cos(phi), sin(phi));
+}
+
+static struct PixelSampler pixelsampler(__constant struct configuration *config,
+        __global float2 *squareSampleSets, __global float2 *diskSampleSets,
+        int numSampleSets, int2 pos)
+{
+    struct PixelSampler p;
+
+    p.sobol = SAMPLER(config) == SAMPLER_SOBOL;
+    p.seed = hashuint(pos.y * config->width + pos.x);
+
+    if (!p.sobol) {
+        // Pick sample sets based on the coordinates of the pixel
+        int sampleSetSize = config->sampleRoot * config->sampleRoot;
+        int sampleSetIndex = ((pos.x * config->height) + pos.y) % numSampleSets;
+        int offset = sampleSetIndex * sampleSetSize;
+
+        p.squareSamples = squareSampleSets + offset;
+        p.diskSamples = diskSampleSets + offset;
+        p.numSamples = sampleSetSize;
+    }
+
+    return p;
+}
+
+/* Sample sampleNum in the unit square, for positions within the pixel */
+static float2 squaresample(struct PixelSampler *p, uint sampleNum)
+{
+    if (p->sobol)
+        return sobolsample(sampleNum, p->seed);
+
+    return p->squareSamples[sampleNum];
+}
+
+/* Sample sampleNum on the unit disk, for positions on the lens */
+static float2 disksample(struct PixelSampler *p, uint sampleNum)
+{
+    if (p->sobol)
+        return concentricdisk(sobolsample(sampleNum, p->seed ^ 0x9e3779b9u));
+
+    return p->diskSamples[sampleNum];
+}
+
+/* Sample sampleNum in the unit square for some further use of the
+pixel's samples, such as positions on area lights. Each dimension gets
+samples stratified on their own and unrelated to every other
+dimension's: with SAMPLER_SETS, the square set's samples in an order
+shuffled per dimension (so the nth sample of one dimension isn't paired
+with the nth of another), shifted by a random offset per dimension,
+wrapping around. */
+static float2 extrasample(struct PixelSampler *p, uint sampleNum, uint dimension)
+{
+    uint seed = hashuint(p->seed ^ hashuint(dimension + 1));
+
+    if (p->sobol)
+        return sobolsample(sampleNum, seed);
+
+    float2 shift = convert_float2((uint2)(seed, hashuint(seed)) >> 8) * (1.f / 16777216.f);
+    uint i = permuteindex(sampleNum, p->numSamples, hashuint(seed + 1));
+    float2 s = p->squareSamples[i] + shift;
+
+    return fmin(s - floor(s), 0x1.fffffep-1f);
+}
+
+#endif
@@ -1,169 +1,131 @@
+#ifndef T2_SCENE_CL
+#define T2_SCENE_CL
 
 #include <t2/types.cl>
-#include <t2/thinlens_camera.cl>
 
-static void buildscene(__local struct Scene *s)
+/* The kernel arguments the host passes the scene through, in the order
+renderer_set_scene_args() sets them. Kernels list these last. */
+#define SCENE_ARGS \
+        __constant struct SceneHeader *sceneHeader, \
+        __global struct Object *objects, \
+        __global struct Material *materials, \
+        __global struct Light *lights, \
+        __global struct BVHNode *bvhNodes, \
+        __global uint *primIndices, \
+        __global float *vertices, \
+        __global uint *indices, \
+        __global struct LightNode *lightNodes, \
+        __global float4 *envTexels, \
+        __global float *envDistribution
+
+/* Object and light counts a specialised build of the program has baked
+in (see TRACE_DEPTH() in t2/config.cl). Planes are the only unbounded
+objects. */
+#ifdef T2_NUM_LIGHTS
+#define SCENE_NUM_LIGHTS(header) ((uint) T2_NUM_LIGHTS)
+#else
+#define SCENE_NUM_LIGHTS(header) ((header)->numLights)
+#endif
+
+#ifdef T2_NUM_AREA_LIGHTS
+#define SCENE_HAS_AREA_LIGHTS (T2_NUM_AREA_LIGHTS > 0)
+#else
+#define SCENE_HAS_AREA_LIGHTS 1
+#endif
+
+#ifdef T2_ENV_MAP
+#define SCENE_HAS_ENV_MAP T2_ENV_MAP
+#else
+#define SCENE_HAS_ENV_MAP 1
+#endif
+
+#ifdef T2_PHOTON_MAP
+#define SCENE_HAS_PHOTON_MAP T2_PHOTON_MAP
+#else
+#define SCENE_HAS_PHOTON_MAP 1
+#endif
+
+#ifdef T2_IRRADIANCE_CACHE
+#define SCENE_HAS_IRRADIANCE_CACHE T2_IRRADIANCE_CACHE
+#else
+#define SCENE_HAS_IRRADIANCE_CACHE 1
+#endif
+
+#ifdef T2_SHADOW_CACHE
+#define SCENE_HAS_SHADOW_CACHE T2_SHADOW_CACHE
+#else
+#define SCENE_HAS_SHADOW_CACHE 1
+#endif
+
+#ifdef T2_NUM_PLANES
+#define SCENE_NUM_UNBOUNDED(header) ((uint) T2_NUM_PLANES)
+#define SCENE_HAS_PLANES (T2_NUM_PLANES > 0)
+#else
+#define SCENE_NUM_UNBOUNDED(header) ((header)->numUnbounded)
+#define SCENE_HAS_PLANES 1
+#endif
+
+#ifdef T2_NUM_SPHERES
+#define SCENE_HAS_SPHERES (T2_NUM_SPHERES > 0)
+#else
+#define SCENE_HAS_SPHERES 1
+#endif
+
+#ifdef T2_NUM_TRIANGLES
+#define SCENE_HAS_TRIANGLES (T2_NUM_TRIANGLES > 0)
+#else
+#define SCENE_HAS_TRIANGLES 1
+#endif
+
+/* Gather a kernel's SCENE_ARGS into a struct Scene */
+#define SCENE_INIT(s) sceneinit(&(s), sceneHeader, objects, materials, lights, \
+        bvhNodes, primIndices, vertices, indices, lightNodes, envTexels, envDistribution)
+
+static void sceneinit(struct Scene *s, __constant struct SceneHeader *sceneHeader,
+        __global struct Object *objects, __global struct Material *materials,
+        __global struct Light *lights, __global struct BVHNode *bvhNodes,
+        __global uint *primIndices, __global float *vertices, __global uint *indices,
+        __global struct LightNode *lightNodes, __global float4 *envTexels,
+        __global float *envDistribution)
 {
-    s->cameraType = CAMERA_THINLENS;
-    s->cameras.thinLens.up = (float3)(0, 1, 0);
-    s->cameras.thinLens.vpdist = 3;
-    s->cameras.thinLens.fpdist = 4;
-
-    // s->cameraType = CAMERA_PINHOLE;
-    // s->cameras.pinhole.up = (float3)(0, 1, 0);
-    // s->cameras.pinhole.vpdist = 3;
-
-    s->numObjects = 0;
-
-    s->objects[s->numObjects].type = OBJECT_SPHERE;
-    s->objects[s->numObjects].types.sphere.center = (float3)(2, 1, -4);
-    s->objects[s->numObjects].types.sphere.radius = 1;
-    s->objects[s->numObjects].material = 3;
-    s->numObjects++;
-
-    s->objects[s->numObjects].type = OBJECT_SPHERE;
-    s->objects[s->numObjects].types.sphere.center = (float3)(2, 1, -2);
-    s->objects[s->numObjects].types.sphere.radius = 1;
-    s->objects[s->numObjects].material = 1;
-    s->numObjects++;
-
-    s->objects[s->numObjects].type = OBJECT_SPHERE;
-    s->objects[s->numObjects].types.sphere.center = (float3)(2, 1, 0);
-    s->objects[s->numObjects].types.sphere.radius = 1;
-    s->objects[s->numObjects].material = 4;
-    s->numObjects++;
-
-    s->objects[s->numObjects].type = OBJECT_SPHERE;
-    s->objects[s->numObjects].types.sphere.center = (float3)(2, 1, 2);
-    s->objects[s->numObjects].types.sphere.radius = 1;
-    s->objects[s->numObjects].material = 1;
-    s->numObjects++;
-
-    s->objects[s->numObjects].type = OBJECT_SPHERE;
-    s->objects[s->numObjects].types.sphere.center = (float3)(2, 1, 4);
-    s->objects[s->numObjects].types.sphere.radius = 1;
-    s->objects[s->numObjects].material = 4;
-    s->numObjects++;
-
-    s->objects[s->numObjects].type = OBJECT_SPHERE;
-    s->objects[s->numObjects].types.sphere.center = (float3)(2, 1, 6);
-    s->objects[s->numObjects].types.sphere.radius = 1;
-    s->objects[s->numObjects].material = 3;
-    s->numObjects++;
-
-    s->objects[s->numObjects].type = OBJECT_SPHERE;
-    s->objects[s->numObjects].types.sphere.center = (float3)(2, 1, 8);
-    s->objects[s->numObjects].types.sphere.radius = 1;
-    s->objects[s->numObjects].material = 3;
-    s->numObjects++;
-
-    s->objects[s->numObjects].type = OBJECT_SPHERE;
-    s->objects[s->numObjects].types.sphere.center = (float3)(2, 1, 10);
-    s->objects[s->numObjects].types.sphere.radius = 1;
-    s->objects[s->numObjects].material = 1;
-    s->numObjects++;
-
-    s->objects[s->numObjects].type = OBJECT_SPHERE;
-    s->objects[s->numObjects].types.sphere.center = (float3)(-2, 1, -4);
-    s->objects[s->numObjects].types.sphere.radius = 1;
-    s->objects[s->numObjects].material = 3;
-    s->numObjects++;
-
-    s->objects[s->numObjects].type = OBJECT_SPHERE;
-    s->objects[s->numObjects].types.sphere.center = (float3)(-2, 1, -2);
-    s->objects[s->numObjects].types.sphere.radius = 1;
-    s->objects[s->numObjects].material = 5;
-    s->numObjects++;
-
-    s->objects[s->numObjects].type = OBJECT_SPHERE;
-    s->objects[s->numObjects].types.sphere.center = (float3)(-2, 1, 0);
-    s->objects[s->numObjects].types.sphere.radius = 1;
-    s->objects[s->numObjects].material = 3;
-    s->numObjects++;
-
-    s->objects[s->numObjects].type = OBJECT_SPHERE;
-    s->objects[s->numObjects].types.sphere.center = (float3)(-2, 1, 2);
-    s->objects[s->numObjects].types.sphere.radius = 1;
-    s->objects[s->numObjects].material = 5;
-    s->numObjects++;
-
-    s->objects[s->numObjects].type = OBJECT_SPHERE;
-    s->objects[s->numObjects].types.sphere.center = (float3)(-2, 1, 4);
-    s->objects[s->numObjects].types.sphere.radius = 1;
-    s->objects[s->numObjects].material = 4;
-    s->numObjects++;
-
-    s->objects[s->numObjects].type = OBJECT_SPHERE;
-    s->objects[s->numObjects].types.sphere.center = (float3)(-2, 1, 6);
-    s->objects[s->numObjects].types.sphere.radius = 1;
-    s->objects[s->numObjects].material = 1;
-    s->numObjects++;
-
-    s->objects[s->numObjects].type = OBJECT_SPHERE;
-    s->objects[s->numObjects].types.sphere.center = (float3)(-2, 1, 8);
-    s->objects[s->numObjects].types.sphere.radius = 1;
-    s->objects[s->numObjects].material = 3;
-    s->numObjects++;
-
-    s->objects[s->numObjects].type = OBJECT_SPHERE;
-    s->objects[s->numObjects].types.sphere.center = (float3)(-2, 1, 10);
-    s->objects[s->numObjects].types.sphere.radius = 1;
-    s->objects[s->numObjects].material = 5;
-    s->numObjects++;
-
-    s->objects[s->numObjects].type = OBJECT_PLANE;
-    s->objects[s->numObjects].types.plane.normal = (float3)(0, 1, 0);
-    s->objects[s->numObjects].types.plane.origin = (float3)(0, 0, 0);
-    s->objects[s->numObjects].material = 2;
-    s->numObjects++;
-
-    s->materials[0].refl = 0;
-    s->materials[0].reflAmount = 1;
-    s->materials[0].spec = 127;
-    s->materials[0].specAmount = 1;
-    s->materials[0].amb  = (float4)(1, 0.7f, 0.7f, 1);
-    s->materials[0].diff = 1;
-
-    s->materials[1].refl = 1;
-    s->materials[1].reflAmount = 1;
-    s->materials[1].spec = 127;
-    s->materials[1].specAmount = 1;
-    s->materials[1].amb  = (float4)(0, 0.7f, 0.7f, 1);
-    s->materials[1].diff = 1;
-
-    s->materials[2].refl = 0;
-    s->materials[2].reflAmount = 1;
-    s->materials[2].spec = 1;
-    s->materials[2].specAmount = 0;
-    s->materials[2].amb  = (float4)(1);
-    s->materials[2].diff = 1;
-
-    s->materials[3].refl = 1;
-    s->materials[3].reflAmount = 0.1;
-    s->materials[3].spec = 10;
-    s->materials[3].specAmount = 1;
-    s->materials[3].amb  = (float4)(0.7f, 0, 0.7f, 1);
-    s->materials[3].diff = 1;
-    s->numMaterials = 4;
-
-    s->materials[4].refl = 0;
-    s->materials[4].reflAmount = 1;
-    s->materials[4].spec = 64;
-    s->materials[4].specAmount = 0.5;
-    s->materials[4].amb  = (float4)(1.f, 0, 0, 1);
-    s->materials[4].diff = 1;
-
-    s->materials[5].refl = 1;
-    s->materials[5].reflAmount = 0;
-    s->materials[5].spec = 2000;
-    s->materials[5].specAmount = 1;
-    s->materials[5].amb  = (float4)(0.3f, 0.3f, 1.f, 1.f);
-    s->materials[5].diff = 1;
-    s->numMaterials = 5;
-
-    s->lights[0].center = (float3)(0, 30, 0);
-    s->lights[0].strength = 0.9;
-    s->lights[0].color = (float4)(1.0, 243.f/255.f, 168.f/255.f, 1);
-
-    s->numLights = 1;
+    s->objects = objects;
+    s->materials = materials;
+    s->lights = lights;
+    s->bvhNodes = bvhNodes;
+    s->primIndices = primIndices;
+    s->vertices = vertices;
+    s->indices = indices;
+    s->lightNodes = lightNodes;
+    s->envTexels = envTexels;
+    s->envDistribution = envDistribution;
+    s->numObjects = sceneHeader->numObjects;
+    s->numLights = SCENE_NUM_LIGHTS(sceneHeader);
+    s->numMaterials = sceneHeader->numMaterials;
+    s->numUnbounded = SCENE_NUM_UNBOUNDED(sceneHeader);
+    s->numBVHNodes = sceneHeader->numBVHNodes;
+    s->numVertices = sceneHeader->numVertices;
+    s->numTriangles = sceneHeader->numTriangles;
+    s->envWidth = sceneHeader->envWidth;
+    s->envHeight = sceneHeader->envHeight;
+
+    // Only the raytracer kernel has a photon map, which it adds itself
+    s->photons = 0;
+    s->photonCells = 0;
+    s->numPhotonCells = 0;
+    s->photonRadius = 0.f;
+
+    // Likewise the irradiance cache
+    s->irradianceCache = 0;
+    s->irradianceRecords = 0;
+    s->irradianceCells = 0;
+    s->irradianceClaims = 0;
+    s->shadowOccluders = 0;
+    s->shadowCacheLights = 0;
+
+#ifdef T2_COUNTERS
+    for (uint i = 0; i < NUM_COUNTERS; i++)
+        s->counts[i] = 0;
+#endif
 }
+
+#endif
@@ -14,15 +14,19 @@ struct RayStack
     int top;
 };
 
-static void push(struct RayStack *s, struct Ray *r, int depth, float contribAmount)
+/* Returns 0 if the stack is full, in which case the ray is dropped */
+static int push(struct RayStack *s, struct Ray *r, int depth, float contribAmount)
 {
-    if (s->top < STACK_DEPTH) {
-        s->r[s->top].dir = r->dir;
-        s->r[s->top].origin = r->origin;
-        s->depth[s->top] = depth;
-        s->contribAmount[s->top] = contribAmount;
-        s->top++;
-    }
+    if (s->top >= STACK_DEPTH)
+        return 0;
+
+    s->r[s->top].dir = r->dir;
+    s->r[s->top].origin = r->origin;
+    s->depth[s->top] = depth;
+    s->contribAmount[s->top] = contribAmount;
+    s->top++;
+
+    return 1;
 }
 
 #endif
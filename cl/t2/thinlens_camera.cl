@@ -3,7 +3,6 @@
 #define T2_THINLENS_CAMERA_CL
 
 #include <t2/types.cl>
-#include <t2/trace.cl>
 #include <t2/config.cl>
 
 static void thinlens_camera_compute_uvw(struct ThinLensCamera *camera)
@@ -24,8 +23,8 @@ static float3 thinlens_camera_ray_direction(struct ThinLensCamera *camera, float
                      (camera->fpdist * camera->w));
 }
 
-static float4 thinlens_camera_render(
-        struct ThinLensCamera *camera, __local struct Scene *scene,
+static struct Ray thinlens_camera_ray(
+        struct ThinLensCamera *camera,
         __constant struct configuration *config,
         int2 coord,
         float2 squareSample, float2 diskSample)
@@ -38,7 +37,7 @@ static float4 thinlens_camera_render(
     r.origin = camera->eye + (lensPoint.x * camera->u) + (lensPoint.y * camera->v);
     r.dir = thinlens_camera_ray_direction(camera, pixelPoint, lensPoint);
 
-    return recursivetrace(scene, config->traceDepth, &r);
+    return r;
 }
 
 #endif
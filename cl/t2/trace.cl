@@ -2,17 +2,45 @@
 #ifndef T2_TRACE_CL
 #define T2_TRACE_CL
 
+#include <t2/counters.cl>
 #include <t2/stack.cl>
 #include <t2/sphere.cl>
 #include <t2/plane.cl>
+#include <t2/triangle.cl>
+#include <t2/bvh.cl>
+#include <t2/lights.cl>
+#include <t2/envmap.cl>
+#include <t2/photonmap.cl>
+
+/* shadowRayHit()'s light for shadow rays that aren't towards a light */
+#define SHADOW_CACHE_NONE 0xffffffffu
 
 static float3 reflect(float3 A, float3 B)
 {
     return B - ((float3)2) * (float3)dot(A, B) * A;
 }
 
-static int findintersection(__local struct Scene *s, struct Ray *r,
-        struct IntersectionResult *intersection)
+static int intersectobject(struct Scene *s, __global struct Object *o, struct Ray *r, float *dist)
+{
+    if (SCENE_HAS_TRIANGLES && o->type == OBJECT_TRIANGLE) {
+        COUNT(s, COUNTER_TRIANGLE_TESTS);
+        return triangleintersect(&o->types.triangle, s->vertices, s->indices, r, dist);
+    } else if (SCENE_HAS_SPHERES && o->type == OBJECT_SPHERE) {
+        COUNT(s, COUNTER_SPHERE_TESTS);
+        return sphereintersect(&o->types.sphere, r, dist);
+    } else if (SCENE_HAS_PLANES && o->type == OBJECT_PLANE) {
+        COUNT(s, COUNTER_PLANE_TESTS);
+        return planeintersect(&o->types.plane, r, dist);
+    }
+
+    return 0;
+}
+
+/* The closest hit along r into intersection, or without one whether r
+hits anything at all, and if so which object into occluder (if that
+isn't NULL either) */
+static int findhit(struct Scene *s, struct Ray *r, struct IntersectionResult *intersection,
+        uint *occluder)
 {
     if (intersection) {
         intersection->distance = MAXFLOAT;
@@ -20,42 +48,106 @@ static int findintersection(__local struct Scene *s, struct Ray *r,
     }
 
     int hitObject = -1;
-    int res;
     float lDist;
+    uint obj;
 
-    for (uint i = 0; i < s->numObjects; i++)
-    {
-        lDist = MAXFLOAT;
-        if (s->objects[i].type == OBJECT_SPHERE) {
-            res = sphereintersect(&s->objects[i].types.sphere, r, &lDist);
-        } else if (s->objects[i].type == OBJECT_PLANE) {
-            res = planeintersect(&s->objects[i].types.plane, r, &lDist);
-        }
-        if (res) {
-            if (!intersection) {
-                // When there's no intersection record to fill out, it's
-                // because we're doing a shadow ray trace. Since we
-                // don't care which object was closer -- we only care
-                // that we hit _something_ - we return as soon as we
-                // find any hit at all.
-                return res;
-            } else if (lDist < intersection->distance) {
-                intersection->result = 1;
-                intersection->distance = lDist;
-                hitObject = i;
+// Test one object. When there's no intersection record to fill out,
+// it's because we're doing a shadow ray trace. Since we don't care
+// which object was closer -- we only care that we hit _something_ - we
+// return as soon as we find any hit at all.
+#define TEST_OBJECT(index) do { \
+        obj = (index); \
+        lDist = MAXFLOAT; \
+        if (intersectobject(s, &s->objects[obj], r, &lDist)) { \
+            if (!intersection) { \
+                if (occluder) \
+                    *occluder = obj; \
+                return 1; \
+            } else if (lDist < intersection->distance) { \
+                intersection->result = 1; \
+                intersection->distance = lDist; \
+                hitObject = obj; \
+            } \
+        } \
+    } while (0)
+
+    // Unbounded objects (planes) aren't in the BVH
+    for (uint i = 0; i < s->numUnbounded; i++)
+        TEST_OBJECT(s->primIndices[i]);
+
+    if (s->numBVHNodes > 0) {
+        float3 invDir = bvhinversedir(r->dir);
+        uint stack[BVH_STACK_DEPTH];
+        int top = 0;
+        uint node = 0;
+        float tLeft, tRight;
+
+        // Closest-hit rays only need to look as far as the closest hit
+        // so far; shadow rays look all the way.
+#define MAX_DIST (intersection ? intersection->distance : MAXFLOAT)
+
+        if (bvhnodeintersect(&s->bvhNodes[0], r->origin, invDir, MAX_DIST, &tLeft)) {
+            while (1) {
+                __global struct BVHNode *n = &s->bvhNodes[node];
+
+                if (n->count > 0) {
+                    for (uint i = 0; i < n->count; i++)
+                        TEST_OBJECT(s->primIndices[n->offset + i]);
+
+                    if (top == 0)
+                        break;
+                    node = stack[--top];
+                } else {
+                    uint left = node + 1;
+                    uint right = n->offset;
+                    int hitLeft = bvhnodeintersect(&s->bvhNodes[left], r->origin, invDir,
+                            MAX_DIST, &tLeft);
+                    int hitRight = bvhnodeintersect(&s->bvhNodes[right], r->origin, invDir,
+                            MAX_DIST, &tRight);
+
+                    if (hitLeft && hitRight) {
+                        // Visit the nearer child first, come back for the
+                        // other. The builder keeps trees shallow enough
+                        // for the stack (see BVH_MAX_DEPTH in t2/bvh.h),
+                        // so the check only guards against a bad one.
+                        node = tLeft <= tRight ? left : right;
+                        if (top < BVH_STACK_DEPTH)
+                            stack[top++] = tLeft <= tRight ? right : left;
+                    } else if (hitLeft) {
+                        node = left;
+                    } else if (hitRight) {
+                        node = right;
+                    } else {
+                        if (top == 0)
+                            break;
+                        node = stack[--top];
+                    }
+                }
             }
         }
+
+#undef MAX_DIST
     }
 
+#undef TEST_OBJECT
+
     if (intersection) {
         if (intersection->result) {
             intersection->position = r->origin + r->dir * intersection->distance;
             intersection->material = &s->materials[s->objects[hitObject].material];
-            if (s->objects[hitObject].type == OBJECT_SPHERE) {
+            if (SCENE_HAS_SPHERES && s->objects[hitObject].type == OBJECT_SPHERE) {
                 intersection->normal = spherenormal(&s->objects[hitObject].types.sphere,
                         intersection->position);
-            } else if (s->objects[hitObject].type == OBJECT_PLANE) {
+            } else if (SCENE_HAS_PLANES && s->objects[hitObject].type == OBJECT_PLANE) {
                 intersection->normal = (&s->objects[hitObject].types.plane)->normal;
+            } else if (SCENE_HAS_TRIANGLES &&
+                    s->objects[hitObject].type == OBJECT_TRIANGLE) {
+                // Mesh winding isn't reliable, so face the normal
+                // towards the ray
+                intersection->normal = trianglenormal(&s->objects[hitObject].types.triangle,
+                        s->vertices, s->indices);
+                if (dot(intersection->normal, r->dir) > 0.f)
+                    intersection->normal = -intersection->normal;
             }
         }
         return intersection->result;
@@ -63,51 +155,172 @@ static int findintersection(__local struct Scene *s, struct Ray *r,
         return 0;
 }
 
-static int shadowRayHit(__local struct Scene *s, float3 L, float3 P)
+static int findintersection(struct Scene *s, struct Ray *r,
+        struct IntersectionResult *intersection)
 {
-    struct Ray light;
-    light.origin = P;
-    light.dir = L;
-
-    return findintersection(s, &light, 0);
+    return findhit(s, r, intersection, 0);
 }
 
-static float4 raytrace(__local struct Scene *s, struct RayStack *stack, uint traceDepth,
-        struct Ray *r, uint depth, float prevAmount)
+/**
+ * Whether anything blocks the shadow ray from P in direction L towards
+ * light number light, or SHADOW_CACHE_NONE for rays that shouldn't use
+ * the shadow cache: those not towards a light, and those from past the
+ * primary hit.
+ * With a shadow cache, the object that blocked the pixel's last shadow
+ * ray towards the same light is tried first, and only if it no longer
+ * does are the rest searched; the cache then remembers what was found.
+ * The cache has a slot per light up to s->shadowCacheLights (16 at
+ * most, see src/renderer.c); lights past that share slots, and a pixel
+ * lit by two of them only gains where they're blocked by the same
+ * object.
+ */
+static int shadowRayHit(struct Scene *s, float3 L, float3 P, uint light)
 {
-    float4 color = (float4)(0, 0, 0, 0);
+    struct Ray ray;
+    ray.origin = P;
+    ray.dir = L;
 
-    if (depth > traceDepth) return color;
+    COUNT(s, COUNTER_SHADOW_RAYS);
 
-    struct IntersectionResult intersection;
-    int result = findintersection(s, r, &intersection);
+    if (!SCENE_HAS_SHADOW_CACHE || !s->shadowOccluders || !s->shadowCacheLights ||
+            light == SHADOW_CACHE_NONE)
+        return findintersection(s, &ray, 0);
 
-    if (result == 0) return color;
+    // Objects are stored one up, so that 0 is nothing
+    __global uint *cached = &s->shadowOccluders[light % s->shadowCacheLights];
+    uint last = *cached;
+    float dist = MAXFLOAT;
 
-    __local struct Material *m  = intersection.material;
-    float3 P = intersection.position;
-    float3 N = intersection.normal;
+    if (last > 0 && last <= s->numObjects &&
+            intersectobject(s, &s->objects[last - 1], &ray, &dist)) {
+        COUNT(s, COUNTER_CACHED_SHADOWS);
+        return 1;
+    }
+
+    uint occluder;
+    int hit = findhit(s, &ray, 0, &occluder);
+    uint found = hit ? occluder + 1 : 0;
+
+    if (found != last)
+        *cached = found;
+
+    return hit;
+}
+
+/* Light reaching the eye along rayDir from a light in direction L of a
+surface with normal N, assuming nothing blocks the light */
+static float4 shadelight(__global struct Material *m, __global struct Light *light,
+        float3 N, float3 L, float3 rayDir)
+{
+    float angle = fmax(0.f, dot(N, L));
+    float sv = dot(rayDir, reflect(N, L));
+    float4 lColor = (float4)(light->strength) * light->color;
+
+    return angle * m->diff * m->amb * lColor
+        + native_powr(fmax(0.f, sv), m->spec) * lColor * m->specAmount;
+}
 
-    float angle, sv;
+/**
+ * Light reaching the eye along rayDir from P, on a surface with normal
+ * N, from one light: the slot'th shaded at this depth, which picks its
+ * samples. Area lights take a light sample and a material sample,
+ * weighted by multiple importance sampling (see t2/lights.cl).
+ */
+static float4 directlight(struct Scene *s, __global struct Material *m,
+        __global struct Light *light, float3 P, float3 N, float3 rayDir,
+        struct LightSampler *ls, uint depth, uint slot)
+{
     float3 L;
-    float4 lColor;
-    __local struct Light *light;
 
-    for (uint i = 0; i < s->numLights; i++)
-    {
-        light = &(s->lights[i]);
+    // Only primary hits use the shadow cache (see struct Scene)
+    uint cached = depth == 0 ? light - s->lights : SHADOW_CACHE_NONE;
+
+    if (!SCENE_HAS_AREA_LIGHTS || light->type == LIGHT_POINT) {
         L = normalize(light->center - P);
+        if (shadowRayHit(s, L, P, cached))
+            return (float4)(0.f);
+
+        return shadelight(m, light, N, L, rayDir);
+    }
+
+    float4 color = (float4)(0.f);
+    float3 directions[2];
+    float weights[2];
+    int n = arealightsamples(light, m, P, N, reflect(N, rayDir), lightsample(ls, depth, slot),
+            directions, weights);
+
+    for (int i = 0; i < n; i++) {
+        if (shadowRayHit(s, directions[i], P, cached) == 0)
+            color += shadelight(m, light, N, directions[i], rayDir) * weights[i];
+    }
+
+    return color;
+}
+
+/* Light reaching the eye along rayDir from P, on a surface with normal
+N, from every light, or from lightSamples picked by importance, and
+from the environment map */
+static float4 directlighting(struct Scene *s, __global struct Material *m, float3 P,
+        float3 N, float3 rayDir, uint lightSamples, struct LightSampler *ls, uint depth)
+{
+    float4 color = (float4)(0.f);
+
+    if (lightSamples == 0 || s->numLights <= lightSamples) {
+        for (uint i = 0; i < s->numLights; i++)
+            color += directlight(s, m, &s->lights[i], P, N, rayDir, ls, depth, i);
+    } else {
+        // Too many lights to shade them all: shade a few picked by
+        // importance, weighted by how likely they were to be picked
+        for (uint i = 0; i < lightSamples; i++)
+        {
+            float pdf;
+            uint l = picklight(s, P, randomfloat(&ls->rng), &pdf);
+
+            if (pdf > 0.f)
+                color += directlight(s, m, &s->lights[l], P, N, rayDir, ls, depth, i) /
+                    (pdf * lightSamples);
+        }
+    }
 
-        if (shadowRayHit(s, L, P) == 0) {
-            angle = fmax(0.f, dot(N, L));
-            sv = dot(r->dir, reflect(N, L));
+    if (SCENE_HAS_ENV_MAP && s->envWidth > 0) {
+        float3 directions[2];
+        float4 contributions[2];
+        int n = environmentsamples(s, m, N, reflect(N, rayDir),
+                lightsample(ls, depth, ENV_MAP_SLOT), directions, contributions);
 
-            lColor = (float4)(light->strength) * light->color;
-            color += angle * m->diff * m->amb * lColor
-                + native_powr(fmax(0.f, sv), m->spec) * lColor * m->specAmount;
+        for (int i = 0; i < n; i++) {
+            if (shadowRayHit(s, directions[i], P, SHADOW_CACHE_NONE) == 0)
+                color += contributions[i];
         }
     }
 
+    return color;
+}
+
+// The irradiance cache lights its samples with directlighting()
+#include <t2/irradiance.cl>
+
+static float4 raytrace(struct Scene *s, struct RayStack *stack, uint traceDepth,
+        uint lightSamples, struct LightSampler *ls, struct Ray *r, uint depth,
+        float prevAmount)
+{
+    float4 color = (float4)(0, 0, 0, 0);
+
+    if (depth > traceDepth) return color;
+
+    struct IntersectionResult intersection;
+    int result = findintersection(s, r, &intersection);
+
+    if (result == 0) return envradiance(s, r->dir);
+
+    __global struct Material *m  = intersection.material;
+    float3 P = intersection.position;
+    float3 N = intersection.normal;
+
+    color += directlighting(s, m, P, N, r->dir, lightSamples, ls, depth);
+    color += photonlight(s, m, P, N);
+    color += irradiancelight(s, m, P, N, lightSamples, &ls->rng);
+
     if (depth < traceDepth && m->refl > 0 && m->reflAmount > 0 && prevAmount > 0)
     {
         float3 refl = reflect(N, r->dir);
@@ -116,25 +329,34 @@ static float4 raytrace(__local struct Scene *s, struct RayStack *stack, uint tra
         R.origin = P + refl * EPSILON;
         R.dir = refl;
 
-        push(stack, &R, depth + 1, m->reflAmount * prevAmount);
+        if (push(stack, &R, depth + 1, m->reflAmount * prevAmount))
+            COUNT(s, COUNTER_REFLECTION_RAYS);
+        else
+            COUNT(s, COUNTER_STACK_OVERFLOWS);
     }
 
     return color;
 }
 
-static float4 recursivetrace(__local struct Scene *s, uint traceDepth, struct Ray *r)
+static float4 recursivetrace(struct Scene *s, uint traceDepth, uint lightSamples,
+        struct Ray *r, struct LightSampler *ls)
 {
     struct RayStack stack;
     stack.top = 0;
     push(&stack, r, 0, 1.f);
+    COUNT(s, COUNTER_PRIMARY_RAYS);
 
     float4 c = (float4)(0, 0, 0, 0);
 
-    while(stack.top > 0)
+    // Each ray pushes at most one reflected ray, one level deeper, so
+    // there are at most traceDepth + 1 rays. Bounding the loop by that
+    // lets it unroll when traceDepth is a constant.
+    for (uint bounce = 0; bounce <= traceDepth && stack.top > 0; bounce++)
     {
         stack.top--;
         c += (float4)(stack.contribAmount[stack.top]) * raytrace(s, &stack, traceDepth,
-                &stack.r[stack.top], stack.depth[stack.top], stack.contribAmount[stack.top]);
+                lightSamples, ls, &stack.r[stack.top], stack.depth[stack.top],
+                stack.contribAmount[stack.top]);
     }
 
     return c;
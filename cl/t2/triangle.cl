@@ -0,0 +1,81 @@
+
+#include <t2/types.cl>
+
+static float3 trianglevertex(__global float *vertices, __global uint *indices,
+        __global struct Triangle *t, uint corner)
+{
+    return vload3(indices[t->index * 3 + corner], vertices);
+}
+
+static float3 trianglenormal(__global struct Triangle *t, __global float *vertices,
+        __global uint *indices)
+{
+    float3 v0 = trianglevertex(vertices, indices, t, 0);
+    float3 v1 = trianglevertex(vertices, indices, t, 1);
+    float3 v2 = trianglevertex(vertices, indices, t, 2);
+
+    return normalize(cross(v1 - v0, v2 - v0));
+}
+
+/* Reorder v so the ray direction's dominant axis comes last (see
+triangleintersect) */
+static float3 trianglepermute(float3 v, int kz, int swapXY)
+{
+    float3 p = kz == 0 ? v.yzx : (kz == 1 ? v.zxy : v.xyz);
+    return swapXY ? p.yxz : p;
+}
+
+/**
+ * Watertight ray/triangle intersection (Woop, Benthin and Wald, "Watertight
+ * Ray/Triangle Intersection", JCGT 2013). The vertices are moved into a
+ * space where the ray starts at the origin and runs along +z, so edges
+ * shared by neighbouring triangles are tested identically and rays
+ * can't slip through the cracks between them.
+ */
+static int triangleintersect(__global struct Triangle *t, __global float *vertices,
+        __global uint *indices, struct Ray *r, float *dist)
+{
+    float3 absDir = fabs(r->dir);
+    int kz = absDir.x > absDir.y ? (absDir.x > absDir.z ? 0 : 2) :
+                                   (absDir.y > absDir.z ? 1 : 2);
+    float3 dir = trianglepermute(r->dir, kz, 0);
+
+    // Keep the winding direction of the triangle
+    int swapXY = dir.z < 0.f;
+    dir = trianglepermute(r->dir, kz, swapXY);
+
+    float3 shear = (float3)(dir.x / dir.z, dir.y / dir.z, 1.f / dir.z);
+
+    float3 A = trianglepermute(trianglevertex(vertices, indices, t, 0) - r->origin, kz, swapXY);
+    float3 B = trianglepermute(trianglevertex(vertices, indices, t, 1) - r->origin, kz, swapXY);
+    float3 C = trianglepermute(trianglevertex(vertices, indices, t, 2) - r->origin, kz, swapXY);
+
+    float Ax = A.x - shear.x * A.z;
+    float Ay = A.y - shear.y * A.z;
+    float Bx = B.x - shear.x * B.z;
+    float By = B.y - shear.y * B.z;
+    float Cx = C.x - shear.x * C.z;
+    float Cy = C.y - shear.y * C.z;
+
+    // Scaled barycentric coordinates
+    float U = Cx * By - Cy * Bx;
+    float V = Ax * Cy - Ay * Cx;
+    float W = Bx * Ay - By * Ax;
+
+    if ((U < 0.f || V < 0.f || W < 0.f) && (U > 0.f || V > 0.f || W > 0.f))
+        return 0;
+
+    float det = U + V + W;
+    if (det == 0.f)
+        return 0;
+
+    float T = U * shear.z * A.z + V * shear.z * B.z + W * shear.z * C.z;
+    float tHit = T / det;
+
+    if (tHit > EPSILON) {
+        *dist = tHit;
+        return 1;
+    }
+
+    return 0;
+}
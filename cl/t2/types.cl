@@ -2,9 +2,7 @@
 #ifndef T2_TYPES_CL
 #define T2_TYPES_CL
 
-#define MAX_OBJECTS 20
-#define MAX_LIGHTS 10
-#define MAX_MATERIALS 10
+#include <t2/counters.h>
 
 struct Ray
 {
@@ -46,9 +44,18 @@ struct Plane
     float3 origin;
 };
 
+/* A mesh triangle; its corners are at indices [3 * index, 3 * index + 2]
+of the scene's index array, which in turn point into the packed (x, y,
+z) vertex array */
+struct Triangle
+{
+    uint index;
+};
+
 enum ObjectType {
     OBJECT_SPHERE,
-    OBJECT_PLANE
+    OBJECT_PLANE,
+    OBJECT_TRIANGLE
 };
 
 struct Object {
@@ -56,15 +63,27 @@ struct Object {
     union {
         struct Sphere sphere;
         struct Plane plane;
+        struct Triangle triangle;
     } types;
     uint material;
 };
 
+enum LightType {
+    LIGHT_POINT,
+    LIGHT_SPHERE,
+    LIGHT_RECT
+};
+
+/* See t2/scene.h for what the fields mean for each type */
 struct Light
 {
     float3 center;
     float strength;
     float4 color;
+    float3 edgeU;
+    float3 edgeV;
+    float radius;
+    enum LightType type;
 };
 
 struct Material
@@ -77,21 +96,56 @@ struct Material
     float specAmount;
 };
 
+/* Flattened BVH node. Interior nodes have count 0, their left child
+immediately after them and their right child at offset. Leaves cover
+count entries of the primitive index array starting at offset. */
+struct BVHNode
+{
+    float min[3];
+    uint offset;
+    float max[3];
+    uint count;
+};
+
+/* Light tree node; see t2/scene.h */
+struct LightNode
+{
+    float min[3];
+    uint offset;
+    float max[3];
+    uint count;
+    float power;
+};
+
 enum CameraType {
     CAMERA_PINHOLE,
     CAMERA_THINLENS
 };
 
-struct Scene
+/* The fixed-size part of the scene. This and the object, light and
+material arrays are built on the host (see t2/scene.h, which should
+match these structs) and uploaded once. */
+struct SceneHeader
 {
-    struct Object objects[MAX_OBJECTS];
-    struct Light  lights[MAX_LIGHTS];
-    struct Material materials[MAX_MATERIALS];
-
     uint numObjects;
     uint numLights;
     uint numMaterials;
 
+    // The first numUnbounded primitive indices are objects without
+    // bounds (planes), the rest are ordered for the BVH leaves
+    uint numUnbounded;
+    uint numBVHNodes;
+
+    uint numVertices;
+    uint numTriangles;
+
+    uint numLightNodes;
+
+    uint numAreaLights;
+
+    uint envWidth;
+    uint envHeight;
+
     union {
         struct PinholeCamera pinhole;
         struct ThinLensCamera thinLens;
@@ -100,13 +154,68 @@ struct Scene
     enum CameraType cameraType;
 };
 
+/* What the tracing code sees: the scene arrays in global memory */
+struct Scene
+{
+    __global struct Object *objects;
+    __global struct Light *lights;
+    __global struct Material *materials;
+    __global struct BVHNode *bvhNodes;
+    __global uint *primIndices;
+    __global float *vertices;
+    __global uint *indices;
+    __global struct LightNode *lightNodes;
+    __global float4 *envTexels;
+    __global float *envDistribution;
+
+    // The current pass's photon map, if there is one (see
+    // t2/photonmap.cl): photons sorted by grid cell, and where each
+    // cell's photons start in that array
+    __global struct Photon *photons;
+    __global uint *photonCells;
+
+    // The irradiance cache, if there is one (see t2/irradiance.cl): its
+    // header, records, the first record in each bucket and the buckets
+    // claimed for new records
+    __global struct IrradianceCache *irradianceCache;
+    __global struct IrradianceRecord *irradianceRecords;
+    __global uint *irradianceCells;
+    __global uint *irradianceClaims;
+
+    // The pixel's shadow cache, if there is one: the object that last
+    // blocked a shadow ray from the pixel's primary hit towards each of
+    // its shadowCacheLights lights, one up (see shadowRayHit() in
+    // t2/trace.cl). Shadow rays from reflections and path bounces land
+    // somewhere else every sample and would only evict the primary
+    // hit's occluders, so they don't use it.
+    __global uint *shadowOccluders;
+    uint shadowCacheLights;
+
+    uint numObjects;
+    uint numLights;
+    uint numMaterials;
+    uint numUnbounded;
+    uint numBVHNodes;
+    uint numVertices;
+    uint numTriangles;
+    uint envWidth;
+    uint envHeight;
+    uint numPhotonCells;
+    float photonRadius;
+
+#ifdef T2_COUNTERS
+    // This work item's share of the work done (see t2/counters.cl)
+    uint counts[NUM_COUNTERS];
+#endif
+};
+
 struct IntersectionResult
 {
     int result;
     float3 normal;
     float3 position;
     float distance;
-    __local struct Material *material;
+    __global struct Material *material;
 };
 
 #endif
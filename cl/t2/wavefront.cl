@@ -0,0 +1,287 @@
+#ifndef T2_WAVEFRONT_CL
+#define T2_WAVEFRONT_CL
+
+/*
+ * Wavefront renderer. Instead of tracing a whole path per work item,
+ * the host runs one small kernel per stage over every live path:
+ *
+ *   generate: one camera ray per pixel into the ray queue
+ *   extend:   closest hit for each queued ray; hits go to the hit queue
+ *   shade:    one shadow ray per hit and light into the shadow queue,
+ *             and the reflected ray (if any) into the next ray queue
+ *   connect:  trace shadow rays, adding unblocked light to the pixel's
+ *             running sum (the same one the raytracer kernel uses)
+ *   advance:  make the next ray queue current
+ *
+ * extend to advance repeat once per bounce. Queues are compacted with
+ * atomic counters, so each stage only does useful work and work items
+ * in a group take the same branches. Kernels are launched over each
+ * queue's capacity and items past the current count return at once.
+ */
+
+#include <t2/types.cl>
+#include <t2/config.cl>
+#include <t2/camera.cl>
+#include <t2/scene.cl>
+#include <t2/trace.cl>
+#include <t2/sampling.cl>
+
+#include <t2/state.h>
+
+/* These should match the structs in t2/wavefront.h */
+
+struct QueueCounts
+{
+    uint rays;
+    uint hits;
+    uint shadowRays;
+    uint nextRays;
+};
+
+/* A path waiting to be extended by one segment */
+struct PathState
+{
+    struct Ray ray;
+    float throughput;
+    uint pixel;
+    uint depth;
+    // Random state for picking lights (see cl/t2/lights.cl)
+    uint seed;
+};
+
+struct PathHit
+{
+    float3 position;
+    float3 normal;
+    uint path;
+    uint material;
+};
+
+struct ShadowRay
+{
+    struct Ray ray;
+    float4 contribution;
+    uint pixel;
+};
+
+static void atomicaddfloat(volatile __global float *addr, float value)
+{
+    uint old, sum;
+
+    do {
+        old = as_uint(*addr);
+        sum = as_uint(as_float(old) + value);
+    } while (atomic_cmpxchg((volatile __global uint *) addr, old, sum) != old);
+}
+
+__kernel void wavefront_generate(
+        __constant struct configuration *config,
+        __constant struct state *state,
+        __global float2 *squareSampleSets,
+        __global float2 *diskSampleSets,
+        int numSampleSets,
+        uint sampleNum,
+        __global struct QueueCounts *counts,
+        __global struct PathState *rays,
+        __global float4 *accum,
+        SCENE_ARGS)
+{
+    int2 pos = (int2)(get_global_id(0), get_global_id(1));
+    uint pixel = pos.y * config->width + pos.x;
+
+    // connect adds to the sums, so start them over for a new frame.
+    // The w component counts samples.
+    if (sampleNum == 0)
+        accum[pixel] = (float4)(0.f, 0.f, 0.f, 1.f);
+    else
+        accum[pixel].w += 1.f;
+
+    // Same samples as the raytracer kernel
+    struct PixelSampler sampler = pixelsampler(config, squareSampleSets, diskSampleSets,
+            numSampleSets, pos);
+
+    struct Camera camera;
+    camera_setup(&camera, sceneHeader, state);
+
+    __global struct PathState *p = &rays[pixel];
+    p->ray = camera_ray(&camera, config, pos, squaresample(&sampler, sampleNum),
+            disksample(&sampler, sampleNum));
+    p->throughput = 1.f;
+    p->pixel = pixel;
+    p->depth = 0;
+    p->seed = hashuint(pixel ^ hashuint(sampleNum));
+
+    if (pixel == 0) {
+        counts->rays = config->width * config->height;
+        counts->hits = 0;
+        counts->shadowRays = 0;
+        counts->nextRays = 0;
+    }
+}
+
+__kernel void wavefront_extend(
+        __global struct QueueCounts *counts,
+        __global struct PathState *rays,
+        __global struct PathHit *hits,
+        __global float *accum,
+        SCENE_ARGS)
+{
+    uint i = get_global_id(0);
+    if (i >= counts->rays)
+        return;
+
+    struct Scene s;
+    SCENE_INIT(s);
+
+    struct Ray r = rays[i].ray;
+    struct IntersectionResult intersection;
+
+    // Paths that leave the scene are done, after picking up the
+    // environment map if there is one
+    if (!findintersection(&s, &r, &intersection)) {
+        if (SCENE_HAS_ENV_MAP && s.envWidth > 0) {
+            float4 c = rays[i].throughput * envradiance(&s, r.dir);
+            __global float *p = accum + 4 * rays[i].pixel;
+            atomicaddfloat(p, c.x);
+            atomicaddfloat(p + 1, c.y);
+            atomicaddfloat(p + 2, c.z);
+        }
+        return;
+    }
+
+    uint h = atomic_inc(&counts->hits);
+    hits[h].position = intersection.position;
+    hits[h].normal = intersection.normal;
+    hits[h].path = i;
+    hits[h].material = intersection.material - s.materials;
+}
+
+__kernel void wavefront_shade(
+        __constant struct configuration *config,
+        __global struct QueueCounts *counts,
+        __global struct PathState *rays,
+        __global struct PathHit *hits,
+        __global struct ShadowRay *shadowRays,
+        __global struct PathState *nextRays,
+        SCENE_ARGS)
+{
+    uint i = get_global_id(0);
+    if (i >= counts->hits)
+        return;
+
+    struct Scene s;
+    SCENE_INIT(s);
+
+    struct PathHit hit = hits[i];
+    struct PathState path = rays[hit.path];
+    __global struct Material *m = &s.materials[hit.material];
+
+    // Queue shadow rays for each light, or for each light picked when
+    // there are more than lightSamples as in raytrace(); connect adds
+    // the light if it turns out to be visible. Area lights take two,
+    // like directlight(), with random rather than stratified samples.
+    uint lightSamples = LIGHT_SAMPLES(config);
+    int pick = lightSamples > 0 && s.numLights > lightSamples;
+    uint numLights = pick ? lightSamples : s.numLights;
+    struct LightSampler ls = { 0, 0, path.seed };
+
+    for (uint l = 0; l < numLights; l++) {
+        float weight = path.throughput;
+        uint index = l;
+
+        if (pick) {
+            float pdf;
+            index = picklight(&s, hit.position, randomfloat(&ls.rng), &pdf);
+            if (pdf <= 0.f)
+                continue;
+            weight /= pdf * lightSamples;
+        }
+
+        __global struct Light *light = &s.lights[index];
+        float3 directions[2];
+        float weights[2];
+        int n;
+
+        if (!SCENE_HAS_AREA_LIGHTS || light->type == LIGHT_POINT) {
+            directions[0] = normalize(light->center - hit.position);
+            weights[0] = 1.f;
+            n = 1;
+        } else {
+            n = arealightsamples(light, m, hit.position, hit.normal,
+                    reflect(hit.normal, path.ray.dir), lightsample(&ls, path.depth, l),
+                    directions, weights);
+        }
+
+        for (int j = 0; j < n; j++) {
+            uint sr = atomic_inc(&counts->shadowRays);
+            shadowRays[sr].ray.origin = hit.position;
+            shadowRays[sr].ray.dir = directions[j];
+            shadowRays[sr].contribution = weight * weights[j] *
+                shadelight(m, light, hit.normal, directions[j], path.ray.dir);
+            shadowRays[sr].pixel = path.pixel;
+        }
+    }
+
+    if (SCENE_HAS_ENV_MAP && s.envWidth > 0) {
+        float3 directions[2];
+        float4 contributions[2];
+        int n = environmentsamples(&s, m, hit.normal, reflect(hit.normal, path.ray.dir),
+                lightsample(&ls, path.depth, ENV_MAP_SLOT), directions, contributions);
+
+        for (int j = 0; j < n; j++) {
+            uint sr = atomic_inc(&counts->shadowRays);
+            shadowRays[sr].ray.origin = hit.position;
+            shadowRays[sr].ray.dir = directions[j];
+            shadowRays[sr].contribution = path.throughput * contributions[j];
+            shadowRays[sr].pixel = path.pixel;
+        }
+    }
+
+    // Same continuation rule as raytrace()
+    if (path.depth < config->traceDepth && m->refl > 0 && m->reflAmount > 0 &&
+            path.throughput > 0) {
+        float3 refl = reflect(hit.normal, path.ray.dir);
+
+        uint n = atomic_inc(&counts->nextRays);
+        nextRays[n].ray.origin = hit.position + refl * EPSILON;
+        nextRays[n].ray.dir = refl;
+        nextRays[n].throughput = path.throughput * m->reflAmount;
+        nextRays[n].pixel = path.pixel;
+        nextRays[n].depth = path.depth + 1;
+        nextRays[n].seed = ls.rng;
+    }
+}
+
+__kernel void wavefront_connect(
+        __global struct QueueCounts *counts,
+        __global struct ShadowRay *shadowRays,
+        __global float *accum,
+        SCENE_ARGS)
+{
+    uint i = get_global_id(0);
+    if (i >= counts->shadowRays)
+        return;
+
+    struct Scene s;
+    SCENE_INIT(s);
+
+    struct ShadowRay sr = shadowRays[i];
+    if (findintersection(&s, &sr.ray, 0))
+        return;
+
+    // Several lights can light the same pixel in one pass
+    __global float *p = accum + 4 * sr.pixel;
+    atomicaddfloat(p, sr.contribution.x);
+    atomicaddfloat(p + 1, sr.contribution.y);
+    atomicaddfloat(p + 2, sr.contribution.z);
+}
+
+__kernel void wavefront_advance(__global struct QueueCounts *counts)
+{
+    counts->rays = counts->nextRays;
+    counts->hits = 0;
+    counts->shadowRays = 0;
+    counts->nextRays = 0;
+}
+
+#endif
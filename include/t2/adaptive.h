@@ -0,0 +1,48 @@
+#ifndef T2_ADAPTIVE_H
+#define T2_ADAPTIVE_H
+
+#include <t2/opencl_setup.h>
+#include <t2/config.h>
+
+struct renderer;
+
+/* Adaptive sampling state (see cl/t2/adaptive.cl) */
+struct adaptive {
+    int enabled;
+    cl_kernel compact;
+
+    /* Per-pixel sums of squared sample luminance. The raytracer kernel
+       keeps these up to date whether or not sampling is adaptive. */
+    cl_mem momentBuf;
+
+    /* Lists of the pixels still taking samples, with their lengths.
+       Each compaction filters one list into the other. While list is
+       -1 every pixel is active. */
+    cl_mem pixelBufs[2];
+    cl_mem countBufs[2];
+    int list;
+
+    /* An upper bound on the current list's length. Lists only shrink
+       within a frame, so a stale count read back from the device
+       still bounds it. */
+    cl_uint count;
+
+    /* Non-blocking read of a list length, while in flight, and the
+       frame it belongs to */
+    cl_uint countRead;
+    cl_event countEvent;
+    cl_ulong countFrame;
+    cl_ulong frame;
+
+    size_t numPixels;
+};
+
+int adaptive_init(struct adaptive *a, struct renderer *r, struct configuration *config);
+int adaptive_set_pixels(struct adaptive *a, cl_kernel kernel, cl_uint firstArg,
+        cl_uint sampleNum, size_t *workSize);
+int adaptive_compact(struct adaptive *a, struct renderer *r, struct configuration *config,
+        cl_uint sampleCount);
+int adaptive_converged(struct adaptive *a);
+void adaptive_release(struct adaptive *a);
+
+#endif
@@ -0,0 +1,15 @@
+
+#ifndef T2_BVH_H
+#define T2_BVH_H
+
+#include <t2/scene.h>
+
+/* The kernel's traversal stack holds this many nodes (see
+BVH_STACK_DEPTH in cl/t2/bvh.cl), so the builder keeps the tree at
+most this deep, making leaves of larger ranges at the last level
+rather than deeper subtrees the kernel would have to skip. */
+#define BVH_MAX_DEPTH 64
+
+void buildBVH(struct scene *s);
+
+#endif
@@ -4,6 +4,20 @@
 
 #include <t2/opencl_setup.h>
 
+/* Where pixel samples come from (see cl/t2/sampling.cl) */
+#define SAMPLER_SETS  0
+#define SAMPLER_SOBOL 1
+
+/* How the raytracer kernel follows rays (see cl/t2/path.cl) */
+#define INTEGRATOR_WHITTED 0
+#define INTEGRATOR_PATH    1
+
+/* Orders tiles can be rendered in (see t2/tiles.h) */
+#define TILE_ORDER_SCANLINE 0
+#define TILE_ORDER_CENTRE   1
+#define TILE_ORDER_CURSOR   2
+#define TILE_ORDER_HILBERT  3
+
 struct configuration {
     // How deeply will reflective tracing go?
     cl_uint traceDepth;
@@ -28,6 +42,89 @@ struct configuration {
 
     // Whether to run in fullscreen mode
     int fullScreen;
+
+    // Whether to render offline without a window
+    int headless;
+
+    // Adaptive sampling: a pixel stops taking samples once it has at
+    // least adaptiveMinSamples and the standard error of its mean
+    // luminance is below adaptiveThreshold times the mean. 0 disables
+    // adaptive sampling.
+    cl_float adaptiveThreshold;
+    int adaptiveMinSamples;
+
+    // Width and height of the tiles batches are split into
+    int tileSize;
+
+    // SAMPLER_SETS for sample sets generated on the host, or
+    // SAMPLER_SOBOL for samples computed in the kernels
+    int sampler;
+
+    // How many lights each shading point picks by importance (see
+    // cl/t2/lights.cl) when the scene has more than that; 0 shades
+    // every light
+    int lightSamples;
+
+    // INTEGRATOR_WHITTED to follow mirror reflections up to traceDepth,
+    // or INTEGRATOR_PATH to path trace
+    int integrator;
+
+    // Host-only settings below; these are not mirrored in
+    // cl/t2/config.cl.
+
+    // Where headless mode writes the finished image
+    const char *outputFile;
+
+    // Wavefront OBJ mesh to add to the scene, or NULL
+    const char *meshFile;
+
+    // Radiance HDR environment map to light the scene with, or NULL
+    const char *envMapFile;
+
+    // Whether to light the demo scene with area lights instead of its
+    // point light
+    int areaLights;
+
+    // Whether to render with the wavefront kernels (one kernel per
+    // path tracing stage) instead of the raytracer megakernel
+    int wavefront;
+
+    // Which tiles to render first (TILE_ORDER_*), and roughly how many
+    // milliseconds one launch may take; 0 renders whole batches in one
+    // launch
+    int tileOrder;
+    float tileBudget;
+
+    // Whether to share the rendering with every other OpenCL device
+    int multiDevice;
+
+    // With SAMPLER_SETS, the kind of sets (SAMPLE_SET_* in
+    // t2/samplers.h) and the seed they are generated from
+    int sampleSetType;
+    cl_ulong sampleSeed;
+
+    // Whether to build raytracer kernels specialised for the trace
+    // depth, camera and scene (see t2/variants.h)
+    int specialise;
+
+    // Whether the raytracer kernel counts rays and intersection tests
+    // (see t2/counters.h)
+    int countRays;
+
+    // Photon mapping (see t2/photons.h): photons sent out per pass, 0
+    // to turn it off, how many megabytes the photon map may take, and
+    // the gather radius it starts from
+    int photonsPerPass;
+    int photonMemory;
+    float photonRadius;
+
+    // Irradiance caching (see t2/irradiance.h): the largest error
+    // estimate at which a record may light a point, 0 to turn it off
+    float irradianceError;
+
+    // Whether each pixel remembers the object that last blocked its
+    // shadow rays towards each light, and tries it first
+    int shadowCache;
 };
 
 #endif
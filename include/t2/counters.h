@@ -0,0 +1,33 @@
+#ifndef T2_COUNTERS_H
+#define T2_COUNTERS_H
+
+/* Work the raytracer kernel counts when built with -DT2_COUNTERS (see
+cl/t2/counters.cl). The device keeps each count as two uints, low word
+first. */
+#define COUNTER_PRIMARY_RAYS    0
+#define COUNTER_REFLECTION_RAYS 1   /* pushed onto the ray stack, or path bounces */
+#define COUNTER_SHADOW_RAYS     2
+#define COUNTER_SPHERE_TESTS    3
+#define COUNTER_PLANE_TESTS     4
+#define COUNTER_TRIANGLE_TESTS  5
+#define COUNTER_STACK_OVERFLOWS 6   /* reflection rays the stack had no room for */
+#define COUNTER_CACHED_SHADOWS  7   /* shadow rays the shadow cache's occluder blocked */
+#define NUM_COUNTERS            8
+
+#ifndef __OPENCL_C_VERSION__
+
+#include <t2/opencl_setup.h>
+
+struct counters {
+    cl_ulong counts[NUM_COUNTERS];
+};
+
+void counters_clear(struct counters *c);
+void counters_add(struct counters *total, const struct counters *c);
+cl_ulong counters_rays(const struct counters *c);
+cl_ulong counters_tests(const struct counters *c);
+const char *counter_name(int counter);
+
+#endif
+
+#endif
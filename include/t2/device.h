@@ -4,7 +4,12 @@
 
 #include <t2/opencl_setup.h>
 
-cl_context createOpenCLContext();
+#define MAX_DEVICES 10
+
+cl_context createOpenCLContext(cl_platform_id platform_id);
+cl_context createHeadlessOpenCLContext(cl_platform_id platform_id);
+cl_context tryCreateHeadlessOpenCLContext(cl_platform_id platform_id);
+int listOpenCLDevices(cl_context context, cl_device_id *device_ids, int max);
 cl_device_id chooseOpenCLDevice(cl_platform_id platform_id, cl_context context);
 
 #endif
@@ -0,0 +1,9 @@
+
+#ifndef T2_ENVMAP_H
+#define T2_ENVMAP_H
+
+#include <t2/scene.h>
+
+int loadEnvironmentMap(struct scene *s, const char *path);
+
+#endif
@@ -0,0 +1,15 @@
+
+#ifndef T2_HEADLESS_H
+#define T2_HEADLESS_H
+
+#include <t2/config.h>
+#include <t2/state.h>
+#include <t2/renderer.h>
+#include <t2/scene.h>
+
+cl_mem headless_create_image(cl_context context, int width, int height);
+int headless_render(struct renderer *renderer, struct configuration *config,
+        struct state *state, struct scene *scene, cl_mem output);
+int run_headless(struct configuration *config, struct state *programState);
+
+#endif
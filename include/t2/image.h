@@ -0,0 +1,8 @@
+
+#ifndef T2_IMAGE_H
+#define T2_IMAGE_H
+
+int writeImagePPM(const char *path, const float *pixels, int width, int height);
+float *readImageHDR(const char *path, int *width, int *height);
+
+#endif
@@ -0,0 +1,79 @@
+
+#ifndef T2_IRRADIANCE_H
+#define T2_IRRADIANCE_H
+
+#include <t2/opencl_setup.h>
+#include <t2/config.h>
+
+/*
+ * Irradiance caching (Ward et al. 1988) for the Whitted integrator's
+ * diffuse interreflection. Diffuse hits in raytrace() interpolate the
+ * light arriving from other surfaces from records of it nearby, each
+ * with its rotational and translational gradients (Ward and Heckbert,
+ * 1992), and only sample the hemisphere where none is close enough
+ * (see cl/t2/irradiance.cl). The records live on the device in a hash
+ * grid, and carry over from one batch and frame to the next until the
+ * scene changes.
+ */
+
+/* Most records the cache holds, and the number of buckets (a power of
+two) they're hashed into */
+#define IRRADIANCE_CAPACITY (1 << 18)
+#define IRRADIANCE_NUM_CELLS (1 << 16)
+
+/* Bounds on a record's radius, the harmonic mean distance to the
+surfaces around it, so records aren't too dense in corners or too
+sparse in the open */
+#define IRRADIANCE_MIN_SPACING 0.1f
+#define IRRADIANCE_MAX_SPACING 4.f
+
+/* This should match struct IrradianceCache in cl/t2/irradiance.cl */
+struct IrradianceCache
+{
+    cl_uint count;
+    cl_uint linked;
+    cl_uint capacity;
+    cl_uint numCells;
+    cl_float maxError;
+    cl_float minSpacing;
+    cl_float maxSpacing;
+};
+
+/* This should match struct IrradianceRecord in cl/t2/irradiance.cl */
+struct IrradianceRecord
+{
+    cl_float3 position;
+    cl_float3 normal;
+    cl_float4 irradiance;
+    cl_float4 rotation[3];
+    cl_float4 translation[3];
+    cl_float radius;
+    cl_uint next;
+    cl_uint claim;
+};
+
+struct renderer;
+
+/* Irradiance cache state (see cl/t2/irradiance.cl) */
+struct irradiance {
+    int enabled;
+    cl_kernel link;
+
+    /* The cache's header, its records, the first record in each bucket
+       and which buckets of a coarser hash a new record has claimed in
+       the current launch */
+    cl_mem cacheBuf;
+    cl_mem recordBuf;
+    cl_mem cellBuf;
+    cl_mem claimBuf;
+
+    float maxError;
+};
+
+int irradiance_init(struct irradiance *c, struct renderer *r, struct configuration *config);
+int irradiance_set_args(struct irradiance *c, cl_kernel kernel, cl_uint firstArg);
+int irradiance_clear(struct irradiance *c, struct renderer *r);
+int irradiance_link(struct irradiance *c, struct renderer *r);
+void irradiance_release(struct irradiance *c);
+
+#endif
@@ -0,0 +1,9 @@
+
+#ifndef T2_LIGHTTREE_H
+#define T2_LIGHTTREE_H
+
+#include <t2/scene.h>
+
+void buildLightTree(struct scene *s);
+
+#endif
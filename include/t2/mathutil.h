@@ -2,6 +2,8 @@
 #ifndef T2_MATHUTIL_H
 #define T2_MATHUTIL_H
 
+#include <math.h>
+
 #define MAXF(a, b) ((a) > (b) ? (a) : (b))
 #define MINF(a, b) ((a) < (b) ? (a) : (b))
 
@@ -0,0 +1,57 @@
+#ifndef T2_MULTIDEVICE_H
+#define T2_MULTIDEVICE_H
+
+#include <t2/opencl_setup.h>
+#include <t2/config.h>
+#include <t2/platform.h>
+
+#define MAX_HELPER_DEVICES 16
+
+struct renderer;
+
+/* A helper's sums as last read back to the host. Reads go into one
+   buffer while the other holds the last finished one. */
+struct readback {
+    cl_float *sums[2];
+    int latest;
+    cl_event event;
+
+    /* The frame the sums belong to, whether the latest ones do to the
+       current frame, and the helper's batch count when last read */
+    cl_ulong frame;
+    int current;
+    cl_ulong batches;
+};
+
+/* Other OpenCL devices, on any platform, that a renderer shares its
+   tiles with. Each helper is a renderer of its own whose per-pixel sums
+   cover whichever tiles it rendered; they're read back, added up on the
+   host and added to the displaying renderer's own sums when resolving.
+   Sample counts are part of the sums, so this works however the tiles
+   were split up. */
+struct multidevice {
+    struct renderer *helpers;
+    struct readback *readbacks;
+    int numHelpers;
+
+    /* Contexts created for helpers on other platforms */
+    cl_context contexts[MAX_PLATFORMS];
+    int numContexts;
+
+    /* The helpers' sums added up, on the host and the device, and the
+       upload of the former to the latter while it's in flight */
+    cl_float *remoteAccum;
+    cl_mem remoteAccumBuf;
+    cl_event remoteEvent;
+
+    /* Counts frames, so that reads from before a restart are ignored */
+    cl_ulong frame;
+};
+
+int multidevice_init(struct renderer *r, struct configuration *config);
+int multidevice_restart(struct renderer *r);
+int multidevice_poll(struct renderer *r);
+int multidevice_finish(struct renderer *r);
+void multidevice_release(struct renderer *r);
+
+#endif
@@ -0,0 +1,8 @@
+#ifndef T2_OBJ_H
+#define T2_OBJ_H
+
+#include <t2/scene.h>
+
+int loadOBJ(const char *path, struct scene *s, cl_uint material);
+
+#endif
@@ -0,0 +1,12 @@
+
+#ifndef T2_OPENGL_SETUP_H
+#define T2_OPENGL_SETUP_H
+
+#ifdef __APPLE__
+#include <OpenGL/gl.h>
+#include <OpenGL/glext.h>
+#else
+#include <GL/glew.h>
+#endif
+
+#endif
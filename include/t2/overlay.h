@@ -4,8 +4,10 @@
 
 #include <t2/state.h>
 #include <t2/config.h>
+#include <t2/profiler.h>
 
 int initialize_overlay(struct configuration *config);
-void render_overlay(struct configuration *config, struct state *programState);
+void render_overlay(struct configuration *config, struct state *programState,
+        struct profiler *profiler);
 
 #endif
@@ -0,0 +1,80 @@
+
+#ifndef T2_PHOTONS_H
+#define T2_PHOTONS_H
+
+#include <t2/opencl_setup.h>
+#include <t2/config.h>
+#include <t2/state.h>
+#include <t2/scene.h>
+
+/*
+ * Progressive photon mapping (Hachisuka et al. 2008), for the caustics
+ * mirror spheres cast: light reaching a diffuse surface by way of a
+ * mirror, which shadow rays can't find. Every pass of the raytracer
+ * kernel first gets a photon map of its own (see cl/t2/photons.cl), and
+ * gathers from it with a radius that shrinks from one pass to the next
+ * as r_i^2 = r_(i-1)^2 (i + alpha) / (i + 1) (Knaus and Zwicker, 2011).
+ * Each pass's estimate is then biased by a little less and the average
+ * the accumulation buffer keeps converges, without the per-pixel
+ * statistics of the original method.
+ */
+
+/* This should match struct Photon in cl/t2/photonmap.cl */
+struct Photon
+{
+    cl_float3 position;
+    cl_float3 direction;
+    cl_float4 power;
+};
+
+struct renderer;
+
+/* Photon mapping state (see cl/t2/photons.cl) */
+struct photons {
+    int enabled;
+    cl_kernel emit;
+    cl_kernel hash;
+    cl_kernel scanBlocks;
+    cl_kernel scanSums;
+    cl_kernel addSums;
+    cl_kernel sort;
+
+    /* Photons as they're stored, how many were, and each one's bucket
+       and rank within it; then the photons sorted by bucket and the
+       buckets' starts (numCells + 1 of them), with the scan's block
+       totals */
+    cl_mem photonBuf;
+    cl_mem countBuf;
+    cl_mem hashBuf;
+    cl_mem rankBuf;
+    cl_mem sortedBuf;
+    cl_mem cellBuf;
+    cl_mem blockSumBuf;
+
+    /* Most photons a pass keeps, and the number of buckets (a power of
+       two) they're hashed into */
+    cl_uint capacity;
+    cl_uint numCells;
+
+    /* Objects photons are aimed at (mirror spheres), host and device
+       copies */
+    cl_uint *targets;
+    cl_uint numTargets;
+    size_t targetCapacity;
+    cl_mem targetBuf;
+    size_t targetBufSize;
+
+    /* Photons sent out per pass, and passes since the frame started;
+       radius is the current pass's gather radius */
+    cl_uint photonsPerPass;
+    cl_uint passes;
+    float initialRadius;
+    float radius;
+};
+
+int photons_init(struct photons *p, struct renderer *r, struct configuration *config);
+int photons_begin_pass(struct photons *p, struct renderer *r, struct state *state,
+        struct scene *scene);
+void photons_release(struct photons *p);
+
+#endif
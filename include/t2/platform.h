@@ -4,6 +4,9 @@
 
 #include <t2/opencl_setup.h>
 
+#define MAX_PLATFORMS 10
+
 cl_platform_id choosePlatform();
+int listPlatforms(cl_platform_id *platform_ids, int max);
 
 #endif
@@ -0,0 +1,80 @@
+#ifndef T2_PROFILER_H
+#define T2_PROFILER_H
+
+#include <t2/opencl_setup.h>
+#include <t2/counters.h>
+
+/* Stages of a displayed frame. The device stages are timed with OpenCL
+profiling events, the host ones with the host's clock. */
+#define STAGE_UPLOAD  0   /* device: configuration, state and scene uploads */
+#define STAGE_PHOTONS 1   /* device: building photon maps */
+#define STAGE_TRACE   2   /* device: raytracer launches */
+#define STAGE_INTEROP 3   /* device: OpenGL acquire and release */
+#define STAGE_RESOLVE 4   /* device: resolving into the texture */
+#define STAGE_GENERATE 5  /* device: wavefront camera ray generation */
+#define STAGE_EXTEND  6   /* device: wavefront intersection */
+#define STAGE_SHADE   7   /* device: wavefront shading */
+#define STAGE_CONNECT 8   /* device: wavefront shadow rays */
+#define STAGE_ADVANCE 9   /* device: wavefront queue swaps */
+#define STAGE_ENQUEUE 10  /* host: queueing batches */
+#define STAGE_DRAW    11  /* host: drawing the image */
+#define STAGE_OVERLAY 12  /* host: drawing the overlay */
+#define STAGE_SWAP    13  /* host: swapping buffers (waiting for vsync) */
+#define NUM_STAGES    14
+
+#define FIRST_WAVEFRONT_STAGE STAGE_GENERATE
+#define FIRST_HOST_STAGE STAGE_ENQUEUE
+
+/* Device commands waiting to be timed; the wavefront renderer enqueues
+a few per bounce of every sample in a batch */
+#define PROFILER_MAX_PENDING 1024
+
+/* Frame times kept for the graph */
+#define PROFILER_HISTORY 120
+
+/* How often the averages are updated, in milliseconds */
+#define PROFILER_WINDOW_MS 500.0
+
+struct profiler {
+    /* Milliseconds per frame spent in each stage, averaged over the
+       last window, and the frame time averaged the same way */
+    double average[NUM_STAGES];
+    double frameAverage;
+
+    /* Rays per second and intersection tests per ray over the last
+       window, if the raytracer kernel is counting them (see
+       t2/counters.h) */
+    int counting;
+    double raysPerSec;
+    double testsPerRay;
+
+    /* The last PROFILER_HISTORY frame times in milliseconds, oldest at
+       historyNext */
+    float history[PROFILER_HISTORY];
+    int historyNext;
+
+    /* Totals for the window in progress */
+    double sums[NUM_STAGES];
+    int windowFrames;
+    double windowStart;
+    double frameStart;
+
+    /* The latest device counts, and the counts when the window started */
+    struct counters counts;
+    struct counters windowCounts;
+
+    cl_event pending[PROFILER_MAX_PENDING];
+    int pendingStage[PROFILER_MAX_PENDING];
+    int numPending;
+};
+
+void profiler_init(struct profiler *p);
+double profiler_now();
+void profiler_add_host(struct profiler *p, int stage, double start);
+void profiler_add_event(struct profiler *p, int stage, cl_event event);
+void profiler_set_counts(struct profiler *p, const struct counters *c);
+void profiler_end_frame(struct profiler *p);
+const char *profiler_stage_name(int stage);
+void profiler_release(struct profiler *p);
+
+#endif
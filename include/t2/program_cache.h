@@ -0,0 +1,19 @@
+#ifndef T2_PROGRAM_CACHE_H
+#define T2_PROGRAM_CACHE_H
+
+#include <stddef.h>
+
+#include <t2/opencl_setup.h>
+
+/* Environment variables: where binaries are cached (default
+$XDG_CACHE_HOME/t2 or ~/.cache/t2), and whether not to cache at all */
+#define PROGRAM_CACHE_DIR_ENV "T2_CACHE_DIR"
+#define PROGRAM_CACHE_OFF_ENV "T2_NO_PROGRAM_CACHE"
+
+int program_cache_path(cl_device_id device_id, const char *path, const char *options,
+        char *cachePath, size_t size);
+cl_program program_cache_load(cl_context context, cl_device_id device_id,
+        const char *cachePath, const char *options);
+int program_cache_store(cl_program program, cl_device_id device_id, const char *cachePath);
+
+#endif
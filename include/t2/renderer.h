@@ -0,0 +1,181 @@
+
+#ifndef T2_RENDERER_H
+#define T2_RENDERER_H
+
+#include <t2/opencl_setup.h>
+#include <t2/config.h>
+#include <t2/state.h>
+#include <t2/scene.h>
+#include <t2/wavefront.h>
+#include <t2/adaptive.h>
+#include <t2/photons.h>
+#include <t2/irradiance.h>
+#include <t2/tiles.h>
+#include <t2/multidevice.h>
+#include <t2/variants.h>
+#include <t2/profiler.h>
+#include <t2/counters.h>
+
+/* How many batches may be queued on the device at once */
+#define RENDERER_PIPELINE_DEPTH 2
+
+/* Buffers over sample sets from the cache (see t2/sample_cache.h) */
+struct sample_data {
+    cl_mem squareSampleBuf;
+    cl_mem diskSampleBuf;
+
+    size_t numSampleSets;
+};
+
+/* Everything needed to run the raytracer (or wavefront) kernels on one
+device, independent of how (or whether) the results get displayed. */
+struct renderer {
+    cl_context context;
+    cl_device_id device_id;
+    cl_command_queue command_queue;
+    cl_program program;
+    cl_kernel kernel;
+
+    /* OpenCL buffers for configuration and state */
+    cl_mem configBuf;
+    cl_mem stateBuf;
+
+    /* OpenCL buffers for the scene, and the sizes they were allocated
+       with so they can be grown when the scene does */
+    cl_mem sceneBuf;
+    cl_mem objectBuf;
+    cl_mem materialBuf;
+    cl_mem lightBuf;
+    cl_mem bvhNodeBuf;
+    cl_mem primIndexBuf;
+    cl_mem vertexBuf;
+    cl_mem indexBuf;
+    cl_mem lightNodeBuf;
+    cl_mem envTexelBuf;
+    cl_mem envDistributionBuf;
+    size_t objectBufSize;
+    size_t materialBufSize;
+    size_t lightBufSize;
+    size_t bvhNodeBufSize;
+    size_t primIndexBufSize;
+    size_t vertexBufSize;
+    size_t indexBufSize;
+    size_t lightNodeBufSize;
+    size_t envTexelBufSize;
+    size_t envDistributionBufSize;
+
+    /* Per-pixel float4 sums of every sample since rendering last
+       restarted, and the kernel that averages them into an image */
+    size_t numPixels;
+    cl_mem accumBuf;
+    cl_kernel resolveKernel;
+
+    /* Batches in flight: the marker event of each, the raytracer
+       launch and how many pixel samples it covers (for timing), and the
+       copies of configuration and state their (non-blocking) uploads
+       read from */
+    cl_event batchEvents[RENDERER_PIPELINE_DEPTH];
+    cl_event launchEvents[RENDERER_PIPELINE_DEPTH];
+    double launchWork[RENDERER_PIPELINE_DEPTH];
+    struct configuration stagedConfig[RENDERER_PIPELINE_DEPTH];
+    struct state stagedState[RENDERER_PIPELINE_DEPTH];
+    cl_ulong numBatches;
+
+    struct sample_data samples;
+
+    /* Which pixels still take samples, and in what order and how many
+       at a time (raytracer kernel only) */
+    struct adaptive adaptive;
+    struct tiles tiles;
+
+    /* The photon map each pass gathers caustics from (raytracer kernel
+       only) */
+    struct photons photons;
+
+    /* Diffuse interreflection cached across batches (raytracer kernel
+       only) */
+    struct irradiance irradiance;
+
+    /* This device's copy of the tile order, the host copy it's
+       uploaded from and the upload while it's in flight */
+    cl_mem tileOrderBuf;
+    cl_uint *tileOrder;
+    cl_event tileOrderEvent;
+
+    /* Pixel samples per millisecond, from timing finished launches; 0
+       until one has been timed */
+    double rate;
+
+    /* Total nanoseconds of the timed launches */
+    cl_ulong kernelTime;
+
+    /* When counting, the raytracer kernel's running counts, each
+       batch's copy of them and the totals as of the last finished
+       batch; counterBuf is NULL otherwise */
+    cl_mem counterBuf;
+    cl_uint counterReads[RENDERER_PIPELINE_DEPTH][2 * NUM_COUNTERS];
+    struct counters counts;
+
+    /* Whether each pixel has a shadow cache (see shadowRayHit() in
+       cl/t2/trace.cl): shadowCacheLights object indices one up, or
+       NULL until the scene has been uploaded or if it has no lights */
+    int useShadowCache;
+    cl_mem shadowCacheBuf;
+    cl_uint shadowCacheLights;
+
+    /* Where to send command timings for display, or NULL */
+    struct profiler *profiler;
+
+    /* Other devices sharing the tiles */
+    struct multidevice multi;
+
+    /* Counts batches and anything else that changes what resolving
+       would show */
+    cl_ulong updates;
+
+    /* Whether the next batch starts a new frame */
+    int restart;
+
+    /* Specialised builds of the raytracer kernel; kernel is whichever
+       one is in use */
+    struct variants variants;
+
+    /* Whether batches go through the wavefront kernels instead of the
+       raytracer kernel */
+    int useWavefront;
+    struct wavefront wavefront;
+
+    /* Dirty flags */
+    int dirty_config;
+    int dirty_state;
+    int dirty_scene;
+
+    /* The dirty flags as they apply to this device's buffers. Each
+       batch passes the dirty flags on to every device's, and each
+       device clears its own once it has uploaded. */
+    int stale_config;
+    int stale_state;
+    int stale_scene;
+};
+
+int renderer_init(struct renderer *r, cl_context context, cl_device_id device_id,
+        struct configuration *config);
+int renderer_batch_slot_free(struct renderer *r);
+int renderer_enqueue_batch(struct renderer *r, struct configuration *config,
+        struct state *state, struct scene *scene, cl_uint batchSize, cl_uint *samplesDone);
+int renderer_enqueue_resolve(struct renderer *r, struct configuration *config,
+        cl_mem output, cl_event *event);
+int renderer_frame_converged(struct renderer *r);
+void renderer_restart(struct renderer *r);
+int renderer_poll(struct renderer *r);
+int renderer_finish(struct renderer *r);
+cl_ulong renderer_kernel_time(struct renderer *r);
+int renderer_counters(struct renderer *r, struct counters *c);
+void renderer_release(struct renderer *r);
+int renderer_set_scene_args(struct renderer *r, cl_kernel kernel, cl_uint firstArg);
+int renderer_set_raytracer_args(struct renderer *r, cl_kernel kernel);
+
+int setup_samples(struct sample_data *s, int sampleRoot, struct configuration *cfg, cl_context context);
+int renderer_setup_samples(struct renderer *r, struct configuration *config);
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef T2_SAMPLE_CACHE_H
+#define T2_SAMPLE_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <t2/opencl_setup.h>
+
+/* Most memory the cache holds on to for sets nobody is using, in bytes */
+#define SAMPLE_CACHE_SPARE_BYTES (512 * 1024 * 1024)
+
+/* Square and disk sample sets for one sample root, shared by every
+device that renders with them */
+struct sample_sets {
+    int sampleRoot;
+    int type;
+    size_t numSets;
+    uint64_t seed;
+
+    cl_float *square;
+    cl_float *disk;
+
+    /* Private to the cache */
+    int refs;
+    int state;
+    struct sample_sets *next;
+};
+
+struct sample_sets *sample_cache_acquire(int sampleRoot, size_t numSets, int type,
+        uint64_t seed);
+void sample_cache_retain(struct sample_sets *sets);
+void sample_cache_release(struct sample_sets *sets);
+size_t sample_sets_bytes(struct sample_sets *sets);
+
+#endif
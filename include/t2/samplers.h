@@ -1,13 +1,41 @@
-
 #ifndef T2_SAMPLERS_H
 #define T2_SAMPLERS_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 /* Let's be reasonable. */
 #define MAX_SAMPLE_ROOT 32
 
+/* Kinds of sample set */
+#define SAMPLE_SET_RANDOM        0
+#define SAMPLE_SET_JITTERED      1
+#define SAMPLE_SET_NROOKS        2
+#define SAMPLE_SET_MULTIJITTERED 3
+#define SAMPLE_SET_HAMMERSLEY    4
+
+/* Counter-based random number stream: value n of a stream is a hash of
+   its seed and n, so streams are cheap to create, reproducible, and any
+   number of them can be used in parallel. */
+struct rng {
+    uint64_t seed;
+    uint64_t counter;
+};
+
+void rng_seed(struct rng *rng, uint64_t seed);
+uint32_t rng_next(struct rng *rng);
+float rng_float(struct rng *rng);
+uint32_t rng_range(struct rng *rng, uint32_t n);
+
 void mapToUnitDisk(float *x, float *y);
-void generateRandomSampleSet(float *samples, int sampleRoot, void(*map)(float*, float*));
-void generateJitteredSampleSet(float *samples, int sampleRoot, void(*map)(float*, float*));
-void shuffle(void *buf, size_t n, size_t elem_size);
+void shuffle(void *buf, size_t n, size_t elem_size, struct rng *rng);
+
+void generateSampleSet(float *samples, int sampleRoot, int type, struct rng *rng,
+        void(*map)(float*, float*));
+void generateSampleSets(float *samples, size_t numSets, int sampleRoot, int type,
+        uint64_t seed, void(*map)(float*, float*));
+
+const char *sample_set_type_name(int type);
+int sample_set_type_from_name(char *name);
 
 #endif
@@ -0,0 +1,206 @@
+
+#ifndef T2_SCENE_H
+#define T2_SCENE_H
+
+#include <t2/opencl_setup.h>
+
+/* These should match the structs in cl/t2/types.cl */
+
+struct PinholeCamera
+{
+    cl_float3 eye;
+    cl_float3 lookat;
+    cl_float3 up;
+    cl_float vpdist;
+    // Computed
+    cl_float3 u, v, w;
+};
+
+struct ThinLensCamera
+{
+    cl_float3 eye;
+    cl_float3 lookat;
+    cl_float3 up;
+    cl_float vpdist;
+    cl_float fpdist;
+    cl_float lens_radius;
+    // Computed
+    cl_float3 u, v, w;
+};
+
+struct Sphere
+{
+    cl_float3 center;
+    cl_float radius;
+};
+
+struct Plane
+{
+    cl_float3 normal;
+    cl_float3 origin;
+};
+
+/* A mesh triangle; its corners are at indices [3 * index, 3 * index + 2]
+of the scene's index array, which in turn point into the packed (x, y,
+z) vertex array */
+struct Triangle
+{
+    cl_uint index;
+};
+
+enum ObjectType {
+    OBJECT_SPHERE,
+    OBJECT_PLANE,
+    OBJECT_TRIANGLE
+};
+
+struct Object {
+    enum ObjectType type;
+    union {
+        struct Sphere sphere;
+        struct Plane plane;
+        struct Triangle triangle;
+    } types;
+    cl_uint material;
+};
+
+enum LightType {
+    LIGHT_POINT,
+    LIGHT_SPHERE,
+    LIGHT_RECT
+};
+
+/* Point lights are at center. Sphere lights are radius around it, and
+rectangle lights are centred on it with (perpendicular) edges edgeU and
+edgeV, and shine from both faces. An area light lights a point like a
+point light of the same strength spread evenly over the light (over
+the directions it covers, for spheres), so its shadows are soft. */
+struct Light
+{
+    cl_float3 center;
+    cl_float strength;
+    cl_float4 color;
+    cl_float3 edgeU;
+    cl_float3 edgeV;
+    cl_float radius;
+    enum LightType type;
+};
+
+struct Material
+{
+    cl_float refl;
+    cl_float diff;
+    cl_float spec;
+    cl_float4 amb;
+    cl_float reflAmount;
+    cl_float specAmount;
+};
+
+/* Flattened BVH node. Interior nodes have count 0, their left child
+immediately after them and their right child at offset. Leaves cover
+count entries of the primitive index array starting at offset. */
+struct BVHNode
+{
+    cl_float min[3];
+    cl_uint offset;
+    cl_float max[3];
+    cl_uint count;
+};
+
+/* Flattened light tree node, laid out like struct BVHNode. Interior
+nodes have count 0, their left child immediately after them and their
+right child at offset. Leaves hold the one light at offset. power is
+the total of the lights below the node. */
+struct LightNode
+{
+    cl_float min[3];
+    cl_uint offset;
+    cl_float max[3];
+    cl_uint count;
+    cl_float power;
+};
+
+enum CameraType {
+    CAMERA_PINHOLE,
+    CAMERA_THINLENS
+};
+
+struct SceneHeader
+{
+    cl_uint numObjects;
+    cl_uint numLights;
+    cl_uint numMaterials;
+
+    // The first numUnbounded primitive indices are objects without
+    // bounds (planes), the rest are ordered for the BVH leaves
+    cl_uint numUnbounded;
+    cl_uint numBVHNodes;
+
+    cl_uint numVertices;
+    cl_uint numTriangles;
+
+    cl_uint numLightNodes;
+
+    // How many of the lights are area lights (not LIGHT_POINT)
+    cl_uint numAreaLights;
+
+    // Size of the environment map, 0 without one
+    cl_uint envWidth;
+    cl_uint envHeight;
+
+    union {
+        struct PinholeCamera pinhole;
+        struct ThinLensCamera thinLens;
+    } cameras;
+
+    enum CameraType cameraType;
+};
+
+/* Host-side scene description. The arrays are uploaded to the device
+as-is; the header carries their lengths. */
+struct scene {
+    struct SceneHeader header;
+
+    struct Object *objects;
+    size_t objectCapacity;
+
+    struct Light *lights;
+    size_t lightCapacity;
+
+    struct Material *materials;
+    size_t materialCapacity;
+
+    /* Mesh data shared by all triangles: numVertices packed (x, y, z)
+    positions and 3 * numTriangles vertex indices */
+    cl_float *vertices;
+    size_t vertexCapacity;
+
+    cl_uint *indices;
+    size_t indexCapacity;
+
+    /* Built by buildBVH() from the objects above */
+    struct BVHNode *bvhNodes;
+    cl_uint *primIndices;
+
+    /* Built by buildLightTree() from the lights above */
+    struct LightNode *lightNodes;
+
+    /* Loaded by loadEnvironmentMap(): envWidth * envHeight texels,
+    rows top-down, and the distribution they're sampled from */
+    cl_float4 *envTexels;
+    cl_float *envDistribution;
+};
+
+void scene_init(struct scene *s);
+void scene_release(struct scene *s);
+cl_uint scene_add_object(struct scene *s, struct Object *o);
+cl_uint scene_add_light(struct scene *s, struct Light *l);
+cl_uint scene_add_material(struct scene *s, struct Material *m);
+cl_uint scene_add_vertex(struct scene *s, float x, float y, float z);
+cl_uint scene_add_triangle(struct scene *s, cl_uint a, cl_uint b, cl_uint c, cl_uint material);
+void buildDefaultScene(struct scene *s);
+void buildGridScene(struct scene *s, int size, int numLights);
+void buildAreaLightScene(struct scene *s);
+int loadSceneMesh(struct scene *s, const char *path);
+
+#endif
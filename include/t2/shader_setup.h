@@ -2,7 +2,7 @@
 #ifndef T2_SHADER_SETUP_H
 #define T2_SHADER_SETUP_H
 
-#include <OpenGL/gl.h>
+#include <t2/opengl_setup.h>
 
 typedef struct {
     GLuint shader_program;
@@ -12,9 +12,7 @@ typedef struct {
     GLint position_attribute;
     GLint texture_uniform;
 
-    GLuint readTexture;
-    GLuint writeTexture;
-    GLuint fbo;
+    GLuint outputTextures[2];
 } glResources;
 
 GLuint shader_setup(glResources *res);
@@ -4,12 +4,14 @@
 
 #include <ft2build.h>
 #include FT_FREETYPE_H
-#include <OpenGL/gl.h>
+#include <t2/opengl_setup.h>
 
 #include <t2/config.h>
 
+/* Where a glyph is in its font's atlas texture, as texture coordinates
+of its top left and bottom right corners, and how to place it */
 struct character {
-    GLuint texture;
+    GLfloat u0, v0, u1, v1;
     GLuint width;
     GLuint rows;
     GLuint bitmap_left;
@@ -20,21 +22,66 @@ struct character {
 
 #define FONT_NUM_CHARACTERS 128
 
+/* Every glyph of a font is packed into one texture, along with a few
+opaque texels for drawing solid rectangles */
 struct font {
     struct character characters[FONT_NUM_CHARACTERS];
     int pixel_height;
+
+    GLuint atlas;
+    GLfloat solid_u, solid_v;
 };
 
+/* Position, texture coordinates and colour */
+#define TEXT_VERTEX_FLOATS 7
+#define TEXT_QUAD_FLOATS (6 * TEXT_VERTEX_FLOATS)
+
 struct text_configuration {
     int width;
     int height;
     GLuint shader_program;
     GLuint vao, vbo;
+    GLint vertex_attribute, color_attribute;
+
+    // Quads added since textBegin(), to be drawn with one draw call
+    GLfloat *vertices;
+    int numQuads, maxQuads;
+
+    // What the vertex buffer holds, so an unchanged batch isn't
+    // uploaded again, and how many quads it has room for
+    GLfloat *uploaded;
+    int uploadedQuads, vboQuads;
+};
+
+/* A string laid out into quads. The caller keeps it from one frame to
+the next, and it's only laid out again when the string, font, position
+or colour changes. */
+struct text_layout {
+    struct font *font;
+    char *text;
+    int len;
+    GLfloat x, y, scale;
+    float color[3];
+
+    GLfloat *vertices;
+    int numQuads, maxQuads;
 };
 
 void logTextSystemInfo();
 struct text_configuration* initializeText(struct configuration *main_config);
 int loadFont(const char *font_filename, struct font *f, int pixel_height);
+
+void initTextLayout(struct text_layout *layout);
+int layoutText(struct text_layout *layout, struct font *font,
+        const char *text, int len, GLfloat x, GLfloat y, GLfloat scale, float *color);
+void releaseTextLayout(struct text_layout *layout);
+
+void textBegin(struct text_configuration *config);
+int addText(struct text_configuration *config, struct text_layout *layout);
+int addRect(struct text_configuration *config, struct font *font,
+        GLfloat x, GLfloat y, GLfloat w, GLfloat h, float *color);
+void textDraw(struct text_configuration *config, struct font *font);
+
 void renderText(struct text_configuration *config, struct font *font,
         const char *text, int len, GLfloat x, GLfloat y, GLfloat scale, float *color);
 
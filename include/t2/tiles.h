@@ -0,0 +1,48 @@
+#ifndef T2_TILES_H
+#define T2_TILES_H
+
+#include <t2/opencl_setup.h>
+#include <t2/config.h>
+
+/* Splits each batch of samples into launches over groups of tiles so
+   that no single launch runs much longer than config->tileBudget. This
+   only does the bookkeeping; the renderer uploads the tile order and
+   times launches for each of its devices. */
+struct tiles {
+    /* Tile grid; edge tiles may hang off the image */
+    cl_uint size;
+    cl_uint tilesX;
+    cl_uint tilesY;
+    cl_uint numTiles;
+
+    /* Tile indices in the order they're rendered, and whether they need
+       sorting again */
+    cl_uint *order;
+    int orderDirty;
+
+    /* Where TILE_ORDER_CURSOR starts, in pixels */
+    float focusX;
+    float focusY;
+
+    /* The batch being split up: the work items it needs, how many of
+       them have been launched, and the samples it takes per pixel
+       starting at which sample */
+    size_t passItems;
+    size_t passNext;
+    cl_uint passSampleNum;
+    cl_uint passBatchSize;
+};
+
+const char *tile_order_name(int order);
+int tile_order_from_name(char *name);
+
+int tiles_init(struct tiles *t, struct configuration *config);
+void tiles_set_focus(struct tiles *t, float x, float y);
+int tiles_begin_pass(struct tiles *t, struct configuration *config, size_t items,
+        cl_uint sampleNum, cl_uint batchSize);
+int tiles_pass_done(struct tiles *t);
+size_t tiles_next_launch(struct tiles *t, struct configuration *config, double rate,
+        size_t maxItems, size_t *first);
+void tiles_release(struct tiles *t);
+
+#endif
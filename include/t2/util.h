@@ -6,7 +6,8 @@
 
 #include <t2/opencl_setup.h>
 
-cl_program readAndBuildProgram(cl_context context, cl_device_id device_id, const char *path, int *res);
+cl_program readAndBuildProgram(cl_context context, cl_device_id device_id, const char *path,
+        const char *extraOptions, int *res);
 void timevalDiff(struct timeval *start, struct timeval *stop, struct timeval *diff);
 
 #define CLEAR_BIT(mask, bit)  do { mask &= ~bit; } while (0);
@@ -0,0 +1,51 @@
+#ifndef T2_VARIANTS_H
+#define T2_VARIANTS_H
+
+#include <pthread.h>
+
+#include <t2/opencl_setup.h>
+#include <t2/config.h>
+#include <t2/scene.h>
+
+/* How many specialised builds of the raytracer kernel a device keeps */
+#define MAX_VARIANTS 8
+
+#define VARIANT_OPTIONS_SIZE 512
+
+struct renderer;
+
+/* One build of the program with some settings fixed by -D options */
+struct variant {
+    char options[VARIANT_OPTIONS_SIZE];
+    cl_context context;
+    cl_device_id device_id;
+
+    /* The build happens on its own thread; program is only valid once
+       state is VARIANT_READY */
+    pthread_t thread;
+    int joined;
+    int state;
+    cl_program program;
+
+    /* Created the first time the variant is used */
+    cl_kernel kernel;
+    cl_ulong lastUsed;
+};
+
+/* A device's raytracer kernel variants. The generic kernel (the
+renderer's own) runs while the right variant is still building. */
+struct variants {
+    int enabled;
+    int wait;
+    cl_kernel generic;
+    struct variant entries[MAX_VARIANTS];
+    int numEntries;
+    cl_ulong uses;
+};
+
+void variants_init(struct variants *v, struct renderer *r, struct configuration *config);
+int variants_select(struct variants *v, struct renderer *r, struct configuration *config,
+        struct scene *scene);
+void variants_release(struct variants *v, struct renderer *r);
+
+#endif
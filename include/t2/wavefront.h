@@ -0,0 +1,76 @@
+#ifndef T2_WAVEFRONT_H
+#define T2_WAVEFRONT_H
+
+#include <t2/opencl_setup.h>
+#include <t2/config.h>
+#include <t2/state.h>
+
+/* These should match the structs in cl/t2/wavefront.cl */
+
+struct QueueCounts
+{
+    cl_uint rays;
+    cl_uint hits;
+    cl_uint shadowRays;
+    cl_uint nextRays;
+};
+
+struct PathState
+{
+    // struct Ray in the kernel
+    cl_float3 origin;
+    cl_float3 dir;
+    cl_float throughput;
+    cl_uint pixel;
+    cl_uint depth;
+    cl_uint seed;
+};
+
+struct PathHit
+{
+    cl_float3 position;
+    cl_float3 normal;
+    cl_uint path;
+    cl_uint material;
+};
+
+struct ShadowRay
+{
+    // struct Ray in the kernel
+    cl_float3 origin;
+    cl_float3 dir;
+    cl_float4 contribution;
+    cl_uint pixel;
+};
+
+struct renderer;
+
+/* Kernels and queues for the wavefront renderer (see cl/t2/wavefront.cl) */
+struct wavefront {
+    cl_kernel generate;
+    cl_kernel extend;
+    cl_kernel shade;
+    cl_kernel connect;
+    cl_kernel advance;
+
+    cl_mem counts;
+
+    /* Paths being extended and paths for the next bounce; they swap
+       roles after every bounce */
+    cl_mem rays[2];
+    cl_mem hits;
+    cl_mem shadowRays;
+
+    /* What the queues above were allocated for */
+    size_t numPixels;
+    size_t shadowCapacity;
+};
+
+int wavefront_init(struct wavefront *w, struct renderer *r);
+int wavefront_set_scene_args(struct wavefront *w, struct renderer *r);
+int wavefront_enqueue_batch(struct wavefront *w, struct renderer *r,
+        struct configuration *config, struct state *state, cl_uint numLights,
+        cl_uint numAreaLights, int envMap, cl_uint batchSize);
+void wavefront_release(struct wavefront *w);
+
+#endif
@@ -1,11 +1,11 @@
 #version 110
 
 varying vec2 TexCoords;
+varying vec3 TextColor;
 uniform sampler2D text;
-uniform vec3 textColor;
 
 void main()
 {    
     vec4 sampled = vec4(1.0, 1.0, 1.0, texture2D(text, TexCoords).r);
-    gl_FragColor = vec4(textColor, 1.0) * sampled;
+    gl_FragColor = vec4(TextColor, 1.0) * sampled;
 }
@@ -1,9 +1,11 @@
 #version 110
 
 attribute vec4 vertex;
+attribute vec3 color;
 uniform int width;
 uniform int height;
 varying vec2 TexCoords;
+varying vec3 TextColor;
 
 void main()
 {
@@ -16,4 +18,5 @@ void main()
 
     gl_Position = projection * vec4(vertex.xy, 0.0, 1.0);
     TexCoords = vertex.zw;
+    TextColor = color;
 }
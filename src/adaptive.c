@@ -0,0 +1,214 @@
+#include <stdlib.h>
+
+#include <t2/adaptive.h>
+#include <t2/logging.h>
+#include <t2/mathutil.h>
+#include <t2/renderer.h>
+
+static cl_mem createBuffer(cl_context context, size_t size, const char *what)
+{
+    cl_int ret;
+    cl_mem buf = clCreateBuffer(context, CL_MEM_READ_WRITE, size, NULL, &ret);
+    if (ret) {
+        log_error("Could not create %s buffer of %ld bytes, ret %d", what, size, ret);
+        return NULL;
+    }
+
+    return buf;
+}
+
+int adaptive_init(struct adaptive *a, struct renderer *r, struct configuration *config)
+{
+    cl_int ret;
+
+    a->numPixels = (size_t) config->width * config->height;
+    a->enabled = config->adaptiveThreshold > 0 && !config->wavefront &&
+        !config->multiDevice;
+    a->list = -1;
+    a->count = a->numPixels;
+    a->countEvent = NULL;
+    a->countFrame = 0;
+    a->frame = 0;
+    a->compact = NULL;
+    a->pixelBufs[0] = a->pixelBufs[1] = NULL;
+    a->countBufs[0] = a->countBufs[1] = NULL;
+
+    a->momentBuf = createBuffer(r->context, sizeof(cl_float) * a->numPixels, "moment");
+    if (!a->momentBuf)
+        return 1;
+
+    if (config->adaptiveThreshold > 0 && config->wavefront)
+        log_info("Adaptive sampling is not supported by the wavefront renderer, ignoring");
+    else if (config->adaptiveThreshold > 0 && config->multiDevice)
+        log_info("Adaptive sampling is not supported with multiple devices, ignoring");
+
+    if (!a->enabled)
+        return 0;
+
+    log_info("Adaptive sampling: threshold %.4f, at least %d samples per pixel",
+            config->adaptiveThreshold, config->adaptiveMinSamples);
+
+    a->compact = clCreateKernel(r->program, "compact", &ret);
+    if (ret) {
+        log_error("Could not create compact kernel, ret %d", ret);
+        return 1;
+    }
+
+    for (int i = 0; i < 2; i++) {
+        a->pixelBufs[i] = createBuffer(r->context, sizeof(cl_uint) * a->numPixels,
+                "active pixel");
+        a->countBufs[i] = createBuffer(r->context, sizeof(cl_uint), "active pixel count");
+        if (!a->pixelBufs[i] || !a->countBufs[i])
+            return 1;
+    }
+
+    // Compaction covers whole lists, or the whole image in pixel order
+    cl_uint first = 0;
+    ret  = clSetKernelArg(a->compact, 0, sizeof(cl_mem), &r->configBuf);
+    ret |= clSetKernelArg(a->compact, 1, sizeof(cl_mem), &r->accumBuf);
+    ret |= clSetKernelArg(a->compact, 2, sizeof(cl_mem), &a->momentBuf);
+    ret |= clSetKernelArg(a->compact, 5, sizeof(cl_mem), NULL);
+    ret |= clSetKernelArg(a->compact, 6, sizeof(first), &first);
+    if (ret) {
+        log_error("Could not set kernel argument, ret %d", ret);
+        return 1;
+    }
+
+    return 0;
+}
+
+/* Pick up the result of the last list length read, if it's arrived */
+static void pollCount(struct adaptive *a)
+{
+    cl_int status;
+
+    if (!a->countEvent)
+        return;
+
+    if (clGetEventInfo(a->countEvent, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(status),
+                &status, NULL) || status != CL_COMPLETE)
+        return;
+
+    // Reads issued before a restart describe the old frame's lists
+    if (a->countFrame == a->frame)
+        a->count = MINF(a->count, a->countRead);
+
+    clReleaseEvent(a->countEvent);
+    a->countEvent = NULL;
+}
+
+/**
+ * Point a kernel's active pixel list arguments (firstArg and the one
+ * after it) at the current list, and work out how many work items a
+ * batch starting at sampleNum needs. A batch starting at sample 0
+ * starts a new frame in which every pixel is active again. *workSize
+ * is 0 once every pixel has converged.
+ */
+int adaptive_set_pixels(struct adaptive *a, cl_kernel kernel, cl_uint firstArg,
+        cl_uint sampleNum, size_t *workSize)
+{
+    cl_int ret;
+
+    if (sampleNum == 0) {
+        a->list = -1;
+        a->count = a->numPixels;
+        a->frame++;
+    }
+
+    pollCount(a);
+
+    if (a->list < 0) {
+        ret  = clSetKernelArg(kernel, firstArg, sizeof(cl_mem), NULL);
+        ret |= clSetKernelArg(kernel, firstArg + 1, sizeof(cl_mem), NULL);
+    } else {
+        ret  = clSetKernelArg(kernel, firstArg, sizeof(cl_mem), &a->pixelBufs[a->list]);
+        ret |= clSetKernelArg(kernel, firstArg + 1, sizeof(cl_mem), &a->countBufs[a->list]);
+    }
+
+    if (ret) {
+        log_error("Could not set kernel argument, ret %d", ret);
+        return ret;
+    }
+
+    *workSize = a->count;
+    return 0;
+}
+
+/**
+ * After a batch has brought the active pixels up to sampleCount
+ * samples, enqueue filtering the converged ones out of the list, and a
+ * read of the new list's length if none is in flight.
+ */
+int adaptive_compact(struct adaptive *a, struct renderer *r, struct configuration *config,
+        cl_uint sampleCount)
+{
+    static const cl_uint zero = 0;
+    size_t workSize;
+    cl_int ret;
+
+    if (!a->enabled || sampleCount < config->adaptiveMinSamples || a->count == 0)
+        return 0;
+
+    int next = a->list < 0 ? 0 : !a->list;
+
+    ret = adaptive_set_pixels(a, a->compact, 3, sampleCount, &workSize);
+    if (ret)
+        return ret;
+
+    ret  = clSetKernelArg(a->compact, 7, sizeof(cl_mem), &a->pixelBufs[next]);
+    ret |= clSetKernelArg(a->compact, 8, sizeof(cl_mem), &a->countBufs[next]);
+    if (ret) {
+        log_error("Could not set kernel argument, ret %d", ret);
+        return ret;
+    }
+
+    ret = clEnqueueWriteBuffer(r->command_queue, a->countBufs[next], 0, 0, sizeof(zero),
+            &zero, 0, NULL, NULL);
+    ret |= clEnqueueNDRangeKernel(r->command_queue, a->compact, 1, NULL, &workSize,
+            NULL, 0, NULL, NULL);
+    if (ret) {
+        log_error("Could not enqueue compaction, ret %d", ret);
+        return ret;
+    }
+
+    a->list = next;
+
+    if (!a->countEvent) {
+        ret = clEnqueueReadBuffer(r->command_queue, a->countBufs[next], 0, 0,
+                sizeof(cl_uint), &a->countRead, 0, NULL, &a->countEvent);
+        if (ret) {
+            log_error("Could not read active pixel count, ret %d", ret);
+            return ret;
+        }
+        a->countFrame = a->frame;
+    }
+
+    return 0;
+}
+
+/* Whether every pixel of the current frame is known to have converged */
+int adaptive_converged(struct adaptive *a)
+{
+    pollCount(a);
+
+    return a->enabled && a->list >= 0 && a->count == 0;
+}
+
+void adaptive_release(struct adaptive *a)
+{
+    if (a->countEvent) {
+        clWaitForEvents(1, &a->countEvent);
+        clReleaseEvent(a->countEvent);
+    }
+
+    for (int i = 0; i < 2; i++) {
+        if (a->pixelBufs[i])
+            clReleaseMemObject(a->pixelBufs[i]);
+        if (a->countBufs[i])
+            clReleaseMemObject(a->countBufs[i]);
+    }
+
+    if (a->compact)
+        clReleaseKernel(a->compact);
+    clReleaseMemObject(a->momentBuf);
+}
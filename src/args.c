@@ -1,10 +1,13 @@
 
 #include <unistd.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <strings.h>
 
 #include <t2/config.h>
 #include <t2/logging.h>
 #include <t2/samplers.h>
+#include <t2/tiles.h>
 
 void usage(char *progname, struct configuration *config)
 {
@@ -20,6 +23,50 @@ void usage(char *progname, struct configuration *config)
     printf("    -H HEIGHT    Scene height (default: %d)\n", config->height);
     printf("    -l LEVEL     Log level (default: %s)\n", log_level_name(config->logLevel));
     printf("    -f           Run in windowed fullscreen mode\n");
+    printf("    -x           Render headlessly (no window) and write the image to a file\n");
+    printf("    -o FILE      Headless output image file (default: %s)\n", config->outputFile);
+    printf("    -m FILE      Add the triangle mesh in the given OBJ file to the scene\n");
+    printf("    -e FILE      Light the scene with the given HDR environment map\n");
+    printf("                 (latitude-longitude Radiance .hdr)\n");
+    printf("    -A           Light the scene with soft-shadowed area lights\n");
+    printf("    -w           Use the wavefront renderer (separate kernels per stage)\n");
+    printf("    -a ERROR     Stop sampling pixels once their relative error is below ERROR\n");
+    printf("                 (default: %.2f, 0 = always take every sample)\n",
+            config->adaptiveThreshold);
+    printf("    -O ORDER     Tile order: scanline, centre, cursor or hilbert (default: %s)\n",
+            tile_order_name(config->tileOrder));
+    printf("    -T MS        Time budget per launch in milliseconds, 0 for whole-image\n");
+    printf("                 launches (default: %.0f)\n", config->tileBudget);
+    printf("    -M           Share the rendering with every other OpenCL device\n");
+    printf("    -S SAMPLER   Pixel samples: sobol (computed on the device), or sets generated\n");
+    printf("                 on the host: random, jittered, nrooks, multijittered or\n");
+    printf("                 hammersley (default: %s)\n",
+            config->sampler == SAMPLER_SOBOL ? "sobol" :
+            sample_set_type_name(config->sampleSetType));
+    printf("    -s SEED      Seed for host sample sets (default: %llu)\n",
+            (unsigned long long) config->sampleSeed);
+    printf("    -g           Only use the generic raytracer kernel, not ones specialised\n");
+    printf("                 for the scene and settings\n");
+    printf("    -i METHOD    Integrator: whitted to follow mirror reflections down to the\n");
+    printf("                 trace depth, or path to path trace (default: %s)\n",
+            config->integrator == INTEGRATOR_PATH ? "path" : "whitted");
+    printf("    -L LIGHTS    Lights each shading point picks by importance when the scene\n");
+    printf("                 has more, 0 to shade every light (default: %d)\n",
+            config->lightSamples);
+    printf("    -c           Count rays and intersection tests on the device and show\n");
+    printf("                 rays/sec and tests/ray\n");
+    printf("    -p PHOTONS   Photon map caustics, sending out PHOTONS photons per pass\n");
+    printf("                 (default: %d, 0 = off)\n", config->photonsPerPass);
+    printf("    -P MB        Most memory the photon map may take (default: %d)\n",
+            config->photonMemory);
+    printf("    -R RADIUS    Photon gather radius to start from; it shrinks with every\n");
+    printf("                 pass (default: %.2f)\n", config->photonRadius);
+    printf("    -I ERROR     Diffuse interreflection from an irradiance cache whose records\n");
+    printf("                 light points up to ERROR away, such as 0.2 (default: %.2f,\n",
+            config->irradianceError);
+    printf("                 0 = off)\n");
+    printf("    -C           Try the object that last blocked each pixel's shadow rays\n");
+    printf("                 towards a light first\n");
     exit(1);
 }
 
@@ -28,7 +75,7 @@ void processArgs(int argc, char **argv, struct configuration *config)
     int ch, logLevel;
     struct configuration newConfig = *config;
 
-    while ((ch = getopt(argc, argv, "b:fhd:r:W:H:l:")) != -1) {
+    while ((ch = getopt(argc, argv, "b:fhd:r:W:H:l:xo:m:e:Awa:O:T:MS:s:gcL:i:p:P:R:I:C")) != -1) {
         switch (ch) {
             case 'b':
                 if (atoi(optarg) < 0) {
@@ -87,6 +134,137 @@ void processArgs(int argc, char **argv, struct configuration *config)
                 newConfig.fullScreen = 1;
                 break;
 
+            case 'x':
+                newConfig.headless = 1;
+                break;
+
+            case 'o':
+                newConfig.outputFile = optarg;
+                break;
+
+            case 'm':
+                newConfig.meshFile = optarg;
+                break;
+
+            case 'e':
+                newConfig.envMapFile = optarg;
+                break;
+
+            case 'A':
+                newConfig.areaLights = 1;
+                break;
+
+            case 'w':
+                newConfig.wavefront = 1;
+                break;
+
+            case 'a':
+                if (atof(optarg) < 0) {
+                    goto bad;
+                }
+
+                newConfig.adaptiveThreshold = atof(optarg);
+                break;
+
+            case 'O':
+                newConfig.tileOrder = tile_order_from_name(optarg);
+                if (newConfig.tileOrder == -1) {
+                    goto bad;
+                }
+                break;
+
+            case 'T':
+                if (atof(optarg) < 0) {
+                    goto bad;
+                }
+
+                newConfig.tileBudget = atof(optarg);
+                break;
+
+            case 'M':
+                newConfig.multiDevice = 1;
+                break;
+
+            case 'S':
+                if (strcasecmp(optarg, "sobol") == 0) {
+                    newConfig.sampler = SAMPLER_SOBOL;
+                } else if (strcasecmp(optarg, "sets") == 0) {
+                    newConfig.sampler = SAMPLER_SETS;
+                    newConfig.sampleSetType = SAMPLE_SET_JITTERED;
+                } else if (sample_set_type_from_name(optarg) >= 0) {
+                    newConfig.sampler = SAMPLER_SETS;
+                    newConfig.sampleSetType = sample_set_type_from_name(optarg);
+                } else {
+                    goto bad;
+                }
+                break;
+
+            case 's':
+                newConfig.sampleSeed = strtoull(optarg, NULL, 0);
+                break;
+
+            case 'g':
+                newConfig.specialise = 0;
+                break;
+
+            case 'c':
+                newConfig.countRays = 1;
+                break;
+
+            case 'i':
+                if (strcasecmp(optarg, "whitted") == 0) {
+                    newConfig.integrator = INTEGRATOR_WHITTED;
+                } else if (strcasecmp(optarg, "path") == 0) {
+                    newConfig.integrator = INTEGRATOR_PATH;
+                } else {
+                    goto bad;
+                }
+                break;
+
+            case 'L':
+                if (atoi(optarg) < 0) {
+                    goto bad;
+                }
+
+                newConfig.lightSamples = atoi(optarg);
+                break;
+
+            case 'p':
+                if (atoi(optarg) < 0) {
+                    goto bad;
+                }
+
+                newConfig.photonsPerPass = atoi(optarg);
+                break;
+
+            case 'P':
+                if (atoi(optarg) <= 0) {
+                    goto bad;
+                }
+
+                newConfig.photonMemory = atoi(optarg);
+                break;
+
+            case 'R':
+                if (atof(optarg) <= 0) {
+                    goto bad;
+                }
+
+                newConfig.photonRadius = atof(optarg);
+                break;
+
+            case 'I':
+                if (atof(optarg) < 0) {
+                    goto bad;
+                }
+
+                newConfig.irradianceError = atof(optarg);
+                break;
+
+            case 'C':
+                newConfig.shadowCache = 1;
+                break;
+
             case '?':
             case 'h':
 bad:
@@ -0,0 +1,692 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include <t2/bvh.h>
+#include <t2/lighttree.h>
+#include <t2/envmap.h>
+#include <t2/device.h>
+#include <t2/headless.h>
+#include <t2/logging.h>
+#include <t2/platform.h>
+#include <t2/renderer.h>
+#include <t2/samplers.h>
+#include <t2/scene.h>
+#include <t2/tiles.h>
+#include <t2/util.h>
+#include <t2/version.h>
+
+/*
+ * t2-bench: renders a fixed set of scenes and camera poses headlessly,
+ * over every combination of the chosen resolutions, sample roots and
+ * trace depths, and writes the timings as JSON. Each case runs a few
+ * times to warm up (kernel variants, caches, clocks) and then the
+ * requested number of times; every figure is reported as the mean,
+ * standard deviation and 95% confidence interval over those runs.
+ *
+ * Given a baseline (an earlier run's JSON), it also compares sample
+ * throughput case by case and exits with status 2 if any case got
+ * slower by more than the threshold.
+ */
+
+#define MAX_LIST_ITEMS 8
+#define MAX_RUNS       100
+
+/* Exit status when a case regressed against the baseline */
+#define EXIT_REGRESSION 2
+
+static int logLevel = LOG_WARN;
+int *global_log_level = &logLevel;
+
+struct benchScene {
+    const char *name;
+    void (*build)(struct scene *s);
+    struct state pose;
+};
+
+static void buildPinholeScene(struct scene *s)
+{
+    buildDefaultScene(s);
+
+    s->header.cameraType = CAMERA_PINHOLE;
+    s->header.cameras.pinhole.up = (cl_float3) { { 0, 1, 0 } };
+    s->header.cameras.pinhole.vpdist = 3;
+}
+
+static void buildGrid(struct scene *s)
+{
+    buildGridScene(s, 16, 4);
+}
+
+/* Too many lights to shade them all, so they're picked by importance */
+static void buildManyLights(struct scene *s)
+{
+    buildGridScene(s, 16, 256);
+}
+
+/* The scenes and the poses they're rendered from. Changing any of
+these changes every result, so baselines need regenerating. */
+static const struct benchScene scenes[] = {
+    {
+        .name = "default",
+        .build = buildDefaultScene,
+        .pose = {
+            .position = { { 0, 1.0, -5.0 } },
+            .heading = { { 0.0, 0.0, 1.0 } },
+            .lens_radius = 0.05f
+        }
+    },
+    {
+        .name = "pinhole",
+        .build = buildPinholeScene,
+        .pose = {
+            .position = { { 4.0, 2.0, -6.0 } },
+            .heading = { { -0.5, -0.1, 0.86 } }
+        }
+    },
+    {
+        .name = "grid",
+        .build = buildGrid,
+        .pose = {
+            .position = { { 0, 6.0, -8.0 } },
+            .heading = { { 0.0, -0.45, 0.89 } }
+        }
+    },
+    {
+        .name = "arealights",
+        .build = buildAreaLightScene,
+        .pose = {
+            .position = { { 0, 1.0, -5.0 } },
+            .heading = { { 0.0, 0.0, 1.0 } },
+            .lens_radius = 0.05f
+        }
+    },
+    {
+        .name = "manylights",
+        .build = buildManyLights,
+        .pose = {
+            .position = { { 0, 6.0, -8.0 } },
+            .heading = { { 0.0, -0.45, 0.89 } }
+        }
+    }
+};
+
+#define NUM_SCENES (sizeof(scenes) / sizeof(scenes[0]))
+
+struct benchOptions {
+    const char *output;
+    const char *baseline;
+    const char *meshFile;
+    const char *envMapFile;
+    double threshold;
+    int runs;
+    int warmup;
+    int batchSize;
+    int specialise;
+    int countRays;
+    int widths[MAX_LIST_ITEMS], heights[MAX_LIST_ITEMS], numSizes;
+    int roots[MAX_LIST_ITEMS], numRoots;
+    int depths[MAX_LIST_ITEMS], numDepths;
+    int sceneEnabled[NUM_SCENES];
+};
+
+struct summary {
+    double mean;
+    double stddev;
+    double ci95;
+};
+
+struct caseResult {
+    char name[128];
+    int width, height, sampleRoot, traceDepth;
+    cl_uint samples;
+    struct summary wallMs, kernelMs, hostMs, samplesPerSec;
+
+    // Only with -c
+    struct summary raysPerSec, testsPerRay;
+};
+
+/* Two-sided 95% critical values of Student's t for 1 to 30 degrees of
+freedom; beyond that the normal distribution's is close enough */
+static const double tCritical[] = {
+    12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+    2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+    2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042
+};
+
+static struct summary summarise(double *values, int n)
+{
+    struct summary s = { 0, 0, 0 };
+
+    for (int i = 0; i < n; i++)
+        s.mean += values[i];
+    s.mean /= n;
+
+    if (n < 2)
+        return s;
+
+    for (int i = 0; i < n; i++)
+        s.stddev += (values[i] - s.mean) * (values[i] - s.mean);
+    s.stddev = sqrt(s.stddev / (n - 1));
+
+    int df = n - 1;
+    double t = df <= sizeof(tCritical) / sizeof(tCritical[0]) ? tCritical[df - 1] : 1.96;
+    s.ci95 = t * s.stddev / sqrt(n);
+
+    return s;
+}
+
+static void usage(char *progname, struct benchOptions *o)
+{
+    printf("Usage: %s [options]\n", progname);
+    printf("Options:\n");
+    printf("    -o FILE      Write JSON results to FILE, - for stdout (default: %s)\n",
+            o->output);
+    printf("    -b FILE      Compare samples/sec against the JSON results in FILE\n");
+    printf("    -t PERCENT   Slowdown against the baseline that counts as a regression\n");
+    printf("                 (default: %.1f)\n", o->threshold);
+    printf("    -n RUNS      Timed runs per case (default: %d)\n", o->runs);
+    printf("    -w RUNS      Warm-up runs per case (default: %d)\n", o->warmup);
+    printf("    -s SIZES     Comma-separated resolutions (default: 640x360)\n");
+    printf("    -r ROOTS     Comma-separated sample roots (default: 2)\n");
+    printf("    -d DEPTHS    Comma-separated trace depths (default: 5)\n");
+    printf("    -S SCENES    Comma-separated scenes to run:");
+    for (int i = 0; i < NUM_SCENES; i++)
+        printf(" %s", scenes[i].name);
+    printf(" (default: all)\n");
+    printf("    -B SIZE      Batch size in samples per kernel invocation (default: %d)\n",
+            o->batchSize);
+    printf("    -m FILE      Add the triangle mesh in the given OBJ file to every scene\n");
+    printf("    -e FILE      Light every scene with the given HDR environment map\n");
+    printf("    -g           Only use the generic raytracer kernel\n");
+    printf("    -c           Count rays and intersection tests, adding rays/sec and\n");
+    printf("                 tests/ray to the results\n");
+    printf("    -l LEVEL     Log level (default: %s)\n", log_level_name(logLevel));
+    exit(1);
+}
+
+/* Parse a comma-separated list of positive integers */
+static int parseList(char *arg, int *values, int *count)
+{
+    *count = 0;
+
+    for (char *item = strtok(arg, ","); item; item = strtok(NULL, ",")) {
+        if (*count == MAX_LIST_ITEMS || atoi(item) <= 0)
+            return 1;
+        values[(*count)++] = atoi(item);
+    }
+
+    return *count == 0;
+}
+
+static int parseSizes(char *arg, struct benchOptions *o)
+{
+    o->numSizes = 0;
+
+    for (char *item = strtok(arg, ","); item; item = strtok(NULL, ",")) {
+        int w, h;
+
+        if (o->numSizes == MAX_LIST_ITEMS || sscanf(item, "%dx%d", &w, &h) != 2 ||
+                w <= 0 || h <= 0)
+            return 1;
+        o->widths[o->numSizes] = w;
+        o->heights[o->numSizes] = h;
+        o->numSizes++;
+    }
+
+    return o->numSizes == 0;
+}
+
+static int parseScenes(char *arg, struct benchOptions *o)
+{
+    for (int i = 0; i < NUM_SCENES; i++)
+        o->sceneEnabled[i] = 0;
+
+    for (char *item = strtok(arg, ","); item; item = strtok(NULL, ",")) {
+        int found = 0;
+
+        for (int i = 0; i < NUM_SCENES; i++) {
+            if (strcasecmp(item, scenes[i].name) == 0)
+                o->sceneEnabled[i] = found = 1;
+        }
+        if (!found)
+            return 1;
+    }
+
+    return 0;
+}
+
+static void processBenchArgs(int argc, char **argv, struct benchOptions *o)
+{
+    int ch;
+
+    while ((ch = getopt(argc, argv, "o:b:t:n:w:s:r:d:S:B:m:e:gcl:h")) != -1) {
+        switch (ch) {
+            case 'o':
+                o->output = optarg;
+                break;
+            case 'b':
+                o->baseline = optarg;
+                break;
+            case 't':
+                o->threshold = atof(optarg);
+                if (o->threshold < 0)
+                    goto bad;
+                break;
+            case 'n':
+                o->runs = atoi(optarg);
+                if (o->runs <= 0 || o->runs > MAX_RUNS)
+                    goto bad;
+                break;
+            case 'w':
+                o->warmup = atoi(optarg);
+                if (o->warmup < 0)
+                    goto bad;
+                break;
+            case 's':
+                if (parseSizes(optarg, o))
+                    goto bad;
+                break;
+            case 'r':
+                if (parseList(optarg, o->roots, &o->numRoots))
+                    goto bad;
+                for (int i = 0; i < o->numRoots; i++) {
+                    if (o->roots[i] > MAX_SAMPLE_ROOT)
+                        goto bad;
+                }
+                break;
+            case 'd':
+                if (parseList(optarg, o->depths, &o->numDepths))
+                    goto bad;
+                break;
+            case 'S':
+                if (parseScenes(optarg, o))
+                    goto bad;
+                break;
+            case 'B':
+                o->batchSize = atoi(optarg);
+                if (o->batchSize <= 0)
+                    goto bad;
+                break;
+            case 'm':
+                o->meshFile = optarg;
+                break;
+            case 'e':
+                o->envMapFile = optarg;
+                break;
+            case 'g':
+                o->specialise = 0;
+                break;
+            case 'c':
+                o->countRays = 1;
+                break;
+            case 'l':
+                logLevel = log_level_from_name(optarg);
+                if (logLevel < 0)
+                    goto bad;
+                break;
+            case 'h':
+            case '?':
+bad:
+            default:
+                usage(argv[0], o);
+        }
+    }
+
+    if (optind < argc)
+        usage(argv[0], o);
+}
+
+/* Render one case warmup + runs times and summarise the timed runs */
+static int runCase(cl_context context, cl_device_id device_id, struct benchOptions *o,
+        const struct benchScene *bs, struct configuration *config, struct caseResult *result)
+{
+    double wallMs[MAX_RUNS], kernelMs[MAX_RUNS], hostMs[MAX_RUNS], samplesPerSec[MAX_RUNS];
+    double raysPerSec[MAX_RUNS], testsPerRay[MAX_RUNS];
+    struct renderer renderer;
+    struct scene scene;
+    struct state state = bs->pose;
+    int ret;
+
+    scene_init(&scene);
+    bs->build(&scene);
+    if (o->meshFile && loadSceneMesh(&scene, o->meshFile)) {
+        log_error("Could not load mesh");
+        return 1;
+    }
+    if (o->envMapFile && loadEnvironmentMap(&scene, o->envMapFile)) {
+        log_error("Could not load environment map");
+        return 1;
+    }
+    buildBVH(&scene);
+    buildLightTree(&scene);
+
+    ret = renderer_init(&renderer, context, device_id, config);
+    if (ret) {
+        log_error("Could not initialize renderer");
+        return 1;
+    }
+
+    cl_mem output = headless_create_image(context, config->width, config->height);
+
+    for (int run = 0; run < o->warmup + o->runs; run++) {
+        struct timeval start, stop, diff;
+        struct counters countsStart, counts;
+        cl_ulong kernelStart = renderer_kernel_time(&renderer);
+
+        renderer_counters(&renderer, &countsStart);
+
+        gettimeofday(&start, NULL);
+        ret = headless_render(&renderer, config, &state, &scene, output);
+        if (ret)
+            return 1;
+        gettimeofday(&stop, NULL);
+
+        if (run < o->warmup)
+            continue;
+
+        int i = run - o->warmup;
+        timevalDiff(&start, &stop, &diff);
+        wallMs[i] = diff.tv_sec * 1000.0 + diff.tv_usec / 1000.0;
+        kernelMs[i] = (renderer_kernel_time(&renderer) - kernelStart) / 1000000.0;
+        hostMs[i] = fmax(wallMs[i] - kernelMs[i], 0);
+        samplesPerSec[i] = (double) config->width * config->height * state.sampleNum /
+            (wallMs[i] / 1000.0);
+
+        // headless_render() finishes every batch, so the counts are
+        // complete
+        renderer_counters(&renderer, &counts);
+        cl_ulong rays = counters_rays(&counts) - counters_rays(&countsStart);
+        cl_ulong tests = counters_tests(&counts) - counters_tests(&countsStart);
+        raysPerSec[i] = rays / (wallMs[i] / 1000.0);
+        testsPerRay[i] = rays ? (double) tests / rays : 0;
+    }
+
+    result->samples = state.sampleNum;
+    result->wallMs = summarise(wallMs, o->runs);
+    result->kernelMs = summarise(kernelMs, o->runs);
+    result->hostMs = summarise(hostMs, o->runs);
+    result->samplesPerSec = summarise(samplesPerSec, o->runs);
+    result->raysPerSec = summarise(raysPerSec, o->runs);
+    result->testsPerRay = summarise(testsPerRay, o->runs);
+
+    clReleaseMemObject(output);
+    renderer_release(&renderer);
+    scene_release(&scene);
+
+    return 0;
+}
+
+static void writeJSONString(FILE *fp, const char *s)
+{
+    fputc('"', fp);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\')
+            fputc('\\', fp);
+        if ((unsigned char) *s >= 0x20)
+            fputc(*s, fp);
+    }
+    fputc('"', fp);
+}
+
+static void writeSummary(FILE *fp, const char *name, struct summary *s, int last)
+{
+    fprintf(fp, "      \"%s\": { \"mean\": %.6g, \"stddev\": %.6g, \"ci95\": %.6g }%s\n",
+            name, s->mean, s->stddev, s->ci95, last ? "" : ",");
+}
+
+static void deviceString(cl_device_id device_id, cl_device_info param, char *out, size_t size)
+{
+    if (clGetDeviceInfo(device_id, param, size, out, NULL))
+        out[0] = '\0';
+    out[size - 1] = '\0';
+}
+
+static int writeResults(struct benchOptions *o, cl_device_id device_id,
+        struct caseResult *results, int numResults)
+{
+    char deviceName[256], driverVersion[256], deviceVersion[256];
+    FILE *fp = stdout;
+
+    if (strcmp(o->output, "-") != 0) {
+        fp = fopen(o->output, "w");
+        if (!fp) {
+            log_error("Could not open %s for writing", o->output);
+            return 1;
+        }
+    }
+
+    deviceString(device_id, CL_DEVICE_NAME, deviceName, sizeof(deviceName));
+    deviceString(device_id, CL_DRIVER_VERSION, driverVersion, sizeof(driverVersion));
+    deviceString(device_id, CL_DEVICE_VERSION, deviceVersion, sizeof(deviceVersion));
+
+    fprintf(fp, "{\n");
+    fprintf(fp, "  \"version\": \"%s\",\n", T2_VERSION);
+    fprintf(fp, "  \"commit\": \"%s\",\n", T2_COMMIT);
+    fprintf(fp, "  \"device\": ");
+    writeJSONString(fp, deviceName);
+    fprintf(fp, ",\n  \"deviceVersion\": ");
+    writeJSONString(fp, deviceVersion);
+    fprintf(fp, ",\n  \"driverVersion\": ");
+    writeJSONString(fp, driverVersion);
+    fprintf(fp, ",\n  \"warmupRuns\": %d,\n", o->warmup);
+    fprintf(fp, "  \"runs\": %d,\n", o->runs);
+    fprintf(fp, "  \"batchSize\": %d,\n", o->batchSize);
+    fprintf(fp, "  \"specialised\": %s,\n", o->specialise ? "true" : "false");
+    fprintf(fp, "  \"countRays\": %s,\n", o->countRays ? "true" : "false");
+    fprintf(fp, "  \"cases\": [\n");
+
+    for (int i = 0; i < numResults; i++) {
+        struct caseResult *r = &results[i];
+
+        fprintf(fp, "    {\n");
+        fprintf(fp, "      \"name\": \"%s\",\n", r->name);
+        fprintf(fp, "      \"width\": %d,\n", r->width);
+        fprintf(fp, "      \"height\": %d,\n", r->height);
+        fprintf(fp, "      \"sampleRoot\": %d,\n", r->sampleRoot);
+        fprintf(fp, "      \"traceDepth\": %d,\n", r->traceDepth);
+        fprintf(fp, "      \"samplesPerPixel\": %u,\n", r->samples);
+        writeSummary(fp, "wallMs", &r->wallMs, 0);
+        writeSummary(fp, "kernelMs", &r->kernelMs, 0);
+        writeSummary(fp, "hostMs", &r->hostMs, 0);
+        writeSummary(fp, "samplesPerSec", &r->samplesPerSec, !o->countRays);
+        if (o->countRays) {
+            writeSummary(fp, "raysPerSec", &r->raysPerSec, 0);
+            writeSummary(fp, "testsPerRay", &r->testsPerRay, 1);
+        }
+        fprintf(fp, "    }%s\n", i == numResults - 1 ? "" : ",");
+    }
+
+    fprintf(fp, "  ]\n}\n");
+
+    if (fp != stdout)
+        fclose(fp);
+
+    return 0;
+}
+
+static char *readFile(const char *path)
+{
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        return NULL;
+
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    char *buf = malloc(size + 1);
+    if (buf) {
+        size_t got = fread(buf, 1, size, fp);
+        buf[got] = '\0';
+    }
+    fclose(fp);
+
+    return buf;
+}
+
+/* The mean samples/sec recorded for a case in a results file we wrote,
+or a negative number if it has none. This only understands t2-bench's
+own output, not JSON in general. */
+static double baselineRate(const char *json, const char *name)
+{
+    char key[160];
+    const char *p, *next, *rate, *mean;
+
+    snprintf(key, sizeof(key), "\"name\": \"%s\"", name);
+    p = strstr(json, key);
+    if (!p)
+        return -1;
+
+    next = strstr(p + 1, "\"name\":");
+    rate = strstr(p, "\"samplesPerSec\"");
+    if (!rate || (next && rate > next))
+        return -1;
+
+    mean = strstr(rate, "\"mean\":");
+    if (!mean)
+        return -1;
+
+    return strtod(mean + strlen("\"mean\":"), NULL);
+}
+
+/* Returns how many cases regressed */
+static int compareBaseline(struct benchOptions *o, struct caseResult *results, int numResults)
+{
+    int regressions = 0;
+    char *json = readFile(o->baseline);
+
+    if (!json) {
+        log_error("Could not read baseline %s", o->baseline);
+        return 0;
+    }
+
+    fprintf(stderr, "Compared with %s:\n", o->baseline);
+    for (int i = 0; i < numResults; i++) {
+        double base = baselineRate(json, results[i].name);
+        double now = results[i].samplesPerSec.mean;
+
+        if (base <= 0) {
+            fprintf(stderr, "  %-32s not in baseline\n", results[i].name);
+            continue;
+        }
+
+        double change = (now - base) / base * 100.0;
+        int regressed = change < -o->threshold;
+
+        fprintf(stderr, "  %-32s %+7.2f%%%s\n", results[i].name, change,
+                regressed ? "  REGRESSION" : "");
+        regressions += regressed;
+    }
+
+    free(json);
+
+    return regressions;
+}
+
+int main(int argc, char **argv)
+{
+    struct benchOptions o = {
+        .output = "-",
+        .baseline = NULL,
+        .meshFile = NULL,
+        .envMapFile = NULL,
+        .threshold = 5.0,
+        .runs = 5,
+        .warmup = 1,
+        .batchSize = 4,
+        .specialise = 1,
+        .countRays = 0,
+        .widths = { 640 }, .heights = { 360 }, .numSizes = 1,
+        .roots = { 2 }, .numRoots = 1,
+        .depths = { 5 }, .numDepths = 1
+    };
+    struct caseResult *results;
+    int numResults = 0, maxResults;
+
+    for (int i = 0; i < NUM_SCENES; i++)
+        o.sceneEnabled[i] = 1;
+
+    processBenchArgs(argc, argv, &o);
+
+    cl_platform_id platform_id = choosePlatform();
+    cl_context context = createHeadlessOpenCLContext(platform_id);
+    cl_device_id device_id = chooseOpenCLDevice(platform_id, context);
+
+    maxResults = NUM_SCENES * o.numSizes * o.numRoots * o.numDepths;
+    results = calloc(maxResults, sizeof(struct caseResult));
+    if (!results) {
+        log_error("Could not allocate results for %d cases", maxResults);
+        return 1;
+    }
+
+    for (int s = 0; s < NUM_SCENES; s++) {
+        if (!o.sceneEnabled[s])
+            continue;
+
+        for (int z = 0; z < o.numSizes; z++)
+        for (int r = 0; r < o.numRoots; r++)
+        for (int d = 0; d < o.numDepths; d++) {
+            // Fixed settings and seeds, so runs are comparable from
+            // one build to the next
+            struct configuration config = {
+                .traceDepth = o.depths[d],
+                .sampleRoot = o.roots[r],
+                .width = o.widths[z],
+                .height = o.heights[z],
+                .logLevel = logLevel,
+                .batchSize = o.batchSize,
+                .headless = 1,
+                .adaptiveThreshold = 0,
+                .adaptiveMinSamples = 8,
+                .tileSize = 32,
+                .sampler = SAMPLER_SOBOL,
+                .lightSamples = 4,
+                .integrator = INTEGRATOR_WHITTED,
+                .tileOrder = TILE_ORDER_SCANLINE,
+                .tileBudget = 0,
+                .sampleSetType = SAMPLE_SET_JITTERED,
+                .sampleSeed = 0,
+                .specialise = o.specialise,
+                .countRays = o.countRays
+            };
+            struct caseResult *result = &results[numResults];
+
+            snprintf(result->name, sizeof(result->name), "%s-%dx%d-r%d-d%d", scenes[s].name,
+                    config.width, config.height, config.sampleRoot, config.traceDepth);
+            result->width = config.width;
+            result->height = config.height;
+            result->sampleRoot = config.sampleRoot;
+            result->traceDepth = config.traceDepth;
+
+            if (runCase(context, device_id, &o, &scenes[s], &config, result)) {
+                log_error("Benchmark case %s failed", result->name);
+                return 1;
+            }
+
+            fprintf(stderr, "%-32s %9.3f ms +/- %.3f  %8.3f Msamples/sec +/- %.3f",
+                    result->name, result->wallMs.mean, result->wallMs.ci95,
+                    result->samplesPerSec.mean / 1000000.0,
+                    result->samplesPerSec.ci95 / 1000000.0);
+            if (o.countRays)
+                fprintf(stderr, "  %8.3f Mrays/sec  %.2f tests/ray",
+                        result->raysPerSec.mean / 1000000.0, result->testsPerRay.mean);
+            fputc('\n', stderr);
+            numResults++;
+        }
+    }
+
+    if (writeResults(&o, device_id, results, numResults))
+        return 1;
+
+    int regressions = o.baseline ? compareBaseline(&o, results, numResults) : 0;
+
+    free(results);
+    clReleaseContext(context);
+
+    return regressions ? EXIT_REGRESSION : 0;
+}
@@ -0,0 +1,359 @@
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#include <sys/time.h>
+
+#include <t2/bvh.h>
+#include <t2/logging.h>
+#include <t2/mathutil.h>
+#include <t2/util.h>
+
+/* Number of centroid bins evaluated per axis when looking for a split */
+#define BVH_BINS 16
+
+/* Leaves never hold more primitives than this */
+#define BVH_MAX_LEAF_SIZE 4
+
+/* Relative costs of visiting a node and intersecting a primitive, for
+the surface area heuristic */
+#define BVH_TRAVERSAL_COST 1.0f
+#define BVH_INTERSECT_COST 1.0f
+
+/* Below this depth SAH splits give way to median splits, which halve
+the primitive count and so bound the remaining depth by log2(count) */
+#define BVH_MEDIAN_DEPTH (BVH_MAX_DEPTH - 24)
+
+struct bounds {
+    float min[3];
+    float max[3];
+};
+
+struct bvh_build {
+    struct BVHNode *nodes;
+    cl_uint numNodes;
+    cl_uint *indices;
+
+    /* Per-object bounds and centroids, indexed by object index */
+    struct bounds *primBounds;
+    float (*centroids)[3];
+};
+
+static inline void bounds_empty(struct bounds *b)
+{
+    for (int a = 0; a < 3; a++) {
+        b->min[a] = FLT_MAX;
+        b->max[a] = -FLT_MAX;
+    }
+}
+
+static inline void bounds_grow(struct bounds *b, const struct bounds *o)
+{
+    for (int a = 0; a < 3; a++) {
+        b->min[a] = MINF(b->min[a], o->min[a]);
+        b->max[a] = MAXF(b->max[a], o->max[a]);
+    }
+}
+
+static inline void bounds_grow_point(struct bounds *b, const float *p)
+{
+    for (int a = 0; a < 3; a++) {
+        b->min[a] = MINF(b->min[a], p[a]);
+        b->max[a] = MAXF(b->max[a], p[a]);
+    }
+}
+
+static inline float bounds_area(const struct bounds *b)
+{
+    float dx = b->max[0] - b->min[0];
+    float dy = b->max[1] - b->min[1];
+    float dz = b->max[2] - b->min[2];
+
+    if (dx < 0 || dy < 0 || dz < 0)
+        return 0;
+
+    return 2.f * (dx * dy + dy * dz + dz * dx);
+}
+
+/**
+ * Compute bounds for a bounded object. Returns 0 for objects that
+ * extend infinitely (planes), which are kept out of the tree.
+ */
+static int objectBounds(struct scene *s, struct Object *o, struct bounds *b)
+{
+    switch (o->type) {
+        case OBJECT_TRIANGLE:
+            bounds_empty(b);
+            for (int c = 0; c < 3; c++) {
+                cl_uint v = s->indices[3 * o->types.triangle.index + c];
+                bounds_grow_point(b, &s->vertices[3 * v]);
+            }
+            return 1;
+
+        case OBJECT_SPHERE:
+            for (int a = 0; a < 3; a++) {
+                b->min[a] = o->types.sphere.center.s[a] - o->types.sphere.radius;
+                b->max[a] = o->types.sphere.center.s[a] + o->types.sphere.radius;
+            }
+            return 1;
+
+        case OBJECT_PLANE:
+        default:
+            return 0;
+    }
+}
+
+static inline int binIndex(float c, float min, float scale)
+{
+    int bin = (int) ((c - min) * scale);
+    return bin < 0 ? 0 : (bin >= BVH_BINS ? BVH_BINS - 1 : bin);
+}
+
+/**
+ * Reorder indices[first, first + count) so the element at the middle
+ * has the median centroid along axis, with smaller ones before it.
+ */
+static void medianSplit(struct bvh_build *b, cl_uint first, cl_uint count, int axis)
+{
+    cl_uint *idx = b->indices;
+    long lo = first, hi = first + count - 1;
+    long k = first + count / 2;
+
+    /* Quickselect */
+    while (lo < hi) {
+        float pivot = b->centroids[idx[(lo + hi) / 2]][axis];
+        long i = lo, j = hi;
+
+        while (i <= j) {
+            while (b->centroids[idx[i]][axis] < pivot) i++;
+            while (b->centroids[idx[j]][axis] > pivot) j--;
+            if (i <= j) {
+                cl_uint t = idx[i]; idx[i] = idx[j]; idx[j] = t;
+                i++;
+                j--;
+            }
+        }
+
+        if (k <= j)
+            hi = j;
+        else if (k >= i)
+            lo = i;
+        else
+            break;
+    }
+}
+
+static cl_uint buildNode(struct bvh_build *b, cl_uint first, cl_uint count, int depth)
+{
+    cl_uint nodeIndex = b->numNodes++;
+    struct BVHNode *node = &b->nodes[nodeIndex];
+    struct bounds nodeBounds, centroidBounds;
+
+    bounds_empty(&nodeBounds);
+    bounds_empty(&centroidBounds);
+
+    for (cl_uint i = first; i < first + count; i++) {
+        bounds_grow(&nodeBounds, &b->primBounds[b->indices[i]]);
+        bounds_grow_point(&centroidBounds, b->centroids[b->indices[i]]);
+    }
+
+    memcpy(node->min, nodeBounds.min, sizeof(node->min));
+    memcpy(node->max, nodeBounds.max, sizeof(node->max));
+
+    /* The kernel's stack holds one node per level below the root, so
+       at the last level it has room for, whatever is left becomes one
+       leaf, however big */
+    assert(depth < BVH_MAX_DEPTH);
+    if (count == 1 || depth == BVH_MAX_DEPTH - 1) {
+        node->offset = first;
+        node->count = count;
+        return nodeIndex;
+    }
+
+    int axis = 0;
+    for (int a = 1; a < 3; a++) {
+        if (centroidBounds.max[a] - centroidBounds.min[a] >
+                centroidBounds.max[axis] - centroidBounds.min[axis])
+            axis = a;
+    }
+
+    float extent = centroidBounds.max[axis] - centroidBounds.min[axis];
+    float parentArea = bounds_area(&nodeBounds);
+    cl_uint split = first + count / 2;
+
+    if (extent <= 0 || parentArea <= 0 || depth >= BVH_MEDIAN_DEPTH) {
+        /* Degenerate or too deep for SAH to be trusted with the depth
+           budget; fall back to splitting at the median */
+        if (count <= BVH_MAX_LEAF_SIZE) {
+            node->offset = first;
+            node->count = count;
+            return nodeIndex;
+        }
+
+        if (extent > 0)
+            medianSplit(b, first, count, axis);
+    } else {
+        /* Binned SAH: try every bin boundary on every axis and keep the
+           cheapest */
+        float bestCost = FLT_MAX;
+        int bestAxis = -1, bestBin = 0;
+
+        for (int a = 0; a < 3; a++) {
+            float min = centroidBounds.min[a];
+            float axisExtent = centroidBounds.max[a] - min;
+            if (axisExtent <= 0)
+                continue;
+
+            float scale = BVH_BINS / axisExtent;
+            struct bounds binBounds[BVH_BINS];
+            cl_uint binCounts[BVH_BINS] = { 0 };
+
+            for (int i = 0; i < BVH_BINS; i++)
+                bounds_empty(&binBounds[i]);
+
+            for (cl_uint i = first; i < first + count; i++) {
+                cl_uint prim = b->indices[i];
+                int bin = binIndex(b->centroids[prim][a], min, scale);
+                binCounts[bin]++;
+                bounds_grow(&binBounds[bin], &b->primBounds[prim]);
+            }
+
+            /* Sweep from the right to get the cost of everything above
+               each boundary, then from the left to combine */
+            float rightArea[BVH_BINS];
+            cl_uint rightCount[BVH_BINS];
+            struct bounds acc;
+            cl_uint accCount = 0;
+
+            bounds_empty(&acc);
+            for (int i = BVH_BINS - 1; i > 0; i--) {
+                bounds_grow(&acc, &binBounds[i]);
+                accCount += binCounts[i];
+                rightArea[i] = bounds_area(&acc);
+                rightCount[i] = accCount;
+            }
+
+            bounds_empty(&acc);
+            accCount = 0;
+            for (int i = 0; i < BVH_BINS - 1; i++) {
+                bounds_grow(&acc, &binBounds[i]);
+                accCount += binCounts[i];
+
+                if (accCount == 0 || rightCount[i + 1] == 0)
+                    continue;
+
+                float cost = BVH_TRAVERSAL_COST + BVH_INTERSECT_COST *
+                    (bounds_area(&acc) * accCount +
+                     rightArea[i + 1] * rightCount[i + 1]) / parentArea;
+
+                if (cost < bestCost) {
+                    bestCost = cost;
+                    bestAxis = a;
+                    bestBin = i;
+                }
+            }
+        }
+
+        float leafCost = BVH_INTERSECT_COST * count;
+
+        if (count <= BVH_MAX_LEAF_SIZE && (bestAxis == -1 || leafCost <= bestCost)) {
+            node->offset = first;
+            node->count = count;
+            return nodeIndex;
+        }
+
+        if (bestAxis != -1) {
+            /* Partition the range around the chosen bin boundary */
+            float min = centroidBounds.min[bestAxis];
+            float scale = BVH_BINS / (centroidBounds.max[bestAxis] - min);
+            cl_uint i = first, j = first + count;
+
+            while (i < j) {
+                if (binIndex(b->centroids[b->indices[i]][bestAxis], min, scale) <= bestBin) {
+                    i++;
+                } else {
+                    j--;
+                    cl_uint t = b->indices[i];
+                    b->indices[i] = b->indices[j];
+                    b->indices[j] = t;
+                }
+            }
+
+            split = i;
+        } else {
+            medianSplit(b, first, count, axis);
+        }
+    }
+
+    node->count = 0;
+    buildNode(b, first, split - first, depth + 1);
+    node->offset = buildNode(b, split, first + count - split, depth + 1);
+
+    return nodeIndex;
+}
+
+/**
+ * (Re)build the scene's BVH and primitive index array. Unbounded
+ * objects are listed first in the primitive indices and are not part
+ * of the tree.
+ */
+void buildBVH(struct scene *s)
+{
+    cl_uint numObjects = s->header.numObjects;
+    struct bvh_build b;
+    struct timeval start, stop, diff;
+
+    gettimeofday(&start, NULL);
+
+    free(s->bvhNodes);
+    free(s->primIndices);
+
+    s->primIndices = malloc(sizeof(cl_uint) * MAXF(numObjects, 1));
+    /* A binary tree over n leaves never has more than 2n - 1 nodes */
+    s->bvhNodes = malloc(sizeof(struct BVHNode) * MAXF(2 * numObjects, 1));
+    b.primBounds = malloc(sizeof(struct bounds) * MAXF(numObjects, 1));
+    b.centroids = malloc(sizeof(float) * 3 * MAXF(numObjects, 1));
+
+    if (!s->primIndices || !s->bvhNodes || !b.primBounds || !b.centroids) {
+        log_error("Could not allocate memory for BVH over %d objects", numObjects);
+        exit(1);
+    }
+
+    cl_uint numUnbounded = 0;
+    cl_uint numBounded = 0;
+
+    /* Unbounded objects go at the front, bounded ones are collected at
+       the back and then moved up behind them */
+    for (cl_uint i = 0; i < numObjects; i++) {
+        if (objectBounds(s, &s->objects[i], &b.primBounds[i])) {
+            s->primIndices[numObjects - 1 - numBounded] = i;
+            numBounded++;
+
+            for (int a = 0; a < 3; a++)
+                b.centroids[i][a] = 0.5f * (b.primBounds[i].min[a] + b.primBounds[i].max[a]);
+        } else {
+            s->primIndices[numUnbounded++] = i;
+        }
+    }
+
+    b.nodes = s->bvhNodes;
+    b.numNodes = 0;
+    b.indices = s->primIndices;
+
+    if (numBounded > 0)
+        buildNode(&b, numUnbounded, numBounded, 0);
+
+    s->header.numUnbounded = numUnbounded;
+    s->header.numBVHNodes = b.numNodes;
+
+    free(b.primBounds);
+    free(b.centroids);
+
+    gettimeofday(&stop, NULL);
+    timevalDiff(&start, &stop, &diff);
+
+    log_info("Built BVH with %d nodes over %d objects (%d unbounded) in %.3f sec",
+            b.numNodes, numBounded, numUnbounded,
+            ((float) diff.tv_sec) + ((float) diff.tv_usec / 1000000.0));
+}
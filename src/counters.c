@@ -0,0 +1,47 @@
+
+#include <t2/counters.h>
+
+static const char *counterNames[NUM_COUNTERS] = {
+    "primary rays",
+    "reflection rays",
+    "shadow rays",
+    "sphere tests",
+    "plane tests",
+    "triangle tests",
+    "stack overflows",
+    "cached shadows"
+};
+
+const char *counter_name(int counter)
+{
+    if (counter < 0 || counter >= NUM_COUNTERS)
+        return NULL;
+
+    return counterNames[counter];
+}
+
+void counters_clear(struct counters *c)
+{
+    for (int i = 0; i < NUM_COUNTERS; i++)
+        c->counts[i] = 0;
+}
+
+void counters_add(struct counters *total, const struct counters *c)
+{
+    for (int i = 0; i < NUM_COUNTERS; i++)
+        total->counts[i] += c->counts[i];
+}
+
+/* Every ray traced, of any kind */
+cl_ulong counters_rays(const struct counters *c)
+{
+    return c->counts[COUNTER_PRIMARY_RAYS] + c->counts[COUNTER_REFLECTION_RAYS] +
+        c->counts[COUNTER_SHADOW_RAYS];
+}
+
+/* Every ray/primitive intersection test */
+cl_ulong counters_tests(const struct counters *c)
+{
+    return c->counts[COUNTER_SPHERE_TESTS] + c->counts[COUNTER_PLANE_TESTS] +
+        c->counts[COUNTER_TRIANGLE_TESTS];
+}
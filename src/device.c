@@ -1,20 +1,23 @@
 
 #include <stdlib.h>
 
+#ifdef __APPLE__
 #include <OpenGL/CGLCurrent.h>
+#else
+#include <GL/glx.h>
+#endif
 
 #include <t2/device.h>
 #include <t2/logging.h>
 
-#define MAX_DEVICES 10
-
 static void clNotify(const char *errinfo, const void *private_info, size_t cb, void *user_data) {
     log_error("%s", errinfo);
 }
 
-cl_context createOpenCLContext() {
+cl_context createOpenCLContext(cl_platform_id platform_id) {
     int ret;
 
+#ifdef __APPLE__
     CGLContextObj cglContext = CGLGetCurrentContext();
     if (!cglContext) {
         log_error("Could not get CGLContext");
@@ -35,6 +38,19 @@ cl_context createOpenCLContext() {
     /* Create OpenCL context using share group so we can do efficient
     rendering from OpenCL kernel */
     cl_context context = clCreateContext(clProperties, 0, NULL, clNotify, NULL, &ret);
+#else
+    cl_context_properties clProperties[] = {
+        CL_GL_CONTEXT_KHR, (cl_context_properties)glXGetCurrentContext(),
+        CL_GLX_DISPLAY_KHR, (cl_context_properties)glXGetCurrentDisplay(),
+        CL_CONTEXT_PLATFORM, (cl_context_properties)platform_id,
+        0
+    };
+
+    /* Create OpenCL context sharing the current GLX context so we can
+    do efficient rendering from OpenCL kernel */
+    cl_context context = clCreateContextFromType(clProperties, CL_DEVICE_TYPE_GPU,
+            clNotify, NULL, &ret);
+#endif
     if (ret) {
         log_error("Could not create context, ret %d", ret);
         exit(1);
@@ -43,19 +59,56 @@ cl_context createOpenCLContext() {
     return context;
 }
 
-cl_device_id chooseOpenCLDevice(cl_platform_id platform_id, cl_context context)
+/* Like createHeadlessOpenCLContext(), but returns NULL on failure */
+cl_context tryCreateHeadlessOpenCLContext(cl_platform_id platform_id) {
+    int ret;
+
+    cl_context_properties clProperties[] = {
+        CL_CONTEXT_PLATFORM, (cl_context_properties)platform_id, 0
+    };
+
+    /* No OpenGL context to share with, so any device on the platform
+    will do (including CPU implementations) */
+    cl_context context = clCreateContextFromType(clProperties, CL_DEVICE_TYPE_ALL,
+            clNotify, NULL, &ret);
+    if (ret) {
+        log_error("Could not create headless context, ret %d", ret);
+        return NULL;
+    }
+
+    return context;
+}
+
+cl_context createHeadlessOpenCLContext(cl_platform_id platform_id) {
+    cl_context context = tryCreateHeadlessOpenCLContext(platform_id);
+    if (!context)
+        exit(1);
+
+    return context;
+}
+
+/* Fill in up to max of the context's devices and return how many there
+are */
+int listOpenCLDevices(cl_context context, cl_device_id *device_ids, int max)
 {
     size_t returned;
     int ret;
-    cl_device_id device_ids[10];
 
-    ret = clGetContextInfo(context, CL_CONTEXT_DEVICES, sizeof(device_ids), device_ids, &returned);
+    ret = clGetContextInfo(context, CL_CONTEXT_DEVICES, sizeof(cl_device_id) * max,
+            device_ids, &returned);
     if (ret) {
         log_error("Could not get devices from context, ret %d", ret);
-        exit(1);
+        return 0;
     }
 
-    int num_devices = returned / sizeof(cl_device_id);
+    return returned / sizeof(cl_device_id);
+}
+
+cl_device_id chooseOpenCLDevice(cl_platform_id platform_id, cl_context context)
+{
+    cl_device_id device_ids[MAX_DEVICES];
+
+    int num_devices = listOpenCLDevices(context, device_ids, MAX_DEVICES);
     log_info("Devices found in OpenCL context: %d", num_devices);
 
     if (num_devices < 1) {
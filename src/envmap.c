@@ -0,0 +1,93 @@
+#include <math.h>
+#include <stdlib.h>
+
+#include <t2/envmap.h>
+#include <t2/image.h>
+#include <t2/logging.h>
+
+/*
+ * Environment maps: an HDR image in latitude-longitude layout that
+ * lights the scene from infinitely far away (see cl/t2/envmap.cl).
+ * Along with the texels, the kernels get a piecewise-constant 2D
+ * distribution over them for importance sampling: a CDF over the rows
+ * (the marginal) followed by a CDF over each row's texels (the
+ * conditionals). Both are built from each texel's luminance times
+ * sin(theta), its share of the sphere, so inverting them picks texels
+ * in proportion to the light they send into the scene.
+ */
+
+/* Fill cdf[0..n] with the running sums of f[0..n-1], scaled to end at
+1 (evenly spaced if f is all 0), and return the total */
+static double buildCdf(const double *f, int n, cl_float *cdf)
+{
+    double total = 0;
+
+    for (int i = 0; i < n; i++)
+        total += f[i];
+
+    double sum = 0;
+    cdf[0] = 0;
+    for (int i = 0; i < n; i++) {
+        sum += f[i];
+        cdf[i + 1] = total > 0 ? sum / total : (double) (i + 1) / n;
+    }
+    cdf[n] = 1;
+
+    return total;
+}
+
+/**
+ * Light the scene with the Radiance HDR image at path, taken as a
+ * latitude-longitude map with +y at the top row. Returns nonzero on
+ * failure.
+ */
+int loadEnvironmentMap(struct scene *s, const char *path)
+{
+    int width, height;
+    float *pixels = readImageHDR(path, &width, &height);
+    if (!pixels)
+        return 1;
+
+    double *rowWeights = malloc(sizeof(double) * height);
+    double *texelWeights = malloc(sizeof(double) * width);
+    cl_float *distribution = malloc(sizeof(cl_float) *
+            ((height + 1) + (size_t) height * (width + 1)));
+    if (!rowWeights || !texelWeights || !distribution) {
+        log_error("Could not allocate memory for %dx%d environment map", width, height);
+        free(pixels);
+        free(rowWeights);
+        free(texelWeights);
+        free(distribution);
+        return 1;
+    }
+
+    cl_float *conditional = distribution + height + 1;
+
+    for (int y = 0; y < height; y++) {
+        float sinTheta = sin(M_PI * (y + 0.5) / height);
+        const float *row = pixels + (size_t) y * width * 4;
+
+        for (int x = 0; x < width; x++) {
+            const float *p = row + 4 * x;
+            texelWeights[x] = (0.2126 * p[0] + 0.7152 * p[1] + 0.0722 * p[2]) * sinTheta;
+        }
+
+        rowWeights[y] = buildCdf(texelWeights, width, conditional + (size_t) y * (width + 1));
+    }
+
+    buildCdf(rowWeights, height, distribution);
+
+    free(rowWeights);
+    free(texelWeights);
+
+    free(s->envTexels);
+    free(s->envDistribution);
+    s->envTexels = (cl_float4 *) pixels;
+    s->envDistribution = distribution;
+    s->header.envWidth = width;
+    s->header.envHeight = height;
+
+    log_info("Loaded %dx%d environment map %s", width, height, path);
+
+    return 0;
+}
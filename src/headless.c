@@ -0,0 +1,199 @@
+
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include <t2/bvh.h>
+#include <t2/lighttree.h>
+#include <t2/envmap.h>
+#include <t2/device.h>
+#include <t2/headless.h>
+#include <t2/image.h>
+#include <t2/info.h>
+#include <t2/logging.h>
+#include <t2/mathutil.h>
+#include <t2/platform.h>
+#include <t2/renderer.h>
+#include <t2/scene.h>
+#include <t2/util.h>
+
+/* A plain OpenCL image to stand in for the shared OpenGL texture */
+cl_mem headless_create_image(cl_context context, int width, int height)
+{
+    cl_int ret;
+    cl_image_format format = { CL_RGBA, CL_FLOAT };
+    cl_image_desc desc = {
+        .image_type = CL_MEM_OBJECT_IMAGE2D,
+        .image_width = width,
+        .image_height = height
+    };
+
+    cl_mem image = clCreateImage(context, CL_MEM_READ_WRITE, &format, &desc, NULL, &ret);
+    if (ret) {
+        log_error("Could not create image, ret %d", ret);
+        exit(1);
+    }
+
+    return image;
+}
+
+/**
+ * Render config->sampleRoot^2 samples per pixel (fewer if adaptive
+ * sampling finds every pixel has converged), starting over from sample
+ * 0, and resolve them into output. Returns once the image is done, with
+ * state->sampleNum set to the number of samples taken.
+ */
+int headless_render(struct renderer *renderer, struct configuration *config,
+        struct state *state, struct scene *scene, cl_mem output)
+{
+    cl_uint totalSamples = config->sampleRoot * config->sampleRoot;
+    cl_int ret;
+
+    state->sampleNum = 0;
+    renderer->dirty_state = 1;
+    renderer_restart(renderer);
+
+    while (state->sampleNum < totalSamples) {
+        if (state->sampleNum > 0 && renderer_frame_converged(renderer)) {
+            log_info("All pixels converged after %d samples", state->sampleNum);
+            break;
+        }
+
+        cl_uint batchSize = MINF(MAXF(config->batchSize, 1), totalSamples - state->sampleNum);
+
+        cl_uint samplesDone;
+        ret = renderer_enqueue_batch(renderer, config, state, scene, batchSize, &samplesDone);
+        if (ret)
+            return 1;
+
+        if (samplesDone) {
+            state->sampleNum += samplesDone;
+            renderer->dirty_state = 1;
+        }
+    }
+
+    /* Nothing looks at the image until the end, so it's only resolved
+       once, after gathering every device's samples */
+    ret = renderer_finish(renderer);
+    if (ret)
+        return 1;
+
+    ret = renderer_enqueue_resolve(renderer, config, output, NULL);
+    if (ret)
+        return 1;
+
+    clFinish(renderer->command_queue);
+
+    return 0;
+}
+
+/**
+ * Render config->sampleRoot^2 samples per pixel without a window or
+ * OpenGL context, report throughput and write the result to
+ * config->outputFile.
+ */
+int run_headless(struct configuration *config, struct state *programState)
+{
+    struct renderer renderer;
+    struct scene scene;
+    cl_int ret;
+
+    logVersionInfo();
+
+    cl_platform_id platform_id = choosePlatform();
+    logPlatformInfo(platform_id);
+    cl_context context = createHeadlessOpenCLContext(platform_id);
+
+    cl_device_id device_id = chooseOpenCLDevice(platform_id, context);
+    logDeviceInfo(device_id);
+
+    scene_init(&scene);
+    if (config->areaLights)
+        buildAreaLightScene(&scene);
+    else
+        buildDefaultScene(&scene);
+    if (config->meshFile && loadSceneMesh(&scene, config->meshFile)) {
+        log_error("Could not load mesh");
+        return 1;
+    }
+    if (config->envMapFile && loadEnvironmentMap(&scene, config->envMapFile)) {
+        log_error("Could not load environment map");
+        return 1;
+    }
+    buildBVH(&scene);
+    buildLightTree(&scene);
+
+    ret = renderer_init(&renderer, context, device_id, config);
+    if (ret) {
+        log_error("Could not initialize renderer");
+        return 1;
+    }
+
+    cl_mem output = headless_create_image(context, config->width, config->height);
+
+    cl_uint totalSamples = config->sampleRoot * config->sampleRoot;
+    size_t origin[3] = { 0, 0, 0 };
+    size_t region[3] = { config->width, config->height, 1 };
+
+    log_info("Rendering %d samples per pixel at %dx%d, batch size %d",
+            totalSamples, config->width, config->height, config->batchSize);
+
+    struct timeval start, stop, diff;
+    gettimeofday(&start, NULL);
+
+    ret = headless_render(&renderer, config, programState, &scene, output);
+    if (ret)
+        return 1;
+
+    gettimeofday(&stop, NULL);
+
+    timevalDiff(&start, &stop, &diff);
+    float secs = ((float)diff.tv_sec) + ((float) diff.tv_usec / 1000000.0);
+    // With adaptive sampling, converged pixels stopped earlier
+    double pixelSamples = (double) config->width * config->height * programState->sampleNum;
+
+    log_info("Rendered in %.3f sec", secs);
+
+    struct counters counts;
+    if (renderer_counters(&renderer, &counts)) {
+        cl_ulong rays = counters_rays(&counts);
+
+        log_info("  %.3f Msamples/sec, %.3f Mrays/sec, %.2f tests/ray",
+                pixelSamples / secs / 1000000.0, rays / secs / 1000000.0,
+                rays ? (double) counters_tests(&counts) / rays : 0.0);
+        for (int i = 0; i < NUM_COUNTERS; i++)
+            log_info("  %-16s %llu", counter_name(i), (unsigned long long) counts.counts[i]);
+    } else {
+        // Every sample is one primary ray; secondary rays are only
+        // counted with -c
+        log_info("  %.3f Msamples/sec, %.3f Mrays/sec (primary)",
+                pixelSamples / secs / 1000000.0, pixelSamples / secs / 1000000.0);
+    }
+
+    size_t pixelsSize = sizeof(cl_float) * 4 * config->width * config->height;
+    cl_float *pixels = malloc(pixelsSize);
+    if (!pixels) {
+        log_error("Could not allocate %ld bytes for output image", pixelsSize);
+        return 1;
+    }
+
+    ret = clEnqueueReadImage(renderer.command_queue, output, CL_TRUE, origin, region,
+            0, 0, pixels, 0, NULL, NULL);
+    if (ret) {
+        log_error("Could not read output image, ret %d", ret);
+        return 1;
+    }
+
+    ret = writeImagePPM(config->outputFile, pixels, config->width, config->height);
+    if (ret)
+        return 1;
+
+    log_info("Wrote %s", config->outputFile);
+
+    free(pixels);
+    clReleaseMemObject(output);
+    renderer_release(&renderer);
+    scene_release(&scene);
+    clReleaseContext(context);
+
+    return 0;
+}
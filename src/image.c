@@ -0,0 +1,184 @@
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <t2/image.h>
+#include <t2/logging.h>
+
+static inline unsigned char toByte(float v)
+{
+    if (v <= 0.f)
+        return 0;
+    if (v >= 1.f)
+        return 255;
+    return (unsigned char) (v * 255.f + 0.5f);
+}
+
+/**
+ * Write RGBA float pixel data to a binary PPM file. Pixel rows are
+ * expected bottom-up (OpenCL image / OpenGL texture order) and are
+ * flipped so the file reads top-down; alpha is dropped.
+ */
+int writeImagePPM(const char *path, const float *pixels, int width, int height)
+{
+    FILE *fp = fopen(path, "wb");
+    if (!fp) {
+        log_error("Could not open %s for writing", path);
+        return 1;
+    }
+
+    unsigned char *row = malloc(width * 3);
+    if (!row) {
+        log_error("Could not allocate %d bytes for image row", width * 3);
+        fclose(fp);
+        return 1;
+    }
+
+    fprintf(fp, "P6\n%d %d\n255\n", width, height);
+
+    for (int y = height - 1; y >= 0; y--) {
+        const float *src = pixels + (size_t) y * width * 4;
+
+        for (int x = 0; x < width; x++) {
+            row[x * 3]     = toByte(src[x * 4]);
+            row[x * 3 + 1] = toByte(src[x * 4 + 1]);
+            row[x * 3 + 2] = toByte(src[x * 4 + 2]);
+        }
+
+        if (fwrite(row, 3, width, fp) != width) {
+            log_error("Error writing image data to %s", path);
+            free(row);
+            fclose(fp);
+            return 1;
+        }
+    }
+
+    free(row);
+    fclose(fp);
+
+    return 0;
+}
+
+/* Read one scanline of RGBE pixels, flat or run-length encoded in the
+newer per-channel scheme */
+static int readRGBEScanline(FILE *fp, unsigned char *rgbe, int width)
+{
+    int c = fgetc(fp);
+
+    if (c != 2 || width < 8 || width >= 32768) {
+        // Flat: the first pixel's red byte is already read
+        if (c == EOF)
+            return 1;
+        rgbe[0] = c;
+        return fread(rgbe + 1, 1, width * 4 - 1, fp) != width * 4 - 1;
+    }
+
+    unsigned char header[3];
+    if (fread(header, 1, 3, fp) != 3 || header[0] != 2 || (header[1] << 8 | header[2]) != width)
+        return 1;
+
+    // Each channel is stored on its own, as runs and literal spans
+    for (int ch = 0; ch < 4; ch++) {
+        for (int x = 0; x < width; ) {
+            int count = fgetc(fp);
+            if (count == EOF)
+                return 1;
+
+            if (count > 128) {
+                int value = fgetc(fp);
+                count -= 128;
+                if (value == EOF || x + count > width)
+                    return 1;
+                while (count--)
+                    rgbe[4 * x++ + ch] = value;
+            } else {
+                if (count == 0 || x + count > width)
+                    return 1;
+                while (count--) {
+                    int value = fgetc(fp);
+                    if (value == EOF)
+                        return 1;
+                    rgbe[4 * x++ + ch] = value;
+                }
+            }
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Read a Radiance RGBE (.hdr) image as RGBA float pixel data, rows
+ * top-down as they are in the file, with alpha 1. Only the usual
+ * "-Y height +X width" orientation is supported. Returns NULL on
+ * failure; otherwise the caller frees the pixels.
+ */
+float *readImageHDR(const char *path, int *width, int *height)
+{
+    char line[256];
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        log_error("Could not open %s", path);
+        return NULL;
+    }
+
+    if (!fgets(line, sizeof(line), fp) || strncmp(line, "#?", 2) != 0) {
+        log_error("%s is not a Radiance HDR image", path);
+        fclose(fp);
+        return NULL;
+    }
+
+    // Header lines up to a blank line, then the resolution
+    while (fgets(line, sizeof(line), fp) && line[0] != '\n') {
+        if (strncmp(line, "FORMAT=", 7) == 0 && strncmp(line + 7, "32-bit_rle_rgbe", 15) != 0) {
+            log_error("%s: unsupported pixel format %s", path, line + 7);
+            fclose(fp);
+            return NULL;
+        }
+    }
+
+    if (!fgets(line, sizeof(line), fp) || sscanf(line, "-Y %d +X %d", height, width) != 2 ||
+            *width <= 0 || *height <= 0) {
+        log_error("%s: unsupported image orientation or size", path);
+        fclose(fp);
+        return NULL;
+    }
+
+    float *pixels = malloc(sizeof(float) * 4 * (size_t) *width * *height);
+    unsigned char *rgbe = malloc(4 * *width);
+    if (!pixels || !rgbe) {
+        log_error("Could not allocate memory for %dx%d image", *width, *height);
+        free(pixels);
+        free(rgbe);
+        fclose(fp);
+        return NULL;
+    }
+
+    for (int y = 0; y < *height; y++) {
+        if (readRGBEScanline(fp, rgbe, *width)) {
+            log_error("Error reading image data from %s", path);
+            free(pixels);
+            free(rgbe);
+            fclose(fp);
+            return NULL;
+        }
+
+        float *dst = pixels + (size_t) y * *width * 4;
+        for (int x = 0; x < *width; x++) {
+            unsigned char *p = rgbe + 4 * x;
+            float scale = p[3] ? ldexpf(1.f, p[3] - (128 + 8)) : 0.f;
+
+            dst[4 * x]     = p[0] * scale;
+            dst[4 * x + 1] = p[1] * scale;
+            dst[4 * x + 2] = p[2] * scale;
+            dst[4 * x + 3] = 1.f;
+        }
+    }
+
+    free(rgbe);
+    fclose(fp);
+
+    return pixels;
+}
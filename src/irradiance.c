@@ -0,0 +1,183 @@
+#include <stddef.h>
+
+#include <t2/irradiance.h>
+#include <t2/logging.h>
+#include <t2/renderer.h>
+
+/* An empty bucket, or the end of one; this should match
+cl/t2/irradiance.cl */
+#define IRRADIANCE_NONE 0xffffffffu
+
+static cl_mem createBuffer(cl_context context, size_t size, const char *what)
+{
+    cl_int ret;
+    cl_mem buf = clCreateBuffer(context, CL_MEM_READ_WRITE, size, NULL, &ret);
+    if (ret) {
+        log_error("Could not create %s buffer of %ld bytes, ret %d", what, size, ret);
+        return NULL;
+    }
+
+    return buf;
+}
+
+static void releaseBuffer(cl_mem *buf)
+{
+    if (*buf) {
+        clReleaseMemObject(*buf);
+        *buf = NULL;
+    }
+}
+
+int irradiance_init(struct irradiance *c, struct renderer *r, struct configuration *config)
+{
+    cl_int ret;
+
+    c->enabled = config->irradianceError > 0 && config->integrator == INTEGRATOR_WHITTED &&
+        !config->wavefront && !config->multiDevice;
+    c->link = NULL;
+    c->cacheBuf = c->recordBuf = c->cellBuf = c->claimBuf = NULL;
+    c->maxError = config->irradianceError;
+
+    // Only raytrace() (the Whitted integrator) looks anything up
+    if (config->irradianceError > 0 && config->integrator != INTEGRATOR_WHITTED)
+        log_info("Irradiance caching is only used by the Whitted integrator, ignoring");
+    else if (config->irradianceError > 0 && config->wavefront)
+        log_info("Irradiance caching is not supported by the wavefront renderer, ignoring");
+    else if (config->irradianceError > 0 && config->multiDevice)
+        log_info("Irradiance caching is not supported with multiple devices, ignoring");
+
+    if (!c->enabled)
+        return 0;
+
+    log_info("Irradiance caching: error %.3f, room for %u records in %u buckets",
+            c->maxError, IRRADIANCE_CAPACITY, IRRADIANCE_NUM_CELLS);
+
+    c->link = clCreateKernel(r->program, "irradiance_link", &ret);
+    if (ret) {
+        log_error("Could not create kernel irradiance_link, ret %d", ret);
+        c->link = NULL;
+        return 1;
+    }
+
+    c->cacheBuf = createBuffer(r->context, sizeof(struct IrradianceCache),
+            "irradiance cache");
+    c->recordBuf = createBuffer(r->context,
+            sizeof(struct IrradianceRecord) * IRRADIANCE_CAPACITY, "irradiance record");
+    c->cellBuf = createBuffer(r->context, sizeof(cl_uint) * IRRADIANCE_NUM_CELLS,
+            "irradiance bucket");
+    c->claimBuf = createBuffer(r->context, sizeof(cl_uint) * IRRADIANCE_NUM_CELLS,
+            "irradiance claim");
+    if (!c->cacheBuf || !c->recordBuf || !c->cellBuf || !c->claimBuf)
+        return 1;
+
+    return irradiance_set_args(c, c->link, 0);
+}
+
+/**
+ * Point a kernel's four irradiance cache arguments, starting at
+ * firstArg, at the cache, or at none when irradiance caching is off.
+ */
+int irradiance_set_args(struct irradiance *c, cl_kernel kernel, cl_uint firstArg)
+{
+    cl_int ret;
+
+    ret  = clSetKernelArg(kernel, firstArg, sizeof(cl_mem),
+            c->enabled ? &c->cacheBuf : NULL);
+    ret |= clSetKernelArg(kernel, firstArg + 1, sizeof(cl_mem),
+            c->enabled ? &c->recordBuf : NULL);
+    ret |= clSetKernelArg(kernel, firstArg + 2, sizeof(cl_mem),
+            c->enabled ? &c->cellBuf : NULL);
+    ret |= clSetKernelArg(kernel, firstArg + 3, sizeof(cl_mem),
+            c->enabled ? &c->claimBuf : NULL);
+    if (ret)
+        log_error("Could not set irradiance cache kernel arguments, ret %d", ret);
+
+    return ret;
+}
+
+/**
+ * Empty the cache, for a scene that has changed: the records it holds
+ * were lit by the old one.
+ */
+int irradiance_clear(struct irradiance *c, struct renderer *r)
+{
+    static const cl_uint none = IRRADIANCE_NONE;
+    static const cl_uint zero = 0;
+    struct IrradianceCache cache = {
+        .count = 0,
+        .linked = 0,
+        .capacity = IRRADIANCE_CAPACITY,
+        .numCells = IRRADIANCE_NUM_CELLS,
+        .maxError = c->maxError,
+        .minSpacing = IRRADIANCE_MIN_SPACING,
+        .maxSpacing = IRRADIANCE_MAX_SPACING
+    };
+    cl_int ret;
+
+    if (!c->enabled)
+        return 0;
+
+    ret  = clEnqueueWriteBuffer(r->command_queue, c->cacheBuf, 1, 0, sizeof(cache), &cache,
+            0, NULL, NULL);
+    ret |= clEnqueueFillBuffer(r->command_queue, c->cellBuf, &none, sizeof(none), 0,
+            sizeof(cl_uint) * IRRADIANCE_NUM_CELLS, 0, NULL, NULL);
+    ret |= clEnqueueFillBuffer(r->command_queue, c->claimBuf, &zero, sizeof(zero), 0,
+            sizeof(cl_uint) * IRRADIANCE_NUM_CELLS, 0, NULL, NULL);
+    if (ret) {
+        log_error("Could not clear irradiance cache, ret %d", ret);
+        return ret;
+    }
+
+    return 0;
+}
+
+/**
+ * Enqueue adding the records the last raytracer launch stored to the
+ * hash grid, where the next launch will find them. Until then a launch
+ * only reads records from earlier ones, which nothing writes to.
+ */
+int irradiance_link(struct irradiance *c, struct renderer *r)
+{
+    size_t size = IRRADIANCE_CAPACITY;
+    cl_event event;
+    cl_int ret;
+
+    if (!c->enabled)
+        return 0;
+
+    ret = clEnqueueNDRangeKernel(r->command_queue, c->link, 1, NULL, &size, NULL,
+            0, NULL, r->profiler ? &event : NULL);
+    if (ret) {
+        log_error("Could not enqueue irradiance cache link, ret %d", ret);
+        return ret;
+    }
+
+    if (r->profiler) {
+        profiler_add_event(r->profiler, STAGE_TRACE, event);
+        clReleaseEvent(event);
+    }
+
+    // Everything stored so far is linked now
+    ret = clEnqueueCopyBuffer(r->command_queue, c->cacheBuf, c->cacheBuf,
+            offsetof(struct IrradianceCache, count), offsetof(struct IrradianceCache, linked),
+            sizeof(cl_uint), 0, NULL, NULL);
+    if (ret) {
+        log_error("Could not update irradiance cache, ret %d", ret);
+        return ret;
+    }
+
+    return 0;
+}
+
+void irradiance_release(struct irradiance *c)
+{
+    releaseBuffer(&c->cacheBuf);
+    releaseBuffer(&c->recordBuf);
+    releaseBuffer(&c->cellBuf);
+    releaseBuffer(&c->claimBuf);
+
+    if (c->link) {
+        clReleaseKernel(c->link);
+        c->link = NULL;
+    }
+}
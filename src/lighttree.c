@@ -0,0 +1,169 @@
+
+#include <math.h>
+#include <stdlib.h>
+#include <float.h>
+#include <sys/time.h>
+
+#include <t2/lighttree.h>
+#include <t2/logging.h>
+#include <t2/mathutil.h>
+#include <t2/util.h>
+
+/*
+ * A binary tree over the scene's lights, for picking lights in
+ * proportion to how much they're likely to contribute (see
+ * cl/t2/lights.cl). Each node has the bounds of its lights and their
+ * total power. Lights are split at the median of their centres along
+ * the longest axis of the bounds, so nearby lights share subtrees and
+ * the tree stays balanced.
+ */
+
+struct light_build {
+    struct scene *s;
+    struct LightNode *nodes;
+    cl_uint numNodes;
+    cl_uint *indices;
+};
+
+/* How bright a light is, as its strength times its mean colour */
+static float lightPower(const struct Light *l)
+{
+    return l->strength * (l->color.s[0] + l->color.s[1] + l->color.s[2]) / 3.f;
+}
+
+/* How far a light reaches from its centre along axis */
+static float lightExtent(const struct Light *l, int axis)
+{
+    switch (l->type) {
+        case LIGHT_SPHERE:
+            return l->radius;
+        case LIGHT_RECT:
+            return 0.5f * (fabsf(l->edgeU.s[axis]) + fabsf(l->edgeV.s[axis]));
+        default:
+            return 0;
+    }
+}
+
+/**
+ * Reorder indices[first, first + count) so the element at the middle
+ * has the median position along axis, with smaller ones before it.
+ */
+static void medianSplit(struct light_build *b, cl_uint first, cl_uint count, int axis)
+{
+    cl_uint *idx = b->indices;
+    struct Light *lights = b->s->lights;
+    long lo = first, hi = first + count - 1;
+    long k = first + count / 2;
+
+    /* Quickselect */
+    while (lo < hi) {
+        float pivot = lights[idx[(lo + hi) / 2]].center.s[axis];
+        long i = lo, j = hi;
+
+        while (i <= j) {
+            while (lights[idx[i]].center.s[axis] < pivot) i++;
+            while (lights[idx[j]].center.s[axis] > pivot) j--;
+            if (i <= j) {
+                cl_uint t = idx[i]; idx[i] = idx[j]; idx[j] = t;
+                i++;
+                j--;
+            }
+        }
+
+        if (k <= j)
+            hi = j;
+        else if (k >= i)
+            lo = i;
+        else
+            break;
+    }
+}
+
+static cl_uint buildNode(struct light_build *b, cl_uint first, cl_uint count)
+{
+    cl_uint nodeIndex = b->numNodes++;
+    struct LightNode *node = &b->nodes[nodeIndex];
+
+    node->power = 0;
+    for (int a = 0; a < 3; a++) {
+        node->min[a] = FLT_MAX;
+        node->max[a] = -FLT_MAX;
+    }
+
+    for (cl_uint i = first; i < first + count; i++) {
+        struct Light *l = &b->s->lights[b->indices[i]];
+
+        node->power += lightPower(l);
+        for (int a = 0; a < 3; a++) {
+            float extent = lightExtent(l, a);
+            node->min[a] = MINF(node->min[a], l->center.s[a] - extent);
+            node->max[a] = MAXF(node->max[a], l->center.s[a] + extent);
+        }
+    }
+
+    if (count == 1) {
+        node->offset = b->indices[first];
+        node->count = 1;
+        return nodeIndex;
+    }
+
+    int axis = 0;
+    for (int a = 1; a < 3; a++) {
+        if (node->max[a] - node->min[a] > node->max[axis] - node->min[axis])
+            axis = a;
+    }
+
+    medianSplit(b, first, count, axis);
+
+    cl_uint split = count / 2;
+
+    node->count = 0;
+    buildNode(b, first, split);
+    node->offset = buildNode(b, first + split, count - split);
+
+    return nodeIndex;
+}
+
+/**
+ * (Re)build the scene's light tree. Call this whenever lights are
+ * added or change.
+ */
+void buildLightTree(struct scene *s)
+{
+    cl_uint numLights = s->header.numLights;
+    struct light_build b;
+    struct timeval start, stop, diff;
+
+    gettimeofday(&start, NULL);
+
+    free(s->lightNodes);
+
+    /* A binary tree over n leaves never has more than 2n - 1 nodes */
+    s->lightNodes = malloc(sizeof(struct LightNode) * MAXF(2 * numLights, 1));
+    b.indices = malloc(sizeof(cl_uint) * MAXF(numLights, 1));
+    if (!s->lightNodes || !b.indices) {
+        log_error("Could not allocate memory for light tree over %d lights", numLights);
+        exit(1);
+    }
+
+    for (cl_uint i = 0; i < numLights; i++)
+        b.indices[i] = i;
+
+    b.s = s;
+    b.nodes = s->lightNodes;
+    b.numNodes = 0;
+
+    if (numLights > 0)
+        buildNode(&b, 0, numLights);
+
+    s->header.numLightNodes = b.numNodes;
+
+    free(b.indices);
+
+    gettimeofday(&stop, NULL);
+    timevalDiff(&start, &stop, &diff);
+
+    log_info("Built light tree with %d nodes over %d lights in %.3f sec",
+            b.numNodes, numLights,
+            ((float) diff.tv_sec) + ((float) diff.tv_usec / 1000000.0));
+}
@@ -1,21 +1,29 @@
 
 #include <GL/glew.h>
-#include <OpenGL/gl.h>
+#include <t2/opengl_setup.h>
 #include <GLFW/glfw3.h>
 
 #include <math.h>
+#include <stdlib.h>
 #include <sys/time.h>
 
 #include <t2/args.h>
+#include <t2/bvh.h>
+#include <t2/lighttree.h>
+#include <t2/envmap.h>
 #include <t2/config.h>
 #include <t2/device.h>
+#include <t2/headless.h>
 #include <t2/info.h>
 #include <t2/logging.h>
 #include <t2/mathutil.h>
 #include <t2/opencl_setup.h>
 #include <t2/overlay.h>
 #include <t2/platform.h>
+#include <t2/profiler.h>
+#include <t2/renderer.h>
 #include <t2/samplers.h>
+#include <t2/scene.h>
 #include <t2/shader_setup.h>
 #include <t2/state.h>
 #include <t2/texture.h>
@@ -40,44 +48,44 @@ struct configuration config = {
     .logLevel = LOG_INFO,
     .batchSize = 1,
     .paused = 0,
-    .fullScreen = 0
+    .fullScreen = 0,
+    .headless = 0,
+    .adaptiveThreshold = 0,
+    .adaptiveMinSamples = 8,
+    .tileSize = 32,
+    .sampler = SAMPLER_SOBOL,
+    .lightSamples = 4,
+    .integrator = INTEGRATOR_WHITTED,
+    .outputFile = "t2.ppm",
+    .meshFile = NULL,
+    .envMapFile = NULL,
+    .areaLights = 0,
+    .wavefront = 0,
+    .tileOrder = TILE_ORDER_CENTRE,
+    .tileBudget = 25.f,
+    .multiDevice = 0,
+    .sampleSetType = SAMPLE_SET_JITTERED,
+    .sampleSeed = 0,
+    .specialise = 1,
+    .countRays = 0,
+    .photonsPerPass = 0,
+    .photonMemory = 64,
+    .photonRadius = 0.25f,
+    .irradianceError = 0,
+    .shadowCache = 0
 };
 
-struct sample_data {
-    cl_float *squareSamples;
-    cl_mem squareSampleBuf;
+/* The renderer owns the OpenCL queue, kernel and buffers. This is
+global because the GLFW handlers need to be able to mark buffers dirty
+and trigger sample allocations. */
+struct renderer renderer;
 
-    cl_float *diskSamples;
-    cl_mem diskSampleBuf;
-
-    size_t numSampleSets;
-};
-
-/* OpenCL buffers for configuration and state */
-cl_mem configBuf = NULL;
-cl_mem stateBuf = NULL;
-
-/* Dirty flags */
-int dirty_config = 1;
-int dirty_state = 1;
-
-/* OpenCL command queue. This is global because updateConfigBuffer
-needs to be able to selectively issue an OpenCL buffer update when the
-configuration changes. */
-cl_command_queue command_queue = NULL;
-
-/* Where sample buffer pointers are kept. These are global so that GLFW
-handlers can trigger sample allocations and update this structure. */
-struct sample_data samples = { NULL, NULL, NULL, NULL, 0 };
+/* Host-side scene description, uploaded to the device when it changes */
+struct scene scene;
 
 /* For logging.h to get access to the global log level */
 int *global_log_level = &config.logLevel;
 
-/* The OpenCL context. This is global so that we can access it in the
-GLFW handlers since they don't support passing in a void * user pointer.
-*/
-cl_context context = NULL;
-
 /* Store the old configured batch size here while a key or mouse button
 is held down */
 cl_uint oldBatchSize = -1;
@@ -102,117 +110,28 @@ uint8_t button_mask = 0;
 static inline void restartRendering()
 {
     programState.sampleNum = 0;
-}
-
-static inline void updateConfigBuffer()
-{
-    if (dirty_config) {
-        log_debug("Configuration changed, updating");
-        dirty_config = 0;
-        int ret = clEnqueueWriteBuffer(command_queue, configBuf, 1, 0, sizeof(struct configuration),
-                &config, 0, NULL, NULL);
-        if (ret) {
-            log_error("Error updating configuration buffer, ret %d", ret);
-            exit(1);
-        }
-    }
+    renderer.dirty_state = 1;
+    renderer_restart(&renderer);
 }
 
 static inline void markConfigDirty()
 {
-    dirty_config = 1;
-}
-
-static inline void updateStateBuffer()
-{
-    if (dirty_state) {
-        dirty_state = 0;
-        int ret = clEnqueueWriteBuffer(command_queue, stateBuf, 1, 0, sizeof(struct state),
-                &programState, 0, NULL, NULL);
-        if (ret) {
-            log_error("Error updating configuration buffer, ret %d", ret);
-            exit(1);
-        }
-    }
+    renderer.dirty_config = 1;
 }
 
 static inline void markStateDirty()
 {
-    dirty_state = 1;
+    renderer.dirty_state = 1;
 }
 
-int setup_samples(struct sample_data *s, int sampleRoot, struct configuration *cfg, cl_context context)
+/* Replace the sample sets after a sample root change */
+static void regenerateSamples()
 {
-    int ret;
-
-    s->numSampleSets = cfg->width * 23.5;
-    size_t samplesSize = sizeof(cl_float) * sampleRoot * sampleRoot * 2 *
-        s->numSampleSets;
-
-    if (s->squareSamples) {
-        log_info("Freeing old square samples");
-        free(s->squareSamples);
-        clReleaseMemObject(s->squareSampleBuf);
-    }
-
-    if (s->diskSamples) {
-        log_info("Freeing old disk samples");
-        free(s->diskSamples);
-        clReleaseMemObject(s->diskSampleBuf);
-    }
-
-    log_info("Generating %d samples per pixel", sampleRoot * sampleRoot);
-    log_info("  Types: square, disk");
-    log_info("  %ld sample sets per type", s->numSampleSets);
-    log_info("  %ld bytes memory allocated per type", samplesSize);
-
-    log_info("Generating square samples...");
-    /* Allocate and populate square sample sets */
-    s->squareSamples = malloc(samplesSize);
-    if (!s->squareSamples) {
-        log_error("Could not allocate %ld bytes of memory for square samples", samplesSize);
-        return 1;
-    }
-
-    for (int i = 0; i < s->numSampleSets; i++) {
-        // Offset in number of floats for this set
-        size_t offset = i * (2 * sampleRoot * sampleRoot);
-        generateJitteredSampleSet(s->squareSamples + offset, sampleRoot, NULL);
-    }
-    log_info("Done generating square samples.");
-
-    /* Set up OpenCL buffer reference to square sample memory */
-    s->squareSampleBuf = clCreateBuffer(context, CL_MEM_USE_HOST_PTR|CL_MEM_READ_ONLY,
-            samplesSize, s->squareSamples, &ret);
-    if (ret) {
-        log_error("Could not create square sample buffer, ret %d", ret);
-        return 1;
-    }
-
-    log_info("Generating disk samples...");
-    /* Allocate and populate disk sample sets */
-    s->diskSamples = malloc(samplesSize);
-    if (!s->diskSamples) {
-        log_error("Could not allocate %ld bytes of memory for disk samples", samplesSize);
-        return 1;
-    }
-
-    for (int i = 0; i < s->numSampleSets; i++) {
-        // Offset in number of floats for this set
-        size_t offset = i * (2 * sampleRoot * sampleRoot);
-        generateJitteredSampleSet(s->diskSamples + offset, sampleRoot, mapToUnitDisk);
-    }
-    log_info("Done generating disk samples.");
-
-    /* Set up OpenCL buffer reference to disk sample memory */
-    s->diskSampleBuf = clCreateBuffer(context, CL_MEM_USE_HOST_PTR|CL_MEM_READ_ONLY,
-            samplesSize, s->diskSamples, &ret);
+    int ret = renderer_setup_samples(&renderer, &config);
     if (ret) {
-        log_error("Could not create square sample buffer, ret %d", ret);
-        return 1;
+        log_error("Could not set up samples");
+        exit(1);
     }
-
-    return 0;
 }
 
 static inline void rotateHeading(cl_float angle)
@@ -259,6 +178,14 @@ void cursor_position_callback(GLFWwindow* window, double x, double y)
     }
 }
 
+static int eventComplete(cl_event event)
+{
+    cl_int status;
+
+    return !clGetEventInfo(event, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(status),
+            &status, NULL) && status == CL_COMPLETE;
+}
+
 static void key_callback(GLFWwindow* window, int key, int scancode,
         int action, int mods)
 {
@@ -305,22 +232,14 @@ static void key_callback(GLFWwindow* window, int key, int scancode,
 
     if (DECREASE_SAMPLE_ROOT && config.sampleRoot > 1) {
         config.sampleRoot--;
-        int ret = setup_samples(&samples, config.sampleRoot, &config, context);
-        if (ret) {
-            log_error("Could not set up samples");
-            exit(1);
-        }
+        regenerateSamples();
         restartRendering();
         markConfigDirty();
     }
 
     if (INCREASE_SAMPLE_ROOT && config.sampleRoot < MAX_SAMPLE_ROOT) {
         config.sampleRoot++;
-        int ret = setup_samples(&samples, config.sampleRoot, &config, context);
-        if (ret) {
-            log_error("Could not set up samples");
-            exit(1);
-        }
+        regenerateSamples();
         restartRendering();
         markConfigDirty();
     }
@@ -394,13 +313,15 @@ static void key_callback(GLFWwindow* window, int key, int scancode,
 int main(int argc, char **argv)
 {
     cl_platform_id platform_id = NULL;
-    cl_program program = NULL;
-    cl_kernel kernel = NULL;
+    cl_context context = NULL;
     cl_int ret = -1;
     glResources res;
 
     processArgs(argc, argv, &config);
 
+    if (config.headless)
+        return run_headless(&config, &programState);
+
     /* Initialize the library */
     if (!glfwInit())
         return -1;
@@ -458,32 +379,31 @@ int main(int argc, char **argv)
     /* Choose an OpenCL platform and create a context */
     platform_id = choosePlatform();
     logPlatformInfo(platform_id);
-    context = createOpenCLContext();
+    context = createOpenCLContext(platform_id);
 
     /* Choose an OpenCL device */
     cl_device_id device_id = chooseOpenCLDevice(platform_id, context);
     logDeviceInfo(device_id);
 
-    log_info("Loading and building OpenCL kernel");
-
-    /* Create a command queue for the device */
-    command_queue = clCreateCommandQueue(context, device_id, 0, &ret);
-    if (ret) {
-        log_error("Could not create command queue, ret %d", ret);
+    scene_init(&scene);
+    if (config.areaLights)
+        buildAreaLightScene(&scene);
+    else
+        buildDefaultScene(&scene);
+    if (config.meshFile && loadSceneMesh(&scene, config.meshFile)) {
+        log_error("Could not load mesh");
         exit(1);
     }
-
-    /* Create kernel program from the source */
-    program = readAndBuildProgram(context, device_id, "cl/t2.cl", &ret);
-    if (!program) {
-        log_error("readAndBuildProgram failed, ret %d", ret);
+    if (config.envMapFile && loadEnvironmentMap(&scene, config.envMapFile)) {
+        log_error("Could not load environment map");
         exit(1);
     }
+    buildBVH(&scene);
+    buildLightTree(&scene);
 
-    /* Create OpenCL Kernel */
-    kernel = clCreateKernel(program, "raytracer", &ret);
+    ret = renderer_init(&renderer, context, device_id, &config);
     if (ret) {
-        log_error("Could not create kernel!\n");
+        log_error("Could not initialize renderer");
         exit(1);
     }
 
@@ -492,44 +412,18 @@ int main(int argc, char **argv)
     /* Set up GLSL shaders */
     ret = shader_setup(&res);
 
-    /* Create rendering texture buffers */
-    res.readTexture = make_texture(config.width, config.height);
-    cl_mem texmemRead = clCreateFromGLTexture(context, CL_MEM_READ_WRITE, GL_TEXTURE_2D,
-            0, res.readTexture, &ret);
-    if (ret) {
-        log_error("Could not create shared OpenCL/OpenGL texture 1, ret %d", ret);
-        exit(1);
-    }
-
-    res.writeTexture = make_texture(config.width, config.height);
-    cl_mem texmemWrite = clCreateFromGLTexture(context, CL_MEM_READ_WRITE, GL_TEXTURE_2D,
-            0, res.writeTexture, &ret);
-    if (ret) {
-        log_error("Could not create shared OpenCL/OpenGL texture 2, ret %d", ret);
-        exit(1);
-    }
-
-    // Perform initial sample allocation/generation
-    ret = setup_samples(&samples, config.sampleRoot, &config, context);
-    if (ret) {
-        log_error("Could not set up samples");
-        exit(1);
-    }
-
-    /* Set up OpenCL buffer reference to configuration */
-    configBuf = clCreateBuffer(context, CL_MEM_READ_ONLY,
-            sizeof(struct configuration), NULL, &ret);
-    if (ret) {
-        log_error("Could not create configuration buffer, ret %d", ret);
-        exit(1);
-    }
-
-    /* Set up OpenCL buffer for program state */
-    stateBuf = clCreateBuffer(context, CL_MEM_READ_ONLY,
-            sizeof(struct state), NULL, &ret);
-    if (ret) {
-        log_error("Could not create configuration buffer, ret %d", ret);
-        exit(1);
+    /* Create the textures the image is resolved into for display. They
+       are double-buffered: OpenCL resolves into one while OpenGL draws
+       the other. */
+    cl_mem texmemOutput[2];
+    for (int i = 0; i < 2; i++) {
+        res.outputTextures[i] = make_texture(config.width, config.height);
+        texmemOutput[i] = clCreateFromGLTexture(context, CL_MEM_WRITE_ONLY, GL_TEXTURE_2D,
+                0, res.outputTextures[i], &ret);
+        if (ret) {
+            log_error("Could not create shared OpenCL/OpenGL texture %d, ret %d", i + 1, ret);
+            exit(1);
+        }
     }
 
     ret = initialize_overlay(&config);
@@ -538,24 +432,33 @@ int main(int argc, char **argv)
         exit(1);
     }
 
+    /* Per-stage timings for the overlay */
+    struct profiler profiler;
+    profiler_init(&profiler);
+    renderer.profiler = &profiler;
+
     log_info("Ready.");
 
     struct timeval start;
-    size_t global_work_size[2] = { config.width, config.height };
+    double stageStart;
     cl_uint batchSize = 0;
+    cl_uint samplesDone = 0;
+    cl_command_queue command_queue = renderer.command_queue;
 
-    ret  = clSetKernelArg(kernel, 0, sizeof(cl_mem), &configBuf);
-    ret |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &stateBuf);
-    ret |= clSetKernelArg(kernel, 2, sizeof(cl_mem), &texmemRead);
-    ret |= clSetKernelArg(kernel, 3, sizeof(cl_mem), &texmemWrite);
+    /* The texture being drawn; the other one is resolved into */
+    int displayed = 0;
 
-    if (ret) {
-        log_error("Could not set kernel argument, ret %d", ret);
-        exit(1);
-    }
+    /* The resolve into the other texture, while it's in flight */
+    cl_event resolveEvent = NULL;
+    cl_uint resolveSamples = 0;
+
+    /* renderer.updates as of the last resolve */
+    cl_ulong resolvedUpdates = 0;
 
     while (!glfwWindowShouldClose(window))
     {
+        cl_uint totalSamples = config.sampleRoot * config.sampleRoot;
+
         if (ANY_PRESSED && (oldBatchSize == -1)) {
             log_debug("Lowering batch size to 1");
             oldBatchSize = config.batchSize;
@@ -566,73 +469,89 @@ int main(int argc, char **argv)
             oldBatchSize = -1;
         }
 
-        if (programState.sampleNum < (config.sampleRoot * config.sampleRoot)) {
+        if (config.tileOrder == TILE_ORDER_CURSOR) {
+            double x, y;
+            int windowWidth, windowHeight;
+
+            // Image rows go bottom to top
+            glfwGetCursorPos(window, &x, &y);
+            glfwGetWindowSize(window, &windowWidth, &windowHeight);
+            tiles_set_focus(&renderer.tiles, x * config.width / MAXF(windowWidth, 1),
+                    config.height - y * config.height / MAXF(windowHeight, 1));
+        }
+
+        /* Keep the device busy: queue batches while there are samples
+           left and the renderer has room for them, without waiting for
+           any to finish. They only touch OpenCL buffers, so no OpenGL
+           objects need to be acquired. With adaptive sampling the frame
+           is done once every pixel has converged. */
+        if (programState.sampleNum > 0 && programState.sampleNum < totalSamples &&
+                renderer_frame_converged(&renderer)) {
+            log_debug("All pixels converged after %d samples", programState.sampleNum);
+            programState.sampleNum = totalSamples;
+            markStateDirty();
+        }
+
+        stageStart = profiler_now();
+        while (programState.sampleNum < totalSamples && renderer_batch_slot_free(&renderer)) {
             programState.last_frame_time = -1;
 
-            if (programState.sampleNum == 0)
+            if (renderer.restart)
                 gettimeofday(&start, NULL);
 
-            /* Before we begin collecting a new sample, copy the old
-               write buffer to the read buffer. This is critical because
-               the kernel reads the image data and averages new sample
-               data with it before writing back out, so we need to read
-               this time what we wrote last time. Since OpenCL doesn't
-               support read-write images, we have to have two: one to
-               read, one to write, and some code to copy between them at
-               the right time (now). */
-            copyTexture(res.fbo, res.writeTexture, res.readTexture,
-                    config.width, config.height);
-
             /* Determine the number of samples in this batch */
-            batchSize = MINF(config.batchSize,
-                    config.sampleRoot * config.sampleRoot - programState.sampleNum);
+            batchSize = MINF(config.batchSize, totalSamples - programState.sampleNum);
 
-            /* Set OpenCL Kernel Parameters */
-            ret = 0;
-            ret |= clSetKernelArg(kernel, 4, sizeof(cl_mem), &samples.squareSampleBuf);
-            ret |= clSetKernelArg(kernel, 5, sizeof(cl_mem), &samples.diskSampleBuf);
-            ret |= clSetKernelArg(kernel, 6, sizeof(cl_int), &samples.numSampleSets);
-            ret |= clSetKernelArg(kernel, 7, sizeof(batchSize), &batchSize);
-
-            if (ret) {
-                log_error("Could not set kernel argument, ret %d", ret);
+            ret = renderer_enqueue_batch(&renderer, &config, &programState, &scene, batchSize,
+                    &samplesDone);
+            if (ret)
                 exit(1);
-            }
 
-            /* Update dirty structs */
-            updateConfigBuffer();
-            updateStateBuffer();
-
-            /* Acquire OpenGL objects */
-            ret = clEnqueueAcquireGLObjects(command_queue, 1, &texmemRead, 0, NULL, NULL);
-            ret |= clEnqueueAcquireGLObjects(command_queue, 1, &texmemWrite, 0, NULL, NULL);
-            if (ret) {
-                log_error("Could not issue OpenCL commands, ret %d", ret);
-                exit(1);
+            /* Launches cover the image a few tiles at a time; the sample
+               number moves on once all of them have had the batch */
+            if (samplesDone) {
+                programState.sampleNum += samplesDone;
+                markStateDirty();
             }
+        }
 
-            /* Execute OpenCL Kernel */
-            ret = clEnqueueNDRangeKernel(command_queue, kernel, 2, NULL, global_work_size,
-                    NULL, 0, NULL, NULL);
+        /* Pick up whatever other devices have finished */
+        if (renderer_poll(&renderer))
+            exit(1);
+        profiler_add_host(&profiler, STAGE_ENQUEUE, stageStart);
+
+        /* Average the samples queued so far into the texture that isn't
+           on screen. This is the only OpenCL work touching OpenGL
+           objects, so it's the only acquire/release. */
+        if (!resolveEvent && (resolvedUpdates != renderer.updates ||
+                    resolveSamples != programState.sampleNum)) {
+            cl_mem *target = &texmemOutput[!displayed];
+            cl_event acquireEvent = NULL;
+
+            ret  = clEnqueueAcquireGLObjects(command_queue, 1, target, 0, NULL, &acquireEvent);
+            ret |= renderer_enqueue_resolve(&renderer, &config, *target, NULL);
+            ret |= clEnqueueReleaseGLObjects(command_queue, 1, target, 0, NULL, &resolveEvent);
             if (ret) {
-                log_error("Could not enqueue task");
+                log_error("Could not issue OpenCL commands, ret %d", ret);
                 exit(1);
             }
 
-            // Before returning the objects to OpenGL, we sync to make sure OpenCL is done.
-            clFinish(command_queue);
+            profiler_add_event(&profiler, STAGE_INTEROP, acquireEvent);
+            profiler_add_event(&profiler, STAGE_INTEROP, resolveEvent);
+            clReleaseEvent(acquireEvent);
 
-            ret = clEnqueueReleaseGLObjects(command_queue, 1, &texmemRead, 0, NULL, NULL);
-            ret |= clEnqueueReleaseGLObjects(command_queue, 1, &texmemWrite, 0, NULL, NULL);
-            if (ret) {
-                log_error("Could not enqueue GL object releases, ret %d", ret);
-                exit(1);
-            }
+            clFlush(command_queue);
+            resolvedUpdates = renderer.updates;
+            resolveSamples = programState.sampleNum;
+        }
 
-            programState.sampleNum += batchSize;
-            markStateDirty();
+        /* Once OpenCL has let go of the new image, show it */
+        if (resolveEvent && eventComplete(resolveEvent)) {
+            clReleaseEvent(resolveEvent);
+            resolveEvent = NULL;
+            displayed = !displayed;
 
-            if (programState.sampleNum == config.sampleRoot * config.sampleRoot) {
+            if (resolveSamples == totalSamples && programState.sampleNum == totalSamples) {
                 struct timeval stop;
                 gettimeofday(&stop, NULL);
                 struct timeval diff;
@@ -642,12 +561,13 @@ int main(int argc, char **argv)
             }
         }
 
+        stageStart = profiler_now();
         glClear(GL_COLOR_BUFFER_BIT);
 
         glUseProgram(res.shader_program);
 
         glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, res.writeTexture);
+        glBindTexture(GL_TEXTURE_2D, res.outputTextures[displayed]);
         glUniform1i(res.texture_uniform, 0);
 
         glBindBuffer(GL_ARRAY_BUFFER, res.vertex_buffer);
@@ -670,23 +590,35 @@ int main(int argc, char **argv)
                 );
 
         glDisableVertexAttribArray(res.position_attribute);
+        profiler_add_host(&profiler, STAGE_DRAW, stageStart);
 
+        stageStart = profiler_now();
         if (programState.show_overlay)
-            render_overlay(&config, &programState);
+            render_overlay(&config, &programState, &profiler);
+        profiler_add_host(&profiler, STAGE_OVERLAY, stageStart);
 
         /* Swap front and back buffers */
+        stageStart = profiler_now();
         glfwSwapBuffers(window);
+        profiler_add_host(&profiler, STAGE_SWAP, stageStart);
+
+        struct counters counts;
+        if (renderer_counters(&renderer, &counts))
+            profiler_set_counts(&profiler, &counts);
+        profiler_end_frame(&profiler);
 
         /* Poll for and process events */
         glfwPollEvents();
     }
 
     /* Finalization */
-    ret = clFlush(command_queue);
-    ret = clFinish(command_queue);
-    ret = clReleaseKernel(kernel);
-    ret = clReleaseProgram(program);
-    ret = clReleaseCommandQueue(command_queue);
+    renderer_release(&renderer);
+    profiler_release(&profiler);
+    if (resolveEvent)
+        clReleaseEvent(resolveEvent);
+    clReleaseMemObject(texmemOutput[0]);
+    clReleaseMemObject(texmemOutput[1]);
+    scene_release(&scene);
     ret = clReleaseContext(context);
 
     glfwDestroyWindow(window);
@@ -0,0 +1,358 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <t2/multidevice.h>
+#include <t2/device.h>
+#include <t2/info.h>
+#include <t2/logging.h>
+#include <t2/renderer.h>
+
+/* Devices that could help, and the contexts they'd be used in */
+struct candidates {
+    cl_device_id devices[MAX_HELPER_DEVICES];
+    cl_context contexts[MAX_HELPER_DEVICES];
+    int count;
+};
+
+static int isUsed(struct renderer *r, struct candidates *c, cl_device_id device)
+{
+    if (device == r->device_id)
+        return 1;
+
+    for (int i = 0; i < c->count; i++) {
+        if (c->devices[i] == device)
+            return 1;
+    }
+
+    return 0;
+}
+
+/* Add the context's devices that aren't in use yet, returning how many
+were added */
+static int addCandidates(struct renderer *r, struct candidates *c, cl_context context)
+{
+    cl_device_id device_ids[MAX_DEVICES];
+    int added = 0;
+
+    int num_devices = listOpenCLDevices(context, device_ids, MAX_DEVICES);
+    for (int i = 0; i < num_devices && c->count < MAX_HELPER_DEVICES; i++) {
+        if (isUsed(r, c, device_ids[i]))
+            continue;
+
+        c->devices[c->count] = device_ids[i];
+        c->contexts[c->count] = context;
+        c->count++;
+        added++;
+    }
+
+    return added;
+}
+
+static int finished(cl_event event)
+{
+    cl_int status;
+
+    return !clGetEventInfo(event, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(status),
+            &status, NULL) && status == CL_COMPLETE;
+}
+
+/**
+ * Find every other OpenCL device: the rest of the renderer's own
+ * context, then every device on every platform, and set up a helper
+ * renderer on each. Does nothing unless config->multiDevice is set.
+ */
+int multidevice_init(struct renderer *r, struct configuration *config)
+{
+    struct multidevice *m = &r->multi;
+    struct candidates c = { .count = 0 };
+    cl_platform_id platform_ids[MAX_PLATFORMS];
+    size_t numPixels = (size_t) config->width * config->height;
+    cl_int ret;
+
+    m->helpers = NULL;
+    m->readbacks = NULL;
+    m->numHelpers = 0;
+    m->numContexts = 0;
+    m->remoteAccum = NULL;
+    m->remoteAccumBuf = NULL;
+    m->remoteEvent = NULL;
+    m->frame = 0;
+
+    if (!config->multiDevice)
+        return 0;
+
+    if (config->wavefront) {
+        log_info("Multiple devices are not supported by the wavefront renderer, ignoring");
+        return 0;
+    }
+
+    addCandidates(r, &c, r->context);
+
+    int num_platforms = listPlatforms(platform_ids, MAX_PLATFORMS);
+    for (int i = 0; i < num_platforms; i++) {
+        cl_context context = tryCreateHeadlessOpenCLContext(platform_ids[i]);
+        if (!context)
+            continue;
+
+        if (addCandidates(r, &c, context))
+            m->contexts[m->numContexts++] = context;
+        else
+            clReleaseContext(context);
+    }
+
+    if (c.count == 0) {
+        log_info("No other OpenCL devices found, rendering on one device");
+        return 0;
+    }
+
+    m->helpers = calloc(c.count, sizeof(struct renderer));
+    m->readbacks = calloc(c.count, sizeof(struct readback));
+    m->remoteAccum = calloc(numPixels, sizeof(cl_float4));
+    if (!m->helpers || !m->readbacks || !m->remoteAccum) {
+        log_error("Could not allocate memory for %d helper devices", c.count);
+        return 1;
+    }
+
+    // Helpers only ever render tiles they're given
+    struct configuration helperConfig = *config;
+    helperConfig.multiDevice = 0;
+    helperConfig.adaptiveThreshold = 0;
+    helperConfig.photonsPerPass = 0;
+    helperConfig.irradianceError = 0;
+
+    for (int i = 0; i < c.count; i++) {
+        struct readback *rb = &m->readbacks[i];
+
+        log_info("Helper device %d:", i + 1);
+        logDeviceInfo(c.devices[i]);
+
+        ret = renderer_init(&m->helpers[i], c.contexts[i], c.devices[i], &helperConfig);
+        if (ret)
+            return ret;
+        m->numHelpers++;
+
+        rb->sums[0] = malloc(sizeof(cl_float4) * numPixels);
+        rb->sums[1] = malloc(sizeof(cl_float4) * numPixels);
+        if (!rb->sums[0] || !rb->sums[1]) {
+            log_error("Could not allocate memory for helper device sums");
+            return 1;
+        }
+    }
+
+    m->remoteAccumBuf = clCreateBuffer(r->context, CL_MEM_READ_ONLY,
+            sizeof(cl_float4) * numPixels, NULL, &ret);
+    if (ret) {
+        log_error("Could not create helper sum buffer, ret %d", ret);
+        return 1;
+    }
+
+    ret = clEnqueueWriteBuffer(r->command_queue, m->remoteAccumBuf, 1, 0,
+            sizeof(cl_float4) * numPixels, m->remoteAccum, 0, NULL, NULL);
+    if (ret) {
+        log_error("Error clearing helper sum buffer, ret %d", ret);
+        return ret;
+    }
+
+    log_info("Sharing tiles with %d more device%s", m->numHelpers,
+            m->numHelpers == 1 ? "" : "s");
+
+    return 0;
+}
+
+/**
+ * Start a new frame on every device. Sums are cleared rather than
+ * replaced by each pixel's first batch, since only one device renders
+ * any given pixel's batch.
+ */
+int multidevice_restart(struct renderer *r)
+{
+    struct multidevice *m = &r->multi;
+    static const cl_float4 zero;
+    size_t size = sizeof(cl_float4) * r->numPixels;
+    cl_int ret;
+
+    if (!m->numHelpers)
+        return 0;
+
+    m->frame++;
+
+    ret  = clEnqueueFillBuffer(r->command_queue, r->accumBuf, &zero, sizeof(zero), 0, size,
+            0, NULL, NULL);
+    ret |= clEnqueueFillBuffer(r->command_queue, m->remoteAccumBuf, &zero, sizeof(zero), 0,
+            size, 0, NULL, NULL);
+
+    for (int i = 0; i < m->numHelpers; i++) {
+        struct renderer *h = &m->helpers[i];
+
+        ret |= clEnqueueFillBuffer(h->command_queue, h->accumBuf, &zero, sizeof(zero), 0,
+                size, 0, NULL, NULL);
+        m->readbacks[i].current = 0;
+    }
+
+    if (ret) {
+        log_error("Could not clear sums, ret %d", ret);
+        return ret;
+    }
+
+    return 0;
+}
+
+/* Add up the helpers' latest sums from this frame and upload them */
+static int uploadRemoteSums(struct renderer *r)
+{
+    struct multidevice *m = &r->multi;
+    size_t numFloats = 4 * r->numPixels;
+    cl_int ret;
+
+    // The last upload may still be reading the host copy
+    if (m->remoteEvent) {
+        clWaitForEvents(1, &m->remoteEvent);
+        clReleaseEvent(m->remoteEvent);
+        m->remoteEvent = NULL;
+    }
+
+    memset(m->remoteAccum, 0, sizeof(cl_float) * numFloats);
+    for (int i = 0; i < m->numHelpers; i++) {
+        struct readback *rb = &m->readbacks[i];
+        if (!rb->current)
+            continue;
+
+        cl_float *sums = rb->sums[rb->latest];
+        for (size_t j = 0; j < numFloats; j++)
+            m->remoteAccum[j] += sums[j];
+    }
+
+    ret = clEnqueueWriteBuffer(r->command_queue, m->remoteAccumBuf, 0, 0,
+            sizeof(cl_float) * numFloats, m->remoteAccum, 0, NULL, &m->remoteEvent);
+    if (ret) {
+        log_error("Error updating helper sum buffer, ret %d", ret);
+        return ret;
+    }
+
+    r->updates++;
+    clFlush(r->command_queue);
+
+    return 0;
+}
+
+/**
+ * Collect any helper sums that have finished reading back, upload
+ * their total if anything changed, and start reading back helpers that
+ * have rendered more since their last read. Never waits for a helper.
+ */
+int multidevice_poll(struct renderer *r)
+{
+    struct multidevice *m = &r->multi;
+    int changed = 0;
+    cl_int ret;
+
+    for (int i = 0; i < m->numHelpers; i++) {
+        struct readback *rb = &m->readbacks[i];
+
+        if (rb->event && finished(rb->event)) {
+            clReleaseEvent(rb->event);
+            rb->event = NULL;
+
+            if (rb->frame == m->frame) {
+                rb->latest = !rb->latest;
+                rb->current = 1;
+                changed = 1;
+            }
+        }
+    }
+
+    if (changed) {
+        ret = uploadRemoteSums(r);
+        if (ret)
+            return ret;
+    }
+
+    for (int i = 0; i < m->numHelpers; i++) {
+        struct renderer *h = &m->helpers[i];
+        struct readback *rb = &m->readbacks[i];
+
+        if (rb->event || rb->batches == h->numBatches)
+            continue;
+
+        ret = clEnqueueReadBuffer(h->command_queue, h->accumBuf, 0, 0,
+                sizeof(cl_float4) * r->numPixels, rb->sums[!rb->latest], 0, NULL, &rb->event);
+        if (ret) {
+            log_error("Could not read helper device sums, ret %d", ret);
+            return ret;
+        }
+
+        rb->frame = m->frame;
+        rb->batches = h->numBatches;
+        clFlush(h->command_queue);
+    }
+
+    return 0;
+}
+
+/* Wait for every helper and upload the total of all their sums */
+int multidevice_finish(struct renderer *r)
+{
+    struct multidevice *m = &r->multi;
+    cl_int ret;
+
+    if (!m->numHelpers)
+        return 0;
+
+    for (int i = 0; i < m->numHelpers; i++) {
+        struct renderer *h = &m->helpers[i];
+        struct readback *rb = &m->readbacks[i];
+
+        clFinish(h->command_queue);
+        if (rb->event) {
+            clReleaseEvent(rb->event);
+            rb->event = NULL;
+        }
+
+        ret = clEnqueueReadBuffer(h->command_queue, h->accumBuf, 1, 0,
+                sizeof(cl_float4) * r->numPixels, rb->sums[0], 0, NULL, NULL);
+        if (ret) {
+            log_error("Could not read helper device sums, ret %d", ret);
+            return ret;
+        }
+
+        rb->latest = 0;
+        rb->current = 1;
+        rb->frame = m->frame;
+        rb->batches = h->numBatches;
+    }
+
+    return uploadRemoteSums(r);
+}
+
+void multidevice_release(struct renderer *r)
+{
+    struct multidevice *m = &r->multi;
+
+    for (int i = 0; i < m->numHelpers; i++) {
+        struct readback *rb = &m->readbacks[i];
+
+        if (rb->event) {
+            clWaitForEvents(1, &rb->event);
+            clReleaseEvent(rb->event);
+        }
+
+        renderer_release(&m->helpers[i]);
+        free(rb->sums[0]);
+        free(rb->sums[1]);
+    }
+
+    if (m->remoteEvent) {
+        clWaitForEvents(1, &m->remoteEvent);
+        clReleaseEvent(m->remoteEvent);
+    }
+
+    if (m->remoteAccumBuf)
+        clReleaseMemObject(m->remoteAccumBuf);
+
+    for (int i = 0; i < m->numContexts; i++)
+        clReleaseContext(m->contexts[i]);
+
+    free(m->helpers);
+    free(m->readbacks);
+    free(m->remoteAccum);
+}
@@ -0,0 +1,263 @@
+#include <fcntl.h>
+#include <stdint.h>
+#include <math.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <t2/obj.h>
+#include <t2/logging.h>
+#include <t2/util.h>
+
+/* Longest polygon face we triangulate; longer ones are rejected */
+#define OBJ_MAX_FACE_VERTICES 64
+
+static const double powersOfTen[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static inline int isDigit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+static inline const char *skipSpace(const char *p, const char *end)
+{
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+        p++;
+    return p;
+}
+
+static inline const char *skipLine(const char *p, const char *end)
+{
+    while (p < end && *p != '\n')
+        p++;
+    return p < end ? p + 1 : p;
+}
+
+/**
+ * Parse a decimal float ("-1.5", "2e-3", ".25") starting at p. This is
+ * much faster than strtof() and doesn't need a terminated string, at
+ * the cost of the last bit of precision for very long mantissas.
+ * Returns the position after the number, or NULL if there was none.
+ */
+static const char *parseFloat(const char *p, const char *end, float *out)
+{
+    int negative = 0, digits = 0, exponent = 0;
+    uint64_t mantissa = 0;
+
+    if (p < end && (*p == '-' || *p == '+'))
+        negative = *p++ == '-';
+
+    for (; p < end && isDigit(*p); p++, digits++) {
+        if (mantissa < UINT64_MAX / 10 - 10)
+            mantissa = mantissa * 10 + (*p - '0');
+        else
+            exponent++;
+    }
+
+    if (p < end && *p == '.') {
+        for (p++; p < end && isDigit(*p); p++, digits++) {
+            if (mantissa < UINT64_MAX / 10 - 10) {
+                mantissa = mantissa * 10 + (*p - '0');
+                exponent--;
+            }
+        }
+    }
+
+    if (digits == 0)
+        return NULL;
+
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        int expNegative = 0, exp = 0;
+        const char *q = p + 1;
+
+        if (q < end && (*q == '-' || *q == '+'))
+            expNegative = *q++ == '-';
+
+        if (q < end && isDigit(*q)) {
+            for (; q < end && isDigit(*q); q++)
+                exp = exp < 10000 ? exp * 10 + (*q - '0') : exp;
+            exponent += expNegative ? -exp : exp;
+            p = q;
+        }
+    }
+
+    double value = (double) mantissa;
+    if (exponent < 0)
+        value = -exponent <= 22 ? value / powersOfTen[-exponent] : value * pow(10, exponent);
+    else if (exponent > 0)
+        value = exponent <= 22 ? value * powersOfTen[exponent] : value * pow(10, exponent);
+
+    *out = (float) (negative ? -value : value);
+    return p;
+}
+
+static const char *parseInt(const char *p, const char *end, long *out)
+{
+    int negative = 0;
+    long value = 0;
+
+    if (p < end && (*p == '-' || *p == '+'))
+        negative = *p++ == '-';
+
+    if (p >= end || !isDigit(*p))
+        return NULL;
+
+    for (; p < end && isDigit(*p); p++)
+        value = value < 1000000000L ? value * 10 + (*p - '0') : value;
+
+    *out = negative ? -value : value;
+    return p;
+}
+
+/**
+ * Parse one face vertex ("7", "7/2", "7/2/5" or "7//5") and resolve its
+ * position index against the vertices read so far. Texture coordinate
+ * and normal indices are skipped.
+ */
+static const char *parseFaceVertex(const char *p, const char *end, cl_uint firstVertex,
+        cl_uint numVertices, cl_uint *out)
+{
+    long index, ignored;
+
+    p = parseInt(p, end, &index);
+    if (!p)
+        return NULL;
+
+    for (int i = 0; i < 2 && p < end && *p == '/'; i++) {
+        p++;
+        if (p < end && *p != '/' && !(p = parseInt(p, end, &ignored)))
+            return NULL;
+    }
+
+    // OBJ indices are 1-based, negative ones count back from the
+    // last vertex
+    long fileVertices = numVertices - firstVertex;
+    long resolved = index < 0 ? fileVertices + index : index - 1;
+    if (index == 0 || resolved < 0 || resolved >= fileVertices)
+        return NULL;
+
+    *out = firstVertex + (cl_uint) resolved;
+    return p;
+}
+
+static int parseOBJ(const char *path, const char *data, size_t size, struct scene *s,
+        cl_uint material)
+{
+    const char *p = data, *end = data + size;
+    cl_uint firstVertex = s->header.numVertices;
+    cl_uint face[OBJ_MAX_FACE_VERTICES];
+    int line = 1;
+
+    for (; p < end; p = skipLine(p, end), line++) {
+        p = skipSpace(p, end);
+        if (p + 1 >= end || (p[1] != ' ' && p[1] != '\t'))
+            continue;
+
+        if (*p == 'v') {
+            float v[3];
+
+            p = skipSpace(p + 1, end);
+            for (int i = 0; i < 3; i++) {
+                if (!(p = parseFloat(p, end, &v[i])))
+                    goto bad;
+                p = skipSpace(p, end);
+            }
+
+            scene_add_vertex(s, v[0], v[1], v[2]);
+        } else if (*p == 'f') {
+            int n = 0;
+
+            p = skipSpace(p + 1, end);
+            while (p < end && *p != '\n') {
+                if (n == OBJ_MAX_FACE_VERTICES) {
+                    log_error("%s:%d: faces with more than %d vertices are not supported",
+                            path, line, OBJ_MAX_FACE_VERTICES);
+                    return 1;
+                }
+
+                if (!(p = parseFaceVertex(p, end, firstVertex, s->header.numVertices, &face[n++])))
+                    goto bad;
+                p = skipSpace(p, end);
+            }
+
+            if (n < 3)
+                goto bad;
+
+            // Triangulate convex polygons as a fan around the first vertex
+            for (int i = 1; i + 1 < n; i++)
+                scene_add_triangle(s, face[0], face[i], face[i + 1], material);
+        }
+
+        // Anything else (normals, texture coordinates, groups,
+        // materials, comments) is ignored
+        continue;
+
+bad:
+        log_error("%s:%d: malformed line", path, line);
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Add the triangles of the Wavefront OBJ mesh at path to the scene,
+ * using the given material. Only vertex positions and faces are read;
+ * polygons are fan-triangulated. The file is mapped rather than read,
+ * so large meshes stream straight from the page cache into the scene
+ * arrays. Returns nonzero on failure.
+ */
+int loadOBJ(const char *path, struct scene *s, cl_uint material)
+{
+    struct timeval start, stop, diff;
+    struct stat st;
+    int ret = 0;
+
+    gettimeofday(&start, NULL);
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        log_error("Could not open %s", path);
+        return 1;
+    }
+
+    if (fstat(fd, &st)) {
+        log_error("Could not stat %s", path);
+        close(fd);
+        return 1;
+    }
+
+    cl_uint numVertices = s->header.numVertices;
+    cl_uint numTriangles = s->header.numTriangles;
+
+    if (st.st_size > 0) {
+        void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            log_error("Could not map %s", path);
+            close(fd);
+            return 1;
+        }
+
+        madvise(data, st.st_size, MADV_SEQUENTIAL);
+        ret = parseOBJ(path, data, st.st_size, s, material);
+        munmap(data, st.st_size);
+    }
+
+    close(fd);
+
+    if (ret)
+        return ret;
+
+    gettimeofday(&stop, NULL);
+    timevalDiff(&start, &stop, &diff);
+
+    log_info("Loaded %s: %d vertices, %d triangles in %.3f sec", path,
+            s->header.numVertices - numVertices, s->header.numTriangles - numTriangles,
+            ((float) diff.tv_sec) + ((float) diff.tv_usec / 1000000.0));
+
+    return 0;
+}
@@ -3,15 +3,32 @@
 #include <t2/state.h>
 #include <t2/config.h>
 #include <t2/logging.h>
+#include <t2/profiler.h>
 #include <t2/text.h>
+#include <t2/mathutil.h>
 
 #define OVERLAY_FONT_FILENAME "fonts/InputMono-Regular.ttf"
 #define OVERLAY_FONT_PIXEL_HEIGHT 18
 
+/* Most rows of text the overlay shows */
+#define OVERLAY_MAX_ROWS 8
+
 static struct text_configuration *text_config = NULL;
 static struct font stats_font;
 
+/* Each row's layout, kept so rows that don't change aren't laid out
+again every frame */
+static struct text_layout row_layouts[OVERLAY_MAX_ROWS];
+
+/* The frame time graph: pixels per millisecond, and how tall it may get */
+#define GRAPH_SCALE 2.0
+#define GRAPH_MAX_HEIGHT 100.0
+#define GRAPH_BAR_WIDTH 2
+
 static float overlay_text_color[3] = { 1, 1, 1 };
+static float graph_fast_color[3] = { 0.2, 0.8, 0.2 };
+static float graph_slow_color[3] = { 0.9, 0.8, 0.2 };
+static float graph_stall_color[3] = { 0.9, 0.2, 0.2 };
 
 int initialize_overlay(struct configuration *config)
 {
@@ -26,10 +43,62 @@ int initialize_overlay(struct configuration *config)
     } else
         log_info("Loaded overlay font %s", OVERLAY_FONT_FILENAME);
 
+    for (int i = 0; i < OVERLAY_MAX_ROWS; i++)
+        initTextLayout(&row_layouts[i]);
+
     return 0;
 }
 
-void render_overlay(struct configuration *config, struct state *programState)
+/* One bar per frame, oldest on the left, coloured by whether the frame
+made 60 or 30 frames per second */
+static void addFrameGraph(struct profiler *profiler, int left, int bottom)
+{
+    for (int i = 0; i < PROFILER_HISTORY; i++) {
+        float ms = profiler->history[(profiler->historyNext + i) % PROFILER_HISTORY];
+        float *color;
+
+        if (ms <= 0)
+            continue;
+
+        if (ms < 17)
+            color = graph_fast_color;
+        else if (ms < 34)
+            color = graph_slow_color;
+        else
+            color = graph_stall_color;
+
+        addRect(text_config, &stats_font, left + i * GRAPH_BAR_WIDTH, bottom,
+                GRAPH_BAR_WIDTH - 1, MINF(ms * GRAPH_SCALE, GRAPH_MAX_HEIGHT), color);
+    }
+}
+
+/* Render "label stage ms | stage ms ..." for stages [first, last) */
+static int stageRow(char *msg, int size, struct profiler *profiler, const char *label,
+        int first, int last)
+{
+    int len = snprintf(msg, size, "%s", label);
+
+    for (int i = first; i < last && len < size; i++)
+        len += snprintf(msg + len, size - len, "%s%s %.2f", i == first ? " " : " | ",
+                profiler_stage_name(i), profiler->average[i]);
+
+    return MINF(len, size - 1);
+}
+
+/* Add a row of text to the overlay's batch */
+static void addRow(int row, const char *msg, int len, int left, int bottom)
+{
+    if (row >= OVERLAY_MAX_ROWS)
+        return;
+
+    if (layoutText(&row_layouts[row], &stats_font, msg, len, left, bottom, 1,
+                overlay_text_color) == 0)
+        addText(text_config, &row_layouts[row]);
+}
+
+/* Draw the overlay: everything in it goes out in one draw call */
+void render_overlay(struct configuration *config, struct state *programState,
+        struct profiler *profiler)
 {
     char msg[128];
     int len;
@@ -39,24 +108,68 @@ void render_overlay(struct configuration *config, struct state *programState)
     int left = 5;
 #define ROWS(n) (n * rowHeight)
 
-    len = snprintf(msg, sizeof(msg), "%d/%d sample%s%s | radius %f | depth %d",
-            programState->sampleNum, config->sampleRoot * config->sampleRoot,
-            (config->sampleRoot == 1 ? "" : "s"),
-            (config->paused ? "*" : ""),
-            programState->lens_radius,
-            config->traceDepth);
+    textBegin(text_config);
 
-    renderText(text_config, &stats_font, msg, len, left, bottom, 1, overlay_text_color);
+    if (config->integrator == INTEGRATOR_PATH)
+        len = snprintf(msg, sizeof(msg), "%d/%d sample%s%s | radius %f | path traced",
+                programState->sampleNum, config->sampleRoot * config->sampleRoot,
+                (config->sampleRoot == 1 ? "" : "s"),
+                (config->paused ? "*" : ""),
+                programState->lens_radius);
+    else
+        len = snprintf(msg, sizeof(msg), "%d/%d sample%s%s | radius %f | depth %d",
+                programState->sampleNum, config->sampleRoot * config->sampleRoot,
+                (config->sampleRoot == 1 ? "" : "s"),
+                (config->paused ? "*" : ""),
+                programState->lens_radius,
+                config->traceDepth);
+    addRow(0, msg, len, left, bottom);
 
-    char frameTimeMsg[64];
-    if (programState->last_frame_time != -1) {
-        len = snprintf(frameTimeMsg, sizeof(frameTimeMsg), "Frame time: %.3f sec",
+    if (programState->last_frame_time != -1)
+        len = snprintf(msg, sizeof(msg), "Frame time: %.3f sec",
                 programState->last_frame_time);
-        renderText(text_config, &stats_font, frameTimeMsg, len, left, bottom + ROWS(1),
-                1, overlay_text_color);
-    } else {
-        len = snprintf(frameTimeMsg, sizeof(frameTimeMsg), "Frame time: ...");
-        renderText(text_config, &stats_font, frameTimeMsg, len, left, bottom + ROWS(1),
-                1, overlay_text_color);
+    else
+        len = snprintf(msg, sizeof(msg), "Frame time: ...");
+    addRow(1, msg, len, left, bottom + ROWS(1));
+
+    if (profiler) {
+        // Milliseconds per displayed frame in each stage
+        int rows = 2;
+
+        len = stageRow(msg, sizeof(msg), profiler, "GPU ms:", 0, FIRST_WAVEFRONT_STAGE);
+        addRow(rows, msg, len, left, bottom + ROWS(rows));
+        rows++;
+
+        // The wavefront renderer's stages in place of the trace stage
+        double wavefrontMs = 0;
+        for (int i = FIRST_WAVEFRONT_STAGE; i < FIRST_HOST_STAGE; i++)
+            wavefrontMs += profiler->average[i];
+        if (wavefrontMs > 0) {
+            len = stageRow(msg, sizeof(msg), profiler, "Wavefront ms:", FIRST_WAVEFRONT_STAGE,
+                    FIRST_HOST_STAGE);
+            addRow(rows, msg, len, left, bottom + ROWS(rows));
+            rows++;
+        }
+
+        len = stageRow(msg, sizeof(msg), profiler, "CPU ms:", FIRST_HOST_STAGE, NUM_STAGES);
+        addRow(rows, msg, len, left, bottom + ROWS(rows));
+        rows++;
+
+        len = snprintf(msg, sizeof(msg), "Display: %.2f ms (%.1f fps)",
+                profiler->frameAverage,
+                profiler->frameAverage > 0 ? 1000.0 / profiler->frameAverage : 0.0);
+        addRow(rows, msg, len, left, bottom + ROWS(rows));
+        rows++;
+
+        if (profiler->counting) {
+            len = snprintf(msg, sizeof(msg), "Rays: %.2f M/sec | %.1f tests/ray",
+                    profiler->raysPerSec / 1000000.0, profiler->testsPerRay);
+            addRow(rows, msg, len, left, bottom + ROWS(rows));
+            rows++;
+        }
+
+        addFrameGraph(profiler, left, bottom + ROWS(rows));
     }
+
+    textDraw(text_config, &stats_font);
 }
@@ -0,0 +1,363 @@
+#include <stdlib.h>
+#include <limits.h>
+#include <math.h>
+
+#include <t2/photons.h>
+#include <t2/logging.h>
+#include <t2/mathutil.h>
+#include <t2/renderer.h>
+
+/* Index of the photon map arguments of the raytracer kernel, and of the
+first scene argument of photon_emit (see cl/t2.cl and cl/t2/photons.cl) */
+#define RAYTRACER_PHOTON_ARG 13
+#define EMIT_SCENE_ARG 7
+
+/* These should match cl/t2/photons.cl */
+#define PHOTON_MAX_BOUNCES 8
+#define PHOTON_SCAN_GROUP 256
+
+/* How quickly the gather radius shrinks; Knaus and Zwicker suggest 2/3 */
+#define PHOTON_ALPHA (2.0 / 3.0)
+
+/* What each photon a pass can keep costs: two copies, its bucket and
+rank, and about one bucket start */
+#define PHOTON_BYTES (2 * sizeof(struct Photon) + 3 * sizeof(cl_uint))
+
+static cl_kernel createKernel(cl_program program, const char *name)
+{
+    cl_int ret;
+    cl_kernel kernel = clCreateKernel(program, name, &ret);
+    if (ret) {
+        log_error("Could not create kernel %s, ret %d", name, ret);
+        return NULL;
+    }
+
+    return kernel;
+}
+
+static cl_mem createBuffer(cl_context context, size_t size, const char *what)
+{
+    cl_int ret;
+    cl_mem buf = clCreateBuffer(context, CL_MEM_READ_WRITE, size, NULL, &ret);
+    if (ret) {
+        log_error("Could not create %s buffer of %ld bytes, ret %d", what, size, ret);
+        return NULL;
+    }
+
+    return buf;
+}
+
+static void releaseBuffer(cl_mem *buf)
+{
+    if (*buf) {
+        clReleaseMemObject(*buf);
+        *buf = NULL;
+    }
+}
+
+static void releaseKernel(cl_kernel *kernel)
+{
+    if (*kernel) {
+        clReleaseKernel(*kernel);
+        *kernel = NULL;
+    }
+}
+
+static size_t roundUp(size_t n, size_t multiple)
+{
+    return (n + multiple - 1) / multiple * multiple;
+}
+
+int photons_init(struct photons *p, struct renderer *r, struct configuration *config)
+{
+    p->enabled = config->photonsPerPass > 0 && !config->wavefront && !config->multiDevice;
+    p->emit = p->hash = p->scanBlocks = p->scanSums = p->addSums = p->sort = NULL;
+    p->photonBuf = p->countBuf = p->hashBuf = p->rankBuf = NULL;
+    p->sortedBuf = p->cellBuf = p->blockSumBuf = NULL;
+    p->capacity = 0;
+    p->numCells = 0;
+    p->targets = NULL;
+    p->numTargets = 0;
+    p->targetCapacity = 0;
+    p->targetBuf = NULL;
+    p->targetBufSize = 0;
+    p->photonsPerPass = config->photonsPerPass;
+    p->passes = 0;
+    p->initialRadius = config->photonRadius;
+    p->radius = config->photonRadius;
+
+    if (config->photonsPerPass > 0 && config->wavefront)
+        log_info("Photon mapping is not supported by the wavefront renderer, ignoring");
+    else if (config->photonsPerPass > 0 && config->multiDevice)
+        log_info("Photon mapping is not supported with multiple devices, ignoring");
+
+    if (!p->enabled)
+        return 0;
+
+    // Keep as many photons as fit in the memory allowed, but no more
+    // than could ever be stored
+    size_t capacity = ((size_t) config->photonMemory << 20) / PHOTON_BYTES;
+    capacity = MINF(capacity, (size_t) p->photonsPerPass * PHOTON_MAX_BOUNCES);
+    capacity = MINF(capacity, (size_t) UINT_MAX / 2);
+    if (capacity == 0) {
+        log_error("No room for photons in %d MB", config->photonMemory);
+        return 1;
+    }
+    p->capacity = capacity;
+
+    p->numCells = 1;
+    while (p->numCells * 2 <= p->capacity)
+        p->numCells *= 2;
+
+    log_info("Photon mapping: %u photons per pass, room for %u in %u buckets, radius %.3f",
+            p->photonsPerPass, p->capacity, p->numCells, p->initialRadius);
+
+    p->emit = createKernel(r->program, "photon_emit");
+    p->hash = createKernel(r->program, "photon_hash");
+    p->scanBlocks = createKernel(r->program, "photon_scan_blocks");
+    p->scanSums = createKernel(r->program, "photon_scan_sums");
+    p->addSums = createKernel(r->program, "photon_add_sums");
+    p->sort = createKernel(r->program, "photon_sort");
+    if (!p->emit || !p->hash || !p->scanBlocks || !p->scanSums || !p->addSums || !p->sort)
+        return 1;
+
+    size_t numBlocks = roundUp(p->numCells + 1, PHOTON_SCAN_GROUP) / PHOTON_SCAN_GROUP;
+
+    p->photonBuf = createBuffer(r->context, sizeof(struct Photon) * p->capacity, "photon");
+    p->sortedBuf = createBuffer(r->context, sizeof(struct Photon) * p->capacity, "photon");
+    p->countBuf = createBuffer(r->context, sizeof(cl_uint), "photon count");
+    p->hashBuf = createBuffer(r->context, sizeof(cl_uint) * p->capacity, "photon bucket");
+    p->rankBuf = createBuffer(r->context, sizeof(cl_uint) * p->capacity, "photon rank");
+    p->cellBuf = createBuffer(r->context, sizeof(cl_uint) * (p->numCells + 1),
+            "photon bucket start");
+    p->blockSumBuf = createBuffer(r->context, sizeof(cl_uint) * numBlocks,
+            "photon block total");
+    if (!p->photonBuf || !p->sortedBuf || !p->countBuf || !p->hashBuf || !p->rankBuf ||
+            !p->cellBuf || !p->blockSumBuf)
+        return 1;
+
+    cl_uint numCellStarts = p->numCells + 1;
+    cl_uint numBlockSums = numBlocks;
+    cl_int ret;
+
+    ret  = clSetKernelArg(p->emit, 1, sizeof(cl_uint), &p->photonsPerPass);
+    ret |= clSetKernelArg(p->emit, 4, sizeof(cl_mem), &p->photonBuf);
+    ret |= clSetKernelArg(p->emit, 5, sizeof(cl_mem), &p->countBuf);
+    ret |= clSetKernelArg(p->emit, 6, sizeof(cl_uint), &p->capacity);
+
+    ret |= clSetKernelArg(p->hash, 0, sizeof(cl_mem), &p->photonBuf);
+    ret |= clSetKernelArg(p->hash, 1, sizeof(cl_mem), &p->countBuf);
+    ret |= clSetKernelArg(p->hash, 2, sizeof(cl_uint), &p->capacity);
+    ret |= clSetKernelArg(p->hash, 4, sizeof(cl_mem), &p->cellBuf);
+    ret |= clSetKernelArg(p->hash, 5, sizeof(cl_uint), &p->numCells);
+    ret |= clSetKernelArg(p->hash, 6, sizeof(cl_mem), &p->hashBuf);
+    ret |= clSetKernelArg(p->hash, 7, sizeof(cl_mem), &p->rankBuf);
+
+    ret |= clSetKernelArg(p->scanBlocks, 0, sizeof(cl_mem), &p->cellBuf);
+    ret |= clSetKernelArg(p->scanBlocks, 1, sizeof(cl_uint), &numCellStarts);
+    ret |= clSetKernelArg(p->scanBlocks, 2, sizeof(cl_mem), &p->blockSumBuf);
+
+    ret |= clSetKernelArg(p->scanSums, 0, sizeof(cl_mem), &p->blockSumBuf);
+    ret |= clSetKernelArg(p->scanSums, 1, sizeof(cl_uint), &numBlockSums);
+
+    ret |= clSetKernelArg(p->addSums, 0, sizeof(cl_mem), &p->cellBuf);
+    ret |= clSetKernelArg(p->addSums, 1, sizeof(cl_uint), &numCellStarts);
+    ret |= clSetKernelArg(p->addSums, 2, sizeof(cl_mem), &p->blockSumBuf);
+
+    ret |= clSetKernelArg(p->sort, 0, sizeof(cl_mem), &p->photonBuf);
+    ret |= clSetKernelArg(p->sort, 1, sizeof(cl_mem), &p->countBuf);
+    ret |= clSetKernelArg(p->sort, 2, sizeof(cl_uint), &p->capacity);
+    ret |= clSetKernelArg(p->sort, 3, sizeof(cl_mem), &p->hashBuf);
+    ret |= clSetKernelArg(p->sort, 4, sizeof(cl_mem), &p->rankBuf);
+    ret |= clSetKernelArg(p->sort, 5, sizeof(cl_mem), &p->cellBuf);
+    ret |= clSetKernelArg(p->sort, 6, sizeof(cl_mem), &p->sortedBuf);
+    if (ret) {
+        log_error("Could not set kernel argument, ret %d", ret);
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Find the objects photons are aimed at, the spheres with a mirror, and
+ * upload their indices. Photons that reach a diffuse surface without a
+ * mirror on the way are direct light, which shadow rays already find.
+ */
+static int findTargets(struct photons *p, struct renderer *r, struct scene *scene)
+{
+    cl_int ret;
+
+    p->numTargets = 0;
+
+    for (cl_uint i = 0; i < scene->header.numObjects; i++) {
+        struct Object *o = &scene->objects[i];
+        struct Material *m = &scene->materials[o->material];
+
+        if (o->type != OBJECT_SPHERE || m->refl <= 0 || m->reflAmount <= 0)
+            continue;
+
+        if (p->numTargets == p->targetCapacity) {
+            size_t capacity = p->targetCapacity ? p->targetCapacity * 2 : 16;
+            cl_uint *targets = realloc(p->targets, sizeof(cl_uint) * capacity);
+            if (!targets) {
+                log_error("Could not allocate %ld photon targets", capacity);
+                return 1;
+            }
+            p->targets = targets;
+            p->targetCapacity = capacity;
+        }
+        p->targets[p->numTargets++] = i;
+    }
+
+    if (p->numTargets == 0)
+        return 0;
+
+    size_t size = sizeof(cl_uint) * p->numTargets;
+    if (size > p->targetBufSize) {
+        releaseBuffer(&p->targetBuf);
+        p->targetBuf = createBuffer(r->context, size, "photon target");
+        if (!p->targetBuf)
+            return 1;
+        p->targetBufSize = size;
+    }
+
+    ret = clEnqueueWriteBuffer(r->command_queue, p->targetBuf, 1, 0, size, p->targets,
+            0, NULL, NULL);
+    if (ret) {
+        log_error("Error updating photon target buffer, ret %d", ret);
+        return ret;
+    }
+
+    return 0;
+}
+
+static int enqueueKernel(struct renderer *r, cl_kernel kernel, size_t size, size_t groupSize)
+{
+    cl_event event;
+    cl_int ret;
+
+    ret = clEnqueueNDRangeKernel(r->command_queue, kernel, 1, NULL, &size,
+            groupSize ? &groupSize : NULL, 0, NULL, r->profiler ? &event : NULL);
+    if (ret) {
+        log_error("Could not enqueue photon kernel, ret %d", ret);
+        return ret;
+    }
+
+    if (r->profiler) {
+        profiler_add_event(r->profiler, STAGE_PHOTONS, event);
+        clReleaseEvent(event);
+    }
+
+    return 0;
+}
+
+/* Point the raytracer kernel at the photon map, or at none */
+static int setRaytracerArgs(struct photons *p, struct renderer *r, int haveMap)
+{
+    cl_uint numCells = haveMap ? p->numCells : 0;
+    cl_int ret;
+
+    ret  = clSetKernelArg(r->kernel, RAYTRACER_PHOTON_ARG, sizeof(cl_mem),
+            haveMap ? &p->sortedBuf : NULL);
+    ret |= clSetKernelArg(r->kernel, RAYTRACER_PHOTON_ARG + 1, sizeof(cl_mem),
+            haveMap ? &p->cellBuf : NULL);
+    ret |= clSetKernelArg(r->kernel, RAYTRACER_PHOTON_ARG + 2, sizeof(cl_uint), &numCells);
+    ret |= clSetKernelArg(r->kernel, RAYTRACER_PHOTON_ARG + 3, sizeof(cl_float), &p->radius);
+    if (ret)
+        log_error("Could not set kernel argument, ret %d", ret);
+
+    return ret;
+}
+
+/**
+ * Enqueue building the photon map for a pass of the raytracer kernel
+ * starting at state->sampleNum, and set the kernel's photon map
+ * arguments. A pass starting at sample 0 starts a new frame, which goes
+ * back to the initial radius and looks for the mirrors in the scene
+ * again. The scene buffers must be up to date. Without photon mapping
+ * this only sets the arguments.
+ */
+int photons_begin_pass(struct photons *p, struct renderer *r, struct state *state,
+        struct scene *scene)
+{
+    static const cl_uint zero = 0;
+    cl_int ret;
+
+    if (!p->enabled)
+        return setRaytracerArgs(p, r, 0);
+
+    if (state->sampleNum == 0) {
+        p->passes = 0;
+        p->radius = p->initialRadius;
+
+        ret = findTargets(p, r, scene);
+        if (ret)
+            return ret;
+    } else {
+        p->radius *= sqrt((p->passes + PHOTON_ALPHA) / (p->passes + 1));
+    }
+    p->passes++;
+
+    if (p->numTargets == 0 || scene->header.numLights == 0)
+        return setRaytracerArgs(p, r, 0);
+
+    cl_uint seed = state->sampleNum;
+    size_t numBlocks = roundUp(p->numCells + 1, PHOTON_SCAN_GROUP) / PHOTON_SCAN_GROUP;
+
+    ret  = clSetKernelArg(p->emit, 0, sizeof(cl_uint), &seed);
+    ret |= clSetKernelArg(p->emit, 2, sizeof(cl_mem), &p->targetBuf);
+    ret |= clSetKernelArg(p->emit, 3, sizeof(cl_uint), &p->numTargets);
+    ret |= clSetKernelArg(p->hash, 3, sizeof(cl_float), &p->radius);
+    if (ret) {
+        log_error("Could not set kernel argument, ret %d", ret);
+        return ret;
+    }
+
+    ret = renderer_set_scene_args(r, p->emit, EMIT_SCENE_ARG);
+    if (ret)
+        return ret;
+
+    // Start the pass's photons and buckets empty
+    ret  = clEnqueueWriteBuffer(r->command_queue, p->countBuf, 0, 0, sizeof(zero), &zero,
+            0, NULL, NULL);
+    ret |= clEnqueueFillBuffer(r->command_queue, p->cellBuf, &zero, sizeof(zero), 0,
+            sizeof(cl_uint) * (p->numCells + 1), 0, NULL, NULL);
+    if (ret) {
+        log_error("Could not clear photon map, ret %d", ret);
+        return ret;
+    }
+
+    ret  = enqueueKernel(r, p->emit, p->photonsPerPass, 0);
+    ret |= enqueueKernel(r, p->hash, p->capacity, 0);
+    ret |= enqueueKernel(r, p->scanBlocks, numBlocks * PHOTON_SCAN_GROUP, PHOTON_SCAN_GROUP);
+    ret |= enqueueKernel(r, p->scanSums, PHOTON_SCAN_GROUP, PHOTON_SCAN_GROUP);
+    ret |= enqueueKernel(r, p->addSums, numBlocks * PHOTON_SCAN_GROUP, PHOTON_SCAN_GROUP);
+    ret |= enqueueKernel(r, p->sort, p->capacity, 0);
+    if (ret)
+        return ret;
+
+    return setRaytracerArgs(p, r, 1);
+}
+
+void photons_release(struct photons *p)
+{
+    releaseBuffer(&p->photonBuf);
+    releaseBuffer(&p->sortedBuf);
+    releaseBuffer(&p->countBuf);
+    releaseBuffer(&p->hashBuf);
+    releaseBuffer(&p->rankBuf);
+    releaseBuffer(&p->cellBuf);
+    releaseBuffer(&p->blockSumBuf);
+    releaseBuffer(&p->targetBuf);
+
+    releaseKernel(&p->emit);
+    releaseKernel(&p->hash);
+    releaseKernel(&p->scanBlocks);
+    releaseKernel(&p->scanSums);
+    releaseKernel(&p->addSums);
+    releaseKernel(&p->sort);
+
+    free(p->targets);
+    p->targets = NULL;
+}
@@ -3,8 +3,7 @@
 
 #include <t2/platform.h>
 #include <t2/logging.h>
-
-#define MAX_PLATFORMS 10
+#include <t2/mathutil.h>
 
 cl_platform_id choosePlatform() {
     cl_platform_id platform_ids[MAX_PLATFORMS];
@@ -29,3 +28,17 @@ cl_platform_id choosePlatform() {
     log_info("Found %d platform%s, using the first one", ret_num, s);
     return platform_ids[0];
 }
+
+/* Fill in up to max platform IDs and return how many there are */
+int listPlatforms(cl_platform_id *platform_ids, int max)
+{
+    cl_uint ret_num;
+
+    cl_int ret = clGetPlatformIDs(max, platform_ids, &ret_num);
+    if (ret) {
+        log_error("Could not get platforms, ret %d", ret);
+        return 0;
+    }
+
+    return MINF(ret_num, max);
+}
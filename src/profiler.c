@@ -0,0 +1,182 @@
+#include <time.h>
+
+#include <t2/profiler.h>
+#include <t2/logging.h>
+
+/*
+ * Per-stage timings for the overlay. Host stages are timed directly;
+ * device commands are handed over as events and timed from their
+ * profiling information once they complete, which can be a frame or
+ * two later. Every stage's time is summed over a window of about half a
+ * second and divided by the frames in it, which gives a steady reading
+ * of where each frame's time goes.
+ */
+
+static const char *stageNames[NUM_STAGES] = {
+    [STAGE_UPLOAD] = "upload",
+    [STAGE_PHOTONS] = "photons",
+    [STAGE_TRACE] = "trace",
+    [STAGE_INTEROP] = "gl",
+    [STAGE_RESOLVE] = "resolve",
+    [STAGE_GENERATE] = "generate",
+    [STAGE_EXTEND] = "extend",
+    [STAGE_SHADE] = "shade",
+    [STAGE_CONNECT] = "connect",
+    [STAGE_ADVANCE] = "advance",
+    [STAGE_ENQUEUE] = "enqueue",
+    [STAGE_DRAW] = "draw",
+    [STAGE_OVERLAY] = "overlay",
+    [STAGE_SWAP] = "swap"
+};
+
+const char *profiler_stage_name(int stage)
+{
+    if (stage < 0 || stage >= NUM_STAGES)
+        return NULL;
+
+    return stageNames[stage];
+}
+
+/* Milliseconds on a clock that never goes backwards */
+double profiler_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+void profiler_init(struct profiler *p)
+{
+    for (int i = 0; i < NUM_STAGES; i++) {
+        p->average[i] = 0;
+        p->sums[i] = 0;
+    }
+
+    for (int i = 0; i < PROFILER_HISTORY; i++)
+        p->history[i] = 0;
+
+    p->frameAverage = 0;
+    p->counting = 0;
+    p->raysPerSec = 0;
+    p->testsPerRay = 0;
+    counters_clear(&p->counts);
+    counters_clear(&p->windowCounts);
+    p->historyNext = 0;
+    p->windowFrames = 0;
+    p->numPending = 0;
+    p->windowStart = p->frameStart = profiler_now();
+}
+
+/* Count the time since start (from profiler_now()) against a stage */
+void profiler_add_host(struct profiler *p, int stage, double start)
+{
+    p->sums[stage] += profiler_now() - start;
+}
+
+/**
+ * Time a device command against a stage once it completes. The event
+ * must come from a queue with profiling enabled; the profiler keeps its
+ * own reference.
+ */
+void profiler_add_event(struct profiler *p, int stage, cl_event event)
+{
+    if (!event)
+        return;
+
+    // If the device has fallen this far behind, the oldest timings
+    // can go
+    if (p->numPending == PROFILER_MAX_PENDING) {
+        clReleaseEvent(p->pending[0]);
+        for (int i = 1; i < p->numPending; i++) {
+            p->pending[i - 1] = p->pending[i];
+            p->pendingStage[i - 1] = p->pendingStage[i];
+        }
+        p->numPending--;
+    }
+
+    clRetainEvent(event);
+    p->pending[p->numPending] = event;
+    p->pendingStage[p->numPending] = stage;
+    p->numPending++;
+}
+
+/* Add up the device commands that have completed */
+static void collectEvents(struct profiler *p)
+{
+    int kept = 0;
+
+    for (int i = 0; i < p->numPending; i++) {
+        cl_event event = p->pending[i];
+        cl_ulong start, end;
+        cl_int status = -1;
+
+        if (clGetEventInfo(event, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(status), &status,
+                    NULL) == 0 && status > CL_COMPLETE) {
+            p->pending[kept] = event;
+            p->pendingStage[kept] = p->pendingStage[i];
+            kept++;
+            continue;
+        }
+
+        if (status == CL_COMPLETE &&
+                clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(start),
+                    &start, NULL) == 0 &&
+                clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(end),
+                    &end, NULL) == 0 &&
+                end >= start)
+            p->sums[p->pendingStage[i]] += (end - start) / 1000000.0;
+
+        clReleaseEvent(event);
+    }
+
+    p->numPending = kept;
+}
+
+/* Pass on the device counts so far (see renderer_counters()) */
+void profiler_set_counts(struct profiler *p, const struct counters *c)
+{
+    p->counting = 1;
+    p->counts = *c;
+}
+
+/* Finish timing a displayed frame; call once per frame */
+void profiler_end_frame(struct profiler *p)
+{
+    double now = profiler_now();
+
+    p->history[p->historyNext] = now - p->frameStart;
+    p->historyNext = (p->historyNext + 1) % PROFILER_HISTORY;
+    p->frameStart = now;
+    p->windowFrames++;
+
+    collectEvents(p);
+
+    if (now - p->windowStart < PROFILER_WINDOW_MS)
+        return;
+
+    for (int i = 0; i < NUM_STAGES; i++) {
+        p->average[i] = p->sums[i] / p->windowFrames;
+        p->sums[i] = 0;
+    }
+    p->frameAverage = (now - p->windowStart) / p->windowFrames;
+
+    if (p->counting) {
+        cl_ulong rays = counters_rays(&p->counts) - counters_rays(&p->windowCounts);
+        cl_ulong tests = counters_tests(&p->counts) - counters_tests(&p->windowCounts);
+
+        p->raysPerSec = rays / ((now - p->windowStart) / 1000.0);
+        p->testsPerRay = rays ? (double) tests / rays : 0;
+        p->windowCounts = p->counts;
+    }
+    p->windowFrames = 0;
+    p->windowStart = now;
+}
+
+void profiler_release(struct profiler *p)
+{
+    for (int i = 0; i < p->numPending; i++)
+        clReleaseEvent(p->pending[i]);
+    p->numPending = 0;
+}
@@ -0,0 +1,564 @@
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <utime.h>
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <t2/program_cache.h>
+#include <t2/logging.h>
+
+/*
+ * Compiled programs are cached on disk, one file per device and build,
+ * named <device key>-<source key>-<options key>.bin. The device key
+ * covers the device, its driver and the build options other than -D
+ * defines; the source key covers the program source and every file it
+ * includes, found through the -I directories in the build options; the
+ * options key covers the build options in full, defines and all.
+ * Editing any of them changes the name, so stale binaries are never
+ * loaded. Builds for other sources are left alone, since two t2 builds
+ * may share the cache (say, a benchmark baseline and a candidate), and
+ * the variants (see t2/variants.h) define the scene's counts, so a new
+ * scene means new builds. Instead, storing a binary keeps no more than
+ * MAX_CACHED_BUILDS and MAX_CACHED_BYTES with the same device key.
+ * Loading a binary touches it, so the least recently used builds go
+ * first.
+ */
+
+#define CACHE_MAGIC "t2clbin1"
+
+/* Most include directories and files a program's source key covers */
+#define MAX_INCLUDE_DIRS  8
+#define MAX_SOURCE_FILES  128
+
+/* Most builds kept for one device, and most bytes they take up */
+#define MAX_CACHED_BUILDS 64
+#define MAX_CACHED_BYTES (256ull << 20)
+
+/* Length of a key in a cache file name, in hex digits */
+#define KEY_DIGITS 16
+
+/* A binary found in the cache directory, for trimCache() */
+struct cachedBuild {
+    char name[NAME_MAX + 1];
+    time_t mtime;
+    uint64_t size;
+};
+
+#define FNV_OFFSET 0xcbf29ce484222325ull
+#define FNV_PRIME  0x100000001b3ull
+
+static uint64_t hashBytes(uint64_t h, const void *data, size_t n)
+{
+    const unsigned char *p = data;
+
+    for (size_t i = 0; i < n; i++) {
+        h ^= p[i];
+        h *= FNV_PRIME;
+    }
+
+    return h;
+}
+
+static uint64_t hashString(uint64_t h, const char *s)
+{
+    // Include the terminator so that "ab" "c" and "a" "bc" differ
+    return hashBytes(h, s, strlen(s) + 1);
+}
+
+/* Hash the build options other than -D defines, which make variants of
+a build rather than different builds */
+static uint64_t hashBaseOptions(uint64_t h, const char *options)
+{
+    const char *p = options;
+    int skipNext = 0;
+
+    while (*p) {
+        size_t space = strspn(p, " \t");
+        size_t len;
+
+        p += space;
+        len = strcspn(p, " \t");
+        if (len == 0)
+            break;
+
+        // -D NAME as well as -DNAME
+        if (skipNext)
+            skipNext = 0;
+        else if (len == 2 && strncmp(p, "-D", 2) == 0)
+            skipNext = 1;
+        else if (strncmp(p, "-D", 2) != 0)
+            h = hashBytes(hashBytes(h, p, len), " ", 1);
+        p += len;
+    }
+
+    return h;
+}
+
+static uint64_t hashDeviceInfo(uint64_t h, cl_device_id device_id, cl_device_info param)
+{
+    char value[1024];
+
+    if (clGetDeviceInfo(device_id, param, sizeof(value), value, NULL))
+        value[0] = '\0';
+    value[sizeof(value) - 1] = '\0';
+
+    return hashString(h, value);
+}
+
+struct sourceSet {
+    char dirs[MAX_INCLUDE_DIRS][PATH_MAX];
+    int numDirs;
+    char files[MAX_SOURCE_FILES][PATH_MAX];
+    int numFiles;
+};
+
+/* Pick the -I directories out of a set of build options */
+static void findIncludeDirs(struct sourceSet *s, const char *options)
+{
+    const char *p = options;
+
+    s->numDirs = 0;
+    while ((p = strstr(p, "-I")) && s->numDirs < MAX_INCLUDE_DIRS) {
+        size_t len;
+
+        p += 2;
+        len = strcspn(p, " \t");
+        if (len > 0 && len < PATH_MAX) {
+            memcpy(s->dirs[s->numDirs], p, len);
+            s->dirs[s->numDirs][len] = '\0';
+            s->numDirs++;
+        }
+        p += len;
+    }
+}
+
+static int fileExists(const char *path)
+{
+    struct stat st;
+    return stat(path, &st) == 0 && S_ISREG(st.st_mode);
+}
+
+/* Where an #include of name from the file at from resolves to; 0 if
+it's not one of ours (a system header, say). Paths longer than
+PATH_MAX don't resolve. */
+static int resolveInclude(struct sourceSet *s, const char *from, const char *name, int quoted,
+        char *out)
+{
+    if (quoted) {
+        const char *slash = strrchr(from, '/');
+        int dirLen = slash ? slash - from + 1 : 0;
+
+        int len = snprintf(out, PATH_MAX, "%.*s%s", dirLen, from, name);
+        if (len >= 0 && len < PATH_MAX && fileExists(out))
+            return 1;
+    }
+
+    for (int i = 0; i < s->numDirs; i++) {
+        int len = snprintf(out, PATH_MAX, "%s/%s", s->dirs[i], name);
+        if (len >= 0 && len < PATH_MAX && fileExists(out))
+            return 1;
+    }
+
+    return 0;
+}
+
+/* Hash the file at path, then everything it includes that hasn't been
+hashed already. Includes are followed whatever preprocessor conditions
+they sit in, which at worst covers a file that doesn't matter. */
+static int hashSource(struct sourceSet *s, const char *path, uint64_t *h)
+{
+    char line[1024];
+    FILE *fp;
+
+    for (int i = 0; i < s->numFiles; i++) {
+        if (strcmp(s->files[i], path) == 0)
+            return 0;
+    }
+
+    if (s->numFiles == MAX_SOURCE_FILES) {
+        log_error("Program includes more than %d files", MAX_SOURCE_FILES);
+        return 1;
+    }
+    strncpy(s->files[s->numFiles++], path, PATH_MAX - 1);
+
+    fp = fopen(path, "r");
+    if (!fp) {
+        log_error("Could not open %s", path);
+        return 1;
+    }
+
+    *h = hashString(*h, path);
+
+    while (fgets(line, sizeof(line), fp)) {
+        char name[PATH_MAX], included[PATH_MAX];
+        char *p = line;
+
+        *h = hashString(*h, line);
+
+        while (*p == ' ' || *p == '\t')
+            p++;
+        if (*p++ != '#')
+            continue;
+        while (*p == ' ' || *p == '\t')
+            p++;
+        if (strncmp(p, "include", 7) != 0)
+            continue;
+        p += 7;
+        while (*p == ' ' || *p == '\t')
+            p++;
+
+        int quoted = *p == '"';
+        if (*p != '"' && *p != '<')
+            continue;
+
+        size_t len = strcspn(p + 1, quoted ? "\"" : ">");
+        if (len == 0 || len >= sizeof(name))
+            continue;
+        memcpy(name, p + 1, len);
+        name[len] = '\0';
+
+        if (resolveInclude(s, path, name, quoted, included) && hashSource(s, included, h)) {
+            fclose(fp);
+            return 1;
+        }
+    }
+
+    fclose(fp);
+
+    return 0;
+}
+
+static int cacheDir(char *out, size_t size)
+{
+    const char *dir = getenv(PROGRAM_CACHE_DIR_ENV);
+    const char *base;
+
+    if (dir && *dir) {
+        snprintf(out, size, "%s", dir);
+    } else if ((base = getenv("XDG_CACHE_HOME")) && *base) {
+        snprintf(out, size, "%s/t2", base);
+    } else if ((base = getenv("HOME")) && *base) {
+        snprintf(out, size, "%s/.cache/t2", base);
+    } else {
+        return 1;
+    }
+
+    return 0;
+}
+
+/* mkdir -p */
+static int makeDirs(const char *path)
+{
+    char dir[PATH_MAX];
+
+    snprintf(dir, sizeof(dir), "%s", path);
+    for (char *p = dir + 1; ; p++) {
+        if (*p == '/' || *p == '\0') {
+            char c = *p;
+
+            *p = '\0';
+            if (mkdir(dir, 0755) && errno != EEXIST)
+                return 1;
+            *p = c;
+        }
+
+        if (*p == '\0')
+            break;
+    }
+
+    return 0;
+}
+
+/**
+ * Work out where the binary for the program at path, built for the
+ * given device with the given options, is cached. Returns nonzero if
+ * it can't be cached (caching is turned off, there is nowhere to put
+ * it, or the sources couldn't be read).
+ */
+int program_cache_path(cl_device_id device_id, const char *path, const char *options,
+        char *cachePath, size_t size)
+{
+    struct sourceSet *sources;
+    char dir[PATH_MAX];
+    cl_platform_id platform;
+    uint64_t deviceKey = FNV_OFFSET, sourceKey = FNV_OFFSET, optionsKey = FNV_OFFSET;
+
+    if (getenv(PROGRAM_CACHE_OFF_ENV) || cacheDir(dir, sizeof(dir)))
+        return 1;
+
+    deviceKey = hashDeviceInfo(deviceKey, device_id, CL_DEVICE_NAME);
+    deviceKey = hashDeviceInfo(deviceKey, device_id, CL_DEVICE_VENDOR);
+    deviceKey = hashDeviceInfo(deviceKey, device_id, CL_DEVICE_VERSION);
+    deviceKey = hashDeviceInfo(deviceKey, device_id, CL_DRIVER_VERSION);
+    if (clGetDeviceInfo(device_id, CL_DEVICE_PLATFORM, sizeof(platform), &platform, NULL) == 0) {
+        char version[256] = "";
+
+        clGetPlatformInfo(platform, CL_PLATFORM_VERSION, sizeof(version), version, NULL);
+        version[sizeof(version) - 1] = '\0';
+        deviceKey = hashString(deviceKey, version);
+    }
+    deviceKey = hashBaseOptions(deviceKey, options ? options : "");
+    optionsKey = hashString(optionsKey, options ? options : "");
+
+    // Far too big for the stack
+    sources = malloc(sizeof(struct sourceSet));
+    if (!sources)
+        return 1;
+
+    sources->numFiles = 0;
+    findIncludeDirs(sources, options);
+    int ret = hashSource(sources, path, &sourceKey);
+    free(sources);
+    if (ret)
+        return 1;
+
+    snprintf(cachePath, size, "%s/%016llx-%016llx-%016llx.bin", dir,
+            (unsigned long long) deviceKey, (unsigned long long) sourceKey,
+            (unsigned long long) optionsKey);
+
+    return 0;
+}
+
+static void removeCached(const char *cachePath, const char *why)
+{
+    log_info("Removing %s cached program binary %s", why, cachePath);
+    unlink(cachePath);
+}
+
+/**
+ * Create and build a program from the binary cached at cachePath.
+ * Returns NULL if there isn't one or it won't load, in which case the
+ * program needs building from source.
+ */
+cl_program program_cache_load(cl_context context, cl_device_id device_id,
+        const char *cachePath, const char *options)
+{
+    char magic[sizeof(CACHE_MAGIC)];
+    unsigned char *binary;
+    uint64_t binarySize;
+    cl_int status, ret;
+    cl_program program;
+    FILE *fp;
+
+    fp = fopen(cachePath, "rb");
+    if (!fp)
+        return NULL;
+
+    if (fread(magic, 1, sizeof(magic), fp) != sizeof(magic) ||
+            memcmp(magic, CACHE_MAGIC, sizeof(magic)) != 0 ||
+            fread(&binarySize, sizeof(binarySize), 1, fp) != 1 || binarySize == 0) {
+        fclose(fp);
+        removeCached(cachePath, "corrupt");
+        return NULL;
+    }
+
+    binary = malloc(binarySize);
+    if (!binary) {
+        fclose(fp);
+        return NULL;
+    }
+
+    if (fread(binary, 1, binarySize, fp) != binarySize) {
+        free(binary);
+        fclose(fp);
+        removeCached(cachePath, "truncated");
+        return NULL;
+    }
+    fclose(fp);
+
+    size_t size = binarySize;
+    program = clCreateProgramWithBinary(context, 1, &device_id, &size,
+            (const unsigned char **) &binary, &status, &ret);
+    free(binary);
+    if (ret || status) {
+        removeCached(cachePath, "unloadable");
+        if (program)
+            clReleaseProgram(program);
+        return NULL;
+    }
+
+    ret = clBuildProgram(program, 1, &device_id, options, NULL, NULL);
+    if (ret) {
+        removeCached(cachePath, "unbuildable");
+        clReleaseProgram(program);
+        return NULL;
+    }
+
+    log_info("Loaded cached program binary %s", cachePath);
+
+    // Recently used, as far as trimCache() is concerned
+    utime(cachePath, NULL);
+
+    return program;
+}
+
+static int compareBuildTimes(const void *a, const void *b)
+{
+    time_t ta = ((const struct cachedBuild *) a)->mtime;
+    time_t tb = ((const struct cachedBuild *) b)->mtime;
+
+    return (ta > tb) - (ta < tb);
+}
+
+/* Delete the least recently used binaries cached for the same device
+key as the one at cachePath until there are at most MAX_CACHED_BUILDS
+of them, taking up at most MAX_CACHED_BYTES. The one just stored is
+always kept. Every store checks, so the cache never gets far over. */
+static void trimCache(const char *cachePath)
+{
+    const char *name = strrchr(cachePath, '/') + 1;
+    size_t dirLen = name - cachePath;
+    size_t deviceLen = KEY_DIGITS + 1;
+    char dir[PATH_MAX], path[PATH_MAX];
+    struct cachedBuild *builds = NULL;
+    size_t numBuilds = 0, capacity = 0;
+    uint64_t totalBytes = 0;
+    struct dirent *entry;
+    struct stat st;
+    DIR *d;
+
+    if (stat(cachePath, &st) == 0)
+        totalBytes = st.st_size;
+
+    snprintf(dir, sizeof(dir), "%.*s", (int) dirLen, cachePath);
+    d = opendir(dir);
+    if (!d)
+        return;
+
+    while ((entry = readdir(d))) {
+        size_t len = strlen(entry->d_name);
+
+        // Leave other processes' half-written files alone
+        if (strncmp(entry->d_name, name, deviceLen) != 0 || strcmp(entry->d_name, name) == 0 ||
+                len < 4 || len > NAME_MAX || strcmp(entry->d_name + len - 4, ".bin") != 0)
+            continue;
+
+        int pathLen = snprintf(path, sizeof(path), "%s%s", dir, entry->d_name);
+        if (pathLen < 0 || pathLen >= sizeof(path) || stat(path, &st) != 0)
+            continue;
+
+        if (numBuilds == capacity) {
+            size_t newCapacity = capacity ? 2 * capacity : MAX_CACHED_BUILDS;
+            struct cachedBuild *grown = realloc(builds, sizeof(*builds) * newCapacity);
+            if (!grown)
+                break;
+
+            builds = grown;
+            capacity = newCapacity;
+        }
+
+        strcpy(builds[numBuilds].name, entry->d_name);
+        builds[numBuilds].mtime = st.st_mtime;
+        builds[numBuilds].size = st.st_size;
+        numBuilds++;
+        totalBytes += st.st_size;
+    }
+
+    closedir(d);
+
+    if (numBuilds > 0)
+        qsort(builds, numBuilds, sizeof(struct cachedBuild), compareBuildTimes);
+
+    // Counting the one just stored
+    for (size_t i = 0; i < numBuilds && (numBuilds - i + 1 > MAX_CACHED_BUILDS ||
+                totalBytes > MAX_CACHED_BYTES); i++) {
+        snprintf(path, sizeof(path), "%s%s", dir, builds[i].name);
+        removeCached(path, "least recently used");
+        totalBytes -= builds[i].size;
+    }
+
+    free(builds);
+}
+
+/**
+ * Save a program's binary for the given device to cachePath, making
+ * room by deleting the device's least recently used binaries.
+ */
+int program_cache_store(cl_program program, cl_device_id device_id, const char *cachePath)
+{
+    cl_uint numDevices;
+    cl_device_id *devices = NULL;
+    size_t *sizes = NULL;
+    unsigned char **binaries = NULL;
+    char dir[PATH_MAX], tmpPath[PATH_MAX];
+    int ret = 1, index = -1;
+    FILE *fp;
+
+    if (clGetProgramInfo(program, CL_PROGRAM_NUM_DEVICES, sizeof(numDevices), &numDevices,
+                NULL))
+        return 1;
+
+    devices = malloc(sizeof(cl_device_id) * numDevices);
+    sizes = malloc(sizeof(size_t) * numDevices);
+    binaries = calloc(numDevices, sizeof(unsigned char *));
+    if (!devices || !sizes || !binaries)
+        goto out;
+
+    if (clGetProgramInfo(program, CL_PROGRAM_DEVICES, sizeof(cl_device_id) * numDevices,
+                devices, NULL) ||
+            clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(size_t) * numDevices,
+                sizes, NULL))
+        goto out;
+
+    for (int i = 0; i < numDevices; i++) {
+        if (devices[i] == device_id)
+            index = i;
+    }
+    if (index < 0 || sizes[index] == 0)
+        goto out;
+
+    // Binaries are only wanted for our device
+    binaries[index] = malloc(sizes[index]);
+    if (!binaries[index])
+        goto out;
+
+    if (clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(unsigned char *) * numDevices,
+                binaries, NULL))
+        goto out;
+
+    snprintf(dir, sizeof(dir), "%.*s", (int) (strrchr(cachePath, '/') - cachePath), cachePath);
+    if (makeDirs(dir)) {
+        log_warn("Could not create program cache directory %s", dir);
+        goto out;
+    }
+
+    // Write then rename, so that another t2 starting up never sees half
+    // a binary
+    snprintf(tmpPath, sizeof(tmpPath), "%s.%ld.tmp", cachePath, (long) getpid());
+    fp = fopen(tmpPath, "wb");
+    if (!fp) {
+        log_warn("Could not write program cache file %s", tmpPath);
+        goto out;
+    }
+
+    uint64_t binarySize = sizes[index];
+    int failed = fwrite(CACHE_MAGIC, 1, sizeof(CACHE_MAGIC), fp) != sizeof(CACHE_MAGIC) ||
+        fwrite(&binarySize, sizeof(binarySize), 1, fp) != 1 ||
+        fwrite(binaries[index], 1, binarySize, fp) != binarySize;
+    failed |= fclose(fp) != 0;
+
+    if (failed || rename(tmpPath, cachePath)) {
+        log_warn("Could not write program cache file %s", cachePath);
+        unlink(tmpPath);
+        goto out;
+    }
+
+    log_info("Cached program binary %s", cachePath);
+    trimCache(cachePath);
+    ret = 0;
+
+out:
+    if (binaries && index >= 0)
+        free(binaries[index]);
+    free(binaries);
+    free(sizes);
+    free(devices);
+
+    return ret;
+}
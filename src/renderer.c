@@ -0,0 +1,1193 @@
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <t2/renderer.h>
+#include <t2/logging.h>
+#include <t2/mathutil.h>
+#include <t2/samplers.h>
+#include <t2/sample_cache.h>
+#include <t2/util.h>
+
+/* Index of the raytracer kernel's irradiance cache arguments, its shadow
+cache arguments and its first scene argument */
+#define RAYTRACER_IRRADIANCE_ARG 17
+#define RAYTRACER_SHADOW_CACHE_ARG 21
+#define RAYTRACER_SCENE_ARG 23
+
+/* Most lights each pixel's shadow cache has a slot for. Scenes with
+more lights share slots between them (see shadowRayHit() in
+cl/t2/trace.cl). */
+#define SHADOW_CACHE_MAX_LIGHTS 16
+
+/* Each buffer made from a set of samples holds a reference on it, which
+goes once OpenCL is done with the buffer */
+static void CL_CALLBACK releaseSampleSets(cl_mem buf, void *sets)
+{
+    sample_cache_release(sets);
+}
+
+static cl_mem createSampleBuffer(cl_context context, struct sample_sets *sets,
+        cl_float *samples)
+{
+    int ret;
+
+    cl_mem buf = clCreateBuffer(context, CL_MEM_USE_HOST_PTR|CL_MEM_READ_ONLY,
+            sample_sets_bytes(sets), samples, &ret);
+    if (ret) {
+        log_error("Could not create sample buffer, ret %d", ret);
+        return NULL;
+    }
+
+    sample_cache_retain(sets);
+    ret = clSetMemObjectDestructorCallback(buf, releaseSampleSets, sets);
+    if (ret) {
+        log_error("Could not set sample buffer destructor, ret %d", ret);
+        sample_cache_release(sets);
+        clReleaseMemObject(buf);
+        return NULL;
+    }
+
+    return buf;
+}
+
+int setup_samples(struct sample_data *s, int sampleRoot, struct configuration *cfg, cl_context context)
+{
+    // Samples are computed in the kernels instead
+    if (cfg->sampler != SAMPLER_SETS) {
+        s->numSampleSets = 0;
+        return 0;
+    }
+
+    // Kernels still queued keep the old buffers (and so the sets
+    // behind them) alive until they're done
+    if (s->squareSampleBuf)
+        clReleaseMemObject(s->squareSampleBuf);
+    if (s->diskSampleBuf)
+        clReleaseMemObject(s->diskSampleBuf);
+    s->squareSampleBuf = NULL;
+    s->diskSampleBuf = NULL;
+
+    s->numSampleSets = cfg->width * 23.5;
+
+    struct sample_sets *sets = sample_cache_acquire(sampleRoot, s->numSampleSets,
+            cfg->sampleSetType, cfg->sampleSeed);
+    if (!sets) {
+        log_error("Could not generate sample sets");
+        return 1;
+    }
+
+    s->squareSampleBuf = createSampleBuffer(context, sets, sets->square);
+    s->diskSampleBuf = createSampleBuffer(context, sets, sets->disk);
+
+    // The buffers hold their own references now
+    sample_cache_release(sets);
+
+    if (!s->squareSampleBuf || !s->diskSampleBuf)
+        return 1;
+
+    return 0;
+}
+
+/*
+ * Configuration and state uploads don't block. A non-blocking write
+ * reads host memory whenever the device gets to it, so each one copies
+ * from the staged copy belonging to its batch slot rather than from
+ * the caller's struct, which may change before then.
+ */
+
+/* The event argument for a command the profiler (if any) should time */
+#define PROFILE_EVENT(r, event) ((r)->profiler ? &(event) : NULL)
+
+/* Pass a command's event from PROFILE_EVENT() on to the profiler */
+static void profileCommand(struct renderer *r, int stage, cl_event event)
+{
+    if (r->profiler) {
+        profiler_add_event(r->profiler, stage, event);
+        clReleaseEvent(event);
+    }
+}
+
+static int updateConfigBuffer(struct renderer *r, struct configuration *config, int slot)
+{
+    cl_event event;
+
+    if (r->stale_config) {
+        log_debug("Configuration changed, updating");
+        r->stale_config = 0;
+        r->stagedConfig[slot] = *config;
+        int ret = clEnqueueWriteBuffer(r->command_queue, r->configBuf, 0, 0,
+                sizeof(struct configuration), &r->stagedConfig[slot], 0, NULL,
+                PROFILE_EVENT(r, event));
+        if (ret) {
+            log_error("Error updating configuration buffer, ret %d", ret);
+            return ret;
+        }
+        profileCommand(r, STAGE_UPLOAD, event);
+    }
+
+    return 0;
+}
+
+static int updateStateBuffer(struct renderer *r, struct state *state, int slot)
+{
+    cl_event event;
+
+    if (r->stale_state) {
+        r->stale_state = 0;
+        r->stagedState[slot] = *state;
+        int ret = clEnqueueWriteBuffer(r->command_queue, r->stateBuf, 0, 0,
+                sizeof(struct state), &r->stagedState[slot], 0, NULL, PROFILE_EVENT(r, event));
+        if (ret) {
+            log_error("Error updating state buffer, ret %d", ret);
+            return ret;
+        }
+        profileCommand(r, STAGE_UPLOAD, event);
+    }
+
+    return 0;
+}
+
+/**
+ * Upload one scene array, first reallocating its buffer if the array
+ * has outgrown it. Buffers are never created empty since OpenCL doesn't
+ * allow zero-sized buffers.
+ */
+static int uploadSceneArray(struct renderer *r, cl_mem *buf, size_t *bufSize,
+        void *data, size_t size)
+{
+    cl_event event;
+    cl_int ret;
+
+    if (!*buf || *bufSize < size) {
+        if (*buf)
+            clReleaseMemObject(*buf);
+
+        *bufSize = MAXF(size, 1);
+        *buf = clCreateBuffer(r->context, CL_MEM_READ_ONLY, *bufSize, NULL, &ret);
+        if (ret) {
+            log_error("Could not create scene buffer of %ld bytes, ret %d", *bufSize, ret);
+            return ret;
+        }
+    }
+
+    if (size == 0)
+        return 0;
+
+    ret = clEnqueueWriteBuffer(r->command_queue, *buf, 1, 0, size, data, 0, NULL,
+            PROFILE_EVENT(r, event));
+    if (ret) {
+        log_error("Error updating scene buffer, ret %d", ret);
+        return ret;
+    }
+    profileCommand(r, STAGE_UPLOAD, event);
+
+    return 0;
+}
+
+/* Point a raytracer kernel at the shadow cache, or at none */
+static int setShadowCacheArgs(struct renderer *r, cl_kernel kernel)
+{
+    cl_int ret;
+
+    ret  = clSetKernelArg(kernel, RAYTRACER_SHADOW_CACHE_ARG, sizeof(cl_mem),
+            &r->shadowCacheBuf);
+    ret |= clSetKernelArg(kernel, RAYTRACER_SHADOW_CACHE_ARG + 1, sizeof(cl_uint),
+            &r->shadowCacheLights);
+    if (ret)
+        log_error("Could not set shadow cache kernel arguments, ret %d", ret);
+
+    return ret;
+}
+
+/* Forget the occluders in a device's shadow cache, if it has one, so a
+new frame doesn't start from the last one's */
+static int clearShadowCache(struct renderer *d)
+{
+    static const cl_uint none = 0;
+    cl_int ret;
+
+    if (!d->shadowCacheBuf)
+        return 0;
+
+    ret = clEnqueueFillBuffer(d->command_queue, d->shadowCacheBuf, &none, sizeof(none), 0,
+            sizeof(cl_uint) * d->shadowCacheLights * d->numPixels, 0, NULL, NULL);
+    if (ret)
+        log_error("Could not clear shadow cache, ret %d", ret);
+
+    return ret;
+}
+
+/* Give each pixel's shadow cache a slot per light in the scene, up to
+SHADOW_CACHE_MAX_LIGHTS, reallocating it if that changed */
+static int resizeShadowCache(struct renderer *r, cl_uint numLights)
+{
+    cl_uint lights = MINF(numLights, SHADOW_CACHE_MAX_LIGHTS);
+    cl_int ret;
+
+    if (!r->useShadowCache || lights == r->shadowCacheLights)
+        return 0;
+
+    if (r->shadowCacheBuf) {
+        clReleaseMemObject(r->shadowCacheBuf);
+        r->shadowCacheBuf = NULL;
+    }
+    r->shadowCacheLights = lights;
+
+    if (lights > 0) {
+        r->shadowCacheBuf = clCreateBuffer(r->context, CL_MEM_READ_WRITE,
+                sizeof(cl_uint) * lights * r->numPixels, NULL, &ret);
+        if (ret) {
+            log_error("Could not create shadow cache buffer, ret %d", ret);
+            r->shadowCacheBuf = NULL;
+            r->shadowCacheLights = 0;
+            return ret;
+        }
+
+        ret = clearShadowCache(r);
+        if (ret)
+            return ret;
+    }
+
+    return setShadowCacheArgs(r, r->kernel);
+}
+
+static int updateSceneBuffers(struct renderer *r, struct scene *scene)
+{
+    cl_event event;
+    int ret;
+
+    if (r->stale_scene) {
+        log_debug("Scene changed, updating");
+        r->stale_scene = 0;
+
+        ret = clEnqueueWriteBuffer(r->command_queue, r->sceneBuf, 1, 0,
+                sizeof(struct SceneHeader), &scene->header, 0, NULL, PROFILE_EVENT(r, event));
+        if (ret) {
+            log_error("Error updating scene buffer, ret %d", ret);
+            return ret;
+        }
+        profileCommand(r, STAGE_UPLOAD, event);
+
+        ret  = uploadSceneArray(r, &r->objectBuf, &r->objectBufSize, scene->objects,
+                sizeof(struct Object) * scene->header.numObjects);
+        ret |= uploadSceneArray(r, &r->materialBuf, &r->materialBufSize, scene->materials,
+                sizeof(struct Material) * scene->header.numMaterials);
+        ret |= uploadSceneArray(r, &r->lightBuf, &r->lightBufSize, scene->lights,
+                sizeof(struct Light) * scene->header.numLights);
+        ret |= uploadSceneArray(r, &r->bvhNodeBuf, &r->bvhNodeBufSize, scene->bvhNodes,
+                sizeof(struct BVHNode) * scene->header.numBVHNodes);
+        ret |= uploadSceneArray(r, &r->primIndexBuf, &r->primIndexBufSize, scene->primIndices,
+                sizeof(cl_uint) * scene->header.numObjects);
+        ret |= uploadSceneArray(r, &r->vertexBuf, &r->vertexBufSize, scene->vertices,
+                sizeof(cl_float) * 3 * scene->header.numVertices);
+        ret |= uploadSceneArray(r, &r->indexBuf, &r->indexBufSize, scene->indices,
+                sizeof(cl_uint) * 3 * scene->header.numTriangles);
+        ret |= uploadSceneArray(r, &r->lightNodeBuf, &r->lightNodeBufSize, scene->lightNodes,
+                sizeof(struct LightNode) * scene->header.numLightNodes);
+        ret |= uploadSceneArray(r, &r->envTexelBuf, &r->envTexelBufSize, scene->envTexels,
+                sizeof(cl_float4) * scene->header.envWidth * scene->header.envHeight);
+        ret |= uploadSceneArray(r, &r->envDistributionBuf, &r->envDistributionBufSize,
+                scene->envDistribution, scene->envDistribution ? sizeof(cl_float) *
+                ((scene->header.envHeight + 1) +
+                 scene->header.envHeight * (scene->header.envWidth + 1)) : 0);
+        if (ret)
+            return ret;
+
+        // Records of the old scene's light would be wrong now
+        ret  = irradiance_clear(&r->irradiance, r);
+        ret |= resizeShadowCache(r, scene->header.numLights);
+        if (ret)
+            return ret;
+
+        // Buffers may have been reallocated
+        ret = renderer_set_scene_args(r, r->kernel, RAYTRACER_SCENE_ARG);
+        if (!ret && r->useWavefront)
+            ret = wavefront_set_scene_args(&r->wavefront, r);
+        if (ret)
+            return ret;
+    }
+
+    return 0;
+}
+
+/**
+ * Point a kernel's scene arguments at the current scene buffers. The
+ * kernel takes them in the order of SCENE_ARGS (see cl/t2/scene.cl),
+ * starting at argument firstArg.
+ */
+int renderer_set_scene_args(struct renderer *r, cl_kernel kernel, cl_uint firstArg)
+{
+    cl_mem *bufs[] = {
+        &r->sceneBuf, &r->objectBuf, &r->materialBuf, &r->lightBuf,
+        &r->bvhNodeBuf, &r->primIndexBuf, &r->vertexBuf, &r->indexBuf,
+        &r->lightNodeBuf, &r->envTexelBuf, &r->envDistributionBuf
+    };
+    cl_int ret = 0;
+
+    for (int i = 0; i < sizeof(bufs) / sizeof(bufs[0]); i++)
+        ret |= clSetKernelArg(kernel, firstArg + i, sizeof(cl_mem), bufs[i]);
+
+    if (ret)
+        log_error("Could not set scene kernel arguments, ret %d", ret);
+
+    return ret;
+}
+
+/**
+ * Set every argument of a raytracer kernel that stays the same from
+ * one pass to the next.
+ */
+int renderer_set_raytracer_args(struct renderer *r, cl_kernel kernel)
+{
+    cl_int ret;
+
+    ret  = clSetKernelArg(kernel, 0, sizeof(cl_mem), &r->configBuf);
+    ret |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &r->stateBuf);
+    ret |= clSetKernelArg(kernel, 2, sizeof(cl_mem), &r->accumBuf);
+    ret |= clSetKernelArg(kernel, 3, sizeof(cl_mem), &r->adaptive.momentBuf);
+    ret |= clSetKernelArg(kernel, 6, sizeof(cl_mem), &r->tileOrderBuf);
+    ret |= clSetKernelArg(kernel, 12, sizeof(cl_mem), &r->counterBuf);
+    if (ret) {
+        log_error("Could not set kernel argument, ret %d", ret);
+        return ret;
+    }
+
+    ret = setShadowCacheArgs(r, kernel);
+    if (ret)
+        return ret;
+
+    ret = irradiance_set_args(&r->irradiance, kernel, RAYTRACER_IRRADIANCE_ARG);
+    if (ret)
+        return ret;
+
+    return renderer_set_scene_args(r, kernel, RAYTRACER_SCENE_ARG);
+}
+
+int renderer_init(struct renderer *r, cl_context context, cl_device_id device_id,
+        struct configuration *config)
+{
+    cl_int ret;
+
+    r->context = context;
+    r->device_id = device_id;
+    r->dirty_config = 1;
+    r->dirty_state = 1;
+    r->dirty_scene = 1;
+    r->stale_config = 1;
+    r->stale_state = 1;
+    r->stale_scene = 1;
+    r->restart = 1;
+    r->updates = 0;
+    r->rate = 0;
+    r->kernelTime = 0;
+    r->counterBuf = NULL;
+    r->shadowCacheBuf = NULL;
+    r->shadowCacheLights = 0;
+    counters_clear(&r->counts);
+    r->profiler = NULL;
+    r->tileOrderEvent = NULL;
+    r->numPixels = (size_t) config->width * config->height;
+
+    r->objectBuf = NULL;
+    r->materialBuf = NULL;
+    r->lightBuf = NULL;
+    r->bvhNodeBuf = NULL;
+    r->primIndexBuf = NULL;
+    r->vertexBuf = NULL;
+    r->indexBuf = NULL;
+    r->lightNodeBuf = NULL;
+    r->envTexelBuf = NULL;
+    r->envDistributionBuf = NULL;
+    r->objectBufSize = 0;
+    r->materialBufSize = 0;
+    r->lightBufSize = 0;
+    r->bvhNodeBufSize = 0;
+    r->primIndexBufSize = 0;
+    r->vertexBufSize = 0;
+    r->indexBufSize = 0;
+    r->lightNodeBufSize = 0;
+    r->envTexelBufSize = 0;
+    r->envDistributionBufSize = 0;
+
+    r->samples.squareSampleBuf = NULL;
+    r->samples.diskSampleBuf = NULL;
+    r->samples.numSampleSets = 0;
+
+    r->numBatches = 0;
+    for (int i = 0; i < RENDERER_PIPELINE_DEPTH; i++) {
+        r->batchEvents[i] = NULL;
+        r->launchEvents[i] = NULL;
+    }
+
+    log_info("Loading and building OpenCL kernel");
+
+    /* Create a command queue for the device. Launches are timed to
+       size the next ones (see t2/tiles.h). */
+    r->command_queue = clCreateCommandQueue(context, device_id, CL_QUEUE_PROFILING_ENABLE,
+            &ret);
+    if (ret) {
+        log_error("Could not create command queue, ret %d", ret);
+        return 1;
+    }
+
+    /* Create kernel program from the source */
+    r->program = readAndBuildProgram(context, device_id, "cl/t2.cl",
+            config->countRays ? "-DT2_COUNTERS" : NULL, &ret);
+    if (!r->program) {
+        log_error("readAndBuildProgram failed, ret %d", ret);
+        return 1;
+    }
+
+    /* Create OpenCL Kernel */
+    r->kernel = clCreateKernel(r->program, "raytracer", &ret);
+    if (ret) {
+        log_error("Could not create kernel, ret %d", ret);
+        return 1;
+    }
+
+    variants_init(&r->variants, r, config);
+
+    r->resolveKernel = clCreateKernel(r->program, "resolve", &ret);
+    if (ret) {
+        log_error("Could not create resolve kernel, ret %d", ret);
+        return 1;
+    }
+
+    // Perform initial sample allocation/generation
+    ret = setup_samples(&r->samples, config->sampleRoot, config, context);
+    if (ret) {
+        log_error("Could not set up samples");
+        return 1;
+    }
+
+    /* Set up OpenCL buffer reference to configuration */
+    r->configBuf = clCreateBuffer(context, CL_MEM_READ_ONLY,
+            sizeof(struct configuration), NULL, &ret);
+    if (ret) {
+        log_error("Could not create configuration buffer, ret %d", ret);
+        return 1;
+    }
+
+    /* Set up OpenCL buffer for program state */
+    r->stateBuf = clCreateBuffer(context, CL_MEM_READ_ONLY,
+            sizeof(struct state), NULL, &ret);
+    if (ret) {
+        log_error("Could not create state buffer, ret %d", ret);
+        return 1;
+    }
+
+    /* Set up OpenCL buffer for the fixed-size part of the scene; the
+       scene arrays are allocated on first upload */
+    r->sceneBuf = clCreateBuffer(context, CL_MEM_READ_ONLY,
+            sizeof(struct SceneHeader), NULL, &ret);
+    if (ret) {
+        log_error("Could not create scene buffer, ret %d", ret);
+        return 1;
+    }
+
+    /* Set up the per-pixel sample sums */
+    r->accumBuf = clCreateBuffer(context, CL_MEM_READ_WRITE,
+            sizeof(cl_float4) * config->width * config->height, NULL, &ret);
+    if (ret) {
+        log_error("Could not create accumulation buffer, ret %d", ret);
+        return 1;
+    }
+
+    ret  = clSetKernelArg(r->kernel, 0, sizeof(cl_mem), &r->configBuf);
+    ret |= clSetKernelArg(r->kernel, 1, sizeof(cl_mem), &r->stateBuf);
+    ret |= clSetKernelArg(r->kernel, 2, sizeof(cl_mem), &r->accumBuf);
+    ret |= clSetKernelArg(r->resolveKernel, 0, sizeof(cl_mem), &r->configBuf);
+    ret |= clSetKernelArg(r->resolveKernel, 1, sizeof(cl_mem), &r->accumBuf);
+    if (ret) {
+        log_error("Could not set kernel argument, ret %d", ret);
+        return 1;
+    }
+
+    ret = adaptive_init(&r->adaptive, r, config);
+    if (ret)
+        return ret;
+
+    ret = tiles_init(&r->tiles, config);
+    if (ret)
+        return ret;
+
+    ret = photons_init(&r->photons, r, config);
+    if (ret)
+        return ret;
+
+    ret = irradiance_init(&r->irradiance, r, config);
+    if (ret)
+        return ret;
+
+    ret = irradiance_set_args(&r->irradiance, r->kernel, RAYTRACER_IRRADIANCE_ARG);
+    if (ret)
+        return ret;
+
+    r->tileOrder = malloc(sizeof(cl_uint) * r->tiles.numTiles);
+    if (!r->tileOrder) {
+        log_error("Could not allocate tile order for %d tiles", r->tiles.numTiles);
+        return 1;
+    }
+
+    r->tileOrderBuf = clCreateBuffer(context, CL_MEM_READ_ONLY,
+            sizeof(cl_uint) * r->tiles.numTiles, NULL, &ret);
+    if (ret) {
+        log_error("Could not create tile order buffer, ret %d", ret);
+        return 1;
+    }
+
+    /* The counts start at zero and only ever go up */
+    if (config->countRays) {
+        cl_uint zeros[2 * NUM_COUNTERS] = { 0 };
+
+        r->counterBuf = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+                sizeof(zeros), zeros, &ret);
+        if (ret) {
+            log_error("Could not create counter buffer, ret %d", ret);
+            return 1;
+        }
+    }
+
+    /* The shadow cache is sized for the scene's lights when it's
+       uploaded (see resizeShadowCache()), and emptied whenever
+       rendering restarts */
+    r->useShadowCache = config->shadowCache && !config->wavefront;
+    if (config->shadowCache && config->wavefront)
+        log_info("The shadow cache is not supported by the wavefront renderer, ignoring");
+
+    ret  = clSetKernelArg(r->kernel, 3, sizeof(cl_mem), &r->adaptive.momentBuf);
+    ret |= clSetKernelArg(r->kernel, 6, sizeof(cl_mem), &r->tileOrderBuf);
+    ret |= clSetKernelArg(r->kernel, 12, sizeof(cl_mem), &r->counterBuf);
+    ret |= setShadowCacheArgs(r, r->kernel);
+    if (ret) {
+        log_error("Could not set kernel argument, ret %d", ret);
+        return 1;
+    }
+
+    r->useWavefront = config->wavefront;
+    if (r->useWavefront) {
+        log_info("Using the wavefront renderer");
+        if (config->integrator == INTEGRATOR_PATH)
+            log_info("Path tracing is not supported by the wavefront renderer, ignoring");
+        ret = wavefront_init(&r->wavefront, r);
+        if (ret)
+            return ret;
+    }
+
+    ret = multidevice_init(r, config);
+    if (ret)
+        return ret;
+
+    ret = clSetKernelArg(r->resolveKernel, 3, sizeof(cl_mem),
+            r->multi.numHelpers ? &r->multi.remoteAccumBuf : NULL);
+    if (ret) {
+        log_error("Could not set kernel argument, ret %d", ret);
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Replace every device's sample sets after a sample root change, once
+ * queued batches are done reading the old ones. There's nothing to do
+ * when samples are computed in the kernels.
+ */
+int renderer_setup_samples(struct renderer *r, struct configuration *config)
+{
+    int ret = 0;
+
+    if (config->sampler != SAMPLER_SETS)
+        return 0;
+
+    ret |= setup_samples(&r->samples, config->sampleRoot, config, r->context);
+
+    for (int i = 0; i < r->multi.numHelpers; i++) {
+        struct renderer *h = &r->multi.helpers[i];
+
+        ret |= setup_samples(&h->samples, config->sampleRoot, config, h->context);
+    }
+
+    return ret;
+}
+
+/**
+ * Update a device's throughput estimate from a finished launch of the
+ * given number of pixel samples.
+ */
+static void recordLaunch(struct renderer *d, cl_event event, double pixelSamples)
+{
+    cl_ulong start, end;
+
+    if (clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(start), &start, NULL) ||
+            clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(end), &end, NULL) ||
+            end <= start)
+        return;
+
+    d->kernelTime += end - start;
+
+    double rate = pixelSamples / ((end - start) / 1000000.0);
+
+    // Smooth out the odd slow launch, but follow the trace depth or
+    // camera changing quickly
+    d->rate = d->rate > 0 ? (d->rate + rate) / 2 : rate;
+}
+
+/**
+ * Take the counts a finished batch read back. They are running totals,
+ * so the largest seen so far are the latest whatever order batches are
+ * released in.
+ */
+static void recordCounts(struct renderer *d, int slot)
+{
+    for (int i = 0; i < NUM_COUNTERS; i++) {
+        cl_ulong n = d->counterReads[slot][2 * i] |
+            (cl_ulong) d->counterReads[slot][2 * i + 1] << 32;
+
+        if (n > d->counts.counts[i])
+            d->counts.counts[i] = n;
+    }
+}
+
+/* Forget a finished batch, keeping its launch's timing and counts */
+static void releaseSlot(struct renderer *d, int slot)
+{
+    clReleaseEvent(d->batchEvents[slot]);
+    d->batchEvents[slot] = NULL;
+
+    if (d->launchEvents[slot]) {
+        if (d->counterBuf)
+            recordCounts(d, slot);
+        recordLaunch(d, d->launchEvents[slot], d->launchWork[slot]);
+        clReleaseEvent(d->launchEvents[slot]);
+        d->launchEvents[slot] = NULL;
+    }
+}
+
+static int slotFree(struct renderer *d)
+{
+    int slot = d->numBatches % RENDERER_PIPELINE_DEPTH;
+    cl_int status;
+
+    if (!d->batchEvents[slot])
+        return 1;
+
+    if (clGetEventInfo(d->batchEvents[slot], CL_EVENT_COMMAND_EXECUTION_STATUS,
+                sizeof(status), &status, NULL) || status != CL_COMPLETE)
+        return 0;
+
+    releaseSlot(d, slot);
+    return 1;
+}
+
+/**
+ * Returns whether a batch can be enqueued without waiting for one of
+ * the RENDERER_PIPELINE_DEPTH batches already in flight on each device
+ * to finish.
+ */
+int renderer_batch_slot_free(struct renderer *r)
+{
+    if (slotFree(r))
+        return 1;
+
+    for (int i = 0; i < r->multi.numHelpers; i++) {
+        if (slotFree(&r->multi.helpers[i]))
+            return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Pick the device for the next launch: the first one with a free batch
+ * slot, or failing that the fastest, whose slot is likely to free up
+ * first.
+ */
+static struct renderer *chooseDevice(struct renderer *r)
+{
+    struct renderer *fastest = r;
+
+    if (slotFree(r))
+        return r;
+
+    for (int i = 0; i < r->multi.numHelpers; i++) {
+        struct renderer *h = &r->multi.helpers[i];
+
+        if (slotFree(h))
+            return h;
+        if (h->rate > fastest->rate)
+            fastest = h;
+    }
+
+    return fastest;
+}
+
+/* Upload the tile order to a device, once its last upload is done with
+the host copy */
+static int uploadTileOrder(struct renderer *d, struct tiles *t)
+{
+    cl_int ret;
+
+    if (d->tileOrderEvent) {
+        clWaitForEvents(1, &d->tileOrderEvent);
+        clReleaseEvent(d->tileOrderEvent);
+        d->tileOrderEvent = NULL;
+    }
+
+    memcpy(d->tileOrder, t->order, sizeof(cl_uint) * t->numTiles);
+
+    ret = clEnqueueWriteBuffer(d->command_queue, d->tileOrderBuf, 0, 0,
+            sizeof(cl_uint) * t->numTiles, d->tileOrder, 0, NULL, &d->tileOrderEvent);
+    if (ret) {
+        log_error("Error updating tile order buffer, ret %d", ret);
+        return ret;
+    }
+
+    if (d->profiler)
+        profiler_add_event(d->profiler, STAGE_UPLOAD, d->tileOrderEvent);
+
+    return 0;
+}
+
+/**
+ * Start a pass of batchSize samples over every pixel still taking
+ * samples, for the tile scheduler to split into launches.
+ */
+static int beginPass(struct renderer *r, struct configuration *config, struct state *state,
+        struct scene *scene, cl_uint batchSize)
+{
+    struct tiles *t = &r->tiles;
+    size_t listSize, items;
+    int ret;
+
+    if (state->sampleNum == 0) {
+        ret = multidevice_restart(r);
+        if (ret)
+            return ret;
+    }
+
+    // Passes are the only place kernels can change, since launches
+    // share the per-pass arguments
+    ret = variants_select(&r->variants, r, config, scene);
+    for (int i = 0; i < r->multi.numHelpers; i++) {
+        struct renderer *h = &r->multi.helpers[i];
+        ret |= variants_select(&h->variants, h, config, scene);
+    }
+    if (ret)
+        return ret;
+
+    // Photon maps are only built without helpers (see photons_init()),
+    // but every kernel needs its photon map arguments set
+    ret = photons_begin_pass(&r->photons, r, state, scene);
+    for (int i = 0; i < r->multi.numHelpers; i++) {
+        struct renderer *h = &r->multi.helpers[i];
+        ret |= photons_begin_pass(&h->photons, h, state, scene);
+    }
+    if (ret)
+        return ret;
+
+    ret = adaptive_set_pixels(&r->adaptive, r->kernel, 4, state->sampleNum, &listSize);
+    for (int i = 0; i < r->multi.numHelpers; i++) {
+        struct renderer *h = &r->multi.helpers[i];
+        size_t helperListSize;
+
+        ret |= adaptive_set_pixels(&h->adaptive, h->kernel, 4, state->sampleNum,
+                &helperListSize);
+    }
+    if (ret)
+        return ret;
+
+    // Without a list, launches cover whole tiles
+    if (r->adaptive.list < 0)
+        items = (size_t) t->numTiles * t->size * t->size;
+    else
+        items = listSize;
+
+    if (tiles_begin_pass(t, config, items, state->sampleNum, batchSize)) {
+        ret = uploadTileOrder(r, t);
+        for (int i = 0; i < r->multi.numHelpers; i++)
+            ret |= uploadTileOrder(&r->multi.helpers[i], t);
+        if (ret)
+            return ret;
+    }
+
+    return 0;
+}
+
+/**
+ * How much of a pass a device may take in one launch when launches
+ * aren't limited by time: a share of the whole pass in proportion to
+ * its measured speed, or an equal share until every device has been
+ * timed.
+ */
+static size_t deviceShare(struct renderer *r, struct renderer *d, struct configuration *config)
+{
+    size_t items = r->tiles.passItems;
+    int numDevices = r->multi.numHelpers + 1;
+    double totalRate = r->rate;
+
+    if (config->tileBudget > 0 || numDevices == 1)
+        return items;
+
+    for (int i = 0; i < r->multi.numHelpers; i++) {
+        if (r->multi.helpers[i].rate <= 0)
+            return items / numDevices;
+        totalRate += r->multi.helpers[i].rate;
+    }
+
+    if (r->rate <= 0)
+        return items / numDevices;
+
+    return items * (d->rate / totalRate);
+}
+
+/* Enqueue the next launch of the current pass on device d */
+static int enqueueLaunch(struct renderer *r, struct renderer *d,
+        struct configuration *config, int slot)
+{
+    struct tiles *t = &r->tiles;
+    size_t first;
+    size_t global_work_size = tiles_next_launch(t, config, d->rate,
+            deviceShare(r, d, config), &first);
+    cl_uint launchFirst = first;
+    cl_int ret = 0;
+
+    /* Set OpenCL Kernel Parameters */
+    ret |= clSetKernelArg(d->kernel, 7, sizeof(launchFirst), &launchFirst);
+    ret |= clSetKernelArg(d->kernel, 8, sizeof(cl_mem), &d->samples.squareSampleBuf);
+    ret |= clSetKernelArg(d->kernel, 9, sizeof(cl_mem), &d->samples.diskSampleBuf);
+    ret |= clSetKernelArg(d->kernel, 10, sizeof(cl_int), &d->samples.numSampleSets);
+    ret |= clSetKernelArg(d->kernel, 11, sizeof(cl_uint), &t->passBatchSize);
+    if (ret) {
+        log_error("Could not set kernel argument, ret %d", ret);
+        return ret;
+    }
+
+    if (global_work_size == 0)
+        return 0;
+
+    /* Execute OpenCL Kernel */
+    ret = clEnqueueNDRangeKernel(d->command_queue, d->kernel, 1, NULL,
+            &global_work_size, NULL, 0, NULL, &d->launchEvents[slot]);
+    if (ret) {
+        log_error("Could not enqueue task, ret %d", ret);
+        return ret;
+    }
+
+    d->launchWork[slot] = (double) global_work_size * t->passBatchSize;
+
+    /* Make the records it stores visible to the next launch */
+    ret = irradiance_link(&d->irradiance, d);
+    if (ret)
+        return ret;
+
+    /* The counts so far, for when the batch is done */
+    if (d->counterBuf) {
+        ret = clEnqueueReadBuffer(d->command_queue, d->counterBuf, CL_FALSE, 0,
+                sizeof(d->counterReads[slot]), d->counterReads[slot], 0, NULL, NULL);
+        if (ret) {
+            log_error("Could not read counters, ret %d", ret);
+            return ret;
+        }
+    }
+
+    if (d->profiler)
+        profiler_add_event(d->profiler, STAGE_TRACE, d->launchEvents[slot]);
+
+    return 0;
+}
+
+static void passOnDirtyFlags(struct renderer *r, struct renderer *d)
+{
+    d->stale_config |= r->dirty_config;
+    d->stale_state |= r->dirty_state;
+    d->stale_scene |= r->dirty_scene;
+}
+
+/**
+ * Upload any changed configuration or state and enqueue rendering
+ * batchSize samples for some of the pixels, adding them to the
+ * per-pixel sums. A pass starting at sample 0 replaces the sums
+ * instead. The raytracer kernel covers the image in tiles, so a pass
+ * may take several calls, each enqueueing one launch on whichever
+ * device is free; *samplesDone is set to the pass's batch size once
+ * every pixel has had its samples, and to 0 before then. A pass's
+ * batch size is fixed when it starts, and it starts over if
+ * state->sampleNum changes or rendering restarts (see
+ * renderer_restart()). With adaptive sampling, passes only cover the
+ * pixels that haven't converged yet.
+ *
+ * Nothing here waits for a device unless RENDERER_PIPELINE_DEPTH
+ * batches are already in flight on every device (see
+ * renderer_batch_slot_free()) or the scene changed.
+ */
+int renderer_enqueue_batch(struct renderer *r, struct configuration *config,
+        struct state *state, struct scene *scene, cl_uint batchSize, cl_uint *samplesDone)
+{
+    struct tiles *t = &r->tiles;
+    cl_int ret = 0;
+
+    *samplesDone = 0;
+
+    int newPass = r->restart || tiles_pass_done(t) || state->sampleNum != t->passSampleNum;
+
+    if (r->restart) {
+        ret = clearShadowCache(r);
+        for (int i = 0; i < r->multi.numHelpers; i++)
+            ret |= clearShadowCache(&r->multi.helpers[i]);
+        if (ret)
+            return ret;
+    }
+    r->restart = 0;
+
+    passOnDirtyFlags(r, r);
+    for (int i = 0; i < r->multi.numHelpers; i++)
+        passOnDirtyFlags(r, &r->multi.helpers[i]);
+    r->dirty_config = 0;
+    r->dirty_state = 0;
+    r->dirty_scene = 0;
+
+    struct renderer *d = r->useWavefront ? r : chooseDevice(r);
+    int slot = d->numBatches % RENDERER_PIPELINE_DEPTH;
+
+    /* Wait for the batch that last used this slot's staged uploads */
+    if (d->batchEvents[slot]) {
+        clWaitForEvents(1, &d->batchEvents[slot]);
+        releaseSlot(d, slot);
+    }
+
+    /* Update dirty structs */
+    ret  = updateConfigBuffer(d, config, slot);
+    ret |= updateStateBuffer(d, state, slot);
+    ret |= updateSceneBuffers(d, scene);
+    if (ret)
+        return ret;
+
+    if (r->useWavefront) {
+        ret = wavefront_enqueue_batch(&r->wavefront, r, config, state,
+                scene->header.numLights, scene->header.numAreaLights,
+                scene->header.envWidth > 0, batchSize);
+        if (ret)
+            return ret;
+
+        *samplesDone = batchSize;
+    } else {
+        if (newPass) {
+            ret = beginPass(r, config, state, scene, batchSize);
+            if (ret)
+                return ret;
+        }
+
+        ret = enqueueLaunch(r, d, config, slot);
+        if (ret)
+            return ret;
+
+        if (tiles_pass_done(t)) {
+            ret = adaptive_compact(&r->adaptive, r, config,
+                    t->passSampleNum + t->passBatchSize);
+            if (ret)
+                return ret;
+
+            *samplesDone = t->passBatchSize;
+        }
+    }
+
+    /* The batch is done when everything enqueued so far is */
+    ret = clEnqueueMarkerWithWaitList(d->command_queue, 0, NULL, &d->batchEvents[slot]);
+    if (ret) {
+        log_error("Could not enqueue batch marker, ret %d", ret);
+        return ret;
+    }
+
+    d->numBatches++;
+    r->updates++;
+    clFlush(d->command_queue);
+
+    return 0;
+}
+
+/* Make the next batch start a new frame */
+void renderer_restart(struct renderer *r)
+{
+    r->restart = 1;
+}
+
+/**
+ * Bring results from other devices (if any) over to this one, without
+ * waiting for anything. Call this regularly while rendering.
+ */
+int renderer_poll(struct renderer *r)
+{
+    return multidevice_poll(r);
+}
+
+/**
+ * Wait for every batch on every device, and bring all their results
+ * over to this one for resolving.
+ */
+int renderer_finish(struct renderer *r)
+{
+    cl_int ret;
+
+    clFinish(r->command_queue);
+
+    ret = multidevice_finish(r);
+    if (ret)
+        return ret;
+
+    // Every batch is done, so collect their timings
+    for (int slot = 0; slot < RENDERER_PIPELINE_DEPTH; slot++) {
+        if (r->batchEvents[slot])
+            releaseSlot(r, slot);
+        for (int i = 0; i < r->multi.numHelpers; i++) {
+            struct renderer *h = &r->multi.helpers[i];
+            if (h->batchEvents[slot])
+                releaseSlot(h, slot);
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Nanoseconds every device has spent in raytracer launches whose
+ * batches have finished, since the renderer was set up.
+ */
+cl_ulong renderer_kernel_time(struct renderer *r)
+{
+    cl_ulong total = r->kernelTime;
+
+    for (int i = 0; i < r->multi.numHelpers; i++)
+        total += r->multi.helpers[i].kernelTime;
+
+    return total;
+}
+
+/**
+ * Add up every device's counts as of its last finished batch, since
+ * the renderer was set up. Returns 0 if the raytracer kernel isn't
+ * counting (see configuration.countRays).
+ */
+int renderer_counters(struct renderer *r, struct counters *c)
+{
+    *c = r->counts;
+
+    for (int i = 0; i < r->multi.numHelpers; i++)
+        counters_add(c, &r->multi.helpers[i].counts);
+
+    return r->counterBuf != NULL;
+}
+
+/**
+ * Enqueue averaging the per-pixel sums into the output image. This only
+ * needs to happen when the image is about to be shown or saved, not
+ * after every batch. The caller is responsible for making sure the
+ * output image is usable by OpenCL. If event is not NULL, it is set to
+ * an event that completes along with the resolve.
+ */
+int renderer_enqueue_resolve(struct renderer *r, struct configuration *config,
+        cl_mem output, cl_event *event)
+{
+    size_t global_work_size[2] = { config->width, config->height };
+    cl_event resolveEvent;
+    cl_int ret;
+
+    ret = clSetKernelArg(r->resolveKernel, 2, sizeof(cl_mem), &output);
+    if (ret) {
+        log_error("Could not set kernel argument, ret %d", ret);
+        return ret;
+    }
+
+    ret = clEnqueueNDRangeKernel(r->command_queue, r->resolveKernel, 2, NULL,
+            global_work_size, NULL, 0, NULL, event || r->profiler ? &resolveEvent : NULL);
+    if (ret) {
+        log_error("Could not enqueue resolve, ret %d", ret);
+        return ret;
+    }
+
+    if (r->profiler)
+        profiler_add_event(r->profiler, STAGE_RESOLVE, resolveEvent);
+    if (event)
+        *event = resolveEvent;
+    else if (r->profiler)
+        clReleaseEvent(resolveEvent);
+
+    return 0;
+}
+
+/**
+ * Returns whether adaptive sampling has found every pixel of the
+ * current frame converged, so further batches would do nothing. This
+ * lags the device by however long the active pixel count takes to
+ * read back.
+ */
+int renderer_frame_converged(struct renderer *r)
+{
+    return adaptive_converged(&r->adaptive);
+}
+
+void renderer_release(struct renderer *r)
+{
+    clFlush(r->command_queue);
+    clFinish(r->command_queue);
+
+    if (r->samples.squareSampleBuf)
+        clReleaseMemObject(r->samples.squareSampleBuf);
+    if (r->samples.diskSampleBuf)
+        clReleaseMemObject(r->samples.diskSampleBuf);
+
+    for (int i = 0; i < RENDERER_PIPELINE_DEPTH; i++) {
+        if (r->batchEvents[i])
+            clReleaseEvent(r->batchEvents[i]);
+        if (r->launchEvents[i])
+            clReleaseEvent(r->launchEvents[i]);
+    }
+
+    clReleaseMemObject(r->configBuf);
+    clReleaseMemObject(r->stateBuf);
+    clReleaseMemObject(r->sceneBuf);
+    clReleaseMemObject(r->accumBuf);
+    if (r->counterBuf)
+        clReleaseMemObject(r->counterBuf);
+    if (r->shadowCacheBuf)
+        clReleaseMemObject(r->shadowCacheBuf);
+
+    if (r->objectBuf)
+        clReleaseMemObject(r->objectBuf);
+    if (r->materialBuf)
+        clReleaseMemObject(r->materialBuf);
+    if (r->lightBuf)
+        clReleaseMemObject(r->lightBuf);
+    if (r->bvhNodeBuf)
+        clReleaseMemObject(r->bvhNodeBuf);
+    if (r->primIndexBuf)
+        clReleaseMemObject(r->primIndexBuf);
+    if (r->vertexBuf)
+        clReleaseMemObject(r->vertexBuf);
+    if (r->indexBuf)
+        clReleaseMemObject(r->indexBuf);
+    if (r->lightNodeBuf)
+        clReleaseMemObject(r->lightNodeBuf);
+    if (r->envTexelBuf)
+        clReleaseMemObject(r->envTexelBuf);
+    if (r->envDistributionBuf)
+        clReleaseMemObject(r->envDistributionBuf);
+    if (r->useWavefront)
+        wavefront_release(&r->wavefront);
+    adaptive_release(&r->adaptive);
+    tiles_release(&r->tiles);
+    photons_release(&r->photons);
+    irradiance_release(&r->irradiance);
+    multidevice_release(r);
+
+    if (r->tileOrderEvent)
+        clReleaseEvent(r->tileOrderEvent);
+    clReleaseMemObject(r->tileOrderBuf);
+    free(r->tileOrder);
+    variants_release(&r->variants, r);
+    clReleaseKernel(r->kernel);
+    clReleaseKernel(r->resolveKernel);
+    clReleaseProgram(r->program);
+    clReleaseCommandQueue(r->command_queue);
+}
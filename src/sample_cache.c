@@ -0,0 +1,262 @@
+#include <stdlib.h>
+#include <pthread.h>
+
+#include <t2/sample_cache.h>
+#include <t2/samplers.h>
+#include <t2/logging.h>
+
+/*
+ * Sample sets take a while to generate at high sample roots, so they
+ * are kept around once made, and whenever sets are handed out the sets
+ * for the sample roots either side of them are built on a background
+ * thread. Changing the sample root by one then usually finds its sets
+ * ready rather than stalling the key handler.
+ *
+ * Sets are reference counted: each OpenCL buffer made from them holds
+ * a reference (see setup_samples()), so they stay alive for as long as
+ * any queued kernel might read them. Sets nobody holds are dropped once
+ * they're neither next to the sample root in use nor affordable.
+ */
+
+/* Entry states */
+#define SETS_QUEUED   0
+#define SETS_BUILDING 1
+#define SETS_READY    2
+#define SETS_FAILED   3
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t changed = PTHREAD_COND_INITIALIZER;
+static struct sample_sets *entries = NULL;
+static int workerStarted = 0;
+
+/* What was last acquired; prefetching and eviction work around it */
+static struct sample_sets current;
+
+size_t sample_sets_bytes(struct sample_sets *sets)
+{
+    return sizeof(cl_float) * 2 * sets->sampleRoot * sets->sampleRoot * sets->numSets;
+}
+
+static int matches(struct sample_sets *e, int sampleRoot, size_t numSets, int type,
+        uint64_t seed)
+{
+    return e->sampleRoot == sampleRoot && e->numSets == numSets && e->type == type &&
+        e->seed == seed;
+}
+
+static struct sample_sets *find(int sampleRoot, size_t numSets, int type, uint64_t seed)
+{
+    for (struct sample_sets *e = entries; e; e = e->next) {
+        if (matches(e, sampleRoot, numSets, type, seed))
+            return e;
+    }
+
+    return NULL;
+}
+
+static int wanted(struct sample_sets *e)
+{
+    return e->refs > 0 || (matches(e, e->sampleRoot, current.numSets, current.type,
+                current.seed) && abs(e->sampleRoot - current.sampleRoot) <= 1);
+}
+
+/* Drop sets nobody holds, unwanted ones first, until what's left
+unheld fits in SAMPLE_CACHE_SPARE_BYTES. Called with the lock held. */
+static void evict()
+{
+    size_t spare = 0;
+
+    for (struct sample_sets **p = &entries; *p;) {
+        struct sample_sets *e = *p;
+
+        if (e->refs > 0 || e->state == SETS_BUILDING) {
+            p = &e->next;
+            continue;
+        }
+
+        if (e->state == SETS_FAILED || !wanted(e) ||
+                spare + sample_sets_bytes(e) > SAMPLE_CACHE_SPARE_BYTES) {
+            *p = e->next;
+            free(e->square);
+            free(e->disk);
+            free(e);
+            continue;
+        }
+
+        spare += sample_sets_bytes(e);
+        p = &e->next;
+    }
+}
+
+/* Generate an entry's sets. Called without the lock held; the entry
+is in SETS_BUILDING so nothing else touches it. */
+static int build(struct sample_sets *e)
+{
+    size_t size = sample_sets_bytes(e);
+
+    e->square = malloc(size);
+    e->disk = malloc(size);
+    if (!e->square || !e->disk) {
+        log_error("Could not allocate %ld bytes of memory for sample sets", 2 * size);
+        return 1;
+    }
+
+    // The disk sets get their own stream of the seed
+    generateSampleSets(e->square, e->numSets, e->sampleRoot, e->type, e->seed, NULL);
+    generateSampleSets(e->disk, e->numSets, e->sampleRoot, e->type, ~e->seed,
+            mapToUnitDisk);
+
+    return 0;
+}
+
+static void *worker(void *arg)
+{
+    pthread_mutex_lock(&lock);
+
+    for (;;) {
+        struct sample_sets *e = entries;
+        while (e && e->state != SETS_QUEUED)
+            e = e->next;
+
+        if (!e) {
+            pthread_cond_wait(&changed, &lock);
+            continue;
+        }
+
+        e->state = SETS_BUILDING;
+        pthread_mutex_unlock(&lock);
+
+        int failed = build(e);
+        log_debug("Prebuilt %s sample sets for sample root %d", sample_set_type_name(e->type),
+                e->sampleRoot);
+
+        pthread_mutex_lock(&lock);
+        e->state = failed ? SETS_FAILED : SETS_READY;
+        evict();
+        pthread_cond_broadcast(&changed);
+    }
+
+    return NULL;
+}
+
+/* Queue sets for the worker, if they aren't there already and would
+fit. Called with the lock held. */
+static void prefetch(int sampleRoot, size_t numSets, int type, uint64_t seed)
+{
+    if (sampleRoot < 1 || sampleRoot > MAX_SAMPLE_ROOT || find(sampleRoot, numSets, type, seed))
+        return;
+
+    struct sample_sets *e = calloc(1, sizeof(struct sample_sets));
+    if (!e)
+        return;
+
+    e->sampleRoot = sampleRoot;
+    e->numSets = numSets;
+    e->type = type;
+    e->seed = seed;
+    e->state = SETS_QUEUED;
+
+    if (sample_sets_bytes(e) > SAMPLE_CACHE_SPARE_BYTES) {
+        free(e);
+        return;
+    }
+
+    if (!workerStarted) {
+        pthread_t thread;
+
+        if (pthread_create(&thread, NULL, worker, NULL)) {
+            log_warn("Could not start the sample set thread; sets will be built on demand");
+            free(e);
+            return;
+        }
+        pthread_detach(thread);
+        workerStarted = 1;
+    }
+
+    e->next = entries;
+    entries = e;
+    pthread_cond_broadcast(&changed);
+}
+
+/**
+ * Returns numSets square and disk sample sets of the given type and
+ * sample root, made from seed, with a reference held on them; NULL if
+ * they could not be made. Waits for them if the background thread is
+ * building them already, or builds them if nobody is.
+ */
+struct sample_sets *sample_cache_acquire(int sampleRoot, size_t numSets, int type,
+        uint64_t seed)
+{
+    pthread_mutex_lock(&lock);
+
+    current.sampleRoot = sampleRoot;
+    current.numSets = numSets;
+    current.type = type;
+    current.seed = seed;
+
+    struct sample_sets *e = find(sampleRoot, numSets, type, seed);
+    if (!e) {
+        e = calloc(1, sizeof(struct sample_sets));
+        if (!e) {
+            pthread_mutex_unlock(&lock);
+            log_error("Could not allocate sample set cache entry");
+            return NULL;
+        }
+
+        e->sampleRoot = sampleRoot;
+        e->numSets = numSets;
+        e->type = type;
+        e->seed = seed;
+        e->state = SETS_QUEUED;
+        e->next = entries;
+        entries = e;
+    }
+
+    e->refs++;
+
+    if (e->state == SETS_QUEUED) {
+        log_info("Generating %d %s samples per pixel, %ld sets", sampleRoot * sampleRoot,
+                sample_set_type_name(type), numSets);
+
+        e->state = SETS_BUILDING;
+        pthread_mutex_unlock(&lock);
+        int failed = build(e);
+        pthread_mutex_lock(&lock);
+
+        e->state = failed ? SETS_FAILED : SETS_READY;
+        pthread_cond_broadcast(&changed);
+    }
+
+    while (e->state == SETS_BUILDING)
+        pthread_cond_wait(&changed, &lock);
+
+    if (e->state == SETS_FAILED) {
+        e->refs--;
+        evict();
+        pthread_mutex_unlock(&lock);
+        return NULL;
+    }
+
+    evict();
+    prefetch(sampleRoot - 1, numSets, type, seed);
+    prefetch(sampleRoot + 1, numSets, type, seed);
+
+    pthread_mutex_unlock(&lock);
+
+    return e;
+}
+
+void sample_cache_retain(struct sample_sets *sets)
+{
+    pthread_mutex_lock(&lock);
+    sets->refs++;
+    pthread_mutex_unlock(&lock);
+}
+
+void sample_cache_release(struct sample_sets *sets)
+{
+    pthread_mutex_lock(&lock);
+    sets->refs--;
+    evict();
+    pthread_mutex_unlock(&lock);
+}
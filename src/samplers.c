@@ -1,33 +1,76 @@
-
 #include <stdlib.h>
 #include <math.h>
 #include <string.h>
+#include <strings.h>
+#include <pthread.h>
+#include <unistd.h>
 
 #include <t2/samplers.h>
+#include <t2/logging.h>
+
+/* Most threads generateSampleSets() will use */
+#define MAX_THREADS 64
+
+/* splitmix64's finalizer */
+static inline uint64_t mix64(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ull;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebull;
+    x ^= x >> 31;
+    return x;
+}
 
-static inline float randFloat()
+void rng_seed(struct rng *rng, uint64_t seed)
 {
-    u_int32_t upper_bound = 0xffffffff;
-    return ((float)arc4random_uniform(upper_bound))/((float)upper_bound);
+    rng->seed = mix64(seed);
+    rng->counter = 0;
 }
 
-void shuffle(void *buf, size_t n, size_t elem_size)
+uint32_t rng_next(struct rng *rng)
 {
-    void *item;
+    return mix64(rng->seed + 0x9e3779b97f4a7c15ull * ++rng->counter) >> 32;
+}
 
-    if (n > 1) {
-        item = malloc(elem_size);
+/* Uniform in [0, 1) */
+float rng_float(struct rng *rng)
+{
+    return (rng_next(rng) >> 8) * (1.f / 16777216.f);
+}
 
-        size_t i;
-        for (i = n - 1; i > 0; i--) {
-            size_t j = (unsigned int) (arc4random_uniform(i+1));
+/* Uniform in [0, n), without modulo bias (Lemire's method) */
+uint32_t rng_range(struct rng *rng, uint32_t n)
+{
+    uint64_t m = (uint64_t) rng_next(rng) * n;
 
-            memcpy(item, buf + (j * elem_size), elem_size);
-            memcpy(buf + (j * elem_size), buf + (i * elem_size), elem_size);
-            memcpy(buf + (i * elem_size), item, elem_size);
-        }
+    if ((uint32_t) m < n) {
+        uint32_t threshold = -n % n;
+        while ((uint32_t) m < threshold)
+            m = (uint64_t) rng_next(rng) * n;
+    }
+
+    return m >> 32;
+}
+
+static void swapBytes(char *a, char *b, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        char tmp = a[i];
+        a[i] = b[i];
+        b[i] = tmp;
+    }
+}
+
+void shuffle(void *buf, size_t n, size_t elem_size, struct rng *rng)
+{
+    char *items = buf;
+
+    for (size_t i = n - 1; n > 1 && i > 0; i--) {
+        size_t j = rng_range(rng, i + 1);
 
-        free(item);
+        if (j != i)
+            swapBytes(items + j * elem_size, items + i * elem_size, elem_size);
     }
 }
 
@@ -65,47 +108,236 @@ void mapToUnitDisk(float *x, float *y)
     *y = r * sin(phi);
 }
 
-void generateRandomSampleSet(float *samples, int sampleRoot, void(*map)(float*, float*))
+static void generateRandom(float *samples, int sampleRoot, struct rng *rng)
 {
-    float x, y;
-    int i, j;
-
-    for (i = 0; i < sampleRoot; i++) {
-        for (j = 0; j < sampleRoot; j++) {
-            x = randFloat();
-            y = randFloat();
+    for (int i = 0; i < sampleRoot * sampleRoot; i++) {
+        samples[i * 2]     = rng_float(rng);
+        samples[i * 2 + 1] = rng_float(rng);
+    }
+}
 
-            if (map)
-                map(&x, &y);
+static void generateJittered(float *samples, int sampleRoot, struct rng *rng)
+{
+    float inc = 1.0 / ((float) sampleRoot);
 
-            samples[i * sampleRoot * 2 + j * 2]     = x;
-            samples[i * sampleRoot * 2 + j * 2 + 1] = y;
+    for (int i = 0; i < sampleRoot; i++) {
+        for (int j = 0; j < sampleRoot; j++) {
+            samples[i * sampleRoot * 2 + j * 2]     = (i * inc) + rng_float(rng) * inc;
+            samples[i * sampleRoot * 2 + j * 2 + 1] = (j * inc) + rng_float(rng) * inc;
         }
     }
+}
+
+/* One sample in each row and each column of an n by n grid, n being
+the number of samples */
+static void generateNRooks(float *samples, int sampleRoot, struct rng *rng)
+{
+    int n = sampleRoot * sampleRoot;
+
+    for (int i = 0; i < n; i++) {
+        samples[i * 2]     = (i + rng_float(rng)) / n;
+        samples[i * 2 + 1] = (i + rng_float(rng)) / n;
+    }
 
-    if (sampleRoot > 1)
-        shuffle(samples, sampleRoot * sampleRoot, sizeof(float) * 2);
+    // Pair the x coordinates up with the y coordinates at random
+    for (int i = n - 1; i > 0; i--) {
+        int j = rng_range(rng, i + 1);
+        float tmp = samples[i * 2];
+        samples[i * 2] = samples[j * 2];
+        samples[j * 2] = tmp;
+    }
 }
 
-void generateJitteredSampleSet(float *samples, int sampleRoot, void(*map)(float*, float*))
+/* Jittered and n-rooks at once (Chiu, Shirley and Wang 1994): start
+from the canonical arrangement, then shuffle x coordinates within each
+column of cells and y coordinates within each row */
+static void generateMultiJittered(float *samples, int sampleRoot, struct rng *rng)
 {
-    float inc = 1.0 / ((float) sampleRoot);
-    float x, y;
-    int i, j;
+    int n = sampleRoot;
+    float subcell = 1.f / (n * n);
 
-    for (i = 0; i < sampleRoot; i++) {
-        for (j = 0; j < sampleRoot; j++) {
-            x = (i * inc) + randFloat() * inc;
-            y = (j * inc) + randFloat() * inc;
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < n; j++) {
+            samples[(i * n + j) * 2]     = (i * n + j + rng_float(rng)) * subcell;
+            samples[(i * n + j) * 2 + 1] = (j * n + i + rng_float(rng)) * subcell;
+        }
+    }
 
-            if (map)
-                map(&x, &y);
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < n - 1; j++) {
+            int k = j + rng_range(rng, n - j);
+            float tmp = samples[(i * n + j) * 2];
+            samples[(i * n + j) * 2] = samples[(i * n + k) * 2];
+            samples[(i * n + k) * 2] = tmp;
+        }
+    }
 
-            samples[i * sampleRoot * 2 + j * 2]     = x;
-            samples[i * sampleRoot * 2 + j * 2 + 1] = y;
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < n - 1; j++) {
+            int k = j + rng_range(rng, n - j);
+            float tmp = samples[(j * n + i) * 2 + 1];
+            samples[(j * n + i) * 2 + 1] = samples[(k * n + i) * 2 + 1];
+            samples[(k * n + i) * 2 + 1] = tmp;
         }
     }
+}
+
+static float radicalInverse2(uint32_t i)
+{
+    i = (i << 16) | (i >> 16);
+    i = ((i & 0x00ff00ff) << 8) | ((i & 0xff00ff00) >> 8);
+    i = ((i & 0x0f0f0f0f) << 4) | ((i & 0xf0f0f0f0) >> 4);
+    i = ((i & 0x33333333) << 2) | ((i & 0xcccccccc) >> 2);
+    i = ((i & 0x55555555) << 1) | ((i & 0xaaaaaaaa) >> 1);
+    return (i >> 8) * (1.f / 16777216.f);
+}
+
+/* The Hammersley point set, shifted by a random offset (wrapping
+around) so that each set is different */
+static void generateHammersley(float *samples, int sampleRoot, struct rng *rng)
+{
+    int n = sampleRoot * sampleRoot;
+    float shiftX = rng_float(rng);
+    float shiftY = rng_float(rng);
+
+    for (int i = 0; i < n; i++) {
+        float x = (float) i / n + shiftX;
+        float y = radicalInverse2(i) + shiftY;
+
+        samples[i * 2]     = x - floorf(x);
+        samples[i * 2 + 1] = y - floorf(y);
+    }
+}
+
+/**
+ * Fill in one set of sampleRoot² 2D samples of the given type, in
+ * random order, optionally mapping each one (e.g. with mapToUnitDisk).
+ */
+void generateSampleSet(float *samples, int sampleRoot, int type, struct rng *rng,
+        void(*map)(float*, float*))
+{
+    int n = sampleRoot * sampleRoot;
+
+    switch (type) {
+        case SAMPLE_SET_RANDOM:
+            generateRandom(samples, sampleRoot, rng);
+            break;
+        case SAMPLE_SET_NROOKS:
+            generateNRooks(samples, sampleRoot, rng);
+            break;
+        case SAMPLE_SET_MULTIJITTERED:
+            generateMultiJittered(samples, sampleRoot, rng);
+            break;
+        case SAMPLE_SET_HAMMERSLEY:
+            generateHammersley(samples, sampleRoot, rng);
+            break;
+        default:
+            generateJittered(samples, sampleRoot, rng);
+            break;
+    }
+
+    if (map) {
+        for (int i = 0; i < n; i++)
+            map(&samples[i * 2], &samples[i * 2 + 1]);
+    }
+
+    shuffle(samples, n, sizeof(float) * 2, rng);
+}
+
+struct generateJob {
+    float *samples;
+    size_t firstSet;
+    size_t numSets;
+    int sampleRoot;
+    int type;
+    uint64_t seed;
+    void(*map)(float*, float*);
+};
+
+static void *generateSets(void *arg)
+{
+    struct generateJob *job = arg;
+    size_t setSize = 2 * job->sampleRoot * job->sampleRoot;
+    struct rng rng;
+
+    for (size_t i = job->firstSet; i < job->firstSet + job->numSets; i++) {
+        // Every set has its own stream, so the results don't depend on
+        // how the sets are split between threads
+        rng_seed(&rng, job->seed ^ mix64(i));
+        generateSampleSet(job->samples + i * setSize, job->sampleRoot, job->type, &rng,
+                job->map);
+    }
+
+    return NULL;
+}
+
+/**
+ * Fill in numSets sample sets (see generateSampleSet()), spread over
+ * as many threads as there are processors. The same seed always gives
+ * the same sets.
+ */
+void generateSampleSets(float *samples, size_t numSets, int sampleRoot, int type,
+        uint64_t seed, void(*map)(float*, float*))
+{
+    struct generateJob jobs[MAX_THREADS];
+    pthread_t threads[MAX_THREADS];
+    int started[MAX_THREADS];
+
+    long numThreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (numThreads < 1)
+        numThreads = 1;
+    if (numThreads > MAX_THREADS)
+        numThreads = MAX_THREADS;
+    if (numThreads > numSets)
+        numThreads = numSets > 0 ? numSets : 1;
+
+    for (int t = 0; t < numThreads; t++) {
+        jobs[t].samples = samples;
+        jobs[t].firstSet = numSets * t / numThreads;
+        jobs[t].numSets = numSets * (t + 1) / numThreads - jobs[t].firstSet;
+        jobs[t].sampleRoot = sampleRoot;
+        jobs[t].type = type;
+        jobs[t].seed = seed;
+        jobs[t].map = map;
+
+        // The calling thread does the last share itself, and any share
+        // a thread couldn't be started for
+        started[t] = t < numThreads - 1 &&
+            pthread_create(&threads[t], NULL, generateSets, &jobs[t]) == 0;
+        if (!started[t])
+            generateSets(&jobs[t]);
+    }
+
+    for (int t = 0; t < numThreads; t++) {
+        if (started[t])
+            pthread_join(threads[t], NULL);
+    }
+}
+
+static const char *typeNames[] = {
+    [SAMPLE_SET_RANDOM] = "random",
+    [SAMPLE_SET_JITTERED] = "jittered",
+    [SAMPLE_SET_NROOKS] = "nrooks",
+    [SAMPLE_SET_MULTIJITTERED] = "multijittered",
+    [SAMPLE_SET_HAMMERSLEY] = "hammersley"
+};
+
+#define NUM_TYPES (sizeof(typeNames) / sizeof(typeNames[0]))
+
+const char *sample_set_type_name(int type)
+{
+    if (type < 0 || type >= NUM_TYPES)
+        return NULL;
+
+    return typeNames[type];
+}
+
+int sample_set_type_from_name(char *name)
+{
+    for (int i = 0; i < NUM_TYPES; i++) {
+        if (strcasecmp(name, typeNames[i]) == 0)
+            return i;
+    }
 
-    if (sampleRoot > 1)
-        shuffle(samples, sampleRoot * sampleRoot, sizeof(float) * 2);
+    return -1;
 }
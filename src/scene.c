@@ -0,0 +1,298 @@
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <t2/scene.h>
+#include <t2/obj.h>
+#include <t2/logging.h>
+
+#define INITIAL_CAPACITY 16
+
+static inline cl_float3 vec3(float x, float y, float z)
+{
+    cl_float3 v = { { x, y, z } };
+    return v;
+}
+
+static inline cl_float4 vec4(float x, float y, float z, float w)
+{
+    cl_float4 v = { { x, y, z, w } };
+    return v;
+}
+
+/* Make room for one more element, doubling the allocation as needed */
+static void *ensureCapacity(void *arr, size_t *capacity, size_t count, size_t elemSize)
+{
+    if (count < *capacity)
+        return arr;
+
+    size_t newCapacity = *capacity ? *capacity * 2 : INITIAL_CAPACITY;
+    void *newArr = realloc(arr, newCapacity * elemSize);
+    if (!newArr) {
+        log_error("Could not grow scene array to %ld elements", newCapacity);
+        exit(1);
+    }
+
+    *capacity = newCapacity;
+    return newArr;
+}
+
+void scene_init(struct scene *s)
+{
+    memset(s, 0, sizeof(struct scene));
+}
+
+void scene_release(struct scene *s)
+{
+    free(s->objects);
+    free(s->lights);
+    free(s->materials);
+    free(s->vertices);
+    free(s->indices);
+    free(s->bvhNodes);
+    free(s->primIndices);
+    free(s->lightNodes);
+    free(s->envTexels);
+    free(s->envDistribution);
+    scene_init(s);
+}
+
+cl_uint scene_add_object(struct scene *s, struct Object *o)
+{
+    s->objects = ensureCapacity(s->objects, &s->objectCapacity,
+            s->header.numObjects, sizeof(struct Object));
+    s->objects[s->header.numObjects] = *o;
+    return s->header.numObjects++;
+}
+
+cl_uint scene_add_light(struct scene *s, struct Light *l)
+{
+    s->lights = ensureCapacity(s->lights, &s->lightCapacity,
+            s->header.numLights, sizeof(struct Light));
+    s->lights[s->header.numLights] = *l;
+    if (l->type != LIGHT_POINT)
+        s->header.numAreaLights++;
+    return s->header.numLights++;
+}
+
+cl_uint scene_add_material(struct scene *s, struct Material *m)
+{
+    s->materials = ensureCapacity(s->materials, &s->materialCapacity,
+            s->header.numMaterials, sizeof(struct Material));
+    s->materials[s->header.numMaterials] = *m;
+    return s->header.numMaterials++;
+}
+
+cl_uint scene_add_vertex(struct scene *s, float x, float y, float z)
+{
+    s->vertices = ensureCapacity(s->vertices, &s->vertexCapacity,
+            s->header.numVertices, 3 * sizeof(cl_float));
+
+    cl_float *v = &s->vertices[3 * s->header.numVertices];
+    v[0] = x;
+    v[1] = y;
+    v[2] = z;
+    return s->header.numVertices++;
+}
+
+/* Add a triangle over three vertices added with scene_add_vertex() */
+cl_uint scene_add_triangle(struct scene *s, cl_uint a, cl_uint b, cl_uint c, cl_uint material)
+{
+    s->indices = ensureCapacity(s->indices, &s->indexCapacity,
+            s->header.numTriangles, 3 * sizeof(cl_uint));
+
+    cl_uint *idx = &s->indices[3 * s->header.numTriangles];
+    idx[0] = a;
+    idx[1] = b;
+    idx[2] = c;
+
+    struct Object o;
+    memset(&o, 0, sizeof(o));
+    o.type = OBJECT_TRIANGLE;
+    o.types.triangle.index = s->header.numTriangles++;
+    o.material = material;
+
+    return scene_add_object(s, &o);
+}
+
+static void addSphere(struct scene *s, float x, float y, float z, float radius, cl_uint material)
+{
+    struct Object o;
+    memset(&o, 0, sizeof(o));
+
+    o.type = OBJECT_SPHERE;
+    o.types.sphere.center = vec3(x, y, z);
+    o.types.sphere.radius = radius;
+    o.material = material;
+
+    scene_add_object(s, &o);
+}
+
+static cl_uint addMaterial(struct scene *s, float refl, float reflAmount, float spec,
+        float specAmount, cl_float4 amb, float diff)
+{
+    struct Material m;
+    memset(&m, 0, sizeof(m));
+
+    m.refl = refl;
+    m.reflAmount = reflAmount;
+    m.spec = spec;
+    m.specAmount = specAmount;
+    m.amb = amb;
+    m.diff = diff;
+
+    return scene_add_material(s, &m);
+}
+
+/* The demo scene's camera, spheres, plane and materials */
+static void addDemoObjects(struct scene *s)
+{
+    s->header.cameraType = CAMERA_THINLENS;
+    s->header.cameras.thinLens.up = vec3(0, 1, 0);
+    s->header.cameras.thinLens.vpdist = 3;
+    s->header.cameras.thinLens.fpdist = 4;
+
+    // s->header.cameraType = CAMERA_PINHOLE;
+    // s->header.cameras.pinhole.up = vec3(0, 1, 0);
+    // s->header.cameras.pinhole.vpdist = 3;
+
+    addSphere(s,  2, 1, -4, 1, 3);
+    addSphere(s,  2, 1, -2, 1, 1);
+    addSphere(s,  2, 1,  0, 1, 4);
+    addSphere(s,  2, 1,  2, 1, 1);
+    addSphere(s,  2, 1,  4, 1, 4);
+    addSphere(s,  2, 1,  6, 1, 3);
+    addSphere(s,  2, 1,  8, 1, 3);
+    addSphere(s,  2, 1, 10, 1, 1);
+    addSphere(s, -2, 1, -4, 1, 3);
+    addSphere(s, -2, 1, -2, 1, 5);
+    addSphere(s, -2, 1,  0, 1, 3);
+    addSphere(s, -2, 1,  2, 1, 5);
+    addSphere(s, -2, 1,  4, 1, 4);
+    addSphere(s, -2, 1,  6, 1, 1);
+    addSphere(s, -2, 1,  8, 1, 3);
+    addSphere(s, -2, 1, 10, 1, 5);
+
+    struct Object plane;
+    memset(&plane, 0, sizeof(plane));
+    plane.type = OBJECT_PLANE;
+    plane.types.plane.normal = vec3(0, 1, 0);
+    plane.types.plane.origin = vec3(0, 0, 0);
+    plane.material = 2;
+    scene_add_object(s, &plane);
+
+    //             refl  reflAmount  spec  specAmount  amb                            diff
+    addMaterial(s, 0,    1,          127,  1,          vec4(1, 0.7f, 0.7f, 1),        1);
+    addMaterial(s, 1,    1,          127,  1,          vec4(0, 0.7f, 0.7f, 1),        1);
+    addMaterial(s, 0,    1,          1,    0,          vec4(1, 1, 1, 1),              1);
+    addMaterial(s, 1,    0.1,        10,   1,          vec4(0.7f, 0, 0.7f, 1),        1);
+    addMaterial(s, 0,    1,          64,   0.5,        vec4(1.f, 0, 0, 1),            1);
+    addMaterial(s, 1,    0,          2000, 1,          vec4(0.3f, 0.3f, 1.f, 1.f),    1);
+}
+
+/**
+ * The built-in demo scene: two rows of spheres on a plane, lit by a
+ * single point light.
+ */
+void buildDefaultScene(struct scene *s)
+{
+    addDemoObjects(s);
+
+    struct Light light;
+    memset(&light, 0, sizeof(light));
+    light.center = vec3(0, 30, 0);
+    light.strength = 0.9;
+    light.color = vec4(1.0, 243.f/255.f, 168.f/255.f, 1);
+    scene_add_light(s, &light);
+
+    log_info("Built scene with %d objects, %d materials, %d lights",
+            s->header.numObjects, s->header.numMaterials, s->header.numLights);
+}
+
+/**
+ * The demo scene lit by area lights instead: a rectangle above the
+ * spheres and a sphere off to one side, for soft shadows.
+ */
+void buildAreaLightScene(struct scene *s)
+{
+    addDemoObjects(s);
+
+    struct Light light;
+    memset(&light, 0, sizeof(light));
+    light.type = LIGHT_RECT;
+    light.center = vec3(0, 8, 3);
+    light.edgeU = vec3(6, 0, 0);
+    light.edgeV = vec3(0, 0, 4);
+    light.strength = 0.6;
+    light.color = vec4(1.0, 243.f/255.f, 168.f/255.f, 1);
+    scene_add_light(s, &light);
+
+    memset(&light, 0, sizeof(light));
+    light.type = LIGHT_SPHERE;
+    light.center = vec3(-7, 4, -3);
+    light.radius = 1.5;
+    light.strength = 0.3;
+    light.color = vec4(0.6f, 0.7f, 1.0, 1);
+    scene_add_light(s, &light);
+
+    log_info("Built area light scene with %d objects, %d materials, %d lights",
+            s->header.numObjects, s->header.numMaterials, s->header.numLights);
+}
+
+/**
+ * A size by size grid of small spheres on a plane, lit by numLights
+ * point lights in a ring above it, for benchmarking scenes with many
+ * objects and lights. The camera is a pinhole.
+ */
+void buildGridScene(struct scene *s, int size, int numLights)
+{
+    s->header.cameraType = CAMERA_PINHOLE;
+    s->header.cameras.pinhole.up = vec3(0, 1, 0);
+    s->header.cameras.pinhole.vpdist = 3;
+
+    //             refl  reflAmount  spec  specAmount  amb                            diff
+    addMaterial(s, 0,    1,          64,   0.5,        vec4(0.9f, 0.4f, 0.3f, 1),     1);
+    addMaterial(s, 1,    0.5,        127,  1,          vec4(0.3f, 0.6f, 0.9f, 1),     1);
+    addMaterial(s, 0,    1,          1,    0,          vec4(1, 1, 1, 1),              1);
+
+    for (int i = 0; i < size; i++) {
+        for (int j = 0; j < size; j++) {
+            addSphere(s, (i - size / 2.f) * 1.2f, 0.5f, j * 1.2f, 0.5f, (i + j) % 2);
+        }
+    }
+
+    struct Object plane;
+    memset(&plane, 0, sizeof(plane));
+    plane.type = OBJECT_PLANE;
+    plane.types.plane.normal = vec3(0, 1, 0);
+    plane.types.plane.origin = vec3(0, 0, 0);
+    plane.material = 2;
+    scene_add_object(s, &plane);
+
+    for (int i = 0; i < numLights; i++) {
+        float angle = 2 * M_PI * i / numLights;
+
+        struct Light light;
+        memset(&light, 0, sizeof(light));
+        light.center = vec3(size * cos(angle), 20, size * 0.6f + size * sin(angle));
+        light.strength = 0.9f / numLights;
+        light.color = vec4(1, 1, 1, 1);
+        scene_add_light(s, &light);
+    }
+
+    log_info("Built grid scene with %d objects, %d materials, %d lights",
+            s->header.numObjects, s->header.numMaterials, s->header.numLights);
+}
+
+/**
+ * Load an OBJ mesh into the scene with a plain grey diffuse material.
+ * Returns nonzero on failure.
+ */
+int loadSceneMesh(struct scene *s, const char *path)
+{
+    //                              refl  reflAmount  spec  specAmount  amb                        diff
+    cl_uint material = addMaterial(s, 0,    1,          16,   0.2,        vec4(0.8f, 0.8f, 0.8f, 1), 1);
+
+    return loadOBJ(path, s, material);
+}
@@ -148,7 +148,5 @@ GLuint shader_setup(glResources *res)
         exit(1);
     }
 
-    glGenFramebuffers(1, &(res->fbo));
-
     return 0;
 }
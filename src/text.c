@@ -3,8 +3,10 @@
 #include <t2/text.h>
 #include <t2/shader_setup.h>
 
-#include <OpenGL/gl.h>
-#include <OpenGL/glext.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <t2/opengl_setup.h>
 #include <ft2build.h>
 #include FT_FREETYPE_H
 
@@ -25,9 +27,57 @@ static int ensureFreetypeInitialized()
     return 0;
 }
 
-int loadFont(const char *font_filename, struct font *f, int pixel_height)
+/* Width of font atlases; they're as tall as the glyphs need */
+#define FONT_ATLAS_WIDTH 512
+
+/* Space around each glyph in the atlas, so filtering doesn't bleed one
+into the next */
+#define FONT_ATLAS_PADDING 1
+
+/* Size of the opaque block in the atlas's top left corner */
+#define FONT_ATLAS_SOLID 3
+
+/**
+ * Work out where every glyph goes in the atlas, shelf by shelf, setting
+ * x and y for each character and returning the atlas height.
+ */
+static int placeGlyphs(FT_Face face, struct font *f, int *x, int *y)
 {
+    int shelfX = FONT_ATLAS_SOLID + FONT_ATLAS_PADDING, shelfY = 0;
+    int shelfHeight = FONT_ATLAS_SOLID;
     int ret;
+
+    for (GLubyte c = 0; c < FONT_NUM_CHARACTERS; c++) {
+        ret = FT_Load_Char(face, c, FT_LOAD_RENDER);
+        if (ret) {
+            log_warn("Failed to load glyph at index %d, ret %d", c, ret);
+            continue;
+        }
+
+        int w = face->glyph->bitmap.width;
+        int h = face->glyph->bitmap.rows;
+
+        if (shelfX + w > FONT_ATLAS_WIDTH) {
+            shelfX = 0;
+            shelfY += shelfHeight + FONT_ATLAS_PADDING;
+            shelfHeight = 0;
+        }
+
+        x[c] = shelfX;
+        y[c] = shelfY;
+        shelfX += w + FONT_ATLAS_PADDING;
+        if (h > shelfHeight)
+            shelfHeight = h;
+
+        f->characters[c].loaded = 1;
+    }
+
+    return shelfY + shelfHeight;
+}
+
+int loadFont(const char *font_filename, struct font *f, int pixel_height)
+{
+    int x[FONT_NUM_CHARACTERS], y[FONT_NUM_CHARACTERS];
     ensureFreetypeInitialized();
 
     FT_Face face;
@@ -41,52 +91,76 @@ int loadFont(const char *font_filename, struct font *f, int pixel_height)
         f->characters[i].loaded = 0;
     }
 
-    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-
     FT_Set_Pixel_Sizes(face, 0, pixel_height);
 
-    // Load each character that we care about
+    int atlasHeight = placeGlyphs(face, f, x, y);
+    GLubyte *atlas = calloc((size_t) FONT_ATLAS_WIDTH * atlasHeight, 1);
+    if (!atlas) {
+        log_error("Could not allocate %dx%d font atlas", FONT_ATLAS_WIDTH, atlasHeight);
+        FT_Done_Face(face);
+        return 1;
+    }
+
+    for (int row = 0; row < FONT_ATLAS_SOLID; row++) {
+        for (int col = 0; col < FONT_ATLAS_SOLID; col++)
+            atlas[row * FONT_ATLAS_WIDTH + col] = 255;
+    }
+
+    // Copy in each character that loaded the first time round
     for (GLubyte c = 0; c < FONT_NUM_CHARACTERS; c++) {
-        ret = FT_Load_Char(face, c, FT_LOAD_RENDER);
-        if (ret) {
-            log_warn("Failed to load glyph at index %d, ret %d", c, ret);
+        struct character *ch = &f->characters[c];
+
+        if (!ch->loaded)
+            continue;
+
+        if (FT_Load_Char(face, c, FT_LOAD_RENDER)) {
+            ch->loaded = 0;
             continue;
         }
 
-        GLuint texture;
-        glGenTextures(1, &texture);
-        glBindTexture(GL_TEXTURE_2D, texture);
-        glTexImage2D(GL_TEXTURE_2D,
-                     0,
-                     GL_RED,
-                     face->glyph->bitmap.width,
-                     face->glyph->bitmap.rows,
-                     0,
-                     GL_RED,
-                     GL_UNSIGNED_BYTE,
-                     face->glyph->bitmap.buffer);
-
-        // Set texture options
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-
-        // Now store character for later use
-        f->characters[c].texture = texture;
-        f->characters[c].width = face->glyph->bitmap.width;
-        f->characters[c].rows = face->glyph->bitmap.rows;
-        f->characters[c].bitmap_left = face->glyph->bitmap_left;
-        f->characters[c].bitmap_top = face->glyph->bitmap_top;
-        f->characters[c].advance = face->glyph->advance.x;
+        FT_Bitmap *bitmap = &face->glyph->bitmap;
+        for (int row = 0; row < bitmap->rows; row++) {
+            memcpy(&atlas[(y[c] + row) * FONT_ATLAS_WIDTH + x[c]],
+                    bitmap->buffer + row * bitmap->pitch, bitmap->width);
+        }
 
-        f->characters[c].loaded = 1;
+        ch->u0 = (GLfloat) x[c] / FONT_ATLAS_WIDTH;
+        ch->v0 = (GLfloat) y[c] / atlasHeight;
+        ch->u1 = (GLfloat) (x[c] + bitmap->width) / FONT_ATLAS_WIDTH;
+        ch->v1 = (GLfloat) (y[c] + bitmap->rows) / atlasHeight;
+        ch->width = bitmap->width;
+        ch->rows = bitmap->rows;
+        ch->bitmap_left = face->glyph->bitmap_left;
+        ch->bitmap_top = face->glyph->bitmap_top;
+        ch->advance = face->glyph->advance.x;
     }
 
     FT_Done_Face(face);
 
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glGenTextures(1, &f->atlas);
+    glBindTexture(GL_TEXTURE_2D, f->atlas);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RED, FONT_ATLAS_WIDTH, atlasHeight, 0, GL_RED,
+            GL_UNSIGNED_BYTE, atlas);
+
+    // Set texture options
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    free(atlas);
+
+    // The middle of the opaque block, where filtering can't reach any
+    // transparent texels
+    f->solid_u = (FONT_ATLAS_SOLID / 2 + 0.5f) / FONT_ATLAS_WIDTH;
+    f->solid_v = (FONT_ATLAS_SOLID / 2 + 0.5f) / atlasHeight;
     f->pixel_height = pixel_height;
 
+    log_debug("Packed font %s into a %dx%d atlas", font_filename, FONT_ATLAS_WIDTH,
+            atlasHeight);
+
     return 0;
 }
 
@@ -112,93 +186,298 @@ struct text_configuration* initializeText(struct configuration *main_config)
         return NULL;
     }
 
-    config = malloc(sizeof(struct text_configuration));
+    config = calloc(1, sizeof(struct text_configuration));
+    if (!config) {
+        log_error("Could not allocate text configuration");
+        return NULL;
+    }
     config->width = main_config->width;
     config->height = main_config->height;
     config->shader_program = shader_program;
+    config->vertex_attribute = glGetAttribLocation(shader_program, "vertex");
+    config->color_attribute = glGetAttribLocation(shader_program, "color");
+    if (config->vertex_attribute == -1 || config->color_attribute == -1) {
+        log_error("Could not get font shader attribute locations");
+        free(config);
+        return NULL;
+    }
+
+    // The projection only depends on the window size
+    glUseProgram(shader_program);
+    glUniform1i(glGetUniformLocation(shader_program, "width"), config->width);
+    glUniform1i(glGetUniformLocation(shader_program, "height"), config->height);
+    glUniform1i(glGetUniformLocation(shader_program, "text"), 0);
+    glUseProgram(0);
 
     glGenVertexArraysAPPLE(1, &config->vao);
     glGenBuffers(1, &config->vbo);
 
     glBindVertexArrayAPPLE(config->vao);
     glBindBuffer(GL_ARRAY_BUFFER, config->vbo);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * 6 * 4, NULL, GL_DYNAMIC_DRAW);
-    glEnableVertexAttribArray(0);
-    glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, 4 * sizeof(GLfloat), 0);
+    glEnableVertexAttribArray(config->vertex_attribute);
+    glVertexAttribPointer(config->vertex_attribute, 4, GL_FLOAT, GL_FALSE,
+            TEXT_VERTEX_FLOATS * sizeof(GLfloat), 0);
+    glEnableVertexAttribArray(config->color_attribute);
+    glVertexAttribPointer(config->color_attribute, 3, GL_FLOAT, GL_FALSE,
+            TEXT_VERTEX_FLOATS * sizeof(GLfloat), (void *) (4 * sizeof(GLfloat)));
     glBindBuffer(GL_ARRAY_BUFFER, 0);
     glBindVertexArrayAPPLE(0);
 
     return config;
 }
 
-void renderText(struct text_configuration *config, struct font *font,
+/* Make room for n quads in an array of them that holds *max */
+static int reserveQuads(GLfloat **vertices, int *max, int n)
+{
+    if (n <= *max)
+        return 0;
+
+    int newMax = *max ? *max : 64;
+    while (newMax < n)
+        newMax *= 2;
+
+    GLfloat *grown = realloc(*vertices, sizeof(GLfloat) * TEXT_QUAD_FLOATS * newMax);
+    if (!grown) {
+        log_error("Could not allocate vertices for %d quads", newMax);
+        return 1;
+    }
+
+    *vertices = grown;
+    *max = newMax;
+    return 0;
+}
+
+/* Write the two triangles covering a rectangle with its bottom left
+corner at (x, y), textured with the given part of the atlas */
+static void putQuad(GLfloat *v, GLfloat x, GLfloat y, GLfloat w, GLfloat h,
+        GLfloat u0, GLfloat v0, GLfloat u1, GLfloat v1, float *color)
+{
+    GLfloat corners[6][4] = {
+        { x,     y + h,   u0, v0 },
+        { x,     y,       u0, v1 },
+        { x + w, y,       u1, v1 },
+
+        { x,     y + h,   u0, v0 },
+        { x + w, y,       u1, v1 },
+        { x + w, y + h,   u1, v0 }
+    };
+
+    for (int i = 0; i < 6; i++) {
+        GLfloat *vertex = &v[i * TEXT_VERTEX_FLOATS];
+
+        vertex[0] = corners[i][0];
+        vertex[1] = corners[i][1];
+        vertex[2] = corners[i][2];
+        vertex[3] = corners[i][3];
+        vertex[4] = color[0];
+        vertex[5] = color[1];
+        vertex[6] = color[2];
+    }
+}
+
+void initTextLayout(struct text_layout *layout)
+{
+    layout->font = NULL;
+    layout->text = NULL;
+    layout->len = 0;
+    layout->vertices = NULL;
+    layout->numQuads = 0;
+    layout->maxQuads = 0;
+}
+
+static int layoutUnchanged(struct text_layout *layout, struct font *font,
         const char *text, int len, GLfloat x, GLfloat y, GLfloat scale, float *color)
 {
-    glUseProgram(config->shader_program);
+    return layout->font == font && layout->len == len && layout->text &&
+        memcmp(layout->text, text, len) == 0 &&
+        layout->x == x && layout->y == y && layout->scale == scale &&
+        layout->color[0] == color[0] && layout->color[1] == color[1] &&
+        layout->color[2] == color[2];
+}
 
-    // Activate corresponding render state	
-    glUniform3f(glGetUniformLocation(config->shader_program, "textColor"),
-            color[0], color[1], color[2]);
-    glUniform1i(glGetUniformLocation(config->shader_program, "width"), config->width);
-    glUniform1i(glGetUniformLocation(config->shader_program, "height"), config->height);
-    glActiveTexture(GL_TEXTURE0);
-    glBindVertexArrayAPPLE(config->vao);
+/**
+ * Lay out len characters of text with the baseline starting at (x, y),
+ * unless the layout already has exactly that. Characters the font
+ * doesn't have come out as '?'.
+ */
+int layoutText(struct text_layout *layout, struct font *font,
+        const char *text, int len, GLfloat x, GLfloat y, GLfloat scale, float *color)
+{
+    if (layoutUnchanged(layout, font, text, len, x, y, scale, color))
+        return 0;
 
-    glEnable(GL_BLEND);
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    char *copy = realloc(layout->text, len + 1);
+    if (!copy) {
+        log_error("Could not allocate text layout for %d characters", len);
+        return 1;
+    }
+    memcpy(copy, text, len);
+    copy[len] = '\0';
+    layout->text = copy;
+
+    if (reserveQuads(&layout->vertices, &layout->maxQuads, len))
+        return 1;
+
+    layout->font = font;
+    layout->len = len;
+    layout->x = x;
+    layout->y = y;
+    layout->scale = scale;
+    layout->color[0] = color[0];
+    layout->color[1] = color[1];
+    layout->color[2] = color[2];
+    layout->numQuads = 0;
 
     for (int i = 0; i < len; i++) {
         unsigned char c = text[i];
         if (c >= FONT_NUM_CHARACTERS) {
-            log_warn("renderText: %hhu at position %d not valid", c, i);
+            log_warn("layoutText: %hhu at position %d not valid", c, i);
             c = '?';
         } else if (!font->characters[c].loaded) {
-            log_warn("renderText: %hhu at position %d not loaded", c, i);
+            log_warn("layoutText: %hhu at position %d not loaded", c, i);
             c = '?';
         }
 
-        struct character ch = font->characters[c];
-        if (!ch.loaded)
+        struct character *ch = &font->characters[c];
+        if (!ch->loaded) {
             log_error("Requested character '%c' is not loaded", c);
+            continue;
+        }
 
-        GLfloat xpos = x + ch.bitmap_left * scale;
-        GLfloat ypos = y - ((float) ch.rows - (float) ch.bitmap_top) * scale;
+        GLfloat xpos = x + ch->bitmap_left * scale;
+        GLfloat ypos = y - ((float) ch->rows - (float) ch->bitmap_top) * scale;
 
-        GLfloat w = ch.width * scale;
-        GLfloat h = ch.rows * scale;
+        // Spaces take up room but have nothing to draw
+        if (ch->width > 0 && ch->rows > 0) {
+            putQuad(&layout->vertices[layout->numQuads * TEXT_QUAD_FLOATS], xpos, ypos,
+                    ch->width * scale, ch->rows * scale, ch->u0, ch->v0, ch->u1, ch->v1,
+                    color);
+            layout->numQuads++;
+        }
 
-        // Update VBO for each character
-        GLfloat vertices[6][4] = {
-            { xpos,     ypos + h,   0.0, 0.0 },            
-            { xpos,     ypos,       0.0, 1.0 },
-            { xpos + w, ypos,       1.0, 1.0 },
+        // Now advance cursor for next glyph (note that advance is number of 1/64 pixels)
+        x += (ch->advance >> 6) * scale; // Bitshift by 6 to get value in pixels (2^6 = 64)
+    }
 
-            { xpos,     ypos + h,   0.0, 0.0 },
-            { xpos + w, ypos,       1.0, 1.0 },
-            { xpos + w, ypos + h,   1.0, 0.0 }           
-        };
+    return 0;
+}
+
+void releaseTextLayout(struct text_layout *layout)
+{
+    free(layout->text);
+    free(layout->vertices);
+    initTextLayout(layout);
+}
+
+/* Start a new batch of quads */
+void textBegin(struct text_configuration *config)
+{
+    config->numQuads = 0;
+}
 
-        // Render glyph texture over quad
-        glBindTexture(GL_TEXTURE_2D, ch.texture);
+/* Add a laid out string to the batch */
+int addText(struct text_configuration *config, struct text_layout *layout)
+{
+    if (reserveQuads(&config->vertices, &config->maxQuads,
+                config->numQuads + layout->numQuads))
+        return 1;
 
-        // Update content of VBO memory
-        glBindBuffer(GL_ARRAY_BUFFER, config->vbo);
-        glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(vertices), vertices); 
-        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    memcpy(&config->vertices[config->numQuads * TEXT_QUAD_FLOATS], layout->vertices,
+            sizeof(GLfloat) * TEXT_QUAD_FLOATS * layout->numQuads);
+    config->numQuads += layout->numQuads;
+
+    return 0;
+}
 
-        // Render quad
-        glDrawArrays(GL_TRIANGLES, 0, 6);
+/* Add a solid rectangle with its bottom left corner at (x, y) to the
+batch, in the same pixel coordinates as text */
+int addRect(struct text_configuration *config, struct font *font,
+        GLfloat x, GLfloat y, GLfloat w, GLfloat h, float *color)
+{
+    if (reserveQuads(&config->vertices, &config->maxQuads, config->numQuads + 1))
+        return 1;
 
-        // Now advance cursor for next glyph (note that advance is number of 1/64 pixels)
-        x += (ch.advance >> 6) * scale; // Bitshift by 6 to get value in pixels (2^6 = 64)
+    putQuad(&config->vertices[config->numQuads * TEXT_QUAD_FLOATS], x, y, w, h,
+            font->solid_u, font->solid_v, font->solid_u, font->solid_v, color);
+    config->numQuads++;
+
+    return 0;
+}
+
+/* Upload the batch, if it changed since last time */
+static int uploadBatch(struct text_configuration *config)
+{
+    size_t size = sizeof(GLfloat) * TEXT_QUAD_FLOATS * config->numQuads;
+
+    if (config->numQuads == config->uploadedQuads &&
+            memcmp(config->vertices, config->uploaded, size) == 0)
+        return 0;
+
+    if (config->numQuads > config->vboQuads) {
+        int vboQuads = config->vboQuads;
+        GLfloat *uploaded = config->uploaded;
+
+        if (reserveQuads(&uploaded, &vboQuads, config->numQuads))
+            return 1;
+
+        glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * TEXT_QUAD_FLOATS * vboQuads, NULL,
+                GL_DYNAMIC_DRAW);
+        config->uploaded = uploaded;
+        config->vboQuads = vboQuads;
     }
 
-    glDisable(GL_BLEND);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, size, config->vertices);
+    memcpy(config->uploaded, config->vertices, size);
+    config->uploadedQuads = config->numQuads;
+
+    return 0;
+}
+
+/* Draw every quad in the batch with one draw call. They must all come
+from the given font. */
+void textDraw(struct text_configuration *config, struct font *font)
+{
+    if (config->numQuads == 0)
+        return;
+
+    glUseProgram(config->shader_program);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, font->atlas);
+    glBindVertexArrayAPPLE(config->vao);
+
+    glBindBuffer(GL_ARRAY_BUFFER, config->vbo);
+    int ret = uploadBatch(config);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    if (!ret) {
+        glEnable(GL_BLEND);
+        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+        glDrawArrays(GL_TRIANGLES, 0, config->numQuads * 6);
+
+        glDisable(GL_BLEND);
+    }
 
     glBindVertexArrayAPPLE(0);
     glBindTexture(GL_TEXTURE_2D, 0);
 }
 
+/* Draw one string on its own. Anything drawn every frame should keep
+its layout and share a batch instead. */
+void renderText(struct text_configuration *config, struct font *font,
+        const char *text, int len, GLfloat x, GLfloat y, GLfloat scale, float *color)
+{
+    struct text_layout layout;
+
+    initTextLayout(&layout);
+    if (!layoutText(&layout, font, text, len, x, y, scale, color)) {
+        textBegin(config);
+        addText(config, &layout);
+        textDraw(config, font);
+    }
+    releaseTextLayout(&layout);
+}
+
 void logTextSystemInfo()
 {
     ensureFreetypeInitialized();
@@ -0,0 +1,223 @@
+#include <stdlib.h>
+#include <strings.h>
+
+#include <t2/tiles.h>
+#include <t2/logging.h>
+#include <t2/mathutil.h>
+
+static const char *orderNames[] = {
+    [TILE_ORDER_SCANLINE] = "scanline",
+    [TILE_ORDER_CENTRE] = "centre",
+    [TILE_ORDER_CURSOR] = "cursor",
+    [TILE_ORDER_HILBERT] = "hilbert"
+};
+
+#define NUM_ORDERS (sizeof(orderNames) / sizeof(orderNames[0]))
+
+const char *tile_order_name(int order)
+{
+    if (order < 0 || order >= NUM_ORDERS)
+        return NULL;
+
+    return orderNames[order];
+}
+
+int tile_order_from_name(char *name)
+{
+    for (int i = 0; i < NUM_ORDERS; i++) {
+        if (strcasecmp(name, orderNames[i]) == 0)
+            return i;
+    }
+
+    return -1;
+}
+
+struct tileKey {
+    float key;
+    cl_uint tile;
+};
+
+static int compareTileKeys(const void *a, const void *b)
+{
+    float ka = ((const struct tileKey *) a)->key;
+    float kb = ((const struct tileKey *) b)->key;
+
+    return (ka > kb) - (ka < kb);
+}
+
+/* Position of (x, y) along the Hilbert curve filling an n by n grid,
+   n a power of two */
+static cl_uint hilbertIndex(cl_uint n, cl_uint x, cl_uint y)
+{
+    cl_uint d = 0;
+
+    for (cl_uint s = n / 2; s > 0; s /= 2) {
+        cl_uint rx = (x & s) > 0;
+        cl_uint ry = (y & s) > 0;
+        d += s * s * ((3 * rx) ^ ry);
+
+        // Rotate the quadrant so the curve inside it has the right
+        // orientation
+        if (ry == 0) {
+            if (rx == 1) {
+                x = s - 1 - x;
+                y = s - 1 - y;
+            }
+            cl_uint tmp = x;
+            x = y;
+            y = tmp;
+        }
+    }
+
+    return d;
+}
+
+int tiles_init(struct tiles *t, struct configuration *config)
+{
+    t->size = config->tileSize;
+    t->tilesX = (config->width + t->size - 1) / t->size;
+    t->tilesY = (config->height + t->size - 1) / t->size;
+    t->numTiles = t->tilesX * t->tilesY;
+    t->orderDirty = 1;
+    t->focusX = config->width / 2.f;
+    t->focusY = config->height / 2.f;
+    t->passItems = 0;
+    t->passNext = 0;
+    t->passSampleNum = 0;
+    t->passBatchSize = 0;
+
+    if (config->tileBudget > 0)
+        log_info("Rendering in %dx%d tiles, up to %.1f ms per launch", t->size, t->size,
+                config->tileBudget);
+
+    t->order = malloc(sizeof(cl_uint) * t->numTiles);
+    if (!t->order) {
+        log_error("Could not allocate tile order for %d tiles", t->numTiles);
+        return 1;
+    }
+
+    return 0;
+}
+
+/* Move the point TILE_ORDER_CURSOR renders outwards from */
+void tiles_set_focus(struct tiles *t, float x, float y)
+{
+    if (x != t->focusX || y != t->focusY) {
+        t->focusX = x;
+        t->focusY = y;
+        t->orderDirty = 1;
+    }
+}
+
+static void sortTiles(struct tiles *t, int order)
+{
+    struct tileKey *keys = malloc(sizeof(struct tileKey) * t->numTiles);
+    cl_uint hilbertSize = 1;
+
+    if (!keys) {
+        // Rendering in scanline order is still rendering
+        log_error("Could not allocate tile sort keys, using scanline order");
+        for (cl_uint i = 0; i < t->numTiles; i++)
+            t->order[i] = i;
+        return;
+    }
+
+    while (hilbertSize < t->tilesX || hilbertSize < t->tilesY)
+        hilbertSize *= 2;
+
+    float fx = t->focusX / t->size - 0.5f;
+    float fy = t->focusY / t->size - 0.5f;
+    if (order == TILE_ORDER_CENTRE) {
+        fx = (t->tilesX - 1) / 2.f;
+        fy = (t->tilesY - 1) / 2.f;
+    }
+
+    for (cl_uint i = 0; i < t->numTiles; i++) {
+        cl_uint x = i % t->tilesX;
+        cl_uint y = i / t->tilesX;
+
+        keys[i].tile = i;
+        switch (order) {
+            case TILE_ORDER_HILBERT:
+                keys[i].key = hilbertIndex(hilbertSize, x, y);
+                break;
+
+            case TILE_ORDER_CENTRE:
+            case TILE_ORDER_CURSOR:
+                keys[i].key = (x - fx) * (x - fx) + (y - fy) * (y - fy);
+                break;
+
+            default:
+                keys[i].key = i;
+                break;
+        }
+    }
+
+    qsort(keys, t->numTiles, sizeof(struct tileKey), compareTileKeys);
+
+    for (cl_uint i = 0; i < t->numTiles; i++)
+        t->order[i] = keys[i].tile;
+
+    free(keys);
+}
+
+/**
+ * Start splitting up a batch of batchSize samples per pixel, starting
+ * at sample sampleNum, that needs the given number of work items. The
+ * tile order is brought up to date first, if it needs it; returns
+ * whether it changed, in which case devices need the new one.
+ */
+int tiles_begin_pass(struct tiles *t, struct configuration *config, size_t items,
+        cl_uint sampleNum, cl_uint batchSize)
+{
+    t->passItems = items;
+    t->passNext = 0;
+    t->passSampleNum = sampleNum;
+    t->passBatchSize = batchSize;
+
+    if (!t->orderDirty)
+        return 0;
+
+    sortTiles(t, config->tileOrder);
+    t->orderDirty = 0;
+
+    return 1;
+}
+
+int tiles_pass_done(struct tiles *t)
+{
+    return t->passNext >= t->passItems;
+}
+
+/**
+ * Returns how many of the pass's work items the next launch on a
+ * device should cover, and sets *first to the first of them. Launches
+ * cover whole tiles' worth of work items and, once the device's rate
+ * (in pixel samples per millisecond) is known, as many as it gets
+ * through in config->tileBudget. No launch covers more than maxItems
+ * (rounded up to a whole tile).
+ */
+size_t tiles_next_launch(struct tiles *t, struct configuration *config, double rate,
+        size_t maxItems, size_t *first)
+{
+    size_t tilePixels = t->size * t->size;
+    size_t remaining = t->passItems - t->passNext;
+    size_t items = MAXF((maxItems + tilePixels - 1) / tilePixels, 1) * tilePixels;
+
+    if (config->tileBudget > 0) {
+        double affordable = config->tileBudget * rate / MAXF(t->passBatchSize, 1);
+        items = MINF(items, MAXF((size_t) (affordable / tilePixels), 1) * tilePixels);
+    }
+
+    items = MINF(items, remaining);
+
+    *first = t->passNext;
+    t->passNext += items;
+
+    return items;
+}
+
+void tiles_release(struct tiles *t)
+{
+    free(t->order);
+}
@@ -1,22 +1,46 @@
 
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <limits.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #include <t2/util.h>
 #include <t2/logging.h>
+#include <t2/program_cache.h>
 
 #define MAX_SOURCE_SIZE 0x20000
 #define MAX_LOG_SIZE    0x10000
-
-cl_program readAndBuildProgram(cl_context context, cl_device_id device_id, const char *path, int *res) {
-    int ret;
+#define MAX_OPTIONS_SIZE 512
+
+#define BUILD_OPTIONS "-cl-mad-enable -cl-fast-relaxed-math -Werror -Icl -Iinclude"
+
+/**
+ * Build the program at path for a device, with extraOptions (or NULL)
+ * added to the usual build options.
+ */
+cl_program readAndBuildProgram(cl_context context, cl_device_id device_id, const char *path,
+        const char *extraOptions, int *res) {
+    int ret, cacheable;
+    char cachePath[PATH_MAX];
+    char options[MAX_OPTIONS_SIZE];
     char *source_str;
     size_t source_size;
     FILE *fp;
     cl_program program;
     struct stat st;
 
+    snprintf(options, sizeof(options), "%s %s", BUILD_OPTIONS,
+            extraOptions ? extraOptions : "");
+
+    /* Use the binary from the last build, if nothing has changed since */
+    cacheable = !program_cache_path(device_id, path, options, cachePath, sizeof(cachePath));
+    if (cacheable) {
+        program = program_cache_load(context, device_id, cachePath, options);
+        if (program)
+            return program;
+    }
+
     if (stat(path, &st)) {
         log_error("Could not get file size for %s", path);
         return NULL;
@@ -52,7 +76,7 @@ cl_program readAndBuildProgram(cl_context context, cl_device_id device_id, const
     }
 
     /* Build Kernel Program */
-    ret = clBuildProgram(program, 1, &device_id, "-cl-mad-enable -cl-fast-relaxed-math -Werror -Icl -Iinclude", NULL, NULL);
+    ret = clBuildProgram(program, 1, &device_id, options, NULL, NULL);
     if (ret) {
         log_error("Error building %s", path);
 
@@ -69,6 +93,8 @@ cl_program readAndBuildProgram(cl_context context, cl_device_id device_id, const
 
         return NULL;
     } else {
+        if (cacheable)
+            program_cache_store(program, device_id, cachePath);
         return program;
     }
 }
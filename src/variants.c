@@ -0,0 +1,213 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <t2/variants.h>
+#include <t2/renderer.h>
+#include <t2/logging.h>
+#include <t2/util.h>
+
+/*
+ * Specialised raytracer kernels. The generic program reads the trace
+ * depth, camera type, sampler and the scene's light and object counts
+ * at run time; a variant is the same program built with those as -D
+ * constants (see TRACE_DEPTH() in cl/t2/config.cl), so the compiler can
+ * unroll the reflection and light loops and drop the branches for
+ * cameras and object types that aren't in use.
+ *
+ * Variants are built on a thread of their own and cached by their
+ * options, and the one matching the current settings is swapped in at
+ * the start of a pass, once it's ready. Changing any of the settings
+ * restarts rendering, so a pass never mixes variants.
+ */
+
+/* Variant states */
+#define VARIANT_BUILDING 0
+#define VARIANT_READY    1
+#define VARIANT_FAILED   2
+
+void variants_init(struct variants *v, struct renderer *r, struct configuration *config)
+{
+    v->enabled = config->specialise;
+    // Headless renders would rather wait than render generically
+    v->wait = config->headless;
+    v->generic = r->kernel;
+    v->numEntries = 0;
+    v->uses = 0;
+}
+
+static void variantOptions(struct configuration *config, struct scene *scene, int photonMap,
+        int irradianceCache, char *options, size_t size)
+{
+    struct SceneHeader *h = &scene->header;
+    cl_uint numSpheres = h->numObjects - h->numUnbounded - h->numTriangles;
+
+    snprintf(options, size, "-DT2_TRACE_DEPTH=%u -DT2_SAMPLER=%d -DT2_CAMERA_TYPE=%d "
+            "-DT2_NUM_LIGHTS=%u -DT2_NUM_SPHERES=%u -DT2_NUM_PLANES=%u -DT2_NUM_TRIANGLES=%u "
+            "-DT2_LIGHT_SAMPLES=%d -DT2_NUM_AREA_LIGHTS=%u -DT2_INTEGRATOR=%d -DT2_ENV_MAP=%d "
+            "-DT2_PHOTON_MAP=%d -DT2_IRRADIANCE_CACHE=%d -DT2_SHADOW_CACHE=%d",
+            config->traceDepth, config->sampler, h->cameraType, h->numLights, numSpheres,
+            h->numUnbounded, h->numTriangles, config->lightSamples, h->numAreaLights,
+            config->integrator, h->envWidth > 0, photonMap, irradianceCache,
+            config->shadowCache);
+
+    if (config->countRays)
+        strncat(options, " -DT2_COUNTERS", size - strlen(options) - 1);
+}
+
+static void *buildVariant(void *arg)
+{
+    struct variant *e = arg;
+    int ret;
+
+    cl_program program = readAndBuildProgram(e->context, e->device_id, "cl/t2.cl",
+            e->options, &ret);
+
+    // Nothing reads program until it sees the new state
+    e->program = program;
+    __atomic_store_n(&e->state, program ? VARIANT_READY : VARIANT_FAILED, __ATOMIC_RELEASE);
+
+    return NULL;
+}
+
+static struct variant *findVariant(struct variants *v, const char *options)
+{
+    for (int i = 0; i < v->numEntries; i++) {
+        if (strcmp(v->entries[i].options, options) == 0)
+            return &v->entries[i];
+    }
+
+    return NULL;
+}
+
+static int variantState(struct variant *e)
+{
+    return __atomic_load_n(&e->state, __ATOMIC_ACQUIRE);
+}
+
+static void joinBuild(struct variant *e)
+{
+    if (!e->joined) {
+        pthread_join(e->thread, NULL);
+        e->joined = 1;
+    }
+}
+
+static void releaseVariant(struct variant *e)
+{
+    joinBuild(e);
+
+    if (e->kernel)
+        clReleaseKernel(e->kernel);
+    if (e->program)
+        clReleaseProgram(e->program);
+}
+
+/* A slot for a new variant: a free one, or the least recently used
+finished one that isn't current. NULL if every slot is building. */
+static struct variant *newVariant(struct variants *v, struct renderer *r)
+{
+    struct variant *oldest = NULL;
+
+    if (v->numEntries < MAX_VARIANTS)
+        return &v->entries[v->numEntries++];
+
+    for (int i = 0; i < MAX_VARIANTS; i++) {
+        struct variant *e = &v->entries[i];
+
+        if (variantState(e) == VARIANT_BUILDING || (e->kernel && e->kernel == r->kernel))
+            continue;
+        if (!oldest || e->lastUsed < oldest->lastUsed)
+            oldest = e;
+    }
+
+    if (oldest)
+        releaseVariant(oldest);
+
+    return oldest;
+}
+
+/**
+ * Make the raytracer kernel of device r the variant for the current
+ * configuration and scene, starting its build if it hasn't been built
+ * yet. Until it's ready (or if it can't be built) the device uses the
+ * generic kernel. Call this at the start of a pass, before anything
+ * sets the kernel's per-pass arguments.
+ */
+int variants_select(struct variants *v, struct renderer *r, struct configuration *config,
+        struct scene *scene)
+{
+    char options[VARIANT_OPTIONS_SIZE];
+    cl_kernel kernel = v->generic;
+    cl_int ret;
+
+    if (!v->enabled)
+        return 0;
+
+    variantOptions(config, scene, r->photons.enabled, r->irradiance.enabled, options,
+            sizeof(options));
+
+    struct variant *e = findVariant(v, options);
+    if (!e) {
+        e = newVariant(v, r);
+        if (e) {
+            log_info("Building kernel variant %s", options);
+
+            strncpy(e->options, options, sizeof(e->options) - 1);
+            e->options[sizeof(e->options) - 1] = '\0';
+            e->context = r->context;
+            e->device_id = r->device_id;
+            e->state = VARIANT_BUILDING;
+            e->program = NULL;
+            e->kernel = NULL;
+            e->lastUsed = 0;
+            e->joined = 0;
+
+            if (pthread_create(&e->thread, NULL, buildVariant, e)) {
+                // Build it here instead
+                buildVariant(e);
+                e->joined = 1;
+            }
+        }
+    }
+
+    if (e && v->wait)
+        joinBuild(e);
+
+    if (e && variantState(e) == VARIANT_READY) {
+        if (!e->kernel) {
+            e->kernel = clCreateKernel(e->program, "raytracer", &ret);
+            if (ret) {
+                log_error("Could not create kernel variant, ret %d", ret);
+                e->kernel = NULL;
+                e->state = VARIANT_FAILED;
+            }
+        }
+
+        if (e->kernel) {
+            kernel = e->kernel;
+            e->lastUsed = ++v->uses;
+        }
+    }
+
+    if (kernel == r->kernel)
+        return 0;
+
+    // Variants don't share arguments, and the scene buffers may have
+    // been reallocated since this one last ran
+    ret = renderer_set_raytracer_args(r, kernel);
+    if (ret)
+        return ret;
+
+    log_debug("Switched to %s raytracer kernel", kernel == v->generic ? "generic" : "specialised");
+    r->kernel = kernel;
+
+    return 0;
+}
+
+void variants_release(struct variants *v, struct renderer *r)
+{
+    for (int i = 0; i < v->numEntries; i++)
+        releaseVariant(&v->entries[i]);
+
+    r->kernel = v->generic;
+}
@@ -0,0 +1,252 @@
+#include <stdlib.h>
+
+#include <t2/wavefront.h>
+#include <t2/logging.h>
+#include <t2/mathutil.h>
+#include <t2/renderer.h>
+
+/* Index of the first scene argument of each wavefront kernel that
+takes them (see cl/t2/wavefront.cl) */
+#define GENERATE_SCENE_ARG 9
+#define EXTEND_SCENE_ARG   4
+#define SHADE_SCENE_ARG    6
+#define CONNECT_SCENE_ARG  3
+
+static cl_kernel createKernel(cl_program program, const char *name)
+{
+    cl_int ret;
+    cl_kernel kernel = clCreateKernel(program, name, &ret);
+    if (ret) {
+        log_error("Could not create kernel %s, ret %d", name, ret);
+        return NULL;
+    }
+
+    return kernel;
+}
+
+static cl_mem createBuffer(cl_context context, size_t size, const char *what)
+{
+    cl_int ret;
+    cl_mem buf = clCreateBuffer(context, CL_MEM_READ_WRITE, size, NULL, &ret);
+    if (ret) {
+        log_error("Could not create %s buffer of %ld bytes, ret %d", what, size, ret);
+        return NULL;
+    }
+
+    return buf;
+}
+
+static void releaseBuffer(cl_mem *buf)
+{
+    if (*buf) {
+        clReleaseMemObject(*buf);
+        *buf = NULL;
+    }
+}
+
+int wavefront_init(struct wavefront *w, struct renderer *r)
+{
+    w->rays[0] = NULL;
+    w->rays[1] = NULL;
+    w->hits = NULL;
+    w->shadowRays = NULL;
+    w->numPixels = 0;
+    w->shadowCapacity = 0;
+
+    w->generate = createKernel(r->program, "wavefront_generate");
+    w->extend = createKernel(r->program, "wavefront_extend");
+    w->shade = createKernel(r->program, "wavefront_shade");
+    w->connect = createKernel(r->program, "wavefront_connect");
+    w->advance = createKernel(r->program, "wavefront_advance");
+    if (!w->generate || !w->extend || !w->shade || !w->connect || !w->advance)
+        return 1;
+
+    w->counts = createBuffer(r->context, sizeof(struct QueueCounts), "queue count");
+    if (!w->counts)
+        return 1;
+
+    return 0;
+}
+
+int wavefront_set_scene_args(struct wavefront *w, struct renderer *r)
+{
+    int ret;
+
+    ret  = renderer_set_scene_args(r, w->generate, GENERATE_SCENE_ARG);
+    ret |= renderer_set_scene_args(r, w->extend, EXTEND_SCENE_ARG);
+    ret |= renderer_set_scene_args(r, w->shade, SHADE_SCENE_ARG);
+    ret |= renderer_set_scene_args(r, w->connect, CONNECT_SCENE_ARG);
+
+    return ret;
+}
+
+/**
+ * (Re)allocate the queues if the image size or light count has changed
+ * since the last batch. Every pixel has at most one live path, and each
+ * path hit queues at most shadowRaysPerHit shadow rays.
+ */
+static int ensureQueues(struct wavefront *w, struct renderer *r, size_t numPixels,
+        cl_uint shadowRaysPerHit)
+{
+    size_t shadowCapacity = numPixels * MAXF(shadowRaysPerHit, 1);
+
+    if (numPixels != w->numPixels) {
+        releaseBuffer(&w->rays[0]);
+        releaseBuffer(&w->rays[1]);
+        releaseBuffer(&w->hits);
+
+        w->rays[0] = createBuffer(r->context, sizeof(struct PathState) * numPixels, "path");
+        w->rays[1] = createBuffer(r->context, sizeof(struct PathState) * numPixels, "path");
+        w->hits = createBuffer(r->context, sizeof(struct PathHit) * numPixels, "hit");
+        if (!w->rays[0] || !w->rays[1] || !w->hits)
+            return 1;
+
+        w->numPixels = numPixels;
+    }
+
+    if (shadowCapacity > w->shadowCapacity) {
+        releaseBuffer(&w->shadowRays);
+        w->shadowRays = createBuffer(r->context, sizeof(struct ShadowRay) * shadowCapacity,
+                "shadow ray");
+        if (!w->shadowRays)
+            return 1;
+
+        w->shadowCapacity = shadowCapacity;
+    }
+
+    return 0;
+}
+
+/* Enqueue a stage kernel, timed against the given profiler stage */
+static int enqueueStage(struct renderer *r, cl_kernel kernel, cl_uint dims,
+        const size_t *size, int stage)
+{
+    cl_event event;
+    cl_int ret = clEnqueueNDRangeKernel(r->command_queue, kernel, dims, NULL, size,
+            NULL, 0, NULL, r->profiler ? &event : NULL);
+    if (ret) {
+        log_error("Could not enqueue wavefront kernel, ret %d", ret);
+        return ret;
+    }
+
+    if (r->profiler) {
+        profiler_add_event(r->profiler, stage, event);
+        clReleaseEvent(event);
+    }
+
+    return 0;
+}
+
+static int enqueue1D(struct renderer *r, cl_kernel kernel, size_t size, int stage)
+{
+    return enqueueStage(r, kernel, 1, &size, stage);
+}
+
+/**
+ * Enqueue one batch of samples through the wavefront kernels. The
+ * scene, configuration and state buffers must be up to date. Stage
+ * kernels are enqueued for every possible bounce without reading the
+ * queue counts back, so the host never waits on the device; once all
+ * paths have terminated the remaining stages return immediately.
+ */
+int wavefront_enqueue_batch(struct wavefront *w, struct renderer *r,
+        struct configuration *config, struct state *state, cl_uint numLights,
+        cl_uint numAreaLights, int envMap, cl_uint batchSize)
+{
+    size_t imageSize[2] = { config->width, config->height };
+    size_t numPixels = imageSize[0] * imageSize[1];
+    cl_int ret = 0;
+
+    // Hits in scenes with many lights only shade lightSamples of them,
+    // and area lights and the environment map can take two shadow rays
+    // each
+    if (config->lightSamples > 0 && numLights > (cl_uint) config->lightSamples)
+        numLights = config->lightSamples;
+    if (numAreaLights > 0)
+        numLights *= 2;
+    if (envMap)
+        numLights += 2;
+
+    if (ensureQueues(w, r, numPixels, numLights))
+        return 1;
+
+    ret |= clSetKernelArg(w->generate, 0, sizeof(cl_mem), &r->configBuf);
+    ret |= clSetKernelArg(w->generate, 1, sizeof(cl_mem), &r->stateBuf);
+    ret |= clSetKernelArg(w->generate, 2, sizeof(cl_mem), &r->samples.squareSampleBuf);
+    ret |= clSetKernelArg(w->generate, 3, sizeof(cl_mem), &r->samples.diskSampleBuf);
+    ret |= clSetKernelArg(w->generate, 4, sizeof(cl_int), &r->samples.numSampleSets);
+    ret |= clSetKernelArg(w->generate, 6, sizeof(cl_mem), &w->counts);
+    ret |= clSetKernelArg(w->generate, 7, sizeof(cl_mem), &w->rays[0]);
+    ret |= clSetKernelArg(w->generate, 8, sizeof(cl_mem), &r->accumBuf);
+
+    ret |= clSetKernelArg(w->extend, 0, sizeof(cl_mem), &w->counts);
+    ret |= clSetKernelArg(w->extend, 2, sizeof(cl_mem), &w->hits);
+    ret |= clSetKernelArg(w->extend, 3, sizeof(cl_mem), &r->accumBuf);
+
+    ret |= clSetKernelArg(w->shade, 0, sizeof(cl_mem), &r->configBuf);
+    ret |= clSetKernelArg(w->shade, 1, sizeof(cl_mem), &w->counts);
+    ret |= clSetKernelArg(w->shade, 3, sizeof(cl_mem), &w->hits);
+    ret |= clSetKernelArg(w->shade, 4, sizeof(cl_mem), &w->shadowRays);
+
+    ret |= clSetKernelArg(w->connect, 0, sizeof(cl_mem), &w->counts);
+    ret |= clSetKernelArg(w->connect, 1, sizeof(cl_mem), &w->shadowRays);
+    ret |= clSetKernelArg(w->connect, 2, sizeof(cl_mem), &r->accumBuf);
+
+    ret |= clSetKernelArg(w->advance, 0, sizeof(cl_mem), &w->counts);
+    if (ret) {
+        log_error("Could not set kernel argument, ret %d", ret);
+        return ret;
+    }
+
+    for (cl_uint i = 0; i < batchSize; i++) {
+        cl_uint sampleNum = state->sampleNum + i;
+
+        ret = clSetKernelArg(w->generate, 5, sizeof(sampleNum), &sampleNum);
+        if (ret) {
+            log_error("Could not set kernel argument, ret %d", ret);
+            return ret;
+        }
+
+        ret = enqueueStage(r, w->generate, 2, imageSize, STAGE_GENERATE);
+        if (ret)
+            return ret;
+
+        // Paths start in rays[0] and move to the other queue each bounce
+        for (cl_uint depth = 0; depth <= config->traceDepth; depth++) {
+            cl_mem *current = &w->rays[depth % 2];
+            cl_mem *next = &w->rays[(depth + 1) % 2];
+
+            ret  = clSetKernelArg(w->extend, 1, sizeof(cl_mem), current);
+            ret |= clSetKernelArg(w->shade, 2, sizeof(cl_mem), current);
+            ret |= clSetKernelArg(w->shade, 5, sizeof(cl_mem), next);
+            if (ret) {
+                log_error("Could not set kernel argument, ret %d", ret);
+                return ret;
+            }
+
+            ret  = enqueue1D(r, w->extend, numPixels, STAGE_EXTEND);
+            ret |= enqueue1D(r, w->shade, numPixels, STAGE_SHADE);
+            ret |= enqueue1D(r, w->connect, w->shadowCapacity, STAGE_CONNECT);
+            ret |= enqueue1D(r, w->advance, 1, STAGE_ADVANCE);
+            if (ret)
+                return ret;
+        }
+    }
+
+    return 0;
+}
+
+void wavefront_release(struct wavefront *w)
+{
+    releaseBuffer(&w->rays[0]);
+    releaseBuffer(&w->rays[1]);
+    releaseBuffer(&w->hits);
+    releaseBuffer(&w->shadowRays);
+    releaseBuffer(&w->counts);
+
+    clReleaseKernel(w->generate);
+    clReleaseKernel(w->extend);
+    clReleaseKernel(w->shade);
+    clReleaseKernel(w->connect);
+    clReleaseKernel(w->advance);
+}